@@ -14,6 +14,33 @@
 #define OLLAMA_ENDPOINT "/api/chat"
 #define OLLAMA_MODEL "llama3.2:1b"
 #define OLLAMA_STREAM_RESP true
+#define OLLAMA_MAX_RETRIES 2     // retries when the server is busy
+#define OLLAMA_MAX_RETRY_WAIT 30 // max seconds to wait before a retry
+#define OLLAMA_TOOL_THREADS 4        // max tool calls run concurrently
+#define OLLAMA_TOOL_TIMEOUT_MS 30000 // default timeout for a tool call
+#define OLLAMA_MAX_TOOL_ROUNDS 8     // max tool call round trips per prompt
+#define OLLAMA_RECONNECT_ATTEMPTS 3          // reconnects after a disconnect
+#define OLLAMA_RECONNECT_BACKOFF_MS 250      // first reconnect delay
+#define OLLAMA_MAX_RECONNECT_BACKOFF_MS 4000 // max reconnect delay
+#define OLLAMA_EMBED_ENDPOINT "/api/embed"
+#define OLLAMA_EMBED_MODEL "nomic-embed-text"
+#define OLLAMA_EMBED_BATCH 32     // inputs per embedding request
+#define OLLAMA_EMBED_IN_FLIGHT 4  // embedding requests sent concurrently
+#define OLLAMA_CHUNK_SIZE 1024    // max bytes of text per embedded chunk
+#define OLLAMA_CHUNK_OVERLAP 128  // bytes shared by consecutive chunks
+#define OLLAMA_VECTOR_STORE "ochat.vec"
+#define OLLAMA_RAG_TOP_K 4           // retrieved chunks added to a prompt
+#define OLLAMA_HNSW_MIN_SIZE 100000  // smaller stores are searched exactly
+#define OLLAMA_SCHED_MAX_QUEUE 256   // queued requests before shedding
+#define OLLAMA_SCHED_INTERACTIVE_DEADLINE_MS 30000 // max queue time
+#define OLLAMA_GATEWAY_PORT 11435         // port of ochat --serve
+#define OLLAMA_GATEWAY_CONNECTIONS 8      // pooled backend connections
+#define OLLAMA_IMAGE_CACHE_BYTES (256 << 20) // encoded images kept for reuse
+#define OLLAMA_PREFILL false              // warm the prompt cache when idle
+#define OLLAMA_KEEP_ALIVE ""              // model keep alive, "" for default
+#define OLLAMA_PREFILL_KEEP_ALIVE "30m"   // keep alive sent with a prefill
+#define OLLAMA_PROFILES "ochat.profiles.json" // options of each model
+#define OLLAMA_TUNE_PREDICT 64            // tokens generated per tune prompt
 
 // Define colors for each context
 namespace COL {
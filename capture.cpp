@@ -0,0 +1,433 @@
+#include "capture.h"
+#include <algorithm>
+#include <charconv>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+namespace ochat {
+
+namespace {
+
+constexpr std::string_view kMagic = "OCAP";
+constexpr char kVersion = 1;
+
+void PutVarint(std::string &out, std::uint64_t v) {
+  while (v >= 0x80) {
+    out.push_back(static_cast<char>(v | 0x80));
+    v >>= 7;
+  }
+  out.push_back(static_cast<char>(v));
+}
+
+std::uint64_t GetVarint(std::string_view &in) {
+  std::uint64_t v = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (in.empty()) {
+      break;
+    }
+    auto b = static_cast<unsigned char>(in.front());
+    in.remove_prefix(1);
+    v |= static_cast<std::uint64_t>(b & 0x7f) << shift;
+    if ((b & 0x80) == 0) {
+      return v;
+    }
+  }
+  throw std::runtime_error("Truncated capture record");
+}
+
+// errors are recorded as "category:value"
+std::string ErrorData(const boost::system::error_code &ec) {
+  return std::string(ec.category().name()) + ":" + std::to_string(ec.value());
+}
+
+boost::system::error_code ErrorFromData(std::string_view data) {
+  size_t colon = data.rfind(':');
+  int value = 0;
+  if (colon != std::string_view::npos) {
+    std::from_chars(data.data() + colon + 1, data.data() + data.size(), value);
+  }
+  std::string_view category = data.substr(0, colon);
+  if (category == boost::asio::error::get_misc_category().name()) {
+    return {value, boost::asio::error::get_misc_category()};
+  }
+  if (category == boost::asio::error::get_netdb_category().name()) {
+    return {value, boost::asio::error::get_netdb_category()};
+  }
+  return {value, boost::system::system_category()};
+}
+
+[[noreturn]] void ThrowEof() {
+  throw boost::system::system_error(boost::asio::error::eof);
+}
+
+} // namespace
+
+std::string CaptureConnection::target() const {
+  for (const auto &r : records) {
+    if (r.kind == CaptureRecord::kSent) {
+      // request line: method SP target SP version
+      size_t sp = r.data.find(' ');
+      size_t end = r.data.find_first_of(" \r\n", sp + 1);
+      if (sp == std::string::npos || end == std::string::npos) {
+        return "";
+      }
+      return r.data.substr(sp + 1, end - sp - 1);
+    }
+  }
+  return "";
+}
+
+Capture Capture::Load(const std::string &path) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    throw std::runtime_error("Unable to read capture file " + path);
+  }
+  std::stringstream ss;
+  ss << file.rdbuf();
+  return Parse(ss.str());
+}
+
+Capture Capture::Parse(std::string_view in) {
+  if (in.substr(0, kMagic.size()) != kMagic || in.size() < kMagic.size() + 1) {
+    throw std::runtime_error("Not a capture file");
+  }
+  if (in[kMagic.size()] != kVersion) {
+    throw std::runtime_error("Unsupported capture file version " +
+                             std::to_string(in[kMagic.size()]));
+  }
+  in.remove_prefix(kMagic.size() + 1);
+
+  Capture capture;
+  std::int64_t time_us = 0;
+  while (!in.empty()) {
+    auto kind = static_cast<CaptureRecord::Kind>(in.front());
+    in.remove_prefix(1);
+    std::uint64_t conn = GetVarint(in);
+    time_us += static_cast<std::int64_t>(GetVarint(in));
+    std::uint64_t size = GetVarint(in);
+    if (size > in.size()) {
+      throw std::runtime_error("Truncated capture record");
+    }
+    std::string_view data = in.substr(0, size);
+    in.remove_prefix(size);
+
+    if (kind == CaptureRecord::kConnect) {
+      if (conn != capture.connections_.size()) {
+        throw std::runtime_error("Capture connections out of order");
+      }
+      capture.connections_.push_back({std::string(data), {}});
+    } else if (kind == CaptureRecord::kSent ||
+               kind == CaptureRecord::kReceived ||
+               kind == CaptureRecord::kError ||
+               kind == CaptureRecord::kClose) {
+      if (conn >= capture.connections_.size()) {
+        throw std::runtime_error("Capture record of an unknown connection");
+      }
+      capture.connections_[conn].records.push_back(
+          {kind, time_us, std::string(data)});
+    } else {
+      throw std::runtime_error("Invalid capture record");
+    }
+  }
+  return capture;
+}
+
+std::size_t Capture::received_bytes() const {
+  std::size_t n = 0;
+  for (const auto &c : connections_) {
+    for (const auto &r : c.records) {
+      if (r.kind == CaptureRecord::kReceived) {
+        n += r.data.size();
+      }
+    }
+  }
+  return n;
+}
+
+CaptureWriter::CaptureWriter(const std::string &path)
+    : file_(path, std::ios::binary | std::ios::trunc),
+      start_(std::chrono::steady_clock::now()) {
+  if (!file_) {
+    throw std::runtime_error("Unable to create capture file " + path);
+  }
+  file_ << kMagic << kVersion;
+}
+
+// The connection number is handed out under the same lock as its connect
+// record is written, so that the records are in the order of the numbers.
+std::uint64_t CaptureWriter::Connect(const std::string &endpoint) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::uint64_t conn = connections_++;
+  AppendLocked(conn, CaptureRecord::kConnect, endpoint);
+  return conn;
+}
+
+void CaptureWriter::Append(std::uint64_t conn, CaptureRecord::Kind kind,
+                           std::string_view data) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  AppendLocked(conn, kind, data);
+}
+
+void CaptureWriter::AppendLocked(std::uint64_t conn, CaptureRecord::Kind kind,
+                                 std::string_view data) {
+  std::string hdr;
+  // the time is taken under the lock so that it never goes backwards
+  std::int64_t now = std::chrono::duration_cast<std::chrono::microseconds>(
+                         std::chrono::steady_clock::now() - start_)
+                         .count();
+  hdr.push_back(kind);
+  PutVarint(hdr, conn);
+  PutVarint(hdr, static_cast<std::uint64_t>(now - last_us_));
+  PutVarint(hdr, data.size());
+  last_us_ = now;
+  file_ << hdr << data;
+  // keep the capture of finished connections if the process is killed
+  if (kind == CaptureRecord::kClose || kind == CaptureRecord::kError) {
+    file_.flush();
+  }
+}
+
+void CaptureWriter::Flush() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  file_.flush();
+}
+
+RecordingTransport::~RecordingTransport() { Close(); }
+
+void RecordingTransport::Connect(const std::string &server, int port) {
+  inner_->Connect(server, port);
+  conn_ = writer_->Connect(server + ":" + std::to_string(port));
+  connected_ = true;
+}
+
+void RecordingTransport::Write(const std::string &data) {
+  inner_->Write(data);
+  writer_->Append(conn_, CaptureRecord::kSent, data);
+}
+
+std::size_t RecordingTransport::ReadUntil(boost::asio::streambuf &buf,
+                                          std::string_view delim) {
+  std::size_t size = buf.size();
+  try {
+    std::size_t n = inner_->ReadUntil(buf, delim);
+    Received(buf, size);
+    return n;
+  } catch (const boost::system::system_error &e) {
+    Received(buf, size);
+    Failed(e.code());
+    throw;
+  }
+}
+
+std::size_t RecordingTransport::ReadExactly(boost::asio::streambuf &buf,
+                                            std::size_t n) {
+  std::size_t size = buf.size();
+  try {
+    std::size_t read = inner_->ReadExactly(buf, n);
+    Received(buf, size);
+    return read;
+  } catch (const boost::system::system_error &e) {
+    Received(buf, size);
+    Failed(e.code());
+    throw;
+  }
+}
+
+// the server closing the connection is recorded as an eof error
+std::size_t RecordingTransport::ReadToEnd(boost::asio::streambuf &buf) {
+  std::size_t size = buf.size();
+  try {
+    std::size_t n = inner_->ReadToEnd(buf);
+    Received(buf, size);
+    Failed(boost::asio::error::eof);
+    return n;
+  } catch (const boost::system::system_error &e) {
+    Received(buf, size);
+    Failed(e.code());
+    throw;
+  }
+}
+
+void RecordingTransport::Close() {
+  inner_->Close();
+  if (connected_) {
+    writer_->Append(conn_, CaptureRecord::kClose, "");
+    connected_ = false;
+  }
+}
+
+void RecordingTransport::Received(const boost::asio::streambuf &buf,
+                                  std::size_t size) {
+  if (connected_ && buf.size() > size) {
+    std::string_view data(
+        boost::asio::buffer_cast<const char *>(buf.data()) + size,
+        buf.size() - size);
+    writer_->Append(conn_, CaptureRecord::kReceived, data);
+  }
+}
+
+void RecordingTransport::Failed(const boost::system::error_code &ec) {
+  if (connected_) {
+    writer_->Append(conn_, CaptureRecord::kError, ErrorData(ec));
+  }
+}
+
+TransportFactory RecordingTransports(TransportFactory inner,
+                                     std::shared_ptr<CaptureWriter> writer) {
+  return [inner = std::move(inner), writer = std::move(writer)]() {
+    return std::make_unique<RecordingTransport>(inner(), writer);
+  };
+}
+
+TransportFactory Replayer::Factory() {
+  return [this]() { return std::make_unique<ReplayTransport>(*this); };
+}
+
+const CaptureConnection *Replayer::Peek() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const auto &conns = capture_.connections();
+  return next_ < conns.size() ? &conns[next_] : nullptr;
+}
+
+const CaptureConnection *Replayer::Next() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const auto &conns = capture_.connections();
+  return next_ < conns.size() ? &conns[next_++] : nullptr;
+}
+
+void Replayer::Rewind() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  next_ = 0;
+}
+
+void ReplayTransport::Connect(const std::string &server, int port) {
+  conn_ = replayer_.Next();
+  if (conn_ == nullptr) {
+    throw boost::system::system_error(
+        boost::asio::error::connection_refused);
+  }
+  next_ = 0;
+  pending_ = {};
+  Sync(conn_->records.empty() ? 0 : conn_->records.front().time_us);
+}
+
+// The response is timed from the request, how long the client took to send
+// it during the recording does not matter.
+void ReplayTransport::Write(const std::string &data) {
+  if (conn_ == nullptr) {
+    throw boost::system::system_error(boost::asio::error::not_connected);
+  }
+  bool synced = false;
+  while (next_ < conn_->records.size() &&
+         conn_->records[next_].kind == CaptureRecord::kSent) {
+    if (!synced) {
+      Sync(conn_->records[next_].time_us);
+      synced = true;
+    }
+    ++next_;
+  }
+}
+
+std::size_t ReplayTransport::ReadUntil(boost::asio::streambuf &buf,
+                                       std::string_view delim) {
+  for (;;) {
+    std::string_view data(boost::asio::buffer_cast<const char *>(buf.data()),
+                          buf.size());
+    size_t pos = data.find(delim);
+    if (pos != std::string_view::npos) {
+      return pos + delim.size();
+    }
+    if (!Arrive()) {
+      ThrowEof();
+    }
+    // like a read from a socket, this returns all the data that arrived
+    size_t n = boost::asio::buffer_copy(
+        buf.prepare(pending_.size()),
+        boost::asio::buffer(pending_.data(), pending_.size()));
+    buf.commit(n);
+    pending_ = {};
+  }
+}
+
+std::size_t ReplayTransport::ReadExactly(boost::asio::streambuf &buf,
+                                         std::size_t n) {
+  std::size_t read = 0;
+  while (read < n) {
+    if (!Arrive()) {
+      ThrowEof();
+    }
+    std::size_t take = std::min(n - read, pending_.size());
+    boost::asio::buffer_copy(buf.prepare(take),
+                             boost::asio::buffer(pending_.data(), take));
+    buf.commit(take);
+    pending_.remove_prefix(take);
+    read += take;
+  }
+  return read;
+}
+
+std::size_t ReplayTransport::ReadToEnd(boost::asio::streambuf &buf) {
+  std::size_t read = 0;
+  try {
+    while (Arrive()) {
+      boost::asio::buffer_copy(
+          buf.prepare(pending_.size()),
+          boost::asio::buffer(pending_.data(), pending_.size()));
+      buf.commit(pending_.size());
+      read += pending_.size();
+      pending_ = {};
+    }
+  } catch (const boost::system::system_error &e) {
+    if (e.code() != boost::asio::error::eof) {
+      throw;
+    }
+  }
+  return read;
+}
+
+void ReplayTransport::Close() {
+  conn_ = nullptr;
+  pending_ = {};
+}
+
+bool ReplayTransport::Arrive() {
+  if (!pending_.empty()) {
+    return true;
+  }
+  if (conn_ == nullptr) {
+    throw boost::system::system_error(boost::asio::error::not_connected);
+  }
+  while (next_ < conn_->records.size()) {
+    const CaptureRecord &r = conn_->records[next_];
+    if (r.kind == CaptureRecord::kSent) {
+      ++next_; // a request the client did not send is skipped
+      continue;
+    }
+    if (r.kind == CaptureRecord::kClose) {
+      return false;
+    }
+    if (replayer_.speed() > 0) {
+      auto delay = std::chrono::microseconds(static_cast<std::int64_t>(
+          (r.time_us - origin_us_) / replayer_.speed()));
+      std::this_thread::sleep_until(origin_ + delay);
+    }
+    ++next_;
+    if (r.kind == CaptureRecord::kError) {
+      throw boost::system::system_error(ErrorFromData(r.data));
+    }
+    if (!r.data.empty()) {
+      pending_ = r.data;
+      return true;
+    }
+  }
+  return false;
+}
+
+void ReplayTransport::Sync(std::int64_t time_us) {
+  origin_ = std::chrono::steady_clock::now();
+  origin_us_ = time_us;
+}
+
+} // namespace ochat
@@ -0,0 +1,248 @@
+/**
+ * @file capture.h
+ * @brief Recording of the bytes exchanged with the server into a capture
+ * file, and replay of captures for deterministic tests and benchmarks.
+ */
+
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+
+#include "transport.h"
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace ochat {
+
+// One event of a captured connection.
+struct CaptureRecord {
+  enum Kind : char {
+    kConnect = 'C', // data is "server:port"
+    kSent = 'S',    // bytes written by the client
+    kReceived = 'R', // bytes received from the server
+    kError = 'E',   // the read failed, data is the error (see capture.cpp)
+    kClose = 'X',   // the client closed the connection
+  };
+  Kind kind;
+  std::int64_t time_us; // since the start of the capture
+  std::string data;
+};
+
+// The records of one connection, in the order they happened.
+struct CaptureConnection {
+  std::string endpoint; // "server:port"
+  std::vector<CaptureRecord> records;
+
+  // the target of the first request (e.g. "/api/chat"), empty if none
+  std::string target() const;
+};
+
+// The connections of a capture file, in the order they were made.
+//
+// A capture file starts with the magic "OCAP" and a version byte, followed by
+// records of: the kind (1 byte), the connection number, the time since the
+// previous record in microseconds and the data size (LEB128 varints), and the
+// data.
+class Capture {
+public:
+  /**
+   * Reads a capture file.
+   *
+   * @param path The file path.
+   * @return The capture.
+   * @throw std::runtime_error if the file cannot be read or is malformed.
+   */
+  static Capture Load(const std::string &path);
+
+  /**
+   * Parses the contents of a capture file.
+   *
+   * @param bytes The file contents.
+   * @return The capture.
+   * @throw std::runtime_error if the data is malformed.
+   */
+  static Capture Parse(std::string_view bytes);
+
+  const std::vector<CaptureConnection> &connections() const {
+    return connections_;
+  }
+
+  // the bytes received on all the connections
+  std::size_t received_bytes() const;
+
+private:
+  std::vector<CaptureConnection> connections_;
+};
+
+// Writes the records of any number of (concurrent) connections to a capture
+// file.  Thread safe.
+class CaptureWriter {
+public:
+  /**
+   * Creates (truncates) the capture file.
+   *
+   * @param path The file path.
+   * @throw std::runtime_error if the file cannot be created.
+   */
+  explicit CaptureWriter(const std::string &path);
+
+  /**
+   * Starts a new connection.
+   *
+   * @param endpoint The "server:port" connected to.
+   * @return The connection number for Append().
+   */
+  std::uint64_t Connect(const std::string &endpoint);
+
+  /**
+   * Appends a record, time stamped now.
+   *
+   * @param conn The connection number.
+   * @param kind The kind of record.
+   * @param data The record data.
+   */
+  void Append(std::uint64_t conn, CaptureRecord::Kind kind,
+              std::string_view data);
+
+  // writes the buffered records to the file
+  void Flush();
+
+private:
+  // Append() with mutex_ held
+  void AppendLocked(std::uint64_t conn, CaptureRecord::Kind kind,
+                    std::string_view data);
+
+  std::mutex mutex_;
+  std::ofstream file_;
+  std::chrono::steady_clock::time_point start_;
+  std::int64_t last_us_ = 0;
+  std::uint64_t connections_ = 0;
+};
+
+// Tees the bytes exchanged by another transport into a capture.
+class RecordingTransport : public Transport {
+public:
+  /**
+   * @param inner The transport that carries the connection.
+   * @param writer The capture the connection is recorded in.
+   */
+  RecordingTransport(std::unique_ptr<Transport> inner,
+                     std::shared_ptr<CaptureWriter> writer)
+      : inner_(std::move(inner)), writer_(std::move(writer)) {}
+
+  // records the close of a connection that is still open
+  ~RecordingTransport() override;
+
+  void Connect(const std::string &server, int port) override;
+  void Write(const std::string &data) override;
+  std::size_t ReadUntil(boost::asio::streambuf &buf,
+                        std::string_view delim) override;
+  std::size_t ReadExactly(boost::asio::streambuf &buf, std::size_t n) override;
+  std::size_t ReadToEnd(boost::asio::streambuf &buf) override;
+  void Close() override;
+  void Cancel() override { inner_->Cancel(); }
+
+private:
+  // records the bytes appended to buf beyond its first size bytes
+  void Received(const boost::asio::streambuf &buf, std::size_t size);
+  void Failed(const boost::system::error_code &ec);
+
+  std::unique_ptr<Transport> inner_;
+  std::shared_ptr<CaptureWriter> writer_;
+  std::uint64_t conn_ = 0;
+  bool connected_ = false;
+};
+
+/**
+ * Returns a factory of transports that record their connections.
+ *
+ * @param inner Creates the transports that carry the connections.
+ * @param writer The capture the connections are recorded in.
+ */
+TransportFactory RecordingTransports(TransportFactory inner,
+                                     std::shared_ptr<CaptureWriter> writer);
+
+// Hands out the connections of a capture, in order, to replay transports.
+// Thread safe.
+class Replayer {
+public:
+  /**
+   * @param capture The capture to replay.
+   * @param speed The replay speed relative to the recording (e.g. 10 for ten
+   * times faster), 0 to deliver the data without any delay.
+   */
+  explicit Replayer(Capture capture, double speed = 1)
+      : capture_(std::move(capture)), speed_(speed) {}
+
+  /**
+   * Returns a factory of transports that replay the connections of the
+   * capture, each transport replays the next connection when it connects.
+   * The replayer must outlive the transports.
+   */
+  TransportFactory Factory();
+
+  // the next connection to replay, nullptr once all were replayed
+  const CaptureConnection *Peek() const;
+
+  // takes the next connection, nullptr once all were replayed
+  const CaptureConnection *Next();
+
+  // replays the capture again from the first connection
+  void Rewind();
+
+  const Capture &capture() const { return capture_; }
+  double speed() const { return speed_; }
+
+private:
+  Capture capture_;
+  double speed_;
+  mutable std::mutex mutex_;
+  std::size_t next_ = 0;
+};
+
+// Plays back the server side of a captured connection.  The written data is
+// discarded.  The received data is delivered in the captured pieces, each
+// when it arrived relative to the request (scaled by the replay speed), and
+// read errors are reproduced.
+class ReplayTransport : public Transport {
+public:
+  explicit ReplayTransport(Replayer &replayer) : replayer_(replayer) {}
+
+  /**
+   * Starts the replay of the next connection of the capture.
+   *
+   * @throw boost::system::system_error (connection_refused) if all the
+   * connections were replayed.
+   */
+  void Connect(const std::string &server, int port) override;
+  void Write(const std::string &data) override;
+  std::size_t ReadUntil(boost::asio::streambuf &buf,
+                        std::string_view delim) override;
+  std::size_t ReadExactly(boost::asio::streambuf &buf, std::size_t n) override;
+  std::size_t ReadToEnd(boost::asio::streambuf &buf) override;
+  void Close() override;
+
+private:
+  // waits for the next received data, false at the end of the connection
+  bool Arrive();
+
+  // sets the time the following records are replayed relative to
+  void Sync(std::int64_t time_us);
+
+  Replayer &replayer_;
+  const CaptureConnection *conn_ = nullptr;
+  std::size_t next_ = 0;       // the next record of conn_
+  std::string_view pending_;   // received data not read yet
+  std::chrono::steady_clock::time_point origin_;
+  std::int64_t origin_us_ = 0; // capture time replayed at origin_
+};
+
+} // namespace ochat
+
+#endif // __CAPTURE_H__
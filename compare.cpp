@@ -0,0 +1,278 @@
+// Side by side comparison of the answers of several models to one prompt,
+// and independent prompts on forks of the conversation.  Each request gets
+// its own client with a copy of the conversation, so the requests run
+// concurrently and an answer never sees the others.
+#include "ochat.h"
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <future>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+
+namespace ochat {
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+double MsSince(Clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(Clock::now() - start)
+      .count();
+}
+
+// Writes the answers of several models to one stream a line at a time, each
+// line labelled with its model, so that answers streaming in at once stay
+// readable.
+class LabelledLines {
+public:
+  explicit LabelledLines(std::ostream &os) : os_(os) {}
+
+  // appends a piece of an answer to its pending line, complete lines are
+  // written and long lines are wrapped (at a space if there is one) so that
+  // the answer keeps streaming
+  void Write(const std::string &label, std::string &pending,
+             std::string_view text) {
+    pending += text;
+    for (;;) {
+      size_t eol = pending.find('\n');
+      size_t skip = 1;
+      if (eol == std::string::npos) {
+        if (pending.size() < kLineWidth) {
+          return;
+        }
+        eol = pending.rfind(' ', kLineWidth);
+        if (eol == std::string::npos || eol == 0) {
+          eol = kLineWidth;
+          skip = 0;
+        }
+      }
+      WriteLine(label, std::string_view(pending).substr(0, eol));
+      pending.erase(0, eol + skip);
+    }
+  }
+
+  // writes the rest of an answer
+  void Flush(const std::string &label, std::string &pending) {
+    if (!pending.empty()) {
+      WriteLine(label, pending);
+      pending.clear();
+    }
+  }
+
+private:
+  static constexpr size_t kLineWidth = 100;
+
+  void WriteLine(const std::string &label, std::string_view line) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    os_ << COL::APP << "[" << label << "] " << COL::AI << line << COL::DEF
+        << std::endl;
+  }
+
+  std::ostream &os_;
+  std::mutex mutex_;
+};
+
+} // namespace
+
+std::string CompareTarget::label() const {
+  if (server.empty()) {
+    return model;
+  }
+  return model + "@" + server + (port != 0 ? ":" + std::to_string(port) : "");
+}
+
+std::vector<CompareResult>
+OllamaChat::Compare(const std::vector<CompareTarget> &targets,
+                    const std::string &prompt) {
+  std::vector<ForkRequest> requests;
+  for (auto &t : targets) {
+    requests.push_back({t, prompt, t.label()});
+  }
+  return RunForks(requests);
+}
+
+std::vector<CompareResult>
+OllamaChat::Fork(const std::vector<std::string> &prompts) {
+  std::vector<ForkRequest> requests;
+  for (size_t i = 0; i < prompts.size(); ++i) {
+    requests.push_back(
+        {CompareTarget{opt_.model}, prompts[i], "#" + std::to_string(i + 1)});
+  }
+  return RunForks(requests);
+}
+
+// The context of each prompt is retrieved here, once for all the requests
+// with that prompt, as the provider may not be thread safe.  The history
+// branches are added once all the answers are complete.
+std::vector<CompareResult>
+OllamaChat::RunForks(const std::vector<ForkRequest> &requests) {
+  CancelPrefill();
+  std::map<std::string, std::string> contexts; // by prompt
+  for (auto &req : requests) {
+    if (context_provider_ && contexts.count(req.prompt) == 0) {
+      contexts[req.prompt] = context_provider_(req.prompt);
+    }
+  }
+  LabelledLines out(os_);
+  std::vector<CompareResult> results(requests.size());
+  std::vector<std::vector<std::string>> histories(requests.size());
+  std::vector<std::future<void>> done;
+  for (size_t i = 0; i < requests.size(); ++i) {
+    done.push_back(std::async(std::launch::async, [&, i] {
+      const ForkRequest &req = requests[i];
+      CompareResult &r = results[i];
+      r.label = req.label;
+      r.target = req.target;
+      Options opt = opt_;
+      opt.model = r.target.model;
+      if (!r.target.server.empty()) {
+        opt.server = r.target.server;
+      }
+      if (r.target.port != 0) {
+        opt.port = r.target.port;
+      }
+      opt.prefill = false;
+
+      // the answer is written by the token handler
+      std::ostream null_os(nullptr);
+      OllamaChat chat(opt, null_os);
+      chat.history_ = history_;
+      chat.images_ = images_;
+      chat.tools_ = tools_;
+      chat.tools_json_ = tools_json_;
+      chat.transport_factory_ = transport_factory_;
+      chat.SetScheduler(scheduler_, sched_tenant_, sched_priority_);
+      if (auto c = contexts.find(req.prompt);
+          c != contexts.end() && !c->second.empty()) {
+        chat.SetContextProvider(
+            [&context = c->second](const std::string &) { return context; });
+      }
+      std::string pending;
+      auto start = Clock::now();
+      chat.SetTokenHandler([&](std::string_view text) {
+        if (r.content.empty()) {
+          r.ttft_ms = MsSince(start);
+        }
+        r.content += text;
+        out.Write(r.label, pending, text);
+      });
+      try {
+        chat.SendRequestToAi(req.prompt);
+        r.stats = chat.last_stats();
+        histories[i] = std::move(chat.history_);
+      } catch (const std::exception &e) {
+        r.error = e.what();
+      }
+      r.wall_ms = MsSince(start);
+      out.Flush(r.label, pending);
+    }));
+  }
+  for (auto &d : done) {
+    d.get();
+  }
+
+  for (size_t i = 0; i < results.size(); ++i) {
+    if (results[i].error.empty()) {
+      branches_[results[i].label] = {results[i].target,
+                                     std::move(histories[i])};
+    }
+  }
+  images_.clear();
+  return results;
+}
+
+void OllamaChat::SwitchBranch(const std::string &label) {
+  const Branch &branch = branches_.at(label);
+  CancelPrefill();
+  history_ = branch.history;
+  opt_.model = branch.target.model;
+  if (!branch.target.server.empty()) {
+    opt_.server = branch.target.server;
+  }
+  if (branch.target.port != 0) {
+    opt_.port = branch.target.port;
+  }
+}
+
+std::vector<std::string> OllamaChat::branches() const {
+  std::vector<std::string> labels;
+  for (auto &[label, branch] : branches_) {
+    labels.push_back(label);
+  }
+  return labels;
+}
+
+// Model names have colons (e.g. "llama3.2:1b"), so the server starts at the
+// '@' and the port after the last colon of the server.
+std::vector<CompareTarget> ParseCompareTargets(const std::string &spec) {
+  std::vector<CompareTarget> targets;
+  size_t pos = 0;
+  while (pos <= spec.size()) {
+    size_t end = std::min(spec.find(',', pos), spec.size());
+    std::string item = spec.substr(pos, end - pos);
+    pos = end + 1;
+    CompareTarget t;
+    size_t at = item.find('@');
+    t.model = item.substr(0, at);
+    if (t.model.empty()) {
+      throw std::invalid_argument("Missing model in \"" + spec + "\"");
+    }
+    if (at != std::string::npos) {
+      t.server = item.substr(at + 1);
+      size_t colon = t.server.rfind(':');
+      if (!IsUnixSocket(t.server) && colon != std::string::npos) {
+        std::string_view port = std::string_view(t.server).substr(colon + 1);
+        auto [p, ec] =
+            std::from_chars(port.data(), port.data() + port.size(), t.port);
+        if (ec != std::errc() || p != port.data() + port.size() ||
+            t.port <= 0) {
+          throw std::invalid_argument("Invalid port in \"" + item + "\"");
+        }
+        t.server.resize(colon);
+      }
+      if (t.server.empty()) {
+        throw std::invalid_argument("Missing server in \"" + item + "\"");
+      }
+    }
+    targets.push_back(std::move(t));
+  }
+  return targets;
+}
+
+// The time to the first token is the server time before the generation
+// (loading the model and evaluating the prompt).
+void PrintComparison(std::ostream &os,
+                     const std::vector<CompareResult> &results) {
+  size_t width = 5;
+  for (auto &r : results) {
+    width = std::max(width, r.label.size());
+  }
+  std::ios_base::fmtflags flags = os.flags();
+  std::streamsize precision = os.precision();
+  os << std::left << std::setw(static_cast<int>(width)) << "model"
+     << std::right << std::setw(10) << "ttft ms" << std::setw(10) << "tok/s"
+     << std::setw(10) << "total ms" << std::setw(8) << "tokens"
+     << std::setw(10) << "wall ms" << std::endl;
+  os << std::fixed << std::setprecision(1);
+  for (auto &r : results) {
+    os << std::left << std::setw(static_cast<int>(width)) << r.label
+       << std::right;
+    if (!r.error.empty()) {
+      os << "  error: " << r.error << std::endl;
+      continue;
+    }
+    const ResponseStats &s = r.stats;
+    os << std::setw(10) << (s.total_duration - s.eval_duration) / 1e6
+       << std::setw(10)
+       << (s.eval_duration > 0 ? s.eval_count * 1e9 / s.eval_duration : 0.0)
+       << std::setw(10) << s.total_duration / 1e6 << std::setw(8)
+       << s.eval_count << std::setw(10) << r.wall_ms << std::endl;
+  }
+  os.flags(flags);
+  os.precision(precision);
+}
+
+} // namespace ochat
@@ -0,0 +1,327 @@
+#include "fake_ollama.h"
+#include "boost/json.hpp"
+#include "http_resp.h"
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+
+using boost::asio::ip::tcp;
+
+namespace ochat {
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr const char *kWords[] = {"lorem ",  "ipsum ", "dolor ",  "sit ",
+                                  "amet, ",  "consectetur ", "adipiscing ",
+                                  "elit, ",  "sed ",   "do ",     "eiusmod ",
+                                  "tempor. "};
+
+struct Request {
+  std::string method;
+  std::string path;
+  bool close = false;
+  std::string body;
+};
+
+// Reads the next request from the connection, returns false at the end of
+// the connection.
+bool ReadRequest(tcp::socket &socket, boost::asio::streambuf &buf,
+                 Request &req) {
+  boost::system::error_code ec;
+  boost::asio::read_until(socket, buf, "\r\n\r\n", ec);
+  if (ec)
+    return false;
+  HttpReqHeader hdr;
+  std::size_t hdr_len = ParseHttpReqHeader(buf, hdr);
+  req.method = hdr.method;
+  req.path = hdr.target;
+  req.close = hdr.conn_close;
+  std::size_t content_length =
+      hdr.content_length > 0 ? static_cast<std::size_t>(hdr.content_length) : 0;
+  buf.consume(hdr_len);
+
+  if (buf.size() < content_length) {
+    boost::asio::read(socket, buf,
+                      boost::asio::transfer_exactly(content_length - buf.size()),
+                      ec);
+    if (ec)
+      return false;
+  }
+  req.body.assign(boost::asio::buffer_cast<const char *>(buf.data()),
+                  content_length);
+  buf.consume(content_length);
+  return true;
+}
+
+void WriteResponse(tcp::socket &socket, int status, const std::string &body) {
+  std::ostringstream ss;
+  ss << "HTTP/1.1 " << status << (status == 200 ? " OK" : " Error") << "\r\n"
+     << "Content-Type: application/json\r\n"
+     << "Content-Length: " << body.size() << "\r\n\r\n"
+     << body;
+  boost::asio::write(socket, boost::asio::buffer(ss.str()));
+}
+
+void WriteChunk(tcp::socket &socket, const std::string &data) {
+  std::ostringstream ss;
+  ss << std::hex << data.size() << "\r\n" << data << "\r\n";
+  boost::asio::write(socket, boost::asio::buffer(ss.str()));
+}
+
+// a deterministic pseudo random vector for a text
+boost::json::array FakeEmbedding(std::string_view text, int dim) {
+  std::uint64_t x = 14695981039346656037ull;
+  for (char c : text) {
+    x = (x ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+  }
+  boost::json::array v;
+  for (int i = 0; i < dim; ++i) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    v.emplace_back(static_cast<double>(x % 2001) / 1000.0 - 1.0);
+  }
+  return v;
+}
+
+std::int64_t ToNs(Clock::duration d) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+}
+
+} // namespace
+
+FakeOllama::FakeOllama(const FakeOllamaOptions &opt)
+    : opt_(opt), acceptor_(io_context_) {
+  tcp::endpoint ep(boost::asio::ip::make_address(opt_.address),
+                   static_cast<unsigned short>(opt_.port));
+  acceptor_.open(ep.protocol());
+  acceptor_.set_option(tcp::acceptor::reuse_address(true));
+  acceptor_.bind(ep);
+  acceptor_.listen();
+  port_ = acceptor_.local_endpoint().port();
+  accept_thread_ = std::thread([this] { AcceptLoop(); });
+}
+
+FakeOllama::~FakeOllama() { Stop(); }
+
+void FakeOllama::Stop() {
+  if (stopping_.exchange(true))
+    return;
+  // wake up the blocking accept with a connection of our own
+  {
+    boost::system::error_code ec;
+    tcp::socket wake(io_context_);
+    wake.connect(acceptor_.local_endpoint(), ec);
+  }
+  accept_thread_.join();
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (auto &s : open_) {
+    boost::system::error_code ec;
+    s->shutdown(tcp::socket::shutdown_both, ec);
+  }
+  slot_cv_.notify_all();
+  done_cv_.wait(lock, [this] { return active_ == 0; });
+}
+
+void FakeOllama::AcceptLoop() {
+  while (true) {
+    auto socket = std::make_shared<tcp::socket>(io_context_);
+    boost::system::error_code ec;
+    acceptor_.accept(*socket, ec);
+    if (stopping_)
+      break;
+    if (ec)
+      continue;
+    socket->set_option(tcp::no_delay(true), ec);
+    std::lock_guard<std::mutex> lock(mutex_);
+    open_.insert(socket);
+    ++active_;
+    // each connection is served on its own thread, Stop() waits for them
+    std::thread([this, s = std::move(socket)]() mutable {
+      Serve(std::move(s));
+    }).detach();
+  }
+}
+
+void FakeOllama::AcquireSlot() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  slot_cv_.wait(lock,
+                [this] { return busy_slots_ < opt_.parallel || stopping_; });
+  ++busy_slots_;
+}
+
+void FakeOllama::ReleaseSlot() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    --busy_slots_;
+  }
+  slot_cv_.notify_one();
+}
+
+void FakeOllama::Serve(std::shared_ptr<tcp::socket> socket) {
+  boost::asio::streambuf buf;
+  Request req;
+  try {
+    while (!stopping_ && ReadRequest(*socket, buf, req)) {
+      ++requests_;
+      if (req.path != "/api/chat" && req.path != "/api/embed") {
+        WriteResponse(*socket, 404, R"({"error":"not found"})");
+        if (req.close)
+          break;
+        continue;
+      }
+      boost::system::error_code ec;
+      boost::json::value body = boost::json::parse(req.body, ec);
+      if (ec || !body.is_object()) {
+        WriteResponse(*socket, 400, R"({"error":"invalid JSON"})");
+        break;
+      }
+      auto &obj = body.as_object();
+      std::string model;
+      if (auto *m = obj.if_contains("model"); m != nullptr && m->is_string()) {
+        model = m->as_string().c_str();
+      }
+
+      if (req.path == "/api/embed") {
+        boost::json::array inputs;
+        if (auto *in = obj.if_contains("input")) {
+          if (in->is_array()) {
+            inputs = in->as_array();
+          } else if (in->is_string()) {
+            inputs.emplace_back(in->as_string());
+          }
+        }
+        boost::json::array embeddings;
+        for (auto &in : inputs) {
+          embeddings.emplace_back(FakeEmbedding(
+              in.is_string() ? std::string_view(in.as_string()) : "",
+              opt_.embed_dim));
+        }
+        boost::json::object resp;
+        resp["model"] = model;
+        resp["embeddings"] = std::move(embeddings);
+        WriteResponse(*socket, 200, boost::json::serialize(resp));
+      } else { // /api/chat
+        // the prompt size, about 4 characters per token
+        std::string prompt;
+        if (auto *msgs = obj.if_contains("messages");
+            msgs != nullptr && msgs->is_array()) {
+          for (auto &m : msgs->as_array()) {
+            if (auto *c = m.as_object().if_contains("content");
+                c != nullptr && c->is_string()) {
+              prompt.append(c->as_string().data(), c->as_string().size());
+            }
+          }
+        }
+        std::size_t chars = prompt.size();
+        std::int64_t tokens = opt_.default_tokens;
+        if (auto *o = obj.if_contains("options"); o != nullptr && o->is_object()) {
+          if (auto *n = o->as_object().if_contains("num_predict");
+              n != nullptr && n->is_number() && n->to_number<std::int64_t>() > 0) {
+            tokens = n->to_number<std::int64_t>();
+          }
+        }
+        bool stream = true;
+        if (auto *s = obj.if_contains("stream"); s != nullptr && s->is_bool()) {
+          stream = s->as_bool();
+        }
+
+        auto arrived = Clock::now();
+        AcquireSlot();
+        struct SlotGuard {
+          FakeOllama *self;
+          ~SlotGuard() { self->ReleaseSlot(); }
+        } guard{this};
+        if (opt_.prompt_cache) {
+          // only the part after the prefix shared with the cache is evaluated
+          std::lock_guard<std::mutex> lock(mutex_);
+          auto diff = std::mismatch(prompt.begin(), prompt.end(),
+                                    cached_prompt_.begin(),
+                                    cached_prompt_.end());
+          chars -= static_cast<std::size_t>(diff.first - prompt.begin());
+        }
+        std::int64_t prompt_tokens = static_cast<std::int64_t>(chars / 4 + 1);
+        auto start = Clock::now();
+        auto next = start + std::chrono::microseconds(static_cast<std::int64_t>(
+                                opt_.ttft_ms * 1000 +
+                                opt_.prefill_us_per_token * prompt_tokens));
+        std::this_thread::sleep_until(next);
+        auto first = Clock::now();
+        if (opt_.prompt_cache) {
+          std::lock_guard<std::mutex> lock(mutex_);
+          cached_prompt_ = std::move(prompt);
+        }
+
+        auto message = [&model](const std::string &content, bool done) {
+          boost::json::object m;
+          m["model"] = model;
+          m["created_at"] = "2024-01-01T00:00:00Z";
+          boost::json::object msg;
+          msg["role"] = "assistant";
+          msg["content"] = content;
+          m["message"] = std::move(msg);
+          m["done"] = done;
+          return m;
+        };
+        std::string content;
+        if (stream) {
+          std::ostringstream hdr;
+          hdr << "HTTP/1.1 200 OK\r\n"
+              << "Content-Type: application/x-ndjson\r\n"
+              << "Transfer-Encoding: chunked\r\n\r\n";
+          boost::asio::write(*socket, boost::asio::buffer(hdr.str()));
+        }
+        auto gap = std::chrono::microseconds(
+            static_cast<std::int64_t>(opt_.token_ms * 1000));
+        for (std::int64_t i = 0; i < tokens; ++i) {
+          if (i > 0) {
+            next += gap;
+            std::this_thread::sleep_until(next);
+          }
+          std::string tok = kWords[i % std::size(kWords)];
+          content += tok;
+          if (stream) {
+            WriteChunk(*socket, boost::json::serialize(message(tok, false)) +
+                                    "\n");
+          }
+        }
+
+        auto end = Clock::now();
+        boost::json::object last = message(stream ? "" : content, true);
+        last["done_reason"] = "stop";
+        last["total_duration"] = ToNs(end - arrived);
+        last["load_duration"] = ToNs(start - arrived);
+        last["prompt_eval_count"] = prompt_tokens;
+        last["prompt_eval_duration"] = ToNs(first - start);
+        last["eval_count"] = tokens;
+        last["eval_duration"] = ToNs(end - first);
+        if (stream) {
+          WriteChunk(*socket, boost::json::serialize(last) + "\n");
+          boost::asio::write(*socket, boost::asio::buffer("0\r\n\r\n", 5));
+        } else {
+          WriteResponse(*socket, 200, boost::json::serialize(last));
+        }
+      }
+      if (req.close)
+        break;
+    }
+  } catch (const std::exception &) {
+    // the client went away or sent a malformed request
+  }
+
+  boost::system::error_code ec;
+  socket->close(ec);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    open_.erase(socket);
+  }
+  socket.reset(); // before Stop() can return and destroy the io_context
+  std::lock_guard<std::mutex> lock(mutex_);
+  --active_;
+  done_cv_.notify_all();
+}
+
+} // namespace ochat
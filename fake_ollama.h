@@ -0,0 +1,99 @@
+/**
+ * @file fake_ollama.h
+ * @brief Local stand-in for an Ollama server that streams synthetic responses
+ * with configurable latencies, for load tests without a GPU.
+ */
+
+#ifndef __FAKE_OLLAMA_H__
+#define __FAKE_OLLAMA_H__
+
+#include <atomic>
+#include <boost/asio.hpp>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+
+namespace ochat {
+
+struct FakeOllamaOptions {
+  std::string address = "127.0.0.1";
+  int port = 0;           // 0 picks a free port
+  int parallel = 1;       // requests generated at once (OLLAMA_NUM_PARALLEL)
+  double ttft_ms = 50;    // time to the first token of a response
+  double prefill_us_per_token = 50; // additional first token time per token
+                                    // of the conversation
+  double token_ms = 10;   // time between generated tokens
+  int default_tokens = 64; // tokens generated without options.num_predict
+  int embed_dim = 64;     // size of the vectors returned by /api/embed
+  bool prompt_cache = false; // keep the last evaluated prompt, so that only
+                             // the part after the common prefix is evaluated
+};
+
+// Serves /api/chat (streamed or not) and /api/embed.  A chat response
+// generates options.num_predict tokens (or default_tokens), the first after
+// ttft_ms plus the prefill time of the conversation, then one every token_ms.
+// Only `parallel` requests are generated at a time, the others wait for a slot
+// like they do on a real server, so the waiting shows up in the time to the
+// first token.  The last message has the counts and durations a real server
+// reports.  With prompt_cache the messages of the last request are kept like
+// the KV cache of a server (without the generated tokens, which the next
+// request renders differently), and prompt_eval_count counts only the
+// uncached part.
+class FakeOllama {
+public:
+  /**
+   * Starts the server on a background thread.
+   *
+   * @param opt The server options.
+   */
+  explicit FakeOllama(const FakeOllamaOptions &opt = {});
+
+  /**
+   * Stops the server.
+   */
+  ~FakeOllama();
+
+  // the port the server listens on
+  int port() const { return port_; }
+
+  // the number of requests served
+  std::size_t requests() const { return requests_; }
+
+  /**
+   * Stops accepting connections and closes the open connections.
+   */
+  void Stop();
+
+  FakeOllama(const FakeOllama &) = delete;
+  FakeOllama &operator=(const FakeOllama &) = delete;
+
+private:
+  void AcceptLoop();
+  void Serve(std::shared_ptr<boost::asio::ip::tcp::socket> socket);
+  void AcquireSlot();
+  void ReleaseSlot();
+
+  FakeOllamaOptions opt_;
+  boost::asio::io_context io_context_;
+  boost::asio::ip::tcp::acceptor acceptor_;
+  int port_ = 0;
+  std::atomic<bool> stopping_{false};
+  std::atomic<std::size_t> requests_{0};
+  std::thread accept_thread_;
+
+  std::mutex mutex_; // guards the members below
+  std::condition_variable slot_cv_;
+  std::condition_variable done_cv_;
+  int busy_slots_ = 0;
+  int active_ = 0; // connections being served
+  std::set<std::shared_ptr<boost::asio::ip::tcp::socket>> open_;
+  std::string cached_prompt_; // the prompt in the cache (prompt_cache)
+};
+
+} // namespace ochat
+
+#endif // __FAKE_OLLAMA_H__
@@ -0,0 +1,481 @@
+#include "gateway.h"
+#include "http_resp.h"
+#include <boost/json.hpp>
+#include <csignal>
+#include <deque>
+#include <sstream>
+#include <string_view>
+
+namespace asio = boost::asio;
+using asio::use_awaitable;
+using boost::asio::ip::tcp;
+
+namespace ochat {
+
+// A request sent to the backend and the clients that wait for its response.
+// The response is kept as it is sent to the clients, so a client that joins
+// late can be sent the part it missed.
+struct GatewayFlight {
+  explicit GatewayFlight(const asio::any_io_executor &ex)
+      : updated(ex, asio::steady_timer::time_point::max()) {}
+
+  std::string key;  // coalescing key, empty when not coalesced
+  std::string head; // response header for the clients, empty until known
+  std::deque<std::string> frames; // the body, deque keeps them in place
+  bool done = false;       // the response is complete (or failed)
+  bool failed = false;     // the body is incomplete, clients are disconnected
+  bool keep_alive = true;  // clients can send another request
+  int clients = 0;
+  tcp::socket *backend = nullptr; // while the response is read
+  asio::steady_timer updated;     // cancelled to wake the clients
+
+  void Notify() { updated.cancel(); }
+};
+
+namespace {
+
+std::string_view BufferView(const asio::streambuf &buf) {
+  auto data = buf.data();
+  return std::string_view(static_cast<const char *>(data.data()), data.size());
+}
+
+std::string ErrorResponse(int status, const std::string &msg) {
+  boost::json::object err;
+  err["error"] = msg;
+  std::string body = boost::json::serialize(err);
+  std::ostringstream ss;
+  ss << "HTTP/1.1 " << status << (status == 502 ? " Bad Gateway" : " Error")
+     << "\r\nContent-Type: application/json\r\nContent-Length: "
+     << body.size() << "\r\n\r\n"
+     << body;
+  return ss.str();
+}
+
+std::string FormatBackendRequest(const std::string &method,
+                                 const std::string &target,
+                                 const std::string &body,
+                                 const std::string &host) {
+  std::ostringstream ss;
+  ss << method << " " << target << " HTTP/1.1\r\n";
+  ss << "Host: " << host << "\r\n";
+  if (!body.empty() || method == "POST") {
+    ss << "Content-Type: application/json\r\n";
+    ss << "Content-Length: " << body.size() << "\r\n";
+  }
+  ss << "\r\n" << body;
+  return ss.str();
+}
+
+// Requests that generate are coalesced by their JSON body (reformatted so
+// the layout of the JSON does not matter), other requests are not.
+std::string CoalesceKey(const std::string &method, const std::string &target,
+                        const std::string &body) {
+  if (method != "POST" || (target != "/api/chat" && target != "/api/generate"))
+    return "";
+  boost::system::error_code ec;
+  boost::json::value json = boost::json::parse(body, ec);
+  if (ec)
+    return "";
+  return target + "\n" + boost::json::serialize(json);
+}
+
+} // namespace
+
+Gateway::Gateway(const GatewayOptions &opt)
+    : opt_(opt), acceptor_(io_context_),
+      pool_changed_(io_context_, asio::steady_timer::time_point::max()) {
+  tcp::endpoint ep(asio::ip::make_address(opt_.address),
+                   static_cast<unsigned short>(opt_.port));
+  acceptor_.open(ep.protocol());
+  acceptor_.set_option(tcp::acceptor::reuse_address(true));
+  acceptor_.bind(ep);
+  acceptor_.listen();
+  port_ = acceptor_.local_endpoint().port();
+}
+
+Gateway::~Gateway() { Stop(); }
+
+void Gateway::Run() {
+  asio::signal_set signals(io_context_, SIGINT, SIGTERM);
+  signals.async_wait([this](const boost::system::error_code &ec, int) {
+    if (!ec)
+      CloseAll();
+  });
+  signals_ = &signals;
+  asio::co_spawn(io_context_, Listen(), asio::detached);
+  io_context_.run();
+  signals_ = nullptr;
+}
+
+void Gateway::Start() {
+  asio::co_spawn(io_context_, Listen(), asio::detached);
+  thread_ = std::thread([this] { io_context_.run(); });
+}
+
+void Gateway::Stop() {
+  if (!stopped_.exchange(true)) {
+    asio::post(io_context_, [this] { CloseAll(); });
+  }
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+}
+
+// Closes every socket and wakes every waiting coroutine, they all see
+// stopping_ and finish, so the io_context runs out of work.
+void Gateway::CloseAll() {
+  stopping_ = true;
+  boost::system::error_code ec;
+  acceptor_.close(ec);
+  for (auto *c : clients_) {
+    c->close(ec);
+  }
+  for (auto *b : backends_) {
+    b->close(ec);
+  }
+  for (auto *f : flights_) {
+    f->Notify();
+  }
+  open_connections_ -= static_cast<int>(idle_.size());
+  idle_.clear();
+  pool_changed_.cancel();
+  if (signals_ != nullptr) {
+    signals_->cancel(ec);
+  }
+}
+
+GatewayStats Gateway::stats() const {
+  GatewayStats s;
+  s.clients = n_clients_;
+  s.requests = n_requests_;
+  s.coalesced = n_coalesced_;
+  s.backend_requests = n_backend_requests_;
+  s.backend_connections = n_backend_connections_;
+  return s;
+}
+
+Gateway::awaitable<void> Gateway::Listen() {
+  while (!stopping_) {
+    boost::system::error_code ec;
+    tcp::socket socket = co_await acceptor_.async_accept(
+        asio::redirect_error(use_awaitable, ec));
+    if (ec) {
+      if (stopping_ || ec == asio::error::operation_aborted)
+        break;
+      continue;
+    }
+    socket.set_option(tcp::no_delay(true), ec);
+    asio::co_spawn(io_context_, ServeClient(std::move(socket)),
+                   asio::detached);
+  }
+}
+
+Gateway::awaitable<void> Gateway::ServeClient(tcp::socket socket) {
+  clients_.insert(&socket);
+  ++n_clients_;
+  asio::streambuf buf(opt_.max_request_size);
+  try {
+    while (!stopping_) {
+      // read the request, the header views are copied before the buffer is
+      // consumed
+      co_await asio::async_read_until(socket, buf, "\r\n\r\n", use_awaitable);
+      HttpReqHeader hdr;
+      std::size_t hdr_len = ParseHttpReqHeader(buf, hdr);
+      std::string method(hdr.method);
+      std::string target(hdr.target);
+      bool close = hdr.conn_close;
+      bool chunked = hdr.chunked;
+      long length = hdr.content_length;
+      buf.consume(hdr_len);
+      if (chunked ||
+          length > static_cast<long>(opt_.max_request_size - buf.size())) {
+        co_await asio::async_write(
+            socket,
+            asio::buffer(chunked ? ErrorResponse(411, "Content-Length required")
+                                 : ErrorResponse(413, "Request too large")),
+            use_awaitable);
+        break;
+      }
+      std::size_t len = length > 0 ? static_cast<std::size_t>(length) : 0;
+      if (buf.size() < len) {
+        co_await asio::async_read(socket, buf,
+                                  asio::transfer_exactly(len - buf.size()),
+                                  use_awaitable);
+      }
+      std::string body(BufferView(buf).substr(0, len));
+      buf.consume(len);
+      ++n_requests_;
+
+      // join an identical request in flight, or send a new one
+      std::shared_ptr<GatewayFlight> flight;
+      std::string key = opt_.coalesce ? CoalesceKey(method, target, body) : "";
+      if (!key.empty()) {
+        auto it = coalescing_.find(key);
+        if (it != coalescing_.end()) {
+          flight = it->second;
+          ++n_coalesced_;
+        }
+      }
+      if (!flight) {
+        flight = std::make_shared<GatewayFlight>(io_context_.get_executor());
+        flight->key = key;
+        if (!key.empty()) {
+          coalescing_[key] = flight;
+        }
+        asio::co_spawn(
+            io_context_,
+            Fetch(flight, FormatBackendRequest(method, target, body,
+                                               opt_.backend_server)),
+            asio::detached);
+      }
+      if (!co_await Relay(socket, flight) || close)
+        break;
+    }
+  } catch (const std::exception &) {
+    // the client went away or sent a malformed request
+  }
+  clients_.erase(&socket);
+  --n_clients_;
+}
+
+// Sends the response of a flight to a client as it arrives.  Returns true if
+// the client can send another request on the connection.
+Gateway::awaitable<bool>
+Gateway::Relay(tcp::socket &client, std::shared_ptr<GatewayFlight> flight) {
+  // when the last client leaves, the generation is stopped
+  struct Leave {
+    GatewayFlight &f;
+    ~Leave() {
+      if (--f.clients == 0 && !f.done && f.backend != nullptr) {
+        boost::system::error_code ec;
+        f.backend->close(ec);
+      }
+    }
+  };
+  ++flight->clients;
+  Leave leave{*flight};
+
+  bool head_sent = false;
+  std::size_t next = 0;
+  while (true) {
+    if (!head_sent && !flight->head.empty()) {
+      co_await asio::async_write(client, asio::buffer(flight->head),
+                                 use_awaitable);
+      head_sent = true;
+    }
+    // more frames may be added while a frame is written
+    while (head_sent && next < flight->frames.size()) {
+      co_await asio::async_write(client, asio::buffer(flight->frames[next]),
+                                 use_awaitable);
+      ++next;
+    }
+    if (flight->done && next == flight->frames.size())
+      break;
+    if (stopping_)
+      co_return false;
+    boost::system::error_code ec;
+    co_await flight->updated.async_wait(
+        asio::redirect_error(use_awaitable, ec));
+  }
+  co_return head_sent && !flight->failed && flight->keep_alive;
+}
+
+Gateway::awaitable<void> Gateway::Fetch(std::shared_ptr<GatewayFlight> flight,
+                                        std::string request) {
+  ++n_backend_requests_;
+  flights_.insert(flight.get());
+  std::unique_ptr<tcp::socket> conn;
+  bool reusable = false;
+  try {
+    asio::streambuf buf;
+    HttpRespHeader hdr;
+    std::size_t hdr_len = 0;
+    for (int attempt = 0;; ++attempt) {
+      bool reused = false;
+      conn = co_await AcquireConnection(reused);
+      flight->backend = conn.get();
+      try {
+        if (flight->clients == 0)
+          throw boost::system::system_error(asio::error::operation_aborted);
+        co_await asio::async_write(*conn, asio::buffer(request), use_awaitable);
+        co_await asio::async_read_until(*conn, buf, "\r\n\r\n", use_awaitable);
+        hdr_len = ParseHttpRespHeader(buf, hdr);
+        break;
+      } catch (const boost::system::system_error &) {
+        flight->backend = nullptr;
+        ReleaseConnection(std::move(conn), false);
+        buf.consume(buf.size());
+        // the backend may have closed a pooled connection while it was idle,
+        // the request is sent again on a new connection
+        if (!reused || attempt > 0 || stopping_ || flight->clients == 0)
+          throw;
+      }
+    }
+
+    // the clients receive the body as it is framed by the backend
+    bool chunked = hdr.chunked;
+    long length = hdr.content_length;
+    bool to_eof = !chunked && length < 0;
+    bool backend_close = hdr.conn_close || to_eof;
+    std::ostringstream head;
+    head << "HTTP/1.1 " << hdr.status << " " << hdr.reason << "\r\n";
+    if (auto type = hdr.Get("Content-Type"); !type.empty()) {
+      head << "Content-Type: " << type << "\r\n";
+    }
+    if (chunked) {
+      head << "Transfer-Encoding: chunked\r\n";
+    } else if (!to_eof) {
+      head << "Content-Length: " << length << "\r\n";
+    } else {
+      head << "Connection: close\r\n";
+      flight->keep_alive = false;
+    }
+    head << "\r\n";
+    buf.consume(hdr_len);
+    flight->head = head.str();
+    flight->Notify();
+
+    co_await ReadBody(*conn, buf, *flight, chunked, length);
+    reusable = !backend_close && buf.size() == 0;
+  } catch (const std::exception &) {
+    if (flight->head.empty()) {
+      flight->head = ErrorResponse(502, "Backend request failed");
+    } else {
+      flight->failed = true;
+    }
+  }
+
+  flight->done = true;
+  flight->backend = nullptr;
+  flight->Notify();
+  if (conn) {
+    ReleaseConnection(std::move(conn), reusable);
+  }
+  flights_.erase(flight.get());
+  if (!flight->key.empty()) {
+    auto it = coalescing_.find(flight->key);
+    if (it != coalescing_.end() && it->second == flight) {
+      coalescing_.erase(it);
+    }
+  }
+}
+
+// Reads the response body, each chunk (or each read of a body with a length)
+// is added to the flight as soon as it arrives.
+Gateway::awaitable<void> Gateway::ReadBody(tcp::socket &backend,
+                                           asio::streambuf &buf,
+                                           GatewayFlight &flight, bool chunked,
+                                           long content_length) {
+  if (chunked) {
+    while (true) {
+      co_await asio::async_read_until(backend, buf, "\r\n", use_awaitable);
+      std::string_view data = BufferView(buf);
+      std::size_t eol = data.find("\r\n");
+      std::string size_hex(data.substr(0, data.find_first_of(";\r")));
+      std::size_t size = std::stoul(size_hex, nullptr, 16);
+      buf.consume(eol + 2);
+      if (size == 0) {
+        // skip the trailer fields up to the blank line
+        while (true) {
+          co_await asio::async_read_until(backend, buf, "\r\n", use_awaitable);
+          std::size_t end = BufferView(buf).find("\r\n");
+          buf.consume(end + 2);
+          if (end == 0)
+            break;
+        }
+        flight.frames.emplace_back("0\r\n\r\n");
+        flight.Notify();
+        co_return;
+      }
+      if (buf.size() < size + 2) {
+        co_await asio::async_read(backend, buf,
+                                  asio::transfer_exactly(size + 2 - buf.size()),
+                                  use_awaitable);
+      }
+      std::string frame = size_hex + "\r\n";
+      frame.append(BufferView(buf).substr(0, size + 2));
+      buf.consume(size + 2);
+      flight.frames.push_back(std::move(frame));
+      flight.Notify();
+    }
+  }
+
+  // a body with a length, or up to the end of the connection
+  std::size_t remaining = content_length >= 0
+                              ? static_cast<std::size_t>(content_length)
+                              : std::string::npos;
+  while (true) {
+    if (buf.size() > 0 && remaining > 0) {
+      std::size_t n = std::min(buf.size(), remaining);
+      flight.frames.emplace_back(BufferView(buf).substr(0, n));
+      buf.consume(n);
+      if (remaining != std::string::npos)
+        remaining -= n;
+      flight.Notify();
+    }
+    if (remaining == 0)
+      break;
+    boost::system::error_code ec;
+    std::size_t n = co_await backend.async_read_some(
+        buf.prepare(1 << 14), asio::redirect_error(use_awaitable, ec));
+    buf.commit(n);
+    if (ec == asio::error::eof && content_length < 0)
+      break;
+    if (ec)
+      throw boost::system::system_error(ec);
+  }
+}
+
+// Returns an idle pooled connection, or opens a new one while there are fewer
+// than max_connections, otherwise waits for a connection to be released.
+Gateway::awaitable<std::unique_ptr<tcp::socket>>
+Gateway::AcquireConnection(bool &reused) {
+  while (true) {
+    if (stopping_)
+      throw boost::system::system_error(asio::error::operation_aborted);
+    if (!idle_.empty()) {
+      auto conn = std::move(idle_.back());
+      idle_.pop_back();
+      backends_.insert(conn.get());
+      reused = true;
+      co_return conn;
+    }
+    if (open_connections_ < opt_.max_connections) {
+      ++open_connections_;
+      auto conn = std::make_unique<tcp::socket>(io_context_);
+      backends_.insert(conn.get());
+      try {
+        tcp::resolver resolver(io_context_);
+        auto endpoints = co_await resolver.async_resolve(
+            opt_.backend_server, std::to_string(opt_.backend_port),
+            use_awaitable);
+        co_await asio::async_connect(*conn, endpoints, use_awaitable);
+      } catch (const std::exception &) {
+        ReleaseConnection(std::move(conn), false);
+        throw;
+      }
+      boost::system::error_code ec;
+      conn->set_option(tcp::no_delay(true), ec);
+      ++n_backend_connections_;
+      reused = false;
+      co_return conn;
+    }
+    boost::system::error_code ec;
+    co_await pool_changed_.async_wait(asio::redirect_error(use_awaitable, ec));
+  }
+}
+
+void Gateway::ReleaseConnection(std::unique_ptr<tcp::socket> conn,
+                                bool reusable) {
+  backends_.erase(conn.get());
+  if (reusable && !stopping_) {
+    idle_.push_back(std::move(conn));
+  } else {
+    boost::system::error_code ec;
+    conn->close(ec);
+    --open_connections_;
+  }
+  pool_changed_.cancel();
+}
+
+} // namespace ochat
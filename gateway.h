@@ -0,0 +1,144 @@
+/**
+ * @file gateway.h
+ * @brief Ollama compatible HTTP gateway that multiplexes many clients over a
+ * pool of backend connections and coalesces identical requests.
+ */
+
+#ifndef __GATEWAY_H__
+#define __GATEWAY_H__
+
+#include "app_config.h"
+#include <atomic>
+#include <boost/asio.hpp>
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace ochat {
+
+struct GatewayOptions {
+  std::string address = "127.0.0.1";  // address the gateway listens on
+  int port = OLLAMA_GATEWAY_PORT;      // 0 picks a free port
+  std::string backend_server = OLLAMA_SERVER_ADDR;
+  int backend_port = OLLAMA_SERVER_PORT;
+  int max_connections = OLLAMA_GATEWAY_CONNECTIONS; // to the backend
+  bool coalesce = true; // share the response of identical chat requests
+  std::size_t max_request_size = 16 << 20; // larger requests are refused
+};
+
+struct GatewayFlight;
+
+// Counters of the gateway, for monitoring and tests.
+struct GatewayStats {
+  std::size_t clients = 0;         // connected clients
+  std::size_t requests = 0;        // requests from clients
+  std::size_t coalesced = 0;       // requests served by another's response
+  std::size_t backend_requests = 0;
+  std::size_t backend_connections = 0; // connections opened to the backend
+};
+
+// An HTTP/1.1 gateway in front of an Ollama server.  Requests are forwarded
+// to the backend over a pool of at most max_connections keep-alive
+// connections (requests wait for a free connection), and the responses are
+// streamed back to the clients as they arrive.
+//
+// Identical in-flight POST requests to /api/chat and /api/generate (same
+// JSON body) are coalesced: the backend generates the response once and
+// every waiting client receives the complete stream, clients that join late
+// first receive the part already generated.  When all the clients of a
+// request have gone away the backend connection is closed, which stops the
+// generation.
+//
+// The gateway runs on a single thread with asynchronous I/O (C++20
+// coroutines), an idle client only costs its socket and a small coroutine
+// frame.
+class Gateway {
+public:
+  /**
+   * Binds the listening socket.
+   *
+   * @param opt The gateway options.
+   * @throw boost::system::system_error if the address cannot be bound.
+   */
+  explicit Gateway(const GatewayOptions &opt = {});
+
+  /**
+   * Stops the gateway.
+   */
+  ~Gateway();
+
+  /**
+   * Serves clients on the calling thread until Stop() is called or the
+   * process receives SIGINT or SIGTERM.
+   */
+  void Run();
+
+  /**
+   * Serves clients on a background thread.
+   */
+  void Start();
+
+  /**
+   * Stops accepting clients, closes all the connections and waits for the
+   * background thread (if any).  Can be called from any thread.
+   */
+  void Stop();
+
+  // the port the gateway listens on
+  int port() const { return port_; }
+
+  GatewayStats stats() const;
+
+  Gateway(const Gateway &) = delete;
+  Gateway &operator=(const Gateway &) = delete;
+
+private:
+  using tcp = boost::asio::ip::tcp;
+  template <class T> using awaitable = boost::asio::awaitable<T>;
+
+  awaitable<void> Listen();
+  awaitable<void> ServeClient(tcp::socket socket);
+  awaitable<bool> Relay(tcp::socket &client,
+                        std::shared_ptr<GatewayFlight> flight);
+  awaitable<void> Fetch(std::shared_ptr<GatewayFlight> flight,
+                        std::string request);
+  awaitable<void> ReadBody(tcp::socket &backend, boost::asio::streambuf &buf,
+                           GatewayFlight &flight, bool chunked,
+                           long content_length);
+  awaitable<std::unique_ptr<tcp::socket>> AcquireConnection(bool &reused);
+  void ReleaseConnection(std::unique_ptr<tcp::socket> conn, bool reusable);
+  void CloseAll();
+
+  GatewayOptions opt_;
+  boost::asio::io_context io_context_;
+  tcp::acceptor acceptor_;
+  int port_ = 0;
+  std::thread thread_;
+  std::atomic<bool> stopped_{false};
+
+  // state below is only used on the gateway thread
+  bool stopping_ = false;
+  std::set<tcp::socket *> clients_;
+  std::set<tcp::socket *> backends_; // backend connections in use
+  std::set<GatewayFlight *> flights_;
+  std::map<std::string, std::shared_ptr<GatewayFlight>> coalescing_;
+  std::vector<std::unique_ptr<tcp::socket>> idle_; // pooled connections
+  int open_connections_ = 0; // idle and in use
+  boost::asio::steady_timer pool_changed_; // wakes requests waiting for a
+                                           // connection
+  boost::asio::signal_set *signals_ = nullptr; // while Run() runs
+
+  std::atomic<std::size_t> n_clients_{0};
+  std::atomic<std::size_t> n_requests_{0};
+  std::atomic<std::size_t> n_coalesced_{0};
+  std::atomic<std::size_t> n_backend_requests_{0};
+  std::atomic<std::size_t> n_backend_connections_{0};
+};
+
+} // namespace ochat
+
+#endif // __GATEWAY_H__
@@ -0,0 +1,184 @@
+/**
+ * @file hdr_histogram.h
+ * @brief High dynamic range histogram for recording latencies with a fixed
+ * relative precision.
+ */
+
+#ifndef __HDR_HISTOGRAM_H__
+#define __HDR_HISTOGRAM_H__
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+namespace ochat {
+
+// Records integer values (e.g. latencies in microseconds) between lowest and
+// highest, keeping sig_digits significant decimal digits.  Each power of two
+// range of values is split into the same number of linear sub buckets, so the
+// memory used grows with the log of the range and every recorded value is
+// reported within its precision.  Values above highest are recorded as
+// highest.
+//
+// The bucket layout is the one of the HdrHistogram library.
+class HdrHistogram {
+public:
+  /**
+   * @param lowest The smallest value that can be told apart from 0 (>= 1).
+   * @param highest The largest value that can be recorded.
+   * @param sig_digits The number of significant digits kept (1 to 5).
+   */
+  explicit HdrHistogram(std::int64_t lowest = 1,
+                        std::int64_t highest = 3600LL * 1000 * 1000,
+                        int sig_digits = 3)
+      : highest_(highest) {
+    if (lowest < 1 || highest < 2 * lowest || sig_digits < 1 ||
+        sig_digits > 5) {
+      throw std::invalid_argument("invalid histogram range or precision");
+    }
+    std::int64_t largest_single_unit =
+        2 * static_cast<std::int64_t>(std::pow(10, sig_digits));
+    unit_magnitude_ = static_cast<int>(std::floor(std::log2(lowest)));
+    int sub_bucket_count_magnitude =
+        static_cast<int>(std::ceil(std::log2(largest_single_unit)));
+    sub_bucket_half_count_magnitude_ = std::max(sub_bucket_count_magnitude, 1) - 1;
+    sub_bucket_count_ = std::int64_t{1} << (sub_bucket_half_count_magnitude_ + 1);
+    sub_bucket_half_count_ = sub_bucket_count_ / 2;
+    sub_bucket_mask_ = (sub_bucket_count_ - 1) << unit_magnitude_;
+
+    // number of power of two buckets needed to cover the range
+    std::int64_t smallest_untrackable = sub_bucket_count_ << unit_magnitude_;
+    int buckets = 1;
+    while (smallest_untrackable <= highest) {
+      if (smallest_untrackable > std::numeric_limits<std::int64_t>::max() / 2) {
+        ++buckets;
+        break;
+      }
+      smallest_untrackable <<= 1;
+      ++buckets;
+    }
+    counts_.assign(static_cast<std::size_t>((buckets + 1) * sub_bucket_half_count_),
+                   0);
+  }
+
+  /**
+   * Records a value (negative values are recorded as 0).
+   */
+  void Record(std::int64_t value, std::int64_t count = 1) {
+    value = std::clamp<std::int64_t>(value, 0, highest_);
+    counts_[CountsIndexFor(value)] += count;
+    total_ += count;
+    min_ = std::min(min_, value);
+    max_ = std::max(max_, value);
+    sum_ += static_cast<double>(value) * count;
+  }
+
+  /**
+   * Adds the values recorded in another histogram with the same range and
+   * precision.
+   */
+  void Merge(const HdrHistogram &other) {
+    if (other.counts_.size() != counts_.size() ||
+        other.unit_magnitude_ != unit_magnitude_ ||
+        other.sub_bucket_count_ != sub_bucket_count_) {
+      throw std::invalid_argument("histograms have different layouts");
+    }
+    for (std::size_t i = 0; i < counts_.size(); ++i) {
+      counts_[i] += other.counts_[i];
+    }
+    total_ += other.total_;
+    min_ = std::min(min_, other.min_);
+    max_ = std::max(max_, other.max_);
+    sum_ += other.sum_;
+  }
+
+  /**
+   * Returns the value at the percentile (0 to 100), the highest value that is
+   * equivalent (within the precision) to the recorded value.
+   */
+  std::int64_t ValueAtPercentile(double percentile) const {
+    if (total_ == 0)
+      return 0;
+    percentile = std::clamp(percentile, 0.0, 100.0);
+    std::int64_t target = std::max<std::int64_t>(
+        1, static_cast<std::int64_t>(
+               std::ceil(percentile / 100.0 * static_cast<double>(total_))));
+    std::int64_t seen = 0;
+    for (std::size_t i = 0; i < counts_.size(); ++i) {
+      seen += counts_[i];
+      if (seen >= target) {
+        std::int64_t v = ValueFromIndex(static_cast<std::int64_t>(i));
+        return std::min(HighestEquivalent(v), max_);
+      }
+    }
+    return max_;
+  }
+
+  std::int64_t count() const { return total_; }
+  std::int64_t min() const { return total_ ? min_ : 0; }
+  std::int64_t max() const { return total_ ? max_ : 0; }
+  double mean() const { return total_ ? sum_ / total_ : 0.0; }
+
+  // size of the range of values that are recorded as the same value
+  std::int64_t EquivalentRange(std::int64_t value) const {
+    int bucket = BucketIndex(value);
+    std::int64_t sub = SubBucketIndex(value, bucket);
+    int adjusted = bucket + (sub >= sub_bucket_count_ ? 1 : 0);
+    return std::int64_t{1} << (unit_magnitude_ + adjusted);
+  }
+
+private:
+  int BucketIndex(std::int64_t value) const {
+    // the power of two range the value falls in (0 for the first sub bucket
+    // range)
+    int pow2_ceiling =
+        64 - __builtin_clzll(static_cast<std::uint64_t>(value | sub_bucket_mask_));
+    return pow2_ceiling - unit_magnitude_ - (sub_bucket_half_count_magnitude_ + 1);
+  }
+
+  std::int64_t SubBucketIndex(std::int64_t value, int bucket) const {
+    return value >> (bucket + unit_magnitude_);
+  }
+
+  std::size_t CountsIndexFor(std::int64_t value) const {
+    int bucket = BucketIndex(value);
+    std::int64_t sub = SubBucketIndex(value, bucket);
+    std::int64_t base = static_cast<std::int64_t>(bucket + 1)
+                        << sub_bucket_half_count_magnitude_;
+    return static_cast<std::size_t>(base + (sub - sub_bucket_half_count_));
+  }
+
+  std::int64_t ValueFromIndex(std::int64_t index) const {
+    int bucket = static_cast<int>(index >> sub_bucket_half_count_magnitude_) - 1;
+    std::int64_t sub = (index & (sub_bucket_half_count_ - 1)) +
+                       sub_bucket_half_count_;
+    if (bucket < 0) {
+      sub -= sub_bucket_half_count_;
+      bucket = 0;
+    }
+    return sub << (bucket + unit_magnitude_);
+  }
+
+  std::int64_t HighestEquivalent(std::int64_t value) const {
+    return value + EquivalentRange(value) - 1;
+  }
+
+  std::int64_t highest_;
+  int unit_magnitude_;
+  int sub_bucket_half_count_magnitude_;
+  std::int64_t sub_bucket_count_;
+  std::int64_t sub_bucket_half_count_;
+  std::int64_t sub_bucket_mask_;
+  std::vector<std::int64_t> counts_;
+  std::int64_t total_ = 0;
+  std::int64_t min_ = std::numeric_limits<std::int64_t>::max();
+  std::int64_t max_ = 0;
+  double sum_ = 0;
+};
+
+} // namespace ochat
+
+#endif // __HDR_HISTOGRAM_H__
@@ -0,0 +1,208 @@
+#include "http_resp.h"
+#include <boost/asio/buffer.hpp>
+#include <algorithm>
+#include <charconv>
+#include <climits>
+#include <cstring>
+#include <stdexcept>
+#include <string_view>
+
+namespace ochat {
+
+namespace {
+
+inline char ToLower(char c) {
+  return (c >= 'A' && c <= 'Z') ? static_cast<char>(c | 0x20) : c;
+}
+
+inline bool IsSpace(char c) { return c == ' ' || c == '\t'; }
+
+std::string_view Trim(std::string_view s) {
+  size_t b = 0, e = s.size();
+  while (b < e && IsSpace(s[b]))
+    ++b;
+  while (e > b && (IsSpace(s[e - 1]) || s[e - 1] == '\r'))
+    --e;
+  return s.substr(b, e - b);
+}
+
+// parse a non-negative decimal number, returns -1 if s is not a number or
+// does not fit in a long (a header from a client can hold any digits).
+long ParseDecimal(std::string_view s) {
+  if (s.empty() || s[0] < '0' || s[0] > '9')
+    return -1;
+  long v = 0;
+  auto [p, ec] = std::from_chars(s.data(), s.data() + s.size(), v);
+  if (ec != std::errc() || p != s.data() + s.size())
+    return -1;
+  return v;
+}
+
+// true if the comma separated token list contains tok (ignoring case).
+bool HasToken(std::string_view list, std::string_view tok) {
+  while (!list.empty()) {
+    size_t comma = list.find(',');
+    if (IEquals(Trim(list.substr(0, comma)), tok))
+      return true;
+    if (comma == std::string_view::npos)
+      break;
+    list.remove_prefix(comma + 1);
+  }
+  return false;
+}
+
+// Parse "HTTP/1.1 200 OK", returns true for HTTP/1.0 responses.
+bool ParseStatusLine(std::string_view line, HttpRespHeader &hdr) {
+  if (line.size() < 12 || line.substr(0, 5) != "HTTP/" || line[8] != ' ')
+    throw std::runtime_error("Malformed HTTP status line");
+  int status = 0;
+  for (size_t i = 9; i < 12; ++i) {
+    if (line[i] < '0' || line[i] > '9')
+      throw std::runtime_error("Malformed HTTP status code");
+    status = status * 10 + (line[i] - '0');
+  }
+  hdr.status = status;
+  hdr.reason = line.size() > 13 ? Trim(line.substr(13)) : std::string_view();
+  return line.substr(5, 3) == "1.0";
+}
+
+// Parse "POST /api/chat HTTP/1.1", returns true for HTTP/1.0 requests.
+bool ParseRequestLine(std::string_view line, HttpReqHeader &hdr) {
+  size_t sp1 = line.find(' ');
+  size_t sp2 = sp1 == std::string_view::npos ? sp1 : line.find(' ', sp1 + 1);
+  if (sp1 == 0 || sp2 == std::string_view::npos || sp2 == sp1 + 1 ||
+      line.substr(sp2 + 1, 5) != "HTTP/")
+    throw std::runtime_error("Malformed HTTP request line");
+  hdr.method = line.substr(0, sp1);
+  hdr.target = line.substr(sp1 + 1, sp2 - sp1 - 1);
+  return line.substr(sp2 + 6) == "1.0";
+}
+
+// Scans the header fields after the start line, which is parsed by
+// parse_start_line (returns true for HTTP/1.0).
+template <class Header, class StartLine>
+std::size_t ParseHeader(std::string_view data, Header &hdr,
+                        StartLine parse_start_line) {
+  hdr = Header();
+  const char *begin = data.data();
+  const char *end = begin + data.size();
+  const char *p = begin;
+  bool start_line = true;
+  bool http10 = false;
+  std::string_view connection;
+
+  while (p < end) {
+    const char *nl = static_cast<const char *>(std::memchr(p, '\n', end - p));
+    if (nl == nullptr)
+      break; // incomplete header
+    std::string_view line(p, nl - p);
+    if (!line.empty() && line.back() == '\r')
+      line.remove_suffix(1);
+    p = nl + 1;
+
+    if (line.empty()) { // blank line terminates the header
+      hdr.size = p - begin;
+      // HTTP/1.0 closes the connection unless keep-alive is requested
+      hdr.conn_close = HasToken(connection, "close") ||
+                       (http10 && !HasToken(connection, "keep-alive"));
+      return hdr.size;
+    }
+
+    if (start_line) {
+      start_line = false;
+      http10 = parse_start_line(line, hdr);
+      continue;
+    }
+
+    size_t colon = line.find(':');
+    if (colon == std::string_view::npos || colon == 0)
+      continue; // not a valid header field, skip it
+    std::string_view name = line.substr(0, colon);
+    std::string_view value = Trim(line.substr(colon + 1));
+
+    if (hdr.num_fields < HttpRespHeader::kMaxFields)
+      hdr.fields[hdr.num_fields++] = {name, value};
+
+    // pick out the fields that determine how the body is read
+    switch (ToLower(name[0])) {
+    case 't':
+      if (IEquals(name, "Transfer-Encoding"))
+        hdr.chunked = HasToken(value, "chunked");
+      break;
+    case 'c':
+      if (IEquals(name, "Content-Length")) {
+        hdr.content_length = ParseDecimal(value);
+        if (hdr.content_length < 0)
+          throw std::runtime_error("Invalid Content-Length header");
+      } else if (IEquals(name, "Connection")) {
+        connection = value;
+      }
+      break;
+    case 'r':
+      if (IEquals(name, "Retry-After"))
+        hdr.retry_after =
+            static_cast<int>(std::min<long>(ParseDecimal(value), INT_MAX));
+      break;
+    default:
+      break;
+    }
+  }
+
+  // header not complete yet
+  hdr = Header();
+  return 0;
+}
+
+std::string_view BufferView(const boost::asio::streambuf &buf) {
+  // the readable area of a basic_streambuf is a single contiguous buffer
+  auto data = buf.data();
+  return std::string_view(static_cast<const char *>(data.data()), data.size());
+}
+
+} // namespace
+
+bool IEquals(std::string_view a, std::string_view b) {
+  if (a.size() != b.size())
+    return false;
+  for (size_t i = 0; i < a.size(); ++i) {
+    if (ToLower(a[i]) != ToLower(b[i]))
+      return false;
+  }
+  return true;
+}
+
+std::string_view HttpRespHeader::Get(std::string_view name) const {
+  for (size_t i = 0; i < num_fields; ++i) {
+    if (IEquals(fields[i].name, name))
+      return fields[i].value;
+  }
+  return std::string_view();
+}
+
+bool HttpRespHeader::Has(std::string_view name) const {
+  for (size_t i = 0; i < num_fields; ++i) {
+    if (IEquals(fields[i].name, name))
+      return true;
+  }
+  return false;
+}
+
+std::size_t ParseHttpRespHeader(std::string_view data, HttpRespHeader &hdr) {
+  return ParseHeader(data, hdr, ParseStatusLine);
+}
+
+std::size_t ParseHttpRespHeader(const boost::asio::streambuf &buf,
+                                HttpRespHeader &hdr) {
+  return ParseHttpRespHeader(BufferView(buf), hdr);
+}
+
+std::size_t ParseHttpReqHeader(std::string_view data, HttpReqHeader &hdr) {
+  return ParseHeader(data, hdr, ParseRequestLine);
+}
+
+std::size_t ParseHttpReqHeader(const boost::asio::streambuf &buf,
+                               HttpReqHeader &hdr) {
+  return ParseHttpReqHeader(BufferView(buf), hdr);
+}
+
+} // namespace ochat
@@ -0,0 +1,129 @@
+/**
+ * @file http_resp.h
+ * @brief Single pass, allocation free parser for HTTP/1.1 response headers.
+ */
+
+#ifndef __HTTP_RESP_H__
+#define __HTTP_RESP_H__
+
+#include <array>
+#include <boost/asio/streambuf.hpp>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+namespace ochat {
+
+// Parsed view of an HTTP response header.  The name/value pairs are views into
+// the buffer that was parsed, so they are only valid until that buffer is
+// consumed or written to again.  The scalar members are copies and remain valid
+// after the buffer is gone.
+struct HttpRespHeader {
+  static constexpr std::size_t kMaxFields = 32;
+
+  struct Field {
+    std::string_view name;
+    std::string_view value; // leading / trailing whitespace removed
+  };
+
+  int status = 0;          // status code, e.g. 200
+  std::string_view reason; // reason phrase, e.g. "OK"
+  std::size_t size = 0;    // bytes in the header including the blank line
+  std::size_t num_fields = 0;
+  std::array<Field, kMaxFields> fields;
+
+  // values of the fields that the client acts on
+  bool chunked = false;      // Transfer-Encoding: chunked
+  long content_length = -1;  // -1 when not specified
+  bool conn_close = false;   // Connection: close (or an HTTP/1.0 response)
+  int retry_after = -1;      // Retry-After in seconds, -1 when not specified
+
+  /**
+   * Looks up a header field by name, ignoring case.
+   *
+   * @param name The name of the header field.
+   * @return The value of the field, or an empty view if it is not present.
+   */
+  std::string_view Get(std::string_view name) const;
+
+  /**
+   * @return true if the header field is present (name compared ignoring case).
+   */
+  bool Has(std::string_view name) const;
+};
+
+// Parsed view of an HTTP request header, the request line is parsed into
+// method and target (status and reason are not used).
+struct HttpReqHeader : HttpRespHeader {
+  std::string_view method; // e.g. "POST"
+  std::string_view target; // e.g. "/api/chat"
+};
+
+/**
+ * Compares two ASCII strings ignoring case.
+ */
+bool IEquals(std::string_view a, std::string_view b);
+
+/**
+ * Parses an HTTP response header in a single pass over the raw bytes.
+ *
+ * Header lines without a ':' are skipped and fields beyond kMaxFields are
+ * ignored (but still scanned for the fields the client acts on).
+ *
+ * @param data The raw bytes starting at the status line.
+ * @param hdr Receives the parsed header.
+ * @return The number of bytes in the header (same as hdr.size), or 0 if data
+ * does not yet contain the complete header.
+ * @throw std::runtime_error if the status line is malformed.
+ */
+std::size_t ParseHttpRespHeader(std::string_view data, HttpRespHeader &hdr);
+
+/**
+ * Parses an HTTP response header from the readable bytes of a streambuf
+ * without consuming them.  The caller is responsible for consuming hdr.size
+ * bytes once it is done with the views in hdr.
+ */
+std::size_t ParseHttpRespHeader(const boost::asio::streambuf &buf,
+                                HttpRespHeader &hdr);
+
+/**
+ * Parses an HTTP request header, like ParseHttpRespHeader.
+ *
+ * @param data The raw bytes starting at the request line.
+ * @param hdr Receives the parsed header.
+ * @return The number of bytes in the header, or 0 if data does not yet
+ * contain the complete header.
+ * @throw std::runtime_error if the request line is malformed.
+ */
+std::size_t ParseHttpReqHeader(std::string_view data, HttpReqHeader &hdr);
+
+/**
+ * Parses an HTTP request header from the readable bytes of a streambuf
+ * without consuming them.
+ */
+std::size_t ParseHttpReqHeader(const boost::asio::streambuf &buf,
+                               HttpReqHeader &hdr);
+
+// Exception thrown when the server responds with a non 200 status.
+class HttpError : public std::runtime_error {
+public:
+  HttpError(int status, const std::string &msg, int retry_after = -1)
+      : std::runtime_error(msg), status_(status), retry_after_(retry_after) {}
+
+  int status() const { return status_; }
+
+  // seconds the server asked us to wait before retrying, -1 if not specified
+  int retry_after() const { return retry_after_; }
+
+  // true for responses that indicate the server is busy (429 / 503)
+  bool busy() const { return status_ == 429 || status_ == 503; }
+
+private:
+  int status_;
+  int retry_after_;
+};
+
+} // namespace ochat
+
+#endif // __HTTP_RESP_H__
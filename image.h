@@ -0,0 +1,109 @@
+/**
+ * @file image.h
+ * @brief Image attachments: memory mapped files, base64 encoding and a cache
+ * of encoded images.
+ */
+
+#ifndef __IMAGE_H__
+#define __IMAGE_H__
+
+#include "app_config.h"
+#include "vector_index.h"
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace ochat {
+
+/**
+ * Returns the size of the base64 encoding of n bytes (with padding).
+ */
+constexpr std::size_t Base64Size(std::size_t n) { return (n + 2) / 3 * 4; }
+
+/**
+ * Base64 encodes (RFC 4648, with padding) the data.
+ *
+ * @param data The data to encode.
+ * @param n The size of the data.
+ * @param out Receives Base64Size(n) characters.
+ * @param level The instruction set, must be supported by the CPU.
+ */
+void Base64Encode(const void *data, std::size_t n, char *out,
+                  SimdLevel level = DetectSimd());
+
+// A read only memory mapping of a whole file.
+class MappedFile {
+public:
+  /**
+   * Maps the file.
+   *
+   * @param path The file path.
+   * @throw std::runtime_error if the file cannot be opened or mapped.
+   */
+  explicit MappedFile(const std::string &path);
+  ~MappedFile();
+
+  const unsigned char *data() const { return data_; }
+  std::size_t size() const { return size_; }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+private:
+  const unsigned char *data_ = nullptr;
+  std::size_t size_ = 0;
+};
+
+/**
+ * Returns the image format of the data from its signature.
+ *
+ * @param data The start of the file.
+ * @param n The size of the data.
+ * @return "png", "jpeg", "gif", "webp" or "bmp", nullptr if not an image.
+ */
+const char *ImageFormat(const unsigned char *data, std::size_t n);
+
+// The base64 encoded images of files, cached by path so that an unchanged
+// file is encoded only once (a file that changed is encoded again).  The
+// least recently used images are dropped when the encoded images exceed
+// max_bytes.  Thread safe.
+class ImageCache {
+public:
+  explicit ImageCache(std::size_t max_bytes = OLLAMA_IMAGE_CACHE_BYTES)
+      : max_bytes_(max_bytes) {}
+
+  /**
+   * Returns the base64 encoding of an image file.
+   *
+   * @param path The image file.
+   * @return The encoded image, it stays valid after it is dropped from the
+   * cache.
+   * @throw std::runtime_error if the file cannot be read or is not an image.
+   */
+  std::shared_ptr<const std::string> Encode(const std::string &path);
+
+  std::size_t bytes() const;   // encoded bytes in the cache
+  std::size_t encoded() const; // files encoded (cache misses)
+
+private:
+  struct Entry {
+    std::uint64_t size, mtime_ns, inode; // the file that was encoded
+    std::shared_ptr<const std::string> data;
+    std::list<std::string>::iterator lru;
+  };
+
+  std::size_t max_bytes_;
+  mutable std::mutex mutex_;
+  std::map<std::string, Entry> entries_;
+  std::list<std::string> lru_; // most recently used first
+  std::size_t bytes_ = 0;
+  std::size_t encoded_ = 0;
+};
+
+} // namespace ochat
+
+#endif // __IMAGE_H__
@@ -0,0 +1,321 @@
+#include "ingest.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+
+namespace fs = std::filesystem;
+
+namespace ochat {
+
+namespace {
+
+// a file read and chunked by the reader threads
+struct FileChunks {
+  bool ok = false; // false for files that are not ingested
+  std::string path;
+  std::uint64_t hash = 0;
+  std::vector<ChunkMeta> chunks;
+};
+
+// the chunks of an embedding request and its result
+struct Batch {
+  std::vector<ChunkMeta> chunks;
+  std::future<std::vector<std::vector<float>>> vecs;
+};
+
+bool IsUtf8Continuation(char c) {
+  return (static_cast<unsigned char>(c) & 0xC0) == 0x80;
+}
+
+bool IsBlank(std::string_view text) {
+  return text.find_first_not_of(" \t\r\n") == std::string_view::npos;
+}
+
+// list the files to ingest, skipping hidden files and directories
+std::vector<std::string> ListFiles(const std::string &root,
+                                   const IngestOptions &opt) {
+  auto wanted = [&](const fs::path &p) {
+    if (opt.extensions.empty())
+      return true;
+    auto ext = p.extension().string();
+    return std::find(opt.extensions.begin(), opt.extensions.end(), ext) !=
+           opt.extensions.end();
+  };
+
+  std::vector<std::string> files;
+  fs::path top = fs::absolute(root).lexically_normal();
+  if (fs::is_regular_file(top)) {
+    files.push_back(top.string());
+    return files;
+  }
+  if (!fs::is_directory(top)) {
+    throw std::runtime_error("Cannot ingest " + root + ": no such directory");
+  }
+  fs::recursive_directory_iterator it(
+      top, fs::directory_options::skip_permission_denied);
+  for (; it != fs::recursive_directory_iterator(); ++it) {
+    const fs::path &p = it->path();
+    std::string name = p.filename().string();
+    if (!name.empty() && name[0] == '.') {
+      if (it->is_directory())
+        it.disable_recursion_pending();
+      continue;
+    }
+    std::error_code ec;
+    if (it->is_regular_file(ec) && wanted(p) &&
+        it->file_size(ec) <= opt.max_file_size && !ec) {
+      files.push_back(p.string());
+    }
+  }
+  std::sort(files.begin(), files.end());
+  return files;
+}
+
+FileChunks ReadFile(const std::string &path, const IngestOptions &opt) {
+  FileChunks fc;
+  std::ifstream in(path, std::ios::binary);
+  if (!in)
+    return fc;
+  std::stringstream ss;
+  ss << in.rdbuf();
+  std::string data = ss.str();
+  if (std::string_view(data).substr(0, 8192).find('\0') !=
+      std::string_view::npos)
+    return fc; // binary file
+  fc.ok = true;
+  fc.path = path;
+  fc.hash = HashContent(data);
+  fc.chunks = ChunkText(data, opt.chunk_size, opt.chunk_overlap);
+  for (auto &c : fc.chunks) {
+    c.file = path;
+    c.hash = fc.hash;
+  }
+  return fc;
+}
+
+} // namespace
+
+void Normalize(std::vector<float> &v) {
+  double sum = 0;
+  for (float x : v) {
+    sum += static_cast<double>(x) * x;
+  }
+  if (sum > 0) {
+    float scale = static_cast<float>(1.0 / std::sqrt(sum));
+    for (float &x : v) {
+      x *= scale;
+    }
+  }
+}
+
+std::uint64_t HashContent(std::string_view text) {
+  std::uint64_t h = 14695981039346656037ull;
+  for (char c : text) {
+    h ^= static_cast<unsigned char>(c);
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+std::vector<ChunkMeta> ChunkText(std::string_view text, std::size_t chunk_size,
+                                 std::size_t overlap) {
+  std::vector<ChunkMeta> chunks;
+  if (chunk_size == 0)
+    return chunks;
+  overlap = std::min(overlap, chunk_size / 2);
+  std::size_t begin = 0;
+  while (begin < text.size()) {
+    std::size_t end = std::min(begin + chunk_size, text.size());
+    if (end < text.size()) {
+      // prefer to end at a line break, otherwise at a character boundary
+      std::size_t nl = text.rfind('\n', end - 1);
+      if (nl != std::string_view::npos && nl >= begin + chunk_size / 2) {
+        end = nl + 1;
+      } else {
+        while (end > begin + 1 && IsUtf8Continuation(text[end]))
+          --end;
+      }
+    }
+    std::string_view chunk = text.substr(begin, end - begin);
+    if (!IsBlank(chunk)) {
+      ChunkMeta &m = chunks.emplace_back();
+      m.begin = begin;
+      m.end = end;
+      m.text = chunk;
+    }
+    if (end == text.size())
+      break;
+
+    // the next chunk repeats the end of this one, starting at a line if
+    // there is a line break in the overlap
+    std::size_t next = end - std::min(overlap, end - begin - 1);
+    std::size_t nl = text.find('\n', next);
+    if (nl != std::string_view::npos && nl + 1 < end) {
+      next = nl + 1;
+    }
+    while (next < end && IsUtf8Continuation(text[next]))
+      ++next;
+    begin = next;
+  }
+  return chunks;
+}
+
+// The ingestion is a pipeline: the reader pool reads, hashes and chunks the
+// files ahead of the main thread, which batches the chunks of changed files
+// and submits the batches to the embedding pool.  Up to twice opt.in_flight
+// batches are outstanding so there is always another request ready to send
+// when one completes.  The main thread writes the results in submission order,
+// so the store is the same regardless of the order the requests complete in.
+IngestStats Ingest(const std::string &root, const std::string &store_path,
+                   const EmbedFn &embed, const IngestOptions &opt,
+                   std::ostream *log) {
+  IngestStats stats;
+
+  // index the files of the existing store by path
+  VectorStore old;
+  std::map<std::string, std::pair<std::uint64_t, std::vector<std::size_t>>>
+      old_files;
+  bool reuse = false;
+  if (!opt.rebuild) {
+    try {
+      reuse = old.Open(store_path) && old.type() == opt.type;
+    } catch (const std::runtime_error &e) {
+      // e.g. an older format, the store is replaced by a full rebuild
+      if (log) {
+        *log << e.what() << ", rebuilding it" << std::endl;
+      }
+    }
+  }
+  if (reuse) {
+    for (std::size_t i = 0; i < old.size(); ++i) {
+      auto &entry = old_files[old.meta()[i].file];
+      entry.first = old.meta()[i].hash;
+      entry.second.push_back(i);
+    }
+  }
+
+  std::vector<std::string> files = ListFiles(root, opt);
+  ThreadPool readers(opt.read_threads);
+  ThreadPool embedders(opt.in_flight);
+  std::unique_ptr<VectorStoreWriter> writer;
+  std::size_t dim = 0;
+
+  auto open_writer = [&](std::size_t d) {
+    if (!writer) {
+      dim = d;
+      writer = std::make_unique<VectorStoreWriter>(store_path, dim, opt.type);
+    } else if (d != dim) {
+      throw std::runtime_error(
+          "Embedding size " + std::to_string(d) + " does not match the " +
+          std::to_string(dim) + " of the store, rebuild the store");
+    }
+  };
+
+  std::deque<Batch> pending;
+  std::vector<ChunkMeta> batch;
+  std::size_t max_pending = 2 * static_cast<std::size_t>(opt.in_flight);
+
+  auto write_batch = [&](Batch &b) {
+    auto vecs = b.vecs.get();
+    if (vecs.size() != b.chunks.size()) {
+      throw std::runtime_error("Expected " + std::to_string(b.chunks.size()) +
+                               " embeddings, received " +
+                               std::to_string(vecs.size()));
+    }
+    for (std::size_t i = 0; i < vecs.size(); ++i) {
+      open_writer(vecs[i].size());
+      Normalize(vecs[i]);
+      writer->Add(vecs[i].data(), b.chunks[i]);
+    }
+    stats.chunks_embedded += vecs.size();
+    if (log) {
+      *log << "\rEmbedded " << stats.chunks_embedded << " chunks"
+           << std::flush;
+    }
+  };
+
+  auto submit = [&]() {
+    if (batch.empty())
+      return;
+    Batch b;
+    std::vector<std::string> inputs;
+    inputs.reserve(batch.size());
+    for (auto &c : batch) {
+      inputs.push_back(c.text);
+    }
+    b.chunks = std::move(batch);
+    batch.clear();
+    b.vecs = embedders.Submit(
+        [&embed, inputs = std::move(inputs)] { return embed(inputs); });
+    pending.push_back(std::move(b));
+    ++stats.requests;
+    while (pending.size() > max_pending) {
+      write_batch(pending.front());
+      pending.pop_front();
+    }
+  };
+
+  // keep the reader pool a few files ahead of the main thread
+  std::deque<std::future<FileChunks>> reads;
+  std::size_t next_file = 0;
+  std::size_t window = 4 * readers.size();
+  auto read_ahead = [&]() {
+    while (next_file < files.size() && reads.size() < window) {
+      reads.push_back(readers.Submit(
+          [path = files[next_file], &opt] { return ReadFile(path, opt); }));
+      ++next_file;
+    }
+  };
+
+  read_ahead();
+  while (!reads.empty()) {
+    FileChunks fc = reads.front().get();
+    reads.pop_front();
+    read_ahead();
+    if (!fc.ok)
+      continue;
+    ++stats.files;
+
+    auto it = old_files.find(fc.path);
+    if (it != old_files.end() && it->second.first == fc.hash) {
+      // unchanged, copy the existing vectors
+      open_writer(old.dim());
+      for (std::size_t row : it->second.second) {
+        writer->AddRaw(old.row(row), old.meta()[row]);
+      }
+      ++stats.files_reused;
+      continue;
+    }
+    for (auto &c : fc.chunks) {
+      batch.push_back(std::move(c));
+      if (batch.size() >= opt.batch_size) {
+        submit();
+      }
+    }
+  }
+  submit();
+  while (!pending.empty()) {
+    write_batch(pending.front());
+    pending.pop_front();
+  }
+  if (log && stats.chunks_embedded > 0) {
+    *log << std::endl;
+  }
+
+  if (!writer) { // nothing to store
+    open_writer(old.size() ? old.dim() : 0);
+  }
+  stats.chunks = writer->size();
+  writer->Close();
+  return stats;
+}
+
+} // namespace ochat
@@ -0,0 +1,93 @@
+/**
+ * @file ingest.h
+ * @brief Pipeline that chunks the files of a directory tree, embeds the chunks
+ * and writes the vectors to a vector store.
+ */
+
+#ifndef __INGEST_H__
+#define __INGEST_H__
+
+#include "app_config.h"
+#include "vector_store.h"
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace ochat {
+
+// computes one embedding per input (e.g. OllamaChat::Embed)
+using EmbedFn = std::function<std::vector<std::vector<float>>(
+    const std::vector<std::string> &inputs)>;
+
+struct IngestOptions {
+  std::size_t chunk_size = OLLAMA_CHUNK_SIZE;       // max bytes per chunk
+  std::size_t chunk_overlap = OLLAMA_CHUNK_OVERLAP; // bytes shared by chunks
+  std::size_t batch_size = OLLAMA_EMBED_BATCH;      // chunks per request
+  int in_flight = OLLAMA_EMBED_IN_FLIGHT;           // concurrent requests
+  int read_threads = 4;                 // threads reading and chunking files
+  VecType type = VecType::kF16;         // element type of the store
+  std::size_t max_file_size = 4 << 20;  // larger files are skipped
+  std::vector<std::string> extensions;  // e.g. ".cpp", empty for all files
+  bool rebuild = false;                 // re-embed files that did not change
+};
+
+struct IngestStats {
+  std::size_t files = 0;         // text files found
+  std::size_t files_reused = 0;  // unchanged files, vectors copied
+  std::size_t chunks = 0;        // chunks in the store
+  std::size_t chunks_embedded = 0;
+  std::size_t requests = 0;      // embedding requests sent
+};
+
+/**
+ * Computes the content hash (64 bit FNV-1a) used to detect changed files.
+ */
+std::uint64_t HashContent(std::string_view text);
+
+/**
+ * Scales a vector to unit length, so the dot product of two vectors is their
+ * cosine similarity.
+ */
+void Normalize(std::vector<float> &v);
+
+/**
+ * Splits text into chunks of at most chunk_size bytes, consecutive chunks
+ * overlap by about overlap bytes.  Chunks end at a line break when there is
+ * one in the second half of the chunk, and never split a UTF-8 sequence.
+ *
+ * @return The chunks, with the begin, end and text members set.
+ */
+std::vector<ChunkMeta> ChunkText(std::string_view text, std::size_t chunk_size,
+                                 std::size_t overlap);
+
+/**
+ * Ingests the text files under root (or root itself if it is a file) into the
+ * vector store at store_path.
+ *
+ * The files are read, hashed and chunked on opt.read_threads threads, the
+ * chunks of changed files are batched and embedded with up to opt.in_flight
+ * requests in flight, and the vectors are written as the requests complete.
+ * Files whose content hash matches the existing store keep their vectors
+ * without being embedded again, and files that no longer exist are dropped.
+ * The store is replaced only once the ingestion completed.
+ *
+ * @param root The directory (or file) to ingest.
+ * @param store_path The path of the vector store.
+ * @param embed Computes the embeddings of a batch of chunks.
+ * @param opt The ingestion options.
+ * @param log If not null, progress is reported here.
+ * @return Statistics of the ingestion.
+ * @throw std::runtime_error if an embedding request fails, or the embedding
+ * size does not match the existing store.
+ */
+IngestStats Ingest(const std::string &root, const std::string &store_path,
+                   const EmbedFn &embed, const IngestOptions &opt = {},
+                   std::ostream *log = nullptr);
+
+} // namespace ochat
+
+#endif // __INGEST_H__
@@ -0,0 +1,572 @@
+#include "json_stream_validator.h"
+#include <charconv>
+#include <cmath>
+#include <string>
+#include <string_view>
+
+namespace ochat {
+
+namespace {
+
+bool IsWhitespace(char c) {
+  return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+bool IsNumberChar(char c) {
+  return (c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' ||
+         c == 'e' || c == 'E';
+}
+
+// true if the JSON value is of the given JSON schema type
+bool IsKind(const boost::json::value &v, std::string_view type) {
+  if (type == "string")
+    return v.is_string();
+  if (type == "number" || type == "integer")
+    return v.is_number();
+  if (type == "boolean")
+    return v.is_bool();
+  if (type == "null")
+    return v.is_null();
+  if (type == "object")
+    return v.is_object();
+  if (type == "array")
+    return v.is_array();
+  return false;
+}
+
+double ToDouble(const boost::json::value &v) {
+  if (v.is_int64())
+    return static_cast<double>(v.as_int64());
+  if (v.is_uint64())
+    return static_cast<double>(v.as_uint64());
+  return v.as_double();
+}
+
+// returns the number in the schema keyword, or nullptr if not present
+const boost::json::value *NumberKeyword(const boost::json::object *s,
+                                        std::string_view kw) {
+  if (s == nullptr)
+    return nullptr;
+  const boost::json::value *v = s->if_contains(kw);
+  return (v != nullptr && v->is_number()) ? v : nullptr;
+}
+
+// the list of allowed values from the enum or const keywords, if any
+bool AllowedValues(const boost::json::object *s,
+                   std::vector<const boost::json::value *> &values) {
+  values.clear();
+  if (s == nullptr)
+    return false;
+  if (auto *c = s->if_contains("const")) {
+    values.push_back(c);
+    return true;
+  }
+  if (auto *e = s->if_contains("enum"); e != nullptr && e->is_array()) {
+    for (auto &v : e->as_array())
+      values.push_back(&v);
+    return true;
+  }
+  return false;
+}
+
+void AppendUtf8(std::string &out, std::uint32_t cp) {
+  if (cp < 0x80) {
+    out += static_cast<char>(cp);
+  } else if (cp < 0x800) {
+    out += static_cast<char>(0xC0 | (cp >> 6));
+    out += static_cast<char>(0x80 | (cp & 0x3F));
+  } else if (cp < 0x10000) {
+    out += static_cast<char>(0xE0 | (cp >> 12));
+    out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+    out += static_cast<char>(0x80 | (cp & 0x3F));
+  } else {
+    out += static_cast<char>(0xF0 | (cp >> 18));
+    out += static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+    out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+    out += static_cast<char>(0x80 | (cp & 0x3F));
+  }
+}
+
+} // namespace
+
+JsonStreamValidator::JsonStreamValidator(const boost::json::value &schema)
+    : schema_(schema) {
+  Reset();
+}
+
+void JsonStreamValidator::Reset() {
+  root_ = nullptr;
+  stack_.clear();
+  done_ = failed_ = false;
+  error_.clear();
+  tok_ = Tok::kNone;
+  val_schema_ = schema_.if_object();
+  slot_ = &root_;
+  str_.clear();
+  escape_ = false;
+  hex_digits_ = 0;
+  high_surrogate_ = 0;
+}
+
+bool JsonStreamValidator::Feed(std::string_view text) {
+  if (failed_)
+    return false;
+  for (char c : text) {
+    if (!Step(c))
+      return false;
+  }
+  return true;
+}
+
+bool JsonStreamValidator::Finish() {
+  if (failed_)
+    return false;
+  if (tok_ == Tok::kNumber && stack_.empty() && !EndNumber())
+    return false;
+  if (!done_)
+    return Fail("incomplete JSON document");
+  return true;
+}
+
+bool JsonStreamValidator::Fail(const std::string &msg) {
+  failed_ = true;
+  std::string path = Path();
+  error_ = msg + " at " + (path.empty() ? "/" : path);
+  return false;
+}
+
+// JSON pointer to the value currently being parsed
+std::string JsonStreamValidator::Path() const {
+  std::string path;
+  for (auto &f : stack_) {
+    if (f.is_object) {
+      if (f.state == State::kColon || f.state == State::kValue)
+        path += "/" + f.key;
+    } else if (f.count > 0) {
+      path += "/" + std::to_string(f.count - 1);
+    }
+  }
+  return path;
+}
+
+bool JsonStreamValidator::AllowsType(std::string_view type) const {
+  const boost::json::object *s = val_schema_;
+  if (s == nullptr)
+    return true;
+  if (auto *t = s->if_contains("type")) {
+    bool found = false;
+    auto matches = [type](std::string_view t) {
+      return t == type || (type == "integer" && t == "number");
+    };
+    if (t->is_string()) {
+      found = matches(t->as_string());
+    } else if (t->is_array()) {
+      for (auto &e : t->as_array())
+        found |= e.is_string() && matches(e.as_string());
+    }
+    if (!found)
+      return false;
+  }
+  std::vector<const boost::json::value *> values;
+  if (AllowedValues(s, values)) {
+    for (auto *v : values) {
+      if (IsKind(*v, type))
+        return true;
+    }
+    return false;
+  }
+  return true;
+}
+
+const boost::json::object *
+JsonStreamValidator::ChildSchema(const Frame &f, std::string_view key) const {
+  if (f.schema == nullptr)
+    return nullptr;
+  if (!f.is_object) {
+    auto *items = f.schema->if_contains("items");
+    return (items != nullptr) ? items->if_object() : nullptr;
+  }
+  if (auto *props = f.schema->if_contains("properties");
+      props != nullptr && props->is_object()) {
+    if (auto *p = props->as_object().if_contains(key))
+      return p->if_object();
+  }
+  auto *ap = f.schema->if_contains("additionalProperties");
+  return (ap != nullptr) ? ap->if_object() : nullptr;
+}
+
+bool JsonStreamValidator::Step(char c) {
+  switch (tok_) {
+  case Tok::kString:
+  case Tok::kKey:
+    return StringChar(c);
+  case Tok::kNumber:
+    if (IsNumberChar(c)) {
+      str_ += c;
+      return true;
+    }
+    if (!EndNumber())
+      return false;
+    break; // c is the character after the number
+  case Tok::kLiteral:
+    if (c != literal_[str_.size()])
+      return Fail("invalid literal");
+    str_ += c;
+    if (str_.size() < literal_.size())
+      return true;
+    tok_ = Tok::kNone;
+    if (literal_ == "null")
+      *slot_ = nullptr;
+    else
+      *slot_ = (literal_ == "true");
+    if (std::vector<const boost::json::value *> values;
+        AllowedValues(val_schema_, values)) {
+      bool found = false;
+      for (auto *v : values)
+        found |= (v->is_null() && slot_->is_null()) ||
+                 (v->is_bool() && slot_->is_bool() &&
+                  v->as_bool() == slot_->as_bool());
+      if (!found)
+        return Fail("value is not one of the allowed values");
+    }
+    return EndValue();
+  case Tok::kNone:
+    break;
+  }
+
+  if (IsWhitespace(c))
+    return true;
+  if (done_)
+    return Fail("unexpected data after the end of the document");
+  if (stack_.empty())
+    return BeginValue(c);
+
+  Frame &f = stack_.back();
+  switch (f.state) {
+  case State::kKeyOrEnd:
+    if (c == '}')
+      break; // empty object
+    [[fallthrough]];
+  case State::kKey:
+    if (c != '"')
+      return Fail("expected a property name");
+    tok_ = Tok::kKey;
+    str_.clear();
+    return AppendDecoded(std::string_view()); // check the empty prefix
+  case State::kColon:
+    if (c != ':')
+      return Fail("expected ':'");
+    f.state = State::kValue;
+    val_schema_ = ChildSchema(f, f.key);
+    slot_ = &f.val->as_object()[f.key];
+    return true;
+  case State::kValue:
+    return BeginValue(c);
+  case State::kValueOrEnd:
+    if (c == ']')
+      break; // empty array
+    f.state = State::kValue;
+    [[fallthrough]];
+  case State::kCommaOrEnd:
+    if (f.state == State::kCommaOrEnd) {
+      if (c == (f.is_object ? '}' : ']'))
+        break;
+      if (c != ',')
+        return Fail("expected ',' or end of container");
+      if (f.is_object) {
+        f.state = State::kKey;
+        return true;
+      }
+    }
+    // start the next array item
+    ++f.count;
+    if (auto *max = NumberKeyword(f.schema, "maxItems");
+        max != nullptr && f.count > ToDouble(*max))
+      return Fail("too many items in array");
+    val_schema_ = ChildSchema(f, std::string_view());
+    slot_ = &f.val->as_array().emplace_back(nullptr);
+    if (f.state == State::kCommaOrEnd) {
+      f.state = State::kValue;
+      return true;
+    }
+    return BeginValue(c);
+  }
+
+  // c closes the object or array at the top of the stack
+  if (c != (f.is_object ? '}' : ']'))
+    return Fail("mismatched end of container");
+  if (!CheckEnd(f))
+    return false;
+  stack_.pop_back();
+  return EndValue();
+}
+
+bool JsonStreamValidator::BeginValue(char c) {
+  switch (c) {
+  case '{':
+    if (!AllowsType("object"))
+      return Fail("object not allowed");
+    slot_->emplace_object();
+    stack_.push_back({true, val_schema_, slot_, State::kKeyOrEnd});
+    return true;
+  case '[':
+    if (!AllowsType("array"))
+      return Fail("array not allowed");
+    slot_->emplace_array();
+    stack_.push_back({false, val_schema_, slot_, State::kValueOrEnd});
+    return true;
+  case '"':
+    if (!AllowsType("string"))
+      return Fail("string not allowed");
+    slot_->emplace_string();
+    tok_ = Tok::kString;
+    str_.clear();
+    str_len_ = 0;
+    return AppendDecoded(std::string_view()); // check the empty prefix
+  case 't':
+  case 'f':
+  case 'n':
+    if (!AllowsType(c == 'n' ? "null" : "boolean"))
+      return Fail(c == 'n' ? "null not allowed" : "boolean not allowed");
+    tok_ = Tok::kLiteral;
+    literal_ = (c == 't') ? "true" : (c == 'f') ? "false" : "null";
+    str_.assign(1, c);
+    return true;
+  default:
+    if (c == '-' || (c >= '0' && c <= '9')) {
+      if (!AllowsType("integer"))
+        return Fail("number not allowed");
+      tok_ = Tok::kNumber;
+      str_.assign(1, c);
+      return true;
+    }
+    return Fail(std::string("unexpected character '") + c + "'");
+  }
+}
+
+bool JsonStreamValidator::EndValue() {
+  if (stack_.empty()) {
+    done_ = true;
+  } else {
+    stack_.back().state = State::kCommaOrEnd;
+  }
+  return true;
+}
+
+bool JsonStreamValidator::CheckEnd(const Frame &f) {
+  if (f.schema == nullptr)
+    return true;
+  if (f.is_object) {
+    auto *req = f.schema->if_contains("required");
+    if (req != nullptr && req->is_array()) {
+      for (auto &r : req->as_array()) {
+        if (!r.is_string())
+          continue;
+        std::string_view name = r.as_string();
+        bool found = false;
+        for (auto &k : f.seen)
+          found |= (k == name);
+        if (!found)
+          return Fail("missing required property '" + std::string(name) + "'");
+      }
+    }
+  } else if (auto *min = NumberKeyword(f.schema, "minItems");
+             min != nullptr && f.count < ToDouble(*min)) {
+    return Fail("too few items in array");
+  }
+  return true;
+}
+
+bool JsonStreamValidator::StringChar(char c) {
+  if (hex_digits_ > 0) {
+    int d = (c >= '0' && c <= '9')   ? c - '0'
+            : (c >= 'a' && c <= 'f') ? c - 'a' + 10
+            : (c >= 'A' && c <= 'F') ? c - 'A' + 10
+                                     : -1;
+    if (d < 0)
+      return Fail("invalid \\u escape in string");
+    code_ = (code_ << 4) | d;
+    if (--hex_digits_ > 0)
+      return true;
+    if (code_ >= 0xD800 && code_ < 0xDC00) {
+      high_surrogate_ = code_; // wait for the low surrogate
+      return true;
+    }
+    std::uint32_t cp = code_;
+    if (high_surrogate_ != 0 && code_ >= 0xDC00 && code_ < 0xE000)
+      cp = 0x10000 + ((high_surrogate_ - 0xD800) << 10) + (code_ - 0xDC00);
+    high_surrogate_ = 0;
+    std::string utf8;
+    AppendUtf8(utf8, cp);
+    return AppendDecoded(utf8);
+  }
+  if (escape_) {
+    escape_ = false;
+    char e;
+    switch (c) {
+    case '"':
+    case '\\':
+    case '/':
+      e = c;
+      break;
+    case 'b':
+      e = '\b';
+      break;
+    case 'f':
+      e = '\f';
+      break;
+    case 'n':
+      e = '\n';
+      break;
+    case 'r':
+      e = '\r';
+      break;
+    case 't':
+      e = '\t';
+      break;
+    case 'u':
+      hex_digits_ = 4;
+      code_ = 0;
+      return true;
+    default:
+      return Fail("invalid escape in string");
+    }
+    return AppendDecoded(std::string_view(&e, 1));
+  }
+  if (c == '\\') {
+    escape_ = true;
+    return true;
+  }
+  if (c == '"')
+    return EndString();
+  if (static_cast<unsigned char>(c) < 0x20)
+    return Fail("control character in string");
+  return AppendDecoded(std::string_view(&c, 1));
+}
+
+// Append decoded bytes to the current string or key, and check that the
+// string so far can still be completed into an allowed value.
+bool JsonStreamValidator::AppendDecoded(std::string_view bytes) {
+  str_.append(bytes);
+  for (char b : bytes) {
+    if ((static_cast<unsigned char>(b) & 0xC0) != 0x80)
+      ++str_len_;
+  }
+
+  if (tok_ == Tok::kKey) {
+    const Frame &f = stack_.back();
+    auto *ap = f.schema ? f.schema->if_contains("additionalProperties")
+                        : nullptr;
+    if (ap == nullptr || !ap->is_bool() || ap->as_bool())
+      return true; // any property name is allowed
+    if (auto *props = f.schema->if_contains("properties");
+        props != nullptr && props->is_object()) {
+      for (auto &p : props->as_object()) {
+        if (p.key().substr(0, str_.size()) == str_)
+          return true;
+      }
+    }
+    return Fail("property '" + str_ + "' not allowed");
+  }
+
+  slot_->as_string().append(bytes);
+  if (auto *max = NumberKeyword(val_schema_, "maxLength");
+      max != nullptr && str_len_ > ToDouble(*max))
+    return Fail("string is too long");
+  std::vector<const boost::json::value *> values;
+  if (AllowedValues(val_schema_, values)) {
+    for (auto *v : values) {
+      if (v->is_string() &&
+          std::string_view(v->as_string()).substr(0, str_.size()) == str_)
+        return true;
+    }
+    return Fail("value is not one of the allowed values");
+  }
+  return true;
+}
+
+bool JsonStreamValidator::EndString() {
+  bool key = (tok_ == Tok::kKey);
+  tok_ = Tok::kNone;
+  if (!key) {
+    // end of a string value
+    if (auto *min = NumberKeyword(val_schema_, "minLength");
+        min != nullptr && str_len_ < ToDouble(*min))
+      return Fail("string is too short");
+    std::vector<const boost::json::value *> values;
+    if (AllowedValues(val_schema_, values)) {
+      bool found = false;
+      for (auto *v : values)
+        found |= v->is_string() && std::string_view(v->as_string()) == str_;
+      if (!found)
+        return Fail("value is not one of the allowed values");
+    }
+    return EndValue();
+  }
+
+  // end of a property name
+  Frame &f = stack_.back();
+  auto *ap = f.schema ? f.schema->if_contains("additionalProperties") : nullptr;
+  if (ap != nullptr && ap->is_bool() && !ap->as_bool()) {
+    auto *props = f.schema->if_contains("properties");
+    if (props == nullptr || !props->is_object() ||
+        !props->as_object().contains(str_))
+      return Fail("property '" + str_ + "' not allowed");
+  }
+  f.key = str_;
+  f.seen.push_back(str_);
+  f.state = State::kColon;
+  return true;
+}
+
+bool JsonStreamValidator::EndNumber() {
+  tok_ = Tok::kNone;
+  const char *b = str_.data();
+  const char *e = b + str_.size();
+  bool integral = str_.find_first_of(".eE") == std::string::npos;
+  double v = 0;
+  if (integral) {
+    std::int64_t i = 0;
+    auto [p, ec] = std::from_chars(b, e, i);
+    if (ec == std::errc() && p == e) {
+      *slot_ = i;
+      v = static_cast<double>(i);
+    } else {
+      integral = false;
+    }
+  }
+  if (!integral) {
+    auto [p, ec] = std::from_chars(b, e, v);
+    if (ec != std::errc() || p != e)
+      return Fail("invalid number");
+    *slot_ = v;
+  }
+  if (!AllowsType("number") && std::floor(v) != v)
+    return Fail("integer expected");
+  if (!CheckNumber(v))
+    return false;
+  return EndValue();
+}
+
+bool JsonStreamValidator::CheckNumber(double v) {
+  const boost::json::object *s = val_schema_;
+  if (auto *m = NumberKeyword(s, "minimum"); m && v < ToDouble(*m))
+    return Fail("number is less than the minimum");
+  if (auto *m = NumberKeyword(s, "maximum"); m && v > ToDouble(*m))
+    return Fail("number is greater than the maximum");
+  if (auto *m = NumberKeyword(s, "exclusiveMinimum"); m && v <= ToDouble(*m))
+    return Fail("number is less than the minimum");
+  if (auto *m = NumberKeyword(s, "exclusiveMaximum"); m && v >= ToDouble(*m))
+    return Fail("number is greater than the maximum");
+  std::vector<const boost::json::value *> values;
+  if (AllowedValues(s, values)) {
+    for (auto *a : values) {
+      if (a->is_number() && ToDouble(*a) == v)
+        return true;
+    }
+    return Fail("value is not one of the allowed values");
+  }
+  return true;
+}
+
+} // namespace ochat
@@ -0,0 +1,132 @@
+/**
+ * @file json_stream_validator.h
+ * @brief Incremental JSON parser that validates a streamed document against a
+ * JSON schema as the text arrives.
+ */
+
+#ifndef __JSON_STREAM_VALIDATOR_H__
+#define __JSON_STREAM_VALIDATOR_H__
+
+#include "boost/json.hpp"
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace ochat {
+
+// Exception thrown when a structured response violates the requested schema.
+class SchemaViolation : public std::runtime_error {
+public:
+  explicit SchemaViolation(const std::string &msg) : std::runtime_error(msg) {}
+};
+
+// Validates a JSON document against a JSON schema while it is being streamed.
+//
+// The text is consumed a piece at a time (e.g. one token from the model), and
+// a violation is reported as soon as no continuation of the text received so
+// far could produce a valid document.  For example a string where the schema
+// requires a number is rejected at its opening quote, and an enum value or a
+// property name that is not allowed is rejected at the first character that
+// does not match any of the allowed values.
+//
+// The supported schema keywords are: type, properties, required,
+// additionalProperties, items, enum, const, minimum, maximum,
+// exclusiveMinimum, exclusiveMaximum, minLength, maxLength, minItems and
+// maxItems.  Other keywords (e.g. anyOf, pattern, $ref) are ignored, so the
+// values they constrain are accepted.
+//
+// While parsing, the validator builds the document parsed so far, which can be
+// used as a live view of the partial response.
+class JsonStreamValidator {
+public:
+  /**
+   * @param schema The JSON schema, a null value accepts any JSON document.
+   */
+  explicit JsonStreamValidator(const boost::json::value &schema = nullptr);
+
+  /**
+   * Consumes the next piece of the document.
+   *
+   * @param text The next piece of the document text.
+   * @return false if the document violates the schema (see error()).
+   */
+  bool Feed(std::string_view text);
+
+  /**
+   * Signals the end of the document.
+   *
+   * @return false if the document is incomplete or violates the schema.
+   */
+  bool Finish();
+
+  /**
+   * Resets the validator so a new document can be validated.
+   */
+  void Reset();
+
+  bool failed() const { return failed_; }
+  bool complete() const { return done_; }
+
+  // description of the violation, including the location in the document
+  const std::string &error() const { return error_; }
+
+  // the (partial) document parsed so far
+  const boost::json::value &Partial() const { return root_; }
+
+  JsonStreamValidator(const JsonStreamValidator &) = delete;
+  JsonStreamValidator &operator=(const JsonStreamValidator &) = delete;
+
+private:
+  enum class Tok { kNone, kString, kKey, kNumber, kLiteral };
+  enum class State { kValue, kKeyOrEnd, kKey, kColon, kCommaOrEnd, kValueOrEnd };
+
+  struct Frame {
+    bool is_object;
+    const boost::json::object *schema; // nullptr accepts anything
+    boost::json::value *val;           // the container in the live view
+    State state;
+    std::vector<std::string> seen; // keys seen so far (objects)
+    std::string key;               // current key (objects)
+    std::size_t count = 0;         // items so far (arrays)
+  };
+
+  bool Step(char c);
+  bool BeginValue(char c);
+  bool EndValue();
+  bool StringChar(char c);
+  bool AppendDecoded(std::string_view bytes);
+  bool EndString();
+  bool EndNumber();
+  bool CheckNumber(double v);
+  bool CheckEnd(const Frame &f);
+  const boost::json::object *ChildSchema(const Frame &f,
+                                         std::string_view key) const;
+  bool AllowsType(std::string_view type) const;
+  bool Fail(const std::string &msg);
+  std::string Path() const;
+
+  boost::json::value schema_;
+  boost::json::value root_;
+  std::vector<Frame> stack_;
+  bool done_ = false;
+  bool failed_ = false;
+  std::string error_;
+
+  // state of the scalar currently being parsed
+  Tok tok_ = Tok::kNone;
+  const boost::json::object *val_schema_ = nullptr; // schema for next value
+  boost::json::value *slot_ = nullptr;              // live view of the value
+  std::string str_;            // decoded string / key / number text so far
+  std::size_t str_len_ = 0;    // length of a string in code points
+  std::string_view literal_;   // expected literal (true/false/null)
+  bool escape_ = false;        // previous char was a '\'
+  int hex_digits_ = -1;        // hex digits remaining in a \u escape
+  std::uint32_t code_ = 0;     // code point of a \u escape
+  std::uint32_t high_surrogate_ = 0;
+};
+
+} // namespace ochat
+
+#endif // __JSON_STREAM_VALIDATOR_H__
@@ -0,0 +1,358 @@
+#include "loadgen.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <future>
+#include <iomanip>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+namespace ochat {
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr const char *kPromptWords[] = {
+    "explain", "the",     "difference", "between", "a",      "thread",
+    "and",     "process", "in",         "simple",  "terms",  "with",
+    "an",      "example", "of",         "how",     "memory", "is",
+    "shared",  "across",  "cores",      "when",    "two",    "tasks",
+    "run",     "at",      "once",       "on",      "linux",  "today"};
+
+std::int64_t ToUs(Clock::duration d) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+}
+
+double ParseNumber(const std::string &s, const std::string &spec) {
+  std::size_t pos = 0;
+  double v;
+  try {
+    v = std::stod(s, &pos);
+  } catch (const std::exception &) {
+    pos = 0;
+  }
+  if (pos == 0 || pos != s.size() || v < 0) {
+    throw std::invalid_argument("Invalid distribution: " + spec);
+  }
+  return v;
+}
+
+// the latencies of one session, recorded into the report at the end
+struct SessionResult {
+  std::int64_t requests = 0;
+  std::int64_t errors = 0;
+  std::int64_t shed = 0;
+  std::int64_t prompt_tokens = 0;
+  std::int64_t tokens = 0;
+  std::int64_t schedule_us = -1;
+  std::vector<std::int64_t> ttft_us;
+  std::vector<std::int64_t> itl_us;
+  std::vector<std::int64_t> e2e_us;
+};
+
+std::string MakePrompt(std::size_t words, std::mt19937_64 &rng) {
+  std::uniform_int_distribution<std::size_t> pick(0, std::size(kPromptWords) - 1);
+  std::string prompt;
+  for (std::size_t i = 0; i < std::max<std::size_t>(words, 1); ++i) {
+    if (i > 0)
+      prompt += ' ';
+    prompt += kPromptWords[pick(rng)];
+  }
+  return prompt;
+}
+
+// Runs the turns of one session.  The latencies of the first request are
+// measured from arrival, the time the session should have started.
+SessionResult RunSession(const Options &chat_opt, const LoadgenOptions &opt,
+                         std::mt19937_64 &rng, Clock::time_point arrival,
+                         const std::string &tenant, bool batch) {
+  SessionResult res;
+  std::ostream null_os(nullptr); // the responses are not printed
+  OllamaChat chat(chat_opt, null_os);
+  if (opt.scheduler) {
+    chat.SetScheduler(opt.scheduler, tenant,
+                      batch ? Priority::kBatch : Priority::kInteractive);
+  }
+
+  Clock::time_point sent;
+  Clock::time_point last_token;
+  bool first = true;
+  chat.SetTokenHandler([&](std::string_view) {
+    auto now = Clock::now();
+    if (first) {
+      res.ttft_us.push_back(ToUs(now - sent));
+      first = false;
+    } else {
+      res.itl_us.push_back(ToUs(now - last_token));
+    }
+    last_token = now;
+  });
+
+  res.schedule_us = ToUs(Clock::now() - arrival);
+  for (int turn = 0; turn < opt.turns; ++turn) {
+    if (turn > 0) {
+      auto think = opt.think_ms.Sample(rng);
+      if (think > 0) {
+        std::this_thread::sleep_for(std::chrono::microseconds(
+            static_cast<std::int64_t>(think * 1000)));
+      }
+    }
+    auto tokens = std::llround(opt.response_tokens.Sample(rng));
+    chat.options().model_options["num_predict"] = std::max<long long>(tokens, 1);
+    std::string prompt = MakePrompt(
+        static_cast<std::size_t>(std::llround(opt.prompt_words.Sample(rng))),
+        rng);
+
+    sent = turn == 0 ? arrival : Clock::now();
+    first = true;
+    ++res.requests;
+    try {
+      chat.SendRequestToAi(prompt);
+      res.e2e_us.push_back(ToUs(Clock::now() - sent));
+      res.prompt_tokens += chat.last_stats().prompt_eval_count;
+      res.tokens += chat.last_stats().eval_count;
+    } catch (const RequestRejected &) {
+      ++res.errors;
+      ++res.shed;
+      break;
+    } catch (const std::exception &) {
+      // the session ends at the first error, like a user giving up
+      ++res.errors;
+      break;
+    }
+  }
+  return res;
+}
+
+} // namespace
+
+Dist Dist::Parse(const std::string &spec) {
+  Dist d;
+  auto colon = spec.find(':');
+  if (colon == std::string::npos) {
+    d.kind_ = kFixed;
+    d.a_ = ParseNumber(spec, spec);
+    return d;
+  }
+  std::string head = spec.substr(0, colon);
+  std::string tail = spec.substr(colon + 1);
+  if (head == "exp") {
+    d.kind_ = kExp;
+    d.a_ = ParseNumber(tail, spec);
+    if (d.a_ <= 0)
+      throw std::invalid_argument("Invalid distribution: " + spec);
+  } else if (head == "normal") {
+    auto comma = tail.find(',');
+    if (comma == std::string::npos)
+      throw std::invalid_argument("Invalid distribution: " + spec);
+    d.kind_ = kNormal;
+    d.a_ = ParseNumber(tail.substr(0, comma), spec);
+    d.b_ = ParseNumber(tail.substr(comma + 1), spec);
+  } else {
+    d.kind_ = kUniform;
+    d.a_ = ParseNumber(head, spec);
+    d.b_ = ParseNumber(tail, spec);
+    if (d.b_ < d.a_)
+      throw std::invalid_argument("Invalid distribution: " + spec);
+  }
+  return d;
+}
+
+double Dist::Sample(std::mt19937_64 &rng) const {
+  switch (kind_) {
+  case kUniform:
+    return std::uniform_real_distribution<double>(a_, b_)(rng);
+  case kExp:
+    return std::exponential_distribution<double>(1.0 / a_)(rng);
+  case kNormal:
+    return std::max(0.0, std::normal_distribution<double>(a_, b_)(rng));
+  case kFixed:
+  default:
+    return a_;
+  }
+}
+
+double Dist::Mean() const {
+  switch (kind_) {
+  case kUniform:
+    return (a_ + b_) / 2;
+  case kExp:
+  case kNormal:
+  case kFixed:
+  default:
+    return a_;
+  }
+}
+
+void LoadgenReport::Merge(const LoadgenReport &other) {
+  sessions += other.sessions;
+  requests += other.requests;
+  errors += other.errors;
+  shed += other.shed;
+  prompt_tokens += other.prompt_tokens;
+  tokens += other.tokens;
+  elapsed_s = std::max(elapsed_s, other.elapsed_s);
+  ttft.Merge(other.ttft);
+  itl.Merge(other.itl);
+  e2e.Merge(other.e2e);
+  schedule.Merge(other.schedule);
+}
+
+namespace {
+
+constexpr double kPercentiles[] = {50, 90, 99, 99.9};
+
+boost::json::object HistogramJson(const HdrHistogram &h) {
+  boost::json::object o;
+  o["count"] = h.count();
+  o["min"] = h.min();
+  o["mean"] = h.mean();
+  o["max"] = h.max();
+  for (double p : kPercentiles) {
+    std::ostringstream name;
+    name << "p" << p;
+    o[name.str()] = h.ValueAtPercentile(p);
+  }
+  return o;
+}
+
+void HistogramText(std::ostream &os, const char *name, const HdrHistogram &h) {
+  os << std::left << std::setw(10) << name << std::right;
+  if (h.count() == 0) {
+    os << "         -\n";
+    return;
+  }
+  auto ms = [](double us) { return us / 1000.0; };
+  os << std::fixed << std::setprecision(2);
+  for (double p : kPercentiles) {
+    os << std::setw(10) << ms(h.ValueAtPercentile(p));
+  }
+  os << std::setw(10) << ms(h.max()) << std::setw(10) << ms(h.mean()) << "\n";
+}
+
+} // namespace
+
+boost::json::object LoadgenReport::ToJson() const {
+  boost::json::object o;
+  o["sessions"] = sessions;
+  o["requests"] = requests;
+  o["errors"] = errors;
+  o["shed"] = shed;
+  o["prompt_tokens"] = prompt_tokens;
+  o["tokens"] = tokens;
+  o["elapsed_s"] = elapsed_s;
+  double secs = elapsed_s > 0 ? elapsed_s : 1;
+  o["requests_per_s"] = static_cast<double>(requests - errors) / secs;
+  o["tokens_per_s"] = static_cast<double>(tokens) / secs;
+  boost::json::object lat;
+  lat["unit"] = "us";
+  lat["ttft"] = HistogramJson(ttft);
+  lat["itl"] = HistogramJson(itl);
+  lat["e2e"] = HistogramJson(e2e);
+  lat["schedule"] = HistogramJson(schedule);
+  o["latency"] = std::move(lat);
+  return o;
+}
+
+std::string LoadgenReport::ToText() const {
+  std::ostringstream os;
+  double secs = elapsed_s > 0 ? elapsed_s : 1;
+  os << std::fixed << std::setprecision(2);
+  os << "sessions " << sessions << ", requests " << requests << " ("
+     << errors << " errors, " << shed << " shed) in " << elapsed_s
+     << " s\n";
+  os << "throughput " << (requests - errors) / secs << " requests/s, "
+     << tokens / secs << " tokens/s (" << tokens << " generated, "
+     << prompt_tokens << " prompt tokens)\n";
+  os << "latency ms     p50       p90       p99     p99.9       max      mean\n";
+  HistogramText(os, "ttft", ttft);
+  HistogramText(os, "itl", itl);
+  HistogramText(os, "e2e", e2e);
+  if (schedule.count() > 0 && schedule.max() > 0) {
+    HistogramText(os, "schedule", schedule);
+  }
+  return os.str();
+}
+
+LoadgenReport RunLoad(const Options &chat_opt, const LoadgenOptions &opt) {
+  if (opt.sessions < 1 || opt.turns < 1) {
+    throw std::invalid_argument("sessions and turns must be at least 1");
+  }
+  LoadgenReport report;
+  std::mutex mutex;
+  auto record = [&](const SessionResult &r) {
+    std::lock_guard<std::mutex> lock(mutex);
+    ++report.sessions;
+    report.requests += r.requests;
+    report.errors += r.errors;
+    report.shed += r.shed;
+    report.prompt_tokens += r.prompt_tokens;
+    report.tokens += r.tokens;
+    for (auto v : r.ttft_us)
+      report.ttft.Record(v);
+    for (auto v : r.itl_us)
+      report.itl.Record(v);
+    for (auto v : r.e2e_us)
+      report.e2e.Record(v);
+    if (r.schedule_us >= 0)
+      report.schedule.Record(r.schedule_us);
+  };
+
+  auto start = Clock::now();
+  auto deadline =
+      start + std::chrono::microseconds(
+                  static_cast<std::int64_t>(opt.duration_s * 1e6));
+  if (opt.rate <= 0) {
+    // closed loop, each worker starts a new session when its session ends
+    int batch_workers =
+        static_cast<int>(std::lround(opt.batch_fraction * opt.sessions));
+    std::vector<std::thread> workers;
+    for (int i = 0; i < opt.sessions; ++i) {
+      workers.emplace_back([&, i] {
+        std::mt19937_64 rng(opt.seed + static_cast<std::uint64_t>(i));
+        std::string tenant = "session-" + std::to_string(i);
+        do {
+          record(RunSession(chat_opt, opt, rng, Clock::now(), tenant,
+                            i < batch_workers));
+        } while (opt.duration_s > 0 && Clock::now() < deadline);
+      });
+    }
+    for (auto &w : workers) {
+      w.join();
+    }
+  } else {
+    // open loop, the arrivals follow a Poisson process whatever the latency
+    ThreadPool pool(static_cast<std::size_t>(opt.sessions));
+    std::vector<std::future<void>> done;
+    std::mt19937_64 rng(opt.seed);
+    std::exponential_distribution<double> gap(opt.rate);
+    std::uniform_real_distribution<double> unit(0, 1);
+    auto arrival = start;
+    for (int n = 0;; ++n) {
+      if (opt.duration_s > 0 ? arrival >= deadline : n >= opt.sessions)
+        break;
+      std::this_thread::sleep_until(arrival);
+      std::uint64_t session_seed = rng();
+      bool batch = unit(rng) < opt.batch_fraction;
+      done.push_back(pool.Submit([&, arrival, session_seed, batch, n] {
+        std::mt19937_64 session_rng(session_seed);
+        record(RunSession(chat_opt, opt, session_rng, arrival,
+                          "session-" + std::to_string(n), batch));
+      }));
+      arrival += std::chrono::microseconds(
+          static_cast<std::int64_t>(gap(rng) * 1e6));
+    }
+    for (auto &f : done) {
+      f.get();
+    }
+  }
+  report.elapsed_s =
+      std::chrono::duration<double>(Clock::now() - start).count();
+  return report;
+}
+
+} // namespace ochat
@@ -0,0 +1,104 @@
+/**
+ * @file loadgen.h
+ * @brief Load generator that runs synthetic multi-turn chat sessions against
+ * a server and records latency histograms.
+ */
+
+#ifndef __LOADGEN_H__
+#define __LOADGEN_H__
+
+#include "hdr_histogram.h"
+#include "ochat.h"
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <string>
+
+namespace ochat {
+
+// A distribution of non-negative values, parsed from a spec:
+//   "N"          always N
+//   "A:B"        uniform between A and B
+//   "exp:M"      exponential with mean M
+//   "normal:M,S" normal with mean M and standard deviation S (clipped at 0)
+class Dist {
+public:
+  Dist(double value = 0) : kind_(kFixed), a_(value) {}
+
+  /**
+   * @throw std::invalid_argument if the spec is not valid.
+   */
+  static Dist Parse(const std::string &spec);
+
+  double Sample(std::mt19937_64 &rng) const;
+
+  // the mean of the distribution
+  double Mean() const;
+
+private:
+  enum Kind { kFixed, kUniform, kExp, kNormal };
+  Kind kind_;
+  double a_ = 0;
+  double b_ = 0;
+};
+
+struct LoadgenOptions {
+  int sessions = 8;         // concurrent sessions (closed loop), or the max
+                            // concurrent sessions (open loop)
+  int turns = 4;            // prompts per session
+  double duration_s = 0;    // run time, 0 runs each session once (closed
+                            // loop) or `sessions` arrivals (open loop)
+  double rate = 0;          // open loop session arrivals per second (Poisson),
+                            // 0 for a closed loop
+  Dist prompt_words{32};    // words per prompt
+  Dist response_tokens{64}; // tokens per response (sent as num_predict)
+  Dist think_ms{0};         // pause between the turns of a session
+  std::uint64_t seed = 1;
+  // if set the sessions share this scheduler, each session is a tenant
+  std::shared_ptr<RequestScheduler> scheduler;
+  double batch_fraction = 0; // share of the sessions with batch priority
+};
+
+// Results of a run, latencies are in microseconds.
+struct LoadgenReport {
+  std::int64_t sessions = 0;
+  std::int64_t requests = 0;
+  std::int64_t errors = 0;
+  std::int64_t shed = 0; // errors that were requests shed by the scheduler
+  std::int64_t prompt_tokens = 0; // as reported by the server
+  std::int64_t tokens = 0;        // generated, as reported by the server
+  double elapsed_s = 0;
+  HdrHistogram ttft;     // request sent to first token
+  HdrHistogram itl;      // between consecutive tokens
+  HdrHistogram e2e;      // request sent to last token
+  HdrHistogram schedule; // session arrival to its first request (open loop)
+
+  // adds the results of another (partial) report
+  void Merge(const LoadgenReport &other);
+
+  // the report as JSON, for comparing runs
+  boost::json::object ToJson() const;
+
+  // a human readable summary
+  std::string ToText() const;
+};
+
+/**
+ * Runs the load and returns the results.
+ *
+ * In a closed loop `sessions` sessions run concurrently, a new session
+ * starting when one ends (until duration_s).  In an open loop sessions arrive
+ * at `rate` per second regardless of how fast the server responds; when more
+ * than `sessions` sessions are active the new ones wait, and the wait is
+ * included in their latencies so a slow server is not hidden by the client
+ * (coordinated omission).
+ *
+ * @param chat_opt The options of the chat client of each session.
+ * @param opt The load options.
+ * @return The results.
+ */
+LoadgenReport RunLoad(const Options &chat_opt, const LoadgenOptions &opt);
+
+} // namespace ochat
+
+#endif // __LOADGEN_H__
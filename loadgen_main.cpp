@@ -0,0 +1,253 @@
+#include "fake_ollama.h"
+#include "loadgen.h"
+#include <csignal>
+#include <fstream>
+#include <getopt.h>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+
+using namespace std;
+
+void show_usage_help(const ochat::Options &opt,
+                     const ochat::LoadgenOptions &load) {
+  cout << "Usage: ochat_loadgen [options]" << endl;
+  cout << "Runs concurrent synthetic chat sessions and reports throughput and "
+          "latency percentiles."
+       << endl;
+  cout << "Options:" << endl;
+  cout << "  --server=<addr>         - server address (default: " << opt.server
+       << ")" << endl;
+  cout << "  --port=<port>           - server port (default: " << opt.port
+       << ")" << endl;
+  cout << "  --model=<model>         - model (default: " << opt.model << ")"
+       << endl;
+  cout << "  --sessions=<n>          - concurrent sessions (default: "
+       << load.sessions << ")" << endl;
+  cout << "  --turns=<n>             - prompts per session (default: "
+       << load.turns << ")" << endl;
+  cout << "  --duration=<s>          - keep starting sessions for s seconds"
+       << endl;
+  cout << "  --rate=<r>              - open loop, r session arrivals per second"
+       << endl;
+  cout << "  --prompt-words=<dist>   - words per prompt (default: 32)" << endl;
+  cout << "  --response-tokens=<dist> - tokens per response (default: 64)"
+       << endl;
+  cout << "  --think-ms=<dist>       - pause between turns (default: 0)"
+       << endl;
+  cout << "  --no-stream             - request non streamed responses" << endl;
+  cout << "  --prefill               - prefill the history during the think "
+          "time"
+       << endl;
+  cout << "  --max-in-flight=<n>     - schedule the requests, at most n in "
+          "flight"
+       << endl;
+  cout << "  --model-limit=<n>       - schedule the requests, at most n in "
+          "flight for the model"
+       << endl;
+  cout << "  --batch-fraction=<f>    - share of the sessions with batch "
+          "priority"
+       << endl;
+  cout << "  --queue-deadline-ms=<ms> - shed interactive requests queued longer"
+       << endl;
+  cout << "  --seed=<n>              - random seed" << endl;
+  cout << "  --json=<file|->         - write the report as JSON" << endl;
+  cout << "  --fake                  - run against a local stand-in server"
+       << endl;
+  cout << "  --fake-parallel=<n>     - requests the stand-in generates at once"
+       << endl;
+  cout << "  --fake-ttft-ms=<ms>     - stand-in time to first token" << endl;
+  cout << "  --fake-token-ms=<ms>    - stand-in time between tokens" << endl;
+  cout << "  --fake-prompt-cache     - stand-in evaluates only the uncached "
+          "prompt"
+       << endl;
+  cout << "  --serve-fake            - only run the stand-in server on --port"
+       << endl;
+  cout << "  --help                  - display help text" << endl;
+  cout << "A <dist> is N, A:B (uniform), exp:M or normal:M,S." << endl;
+}
+
+int main(int argc, char **argv) {
+  ochat::Options opt;
+  ochat::LoadgenOptions load;
+  ochat::FakeOllamaOptions fake_opt;
+  bool fake = false;
+  bool serve_fake = false;
+  std::string json_path;
+  ochat::SchedulerOptions sched_opt;
+  bool scheduled = false;
+
+  static struct option long_options[] = {
+      {"server", required_argument, nullptr, 'S'},
+      {"port", required_argument, nullptr, 'p'},
+      {"model", required_argument, nullptr, 'm'},
+      {"sessions", required_argument, nullptr, 'n'},
+      {"turns", required_argument, nullptr, 't'},
+      {"duration", required_argument, nullptr, 'd'},
+      {"rate", required_argument, nullptr, 'r'},
+      {"prompt-words", required_argument, nullptr, 'w'},
+      {"response-tokens", required_argument, nullptr, 'o'},
+      {"think-ms", required_argument, nullptr, 'k'},
+      {"no-stream", no_argument, nullptr, 'N'},
+      {"prefill", no_argument, nullptr, 'H'},
+      {"max-in-flight", required_argument, nullptr, 'I'},
+      {"model-limit", required_argument, nullptr, 'L'},
+      {"batch-fraction", required_argument, nullptr, 'B'},
+      {"queue-deadline-ms", required_argument, nullptr, 'D'},
+      {"seed", required_argument, nullptr, 's'},
+      {"json", required_argument, nullptr, 'j'},
+      {"fake", no_argument, nullptr, 'f'},
+      {"fake-parallel", required_argument, nullptr, 'P'},
+      {"fake-ttft-ms", required_argument, nullptr, 'T'},
+      {"fake-token-ms", required_argument, nullptr, 'K'},
+      {"fake-prompt-cache", no_argument, nullptr, 'C'},
+      {"serve-fake", no_argument, nullptr, 'F'},
+      {"help", no_argument, nullptr, 'h'},
+      {0, 0, 0, 0}};
+
+  int c;
+  try {
+    while ((c = getopt_long(argc, argv, "m:n:", long_options, nullptr)) !=
+           -1) {
+      switch (c) {
+      case 'S':
+        opt.server = optarg;
+        break;
+      case 'p':
+        opt.port = std::stoi(optarg);
+        fake_opt.port = opt.port;
+        break;
+      case 'm':
+        opt.model = optarg;
+        break;
+      case 'n':
+        load.sessions = std::stoi(optarg);
+        break;
+      case 't':
+        load.turns = std::stoi(optarg);
+        break;
+      case 'd':
+        load.duration_s = std::stod(optarg);
+        break;
+      case 'r':
+        load.rate = std::stod(optarg);
+        break;
+      case 'w':
+        load.prompt_words = ochat::Dist::Parse(optarg);
+        break;
+      case 'o':
+        load.response_tokens = ochat::Dist::Parse(optarg);
+        break;
+      case 'k':
+        load.think_ms = ochat::Dist::Parse(optarg);
+        break;
+      case 'N':
+        opt.stream_resp = false;
+        break;
+      case 'H':
+        opt.prefill = true;
+        break;
+      case 'I':
+        sched_opt.max_in_flight = std::stoi(optarg);
+        scheduled = true;
+        break;
+      case 'L':
+        sched_opt.max_in_flight_per_model = std::stoi(optarg);
+        scheduled = true;
+        break;
+      case 'B':
+        load.batch_fraction = std::stod(optarg);
+        break;
+      case 'D':
+        sched_opt.deadline[0] = std::chrono::milliseconds(std::stoi(optarg));
+        break;
+      case 's':
+        load.seed = std::stoull(optarg);
+        break;
+      case 'j':
+        json_path = optarg;
+        break;
+      case 'f':
+        fake = true;
+        break;
+      case 'P':
+        fake_opt.parallel = std::stoi(optarg);
+        break;
+      case 'T':
+        fake_opt.ttft_ms = std::stod(optarg);
+        break;
+      case 'K':
+        fake_opt.token_ms = std::stod(optarg);
+        break;
+      case 'C':
+        fake_opt.prompt_cache = true;
+        break;
+      case 'F':
+        serve_fake = true;
+        break;
+      case 'h':
+      default:
+        show_usage_help(opt, load);
+        return 1;
+      }
+    }
+  } catch (const std::exception &e) {
+    cerr << "Invalid option value: " << e.what() << endl;
+    return 1;
+  }
+
+  // with --serve-fake the signals are handled by sigwait, blocked before the
+  // server threads start so they inherit the mask
+  sigset_t stop_signals;
+  sigemptyset(&stop_signals);
+  sigaddset(&stop_signals, SIGINT);
+  sigaddset(&stop_signals, SIGTERM);
+  if (serve_fake)
+    pthread_sigmask(SIG_BLOCK, &stop_signals, nullptr);
+
+  std::unique_ptr<ochat::FakeOllama> server;
+  if (fake || serve_fake) {
+    if (!serve_fake)
+      fake_opt.port = 0;
+    server = std::make_unique<ochat::FakeOllama>(fake_opt);
+    opt.server = fake_opt.address;
+    opt.port = server->port();
+    cerr << "Stand-in server on " << opt.server << ":" << opt.port << endl;
+  }
+  if (serve_fake) {
+    int sig;
+    sigwait(&stop_signals, &sig); // serve until interrupted
+    return 0;
+  }
+
+  if (scheduled) {
+    load.scheduler = std::make_shared<ochat::RequestScheduler>(sched_opt);
+  }
+  ochat::LoadgenReport report;
+  try {
+    report = ochat::RunLoad(opt, load);
+  } catch (const std::exception &e) {
+    cerr << "Load run failed: " << e.what() << endl;
+    return 1;
+  }
+  cout << report.ToText();
+  if (load.scheduler) {
+    cout << load.scheduler->Metrics().ToText();
+  }
+
+  if (!json_path.empty()) {
+    std::string json = boost::json::serialize(report.ToJson());
+    if (json_path == "-") {
+      cout << json << endl;
+    } else {
+      std::ofstream out(json_path);
+      out << json << endl;
+      if (!out) {
+        cerr << "Unable to write " << json_path << endl;
+        return 1;
+      }
+    }
+  }
+  return report.errors == 0 ? 0 : 2;
+}
@@ -1,29 +1,190 @@
 #include "app_config.h"
+#include "capture.h"
+#include "gateway.h"
+#include "ingest.h"
 #include "ochat.h"
+#include "prompt_queue.h"
+#include "retriever.h"
+#include "tune.h"
+#include <charconv>
+#include <climits>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
 #include <getopt.h>
+#include <iomanip>
 #include <iostream>
+#include <memory>
+#include <sstream>
 #include <string>
+#include <termios.h>
+#include <unistd.h>
+#include <vector>
 
 using namespace std;
 
+// Turns the echo of the terminal off while a prompt is handled, so that the
+// prompts typed ahead do not mix into the streamed response.  The lines can
+// still be edited, they are shown when they are handled.  The echo is also
+// restored when the process exits or is killed by SIGINT, SIGTERM or SIGHUP.
+class EchoOff {
+public:
+  EchoOff() {
+    if (isatty(STDIN_FILENO) && tcgetattr(STDIN_FILENO, &saved_) == 0) {
+      InstallHandlers();
+      termios t = saved_;
+      t.c_lflag &= ~ECHO;
+      active_ = tcsetattr(STDIN_FILENO, TCSANOW, &t) == 0;
+    }
+  }
+  ~EchoOff() { Restore(); }
+
+private:
+  // tcsetattr is async-signal-safe
+  static void Restore() {
+    if (active_) {
+      active_ = 0;
+      tcsetattr(STDIN_FILENO, TCSANOW, &saved_);
+    }
+  }
+
+  // restores the terminal, then lets the signal terminate the process
+  static void OnSignal(int sig) {
+    Restore();
+    signal(sig, SIG_DFL);
+    raise(sig);
+  }
+
+  static void InstallHandlers() {
+    static bool installed = false;
+    if (installed) {
+      return;
+    }
+    installed = true;
+    std::atexit(Restore);
+    struct sigaction sa = {};
+    sa.sa_handler = OnSignal;
+    sigemptyset(&sa.sa_mask);
+    for (int sig : {SIGINT, SIGTERM, SIGHUP}) {
+      sigaction(sig, &sa, nullptr);
+    }
+  }
+
+  static inline termios saved_;
+  static inline volatile sig_atomic_t active_ = 0;
+};
+
 void show_usage_help(ochat::Options &opt) {
   cout << COL::APP;
   cout << "Help" << endl;
   cout << "Usage: ochat [options]" << endl;
   cout << "Options:" << endl;
   cout << "  --debug - enable debug logs" << endl;
+  cout << "  --server=<addr> - Ollama server address, or unix:///<path> for a "
+          "Unix domain socket (default: "
+       << opt.server << ")" << endl;
+  cout << "  --port=<port> - Ollama server port (default: " << opt.port << ")"
+       << endl;
+  cout << "  --socket-buffer=<bytes> - socket send and receive buffer size "
+          "(default: system)"
+       << endl;
+  cout << "  --serve[=<port>] - run as a gateway to the server for other "
+          "clients (default port: "
+       << OLLAMA_GATEWAY_PORT << ")" << endl;
   cout << "  --model=<model> - specify the AI model to use (default: "
        << opt.model << ")" << endl;
+  cout << "  --format=<json|schema file> - request structured (JSON) output"
+       << endl;
+  cout << "  --format-retries=<n> - retries when the output violates the "
+          "format"
+       << endl;
+  cout << "  --ingest=<dir> - embed the files under dir into the vector store "
+          "and exit"
+       << endl;
+  cout << "  --store=<file> - vector store path (default: " << opt.vector_store
+       << ")" << endl;
+  cout << "  --embed-model=<model> - model used for embeddings (default: "
+       << opt.embed_model << ")" << endl;
+  cout << "  --vec-type=<f32|f16|i8> - element type of ingested vectors "
+          "(default: f16)"
+       << endl;
+  cout << "  --rebuild - with --ingest, embed all the files again instead of "
+          "reusing the vectors of unchanged files"
+       << endl;
+  cout << "  --top-k=<n> - chunks retrieved for each prompt with /rag on "
+          "(default: "
+       << opt.rag_top_k << ")" << endl;
+  cout << "  --prefill - send the history while you type, so that the server "
+          "has evaluated it when the prompt is sent"
+       << endl;
+  cout << "  --keep-alive=<duration> - how long the server keeps the model "
+          "loaded, e.g. 30m"
+       << endl;
+  cout << "  --profiles=<file> - options of each model, e.g. num_ctx "
+          "(default: "
+       << OLLAMA_PROFILES << ")" << endl;
+  cout << "  --tune=<model> - find the fastest options of the model on the "
+          "server, write them to the profiles and exit"
+       << endl;
+  cout << "  --tune-param=<name=v1,v2,...> - an option swept by --tune, can "
+          "be repeated (default: num_thread and num_batch)"
+       << endl;
+  cout << "  --tune-prompts=<file> - prompts sent by --tune, one per line"
+       << endl;
+  cout << "  --record=<file> - record the traffic with the server for "
+          "ochat_replay"
+       << endl;
   cout << "  --help          - display help text" << endl;
   cout << COL::DEF;
 }
 
 // returns 0 on success, non-zero if failure
-int ParseOptions(int argc, char **argv, ochat::Options &opt) {
+// Parses the integer value of an option, which must be in [min, max].
+// Reports an invalid value and returns false.
+bool parse_int_arg(const char *name, const char *arg, int min, int max,
+                   int &value) {
+  const char *end = arg + std::strlen(arg);
+  int v = 0;
+  auto [p, ec] = std::from_chars(arg, end, v);
+  if (ec != std::errc() || p != end || p == arg || v < min || v > max) {
+    cerr << COL::ATN << "Invalid value for --" << name << ": " << arg
+         << " (expected " << min << " to " << max << ")" << COL::DEF << endl;
+    return false;
+  }
+  value = v;
+  return true;
+}
+
+int ParseOptions(int argc, char **argv, ochat::Options &opt,
+                 std::string &ingest_dir, ochat::IngestOptions &ingest_opt,
+                 int &serve_port, std::string &record_path,
+                 std::string &profiles_path, std::string &tune_model,
+                 ochat::TuneOptions &tune_opt) {
   // Define the command-line options
   static struct option long_options[] = {
       {"debug", no_argument, nullptr, 'd'},
+      {"server", required_argument, nullptr, 'S'},
+      {"port", required_argument, nullptr, 'p'},
+      {"socket-buffer", required_argument, nullptr, 'b'},
+      {"serve", optional_argument, nullptr, 'g'},
       {"model", required_argument, nullptr, 'm'},
+      {"format", required_argument, nullptr, 'f'},
+      {"format-retries", required_argument, nullptr, 'r'},
+      {"ingest", required_argument, nullptr, 'i'},
+      {"store", required_argument, nullptr, 's'},
+      {"embed-model", required_argument, nullptr, 'e'},
+      {"vec-type", required_argument, nullptr, 'v'},
+      {"rebuild", no_argument, nullptr, 'B'},
+      {"top-k", required_argument, nullptr, 'k'},
+      {"record", required_argument, nullptr, 'R'},
+      {"prefill", no_argument, nullptr, 'P'},
+      {"keep-alive", required_argument, nullptr, 'K'},
+      {"profiles", required_argument, nullptr, 'o'},
+      {"tune", required_argument, nullptr, 'T'},
+      {"tune-param", required_argument, nullptr, 't'},
+      {"tune-prompts", required_argument, nullptr, 'q'},
       {"help", no_argument, nullptr, 'h'},
       {0, 0, 0, 0}};
 
@@ -34,10 +195,124 @@ int ParseOptions(int argc, char **argv, ochat::Options &opt) {
     case 'd': // enable debug logs
       opt.debug = true;
       break;
+    case 'S':
+      opt.server = optarg;
+      break;
+    case 'p':
+      if (!parse_int_arg("port", optarg, 1, 65535, opt.port)) {
+        show_usage_help(opt);
+        return 1;
+      }
+      break;
+    case 'b': // 0 for the system default
+      if (!parse_int_arg("socket-buffer", optarg, 0, INT_MAX,
+                         opt.transport.receive_buffer)) {
+        show_usage_help(opt);
+        return 1;
+      }
+      opt.transport.send_buffer = opt.transport.receive_buffer;
+      break;
+    case 'g': // gateway mode, on the given or the default port
+      serve_port = OLLAMA_GATEWAY_PORT;
+      if (optarg && !parse_int_arg("serve", optarg, 1, 65535, serve_port)) {
+        show_usage_help(opt);
+        return 1;
+      }
+      break;
     case 'm':
       opt.model = std::string(optarg);
       cout << COL::APP << "Selected Model: " << opt.model << COL::DEF << endl;
       break;
+    case 'f': // "json" or the path to a JSON schema file
+      if (std::string(optarg) == "json") {
+        opt.format = optarg;
+      } else {
+        std::ifstream schema_file(optarg);
+        if (!schema_file) {
+          cerr << COL::ATN << "Unable to read schema file: " << optarg
+               << COL::DEF << endl;
+          return 1;
+        }
+        std::stringstream schema;
+        schema << schema_file.rdbuf();
+        opt.format = schema.str();
+      }
+      break;
+    case 'r':
+      if (!parse_int_arg("format-retries", optarg, 0, INT_MAX,
+                         opt.format_retries)) {
+        show_usage_help(opt);
+        return 1;
+      }
+      break;
+    case 'i':
+      ingest_dir = optarg;
+      break;
+    case 's':
+      opt.vector_store = optarg;
+      break;
+    case 'e':
+      opt.embed_model = optarg;
+      break;
+    case 'v':
+      if (std::string(optarg) == "f32") {
+        ingest_opt.type = ochat::VecType::kF32;
+      } else if (std::string(optarg) == "f16") {
+        ingest_opt.type = ochat::VecType::kF16;
+      } else if (std::string(optarg) == "i8") {
+        ingest_opt.type = ochat::VecType::kI8;
+      } else {
+        show_usage_help(opt);
+        return 1;
+      }
+      break;
+    case 'B':
+      ingest_opt.rebuild = true;
+      break;
+    case 'k':
+      if (!parse_int_arg("top-k", optarg, 1, INT_MAX, opt.rag_top_k)) {
+        show_usage_help(opt);
+        return 1;
+      }
+      break;
+    case 'P':
+      opt.prefill = true;
+      break;
+    case 'K':
+      opt.keep_alive = optarg;
+      break;
+    case 'R':
+      record_path = optarg;
+      break;
+    case 'o':
+      profiles_path = optarg;
+      break;
+    case 'T':
+      tune_model = optarg;
+      break;
+    case 't':
+      try {
+        tune_opt.parameters.push_back(ochat::ParseTuneParameter(optarg));
+      } catch (const std::invalid_argument &e) {
+        cerr << COL::ATN << e.what() << COL::DEF << endl;
+        return 1;
+      }
+      break;
+    case 'q': {
+      std::ifstream prompts_file(optarg);
+      if (!prompts_file) {
+        cerr << COL::ATN << "Unable to read prompts file: " << optarg
+             << COL::DEF << endl;
+        return 1;
+      }
+      std::string line;
+      while (std::getline(prompts_file, line)) {
+        if (!line.empty()) {
+          tune_opt.prompts.push_back(line);
+        }
+      }
+      break;
+    }
     case 'h':
     default:
       show_usage_help(opt);
@@ -57,24 +332,184 @@ void show_chat_help() {
   cout << "  /new - start a new conversation and clear the chat context"
        << endl;
   cout << "  /debug - to enable debug" << endl;
+  cout << "  /rag on|off - add passages from the vector store to prompts"
+       << endl;
+  cout << "  /image <path> - attach an image to the next prompt" << endl;
+  cout << "  /compare <m1,m2[@server[:port]],...> <prompt> - send the prompt "
+          "to several models at once and compare them"
+       << endl;
+  cout << "  /par <prompt> - send the prompt on a fork of the conversation, "
+          "the /par prompts typed ahead are sent at once"
+       << endl;
+  cout << "  /options - show the options sent with the prompts" << endl;
+  cout << "  /set <option> [value] - override an option of the profile (e.g. "
+          "/set num_ctx 8192), or remove the override"
+       << endl;
+  cout << "  /branches - list the answers of /compare and /par" << endl;
+  cout << "  /branch <model> - continue the conversation with the answer of "
+          "a model"
+       << endl;
   cout << "  /help - for this help text" << endl;
   cout << COL::DEF;
 }
 
 int main(int argc, char **argv) {
   ochat::Options opt;
-  int ret = ParseOptions(argc, argv, opt);
+  std::string ingest_dir;
+  ochat::IngestOptions ingest_opt;
+  int serve_port = -1;
+  std::string record_path;
+  std::string profiles_path = OLLAMA_PROFILES;
+  std::string tune_model;
+  ochat::TuneOptions tune_opt;
+  int ret = ParseOptions(argc, argv, opt, ingest_dir, ingest_opt, serve_port,
+                         record_path, profiles_path, tune_model, tune_opt);
   if (ret != 0)
     return ret;
-  ochat::OllamaChat oc(opt);
+  try {
+    opt.profiles = ochat::LoadProfiles(profiles_path);
+  } catch (const std::exception &e) {
+    std::cerr << COL::ATN << e.what() << COL::DEF << std::endl;
+    return 1;
+  }
+
+  if (serve_port >= 0) {
+    if (ochat::IsUnixSocket(opt.server)) {
+      std::cerr << COL::ATN << "The gateway needs a TCP server" << COL::DEF
+                << std::endl;
+      return 1;
+    }
+    ochat::GatewayOptions gw_opt;
+    gw_opt.port = serve_port;
+    gw_opt.backend_server = opt.server;
+    gw_opt.backend_port = opt.port;
+    try {
+      ochat::Gateway gateway(gw_opt);
+      cout << COL::APP << "Serving on " << gw_opt.address << ":"
+           << gateway.port() << " for " << opt.server << ":" << opt.port
+           << COL::DEF << endl;
+      gateway.Run();
+    } catch (const std::exception &e) {
+      std::cerr << COL::ATN << "Gateway failed: " << e.what() << COL::DEF
+                << std::endl;
+      return 1;
+    }
+    return 0;
+  }
+  // the answers to the tune prompts are not shown
+  std::ostream null_os(nullptr);
+  ochat::OllamaChat oc(opt, tune_model.empty() ? cout : null_os);
+  if (!record_path.empty()) {
+    try {
+      oc.SetTransportFactory(ochat::RecordingTransports(
+          [&opt] { return ochat::MakeTransport(opt.server, opt.transport); },
+          std::make_shared<ochat::CaptureWriter>(record_path)));
+    } catch (const std::exception &e) {
+      std::cerr << COL::ATN << e.what() << COL::DEF << std::endl;
+      return 1;
+    }
+    cout << COL::APP << "Recording to " << record_path << COL::DEF << endl;
+  }
+
+  if (!ingest_dir.empty()) {
+    try {
+      ochat::IngestStats stats = ochat::Ingest(
+          ingest_dir, opt.vector_store,
+          [&oc](const std::vector<std::string> &inputs) {
+            return oc.Embed(inputs);
+          },
+          ingest_opt, &cout);
+      cout << COL::APP << "Ingested " << stats.files << " files ("
+           << stats.files_reused << " unchanged), " << stats.chunks
+           << " chunks in " << opt.vector_store << ", embedded "
+           << stats.chunks_embedded << " chunks in " << stats.requests
+           << " requests" << COL::DEF << endl;
+    } catch (const std::exception &e) {
+      std::cerr << COL::ATN << "Ingest failed: " << e.what() << COL::DEF
+                << std::endl;
+      return 1;
+    }
+    return 0;
+  }
+
+  if (!tune_model.empty()) {
+    oc.options().model = tune_model;
+    cout << COL::APP << "Tuning " << tune_model << " on " << opt.server
+         << COL::DEF << endl;
+    try {
+      ochat::TuneResult result = ochat::Tune(oc, tune_opt, &cout);
+      const ochat::TuneTrial &best = result.trials[result.best_trial];
+      // read again, the file may have changed while tuning
+      ochat::ModelProfiles profiles = ochat::LoadProfiles(profiles_path);
+      profiles[tune_model] = result.best;
+      ochat::SaveProfiles(profiles_path, profiles);
+      cout << COL::APP << "Best: " << boost::json::serialize(result.best)
+           << ", " << std::fixed << std::setprecision(2)
+           << result.trials.front().seconds / best.seconds
+           << "x as fast as the current options, written to "
+           << profiles_path << COL::DEF << endl;
+    } catch (const std::exception &e) {
+      std::cerr << COL::ATN << "Tune failed: " << e.what() << COL::DEF
+                << std::endl;
+      return 1;
+    }
+    return 0;
+  }
+
+  // retrieval of passages from the vector store, opened by /rag on
+  auto embed = [&oc](const std::vector<std::string> &inputs) {
+    return oc.Embed(inputs);
+  };
+  ochat::RetrieverOptions rag_opt;
+  rag_opt.top_k = static_cast<size_t>(opt.rag_top_k);
+  std::unique_ptr<ochat::Retriever> retriever;
 
   /// Initiate loop to handle user input and AI response
   cout << COL::APP << "Please enter a prompt for the AI or " << COL::WRN
        << "/help" << COL::DEF << " ,for help, " << COL::ATN << "/bye"
        << COL::APP << " , to exit" << COL::DEF << endl;
+  // the input is read on a thread, so that the prompts typed while a
+  // response streams (or piped in) are queued and handled as soon as it is
+  // complete
+  auto input = std::make_shared<ochat::PromptQueue>();
+  ochat::ReadLinesAsync(cin, input);
+  bool tty = isatty(STDIN_FILENO);
+  auto is_par = [](const std::string &p) { return p.rfind("/par ", 0) == 0; };
+  auto show_options = [&oc] {
+    const ochat::Options &o = oc.options();
+    cout << COL::APP
+         << boost::json::serialize(
+                ochat::ProfileOptions(o.profiles, o.model, o.model_options))
+         << COL::DEF << endl;
+  };
+  // Runs the requests of a prompt.  A request that the server rejects is
+  // reported and the chat continues, returns false if the server failed.
+  auto send = [](const std::function<void()> &request) {
+    try {
+      request();
+    } catch (const ochat::HttpError &e) {
+      std::cerr << COL::ATN << e.what();
+      if (e.busy() && e.retry_after() >= 0) {
+        std::cerr << " (retry after " << e.retry_after() << "s)";
+      }
+      std::cerr << COL::DEF << std::endl;
+    } catch (const ochat::SchemaViolation &e) {
+      std::cerr << COL::ATN << e.what() << COL::DEF << std::endl;
+    } catch (const std::runtime_error &e) {
+      std::cerr << "Exception: " << e.what() << std::endl;
+      return false;
+    }
+    return true;
+  };
   std::string prompt;
-  cout << COL::USR << "PROMPT: ";
-  while (getline(cin, prompt)) {
+  bool waited = false;
+  cout << COL::USR << "PROMPT: " << std::flush;
+  while (input->Pop(prompt, &waited)) {
+    if (!tty || !waited) {
+      // the terminal did not show the line
+      cout << prompt << endl;
+    }
+    EchoOff echo_off;
 
     if (prompt == "/help") {
       show_chat_help();
@@ -87,20 +522,136 @@ int main(int argc, char **argv) {
       opt.debug = !opt.debug;
       cout << COL::ATN << "Toggled Debug, debug is now " << opt.debug
            << COL::DEF << endl;
-    } else if (prompt == "/bye") {
-      cout << COL::ATN << "Exiting Chat..." << COL::DEF << endl;
-      break;
-    } else {
+    } else if (prompt == "/rag on") {
+      if (!retriever) {
+        retriever = std::make_unique<ochat::Retriever>(embed, rag_opt);
+        try {
+          if (!retriever->Open(opt.vector_store, &cout)) {
+            cout << COL::ATN << "No vector store " << opt.vector_store
+                 << ", create it with ochat --ingest=<dir>" << COL::DEF
+                 << endl;
+            retriever.reset();
+          }
+        } catch (const std::exception &e) {
+          // a corrupt store, or the index could not be built or saved
+          cout << COL::ATN << e.what() << COL::DEF << endl;
+          retriever.reset();
+        }
+      }
+      if (retriever) {
+        // a failed lookup (e.g. the embedding model is not available) sends
+        // the prompt without context rather than ending the chat
+        oc.SetContextProvider([&retriever](const std::string &p) {
+          try {
+            return retriever->Context(p);
+          } catch (const std::exception &e) {
+            cout << COL::ATN << "Retrieval failed: " << e.what() << COL::DEF
+                 << endl;
+            return std::string();
+          }
+        });
+        cout << COL::APP << "Retrieval on, " << retriever->store().size()
+             << " chunks in " << opt.vector_store << COL::DEF << endl;
+      }
+    } else if (prompt.rfind("/image ", 0) == 0) {
+      std::string path = prompt.substr(7);
       try {
-        oc.SendRequestToAi(prompt);
-
-      } catch (const std::runtime_error &e) {
-        std::cerr << "Exception: " << e.what() << std::endl;
+        size_t size = oc.AttachImage(path);
+        cout << COL::APP << "Attached " << path << " (" << size / 1024
+             << " KB encoded) to the next prompt" << COL::DEF << endl;
+      } catch (const std::exception &e) {
+        cout << COL::ATN << e.what() << COL::DEF << endl;
+      }
+    } else if (prompt.rfind("/compare ", 0) == 0) {
+      std::string args = prompt.substr(9);
+      size_t space = args.find(' ');
+      if (space == std::string::npos) {
+        cout << COL::ATN << "Usage: /compare <m1,m2,...> <prompt>" << COL::DEF
+             << endl;
+      } else {
+        std::vector<ochat::CompareTarget> targets;
+        try {
+          targets = ochat::ParseCompareTargets(args.substr(0, space));
+        } catch (const std::invalid_argument &e) {
+          cout << COL::ATN << e.what() << COL::DEF << endl;
+        }
+        if (!targets.empty() && !send([&] {
+              auto results = oc.Compare(targets, args.substr(space + 1));
+              cout << COL::APP;
+              ochat::PrintComparison(cout, results);
+              cout << "Continue with /branch <model>" << COL::DEF << endl;
+            })) {
+          ret = 1;
+          break;
+        }
+      }
+    } else if (is_par(prompt)) {
+      // the /par prompts queued after this one are independent of it too
+      std::vector<std::string> prompts{prompt.substr(5)};
+      std::string next;
+      while (input->PopIf(next, is_par)) {
+        cout << COL::USR << "PROMPT: " << next << endl;
+        prompts.push_back(next.substr(5));
+      }
+      if (!send([&] {
+            auto results = oc.Fork(prompts);
+            cout << COL::APP;
+            ochat::PrintComparison(cout, results);
+            cout << "Continue with /branch #<n>" << COL::DEF << endl;
+          })) {
         ret = 1;
         break;
       }
+    } else if (prompt == "/options") {
+      show_options();
+    } else if (prompt.rfind("/set ", 0) == 0) {
+      std::istringstream args(prompt.substr(5));
+      std::string name, value;
+      args >> name >> value;
+      boost::json::object &overrides = oc.options().model_options;
+      if (value.empty()) {
+        // back to the value of the profile
+        boost::json::object kept;
+        for (auto &kv : overrides) {
+          if (kv.key() != name) {
+            kept[kv.key()] = kv.value();
+          }
+        }
+        overrides = std::move(kept);
+      } else {
+        try {
+          overrides[name] = boost::json::parse(value);
+        } catch (const std::exception &) {
+          overrides[name] = value; // e.g. a stop sequence
+        }
+      }
+      show_options();
+    } else if (prompt == "/branches") {
+      cout << COL::APP;
+      for (auto &label : oc.branches()) {
+        cout << label << endl;
+      }
+      cout << COL::DEF;
+    } else if (prompt.rfind("/branch ", 0) == 0) {
+      try {
+        oc.SwitchBranch(prompt.substr(8));
+        cout << COL::APP << "Continuing with " << prompt.substr(8) << COL::DEF
+             << endl;
+      } catch (const std::out_of_range &) {
+        cout << COL::ATN << "No branch " << prompt.substr(8)
+             << ", see /branches" << COL::DEF << endl;
+      }
+    } else if (prompt == "/rag off") {
+      oc.SetContextProvider(nullptr);
+      cout << COL::APP << "Retrieval off" << COL::DEF << endl;
+    } else if (prompt == "/bye") {
+      cout << COL::ATN << "Exiting Chat..." << COL::DEF << endl;
+      break;
+    } else if (!send([&] { oc.SendRequestToAi(prompt); })) {
+      ret = 1;
+      break;
     }
-    cout << COL::USR << "PROMPT: ";
+    cout << COL::USR << "PROMPT: " << std::flush;
   }
 
   return ret;
@@ -6,256 +6,990 @@
 #include <boost/asio.hpp>
 #include <boost/json/src.hpp> // must include from 1 source file, to eliminate need to link to boost
 #include <boost/json/string.hpp>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <future>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <sstream>
 #include <stdexcept> // Include for std::runtime_error
 #include <string>
+#include <string_view>
+#include <thread>
 #include <vector>
 
 using namespace std;
-using boost::asio::ip::tcp;
 using namespace ochat;
 
 namespace ochat {
+
+namespace {
+
+// format a chat message with the given role and content
+std::string ChatMsg(const char *role, std::string_view content) {
+  std::stringstream ss;
+  ss << "   { \"role\": \"" << role << "\", " << "\"content\": "
+     << boost::json::string(content) << " }";
+  return ss.str();
+}
+
+// size of the "images" member of a message with the encoded images
+std::size_t ImagesSize(
+    const std::vector<std::shared_ptr<const std::string>> &images) {
+  std::size_t n = 0;
+  for (auto &img : images) {
+    n += img->size() + 4; // quotes and separator
+  }
+  return n + 14;
+}
+
+// append the "images" member of a message, the base64 encoding does not
+// need escaping
+void AppendImages(std::string &out,
+                  const std::vector<std::shared_ptr<const std::string>> &images) {
+  out += ", \"images\": [";
+  for (size_t i = 0; i < images.size(); ++i) {
+    out += i ? ", \"" : "\"";
+    out += *images[i];
+    out += '"';
+  }
+  out += ']';
+}
+
+// true for errors that indicate the connection to the server was lost
+bool IsDisconnect(const boost::system::error_code &ec) {
+  namespace err = boost::asio::error;
+  return ec == err::eof || ec == err::connection_reset ||
+         ec == err::connection_aborted || ec == err::connection_refused ||
+         ec == err::broken_pipe || ec == err::timed_out ||
+         ec == err::network_reset || ec == err::network_down ||
+         ec == err::network_unreachable || ec == err::host_unreachable;
+}
+
+} // namespace
+
 // function to return a post request message for the Ollama API
 std::string OllamaChat::FormatPostRequest(std::string prompt,
                                           vector<string> &history) {
+  return FormatChatRequest(history, PromptMessages(prompt));
+}
+
+// function to return the messages for a prompt, with the context for it
+std::string OllamaChat::PromptMessages(const std::string &prompt) {
+  std::string context;
+  if (context_provider_) {
+    context = context_provider_(prompt);
+  }
+  std::string msgs;
+  if (!context.empty()) {
+    msgs = ChatMsg("system", context) + ",\n";
+  }
+  std::string user = ChatMsg("user", prompt);
+  if (images_.empty()) {
+    return msgs + user;
+  }
+  // the images go in the user message, before its closing " }"
+  msgs.reserve(msgs.size() + user.size() + ImagesSize(images_));
+  msgs.append(user, 0, user.size() - 2);
+  AppendImages(msgs, images_);
+  msgs += " }";
+  return msgs;
+}
+
+// function to return a post request for the chat endpoint with the given
+// messages following the history.  The history and messages (which can hold
+// megabytes of images) are copied once, straight into the request.
+std::string OllamaChat::FormatChatRequest(const vector<string> &history,
+                                          const std::string &messages,
+                                          bool prefill) {
 
   // format the JSON data for the Ollama request
   std::stringstream ss;
 
   ss << "{"
      << "  \"model\": \"" << opt_.model << "\","
-     << "  \"stream\": " << (opt_.stream_resp ? "true" : "false") << ","
-     << " \"messages\": [";
-  for (auto h : history) {
-    ss << h;
+     << "  \"stream\": " << (opt_.stream_resp && !prefill ? "true" : "false")
+     << ",";
+  if (!opt_.format.empty()) {
+    // structured output, either "json" or a JSON schema
+    ss << "  \"format\": "
+       << (opt_.format == "json" ? "\"json\"" : opt_.format) << ",";
   }
-  ss << "   { \"role\": \"user\", " << "\"content\": \"" << prompt << "\" }"
-     << "  ]"
-     << "}";
-  std::string json_data = ss.str();
-
-  // create the post request
-  ss.str("");
-  ss.clear();
-  ss << "POST " << opt_.endpoint << " HTTP/1.1\r\n";
-  ss << "Host: " << opt_.server << "\r\n";
-  ss << "Content-Type: application/json\r\n";
-  ss << "Content-Length: " << json_data.size() << "\r\n";
-  ss << "\r\n";
-
-  ss << json_data;
-  return ss.str();
+  if (!tools_json_.empty()) {
+    ss << "  \"tools\": " << tools_json_ << ",";
+  }
+  boost::json::object options =
+      ProfileOptions(opt_.profiles, opt_.model, opt_.model_options);
+  if (prefill) {
+    // the same options as the chat requests (changing e.g. num_ctx would
+    // reload the model), generating only one token
+    options["num_predict"] = 1;
+  }
+  if (!options.empty()) {
+    ss << "  \"options\": " << boost::json::serialize(options) << ",";
+  }
+  std::string keep_alive = opt_.keep_alive;
+  if (prefill && keep_alive.empty()) {
+    keep_alive = OLLAMA_PREFILL_KEEP_ALIVE;
+  }
+  if (!keep_alive.empty()) {
+    ss << "  \"keep_alive\": " << boost::json::string(keep_alive) << ",";
+  }
+  ss << " \"messages\": [";
+  std::string head = ss.str();
+  const char *tail = "  ]}";
+  // without messages the history ends the array, without its last ",\n"
+  size_t trim = messages.empty() && !history.empty() ? 2 : 0;
+  size_t body_size = head.size() + messages.size() + strlen(tail) - trim;
+  for (auto &h : history) {
+    body_size += h.size();
+  }
+  std::string req = FormatHttpHeader(opt_.endpoint, body_size);
+  req.reserve(req.size() + body_size);
+  req += head;
+  for (auto &h : history) {
+    req += h;
+  }
+  req.resize(req.size() - trim);
+  req += messages;
+  req += tail;
+  return req;
 }
 
-// Function to parse the HTTP response header
-std::map<std::string, std::string>
-OllamaChat::ParseHttpRespHeader(std::istream &responseStream) {
-  std::map<std::string, std::string> headers;
-  std::string line;
-
-  // First line is the status line (e.g., HTTP/1.1 200 OK)
-  if (std::getline(responseStream, line)) {
-    if (line != "\r")
-      headers["Status"] = line;
+// function to return a post request for the embed endpoint
+std::string OllamaChat::FormatEmbedRequest(const vector<string> &inputs) {
+  std::stringstream ss;
+  ss << "{"
+     << "  \"model\": \"" << opt_.embed_model << "\",";
+  // e.g. num_thread, the chat overrides are not meant for this model
+  boost::json::object options =
+      ProfileOptions(opt_.profiles, opt_.embed_model);
+  if (!options.empty()) {
+    ss << "  \"options\": " << boost::json::serialize(options) << ",";
   }
-
-  // Parse each header line
-  while (std::getline(responseStream, line)) {
-    if (line == "\r")
-      break;
-    std::string::size_type colon = line.find(':');
-    if (colon != std::string::npos) {
-      std::string headerName = line.substr(0, colon);
-      std::string headerValue =
-          line.substr(colon + 2, line.size() - 1); // Skip ": "
-      headers[headerName] = headerValue;
-    }
+  ss << "  \"input\": [";
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    ss << (i ? ", " : "") << boost::json::string(inputs[i]);
   }
+  ss << "]"
+     << "}";
+  return FormatHttpPost(OLLAMA_EMBED_ENDPOINT, ss.str());
+}
+
+// function to wrap the JSON data in a post request for the endpoint
+std::string OllamaChat::FormatHttpPost(const std::string &endpoint,
+                                       const std::string &json_data) {
+  return FormatHttpHeader(endpoint, json_data.size()) + json_data;
+}
 
-  return headers;
+// function to return the header of a post request with a JSON body
+std::string OllamaChat::FormatHttpHeader(const std::string &endpoint,
+                                         size_t content_length) {
+  std::stringstream ss;
+  ss << "POST " << endpoint << " HTTP/1.1\r\n";
+  // HTTP/1.1 requires a host, a Unix domain socket has none
+  ss << "Host: " << (IsUnixSocket(opt_.server) ? "localhost" : opt_.server)
+     << "\r\n";
+  ss << "Content-Type: application/json\r\n";
+  ss << "Content-Length: " << content_length << "\r\n";
+  ss << "\r\n";
+  return ss.str();
 }
 
-// This function reads data from the socket into resp_buff at least up until
-// the delimeter sequence is in the stream.  If there was previously buffered
-// data in resp_buff that will be checked for the delimeter before requesting
-// more data from the socket.
-void OllamaChat::ReadUntilDelimeter(tcp::socket &socket,
+// This function reads data from the connection into resp_buff at least up
+// until the delimeter sequence is in the stream.  If there was previously
+// buffered data in resp_buff that will be checked for the delimeter before
+// requesting more data from the connection.
+void OllamaChat::ReadUntilDelimeter(Transport &conn,
                                     boost::asio::streambuf &resp_buff,
                                     const char *delim = "\r\n") {
   if (resp_buff.size() > 0) {
     // check if the data is already buffered up to the next delimeter or if
     // we need to read more.
-    std::string residual_str(
+    std::string_view residual_str(
         boost::asio::buffer_cast<const char *>(resp_buff.data()),
         resp_buff.size());
     size_t pos = residual_str.find(delim);
-    if (pos == std::string::npos) { // no delimiter found, read more
-      boost::asio::read_until(socket, resp_buff, delim);
+    if (pos == std::string_view::npos) { // no delimiter found, read more
+      conn.ReadUntil(resp_buff, delim);
+    }
+  } else {
+    conn.ReadUntil(resp_buff, delim);
+  }
+}
+
+// Read the response header and consume it from resp_buff.
+HttpRespHeader OllamaChat::ReadRespHeader(Transport &conn,
+                                          boost::asio::streambuf &resp_buff) {
+  conn.ReadUntil(resp_buff, "\r\n\r\n");
+  HttpRespHeader hdr;
+  if (ParseHttpRespHeader(resp_buff, hdr) == 0) {
+    throw std::runtime_error("Incomplete HTTP response header");
+  }
+  if (opt_.debug) {
+    os_ << COL::WRN << "Parsed response headers: " << COL::DEF << endl;
+    os_ << "Status : " << hdr.status << " " << hdr.reason << endl;
+    for (size_t i = 0; i < hdr.num_fields; ++i) {
+      os_ << hdr.fields[i].name << " : " << hdr.fields[i].value << endl;
     }
+  }
+  resp_buff.consume(hdr.size);
+  return hdr;
+}
+
+// Read one chunk of a chunked response.  Each chunk starts with the length of
+// the chunk in hexadecimal followed by a \r\n then the actual data of the
+// chunk, then a \r\n indicating end of that chunk.  The final chunk specifies
+// a chunk length of 0.
+bool OllamaChat::ReadChunk(Transport &conn, boost::asio::streambuf &resp_buff,
+                           std::string &chunk) {
+  // Read the chunk length followed by "\r\n"
+  ReadUntilDelimeter(conn, resp_buff, "\r\n");
+  std::string_view data(boost::asio::buffer_cast<const char *>(resp_buff.data()),
+                        resp_buff.size());
+  size_t eol = data.find("\r\n");
+  std::string_view csize_str = data.substr(0, eol);
+  if (opt_.debug) {
+    os_ << COL::WRN << "Chunk size: " << csize_str << COL::DEF << endl;
+  }
+  size_t cs = 0;
+  auto [end, ec] = std::from_chars(
+      csize_str.data(), csize_str.data() + csize_str.size(), cs, 16);
+  if (ec != std::errc() || end == csize_str.data()) {
+    throw std::runtime_error("Invalid chunk size in response");
+  }
+  resp_buff.consume(eol + 2);
+
+  if (cs == 0) {
+    return false; // End of chunked responses (this is the last chunk)
+  }
+
+  // Read the chunk data accounting for any previous residual already in
+  // the resp_buff.
+  size_t residual = resp_buff.size();
+  if (residual < cs) {
+    size_t cs_remaining = cs - residual;
+    conn.ReadExactly(resp_buff, cs_remaining);
+  }
+  chunk.assign(boost::asio::buffer_cast<const char *>(resp_buff.data()), cs);
+  resp_buff.consume(cs);
+
+  // the trailing "\r\n" marks end of each chunk
+  ReadUntilDelimeter(conn, resp_buff, "\r\n");
+  std::string_view chunk_delim_buff(
+      boost::asio::buffer_cast<const char *>(resp_buff.data()),
+      resp_buff.size());
+  size_t chunk_delim_pos = chunk_delim_buff.find("\r\n");
+  resp_buff.consume(chunk_delim_pos + 2);
+  return true;
+}
+
+// Read a whole response body, framed by the chunked encoding, the
+// Content-Length, or the server closing the connection.
+std::string OllamaChat::ReadRespBody(Transport &conn,
+                                     boost::asio::streambuf &resp_buff,
+                                     const HttpRespHeader &hdr) {
+  std::string body;
+  if (hdr.chunked) {
+    std::string chunk;
+    while (ReadChunk(conn, resp_buff, chunk)) {
+      body += chunk;
+    }
+  } else if (hdr.content_length >= 0) {
+    size_t len = static_cast<size_t>(hdr.content_length);
+    size_t residual = resp_buff.size();
+    if (residual < len) {
+      conn.ReadExactly(resp_buff, len - residual);
+    }
+    body.assign(boost::asio::buffer_cast<const char *>(resp_buff.data()), len);
+    resp_buff.consume(len);
+  } else if (hdr.conn_close) {
+    // the body extends until the server closes the connection
+    conn.ReadToEnd(resp_buff);
+    body.assign(boost::asio::buffer_cast<const char *>(resp_buff.data()),
+                resp_buff.size());
+    resp_buff.consume(body.size());
   } else {
-    boost::asio::read_until(socket, resp_buff, delim);
+    throw std::runtime_error("No Content-Length header found in response");
   }
+  return body;
 }
 
 // Parse the returned JSON data for the content string in the message object.
-std::string OllamaChat::GetMsgContentFromJson(std::string json_str) {
+std::string OllamaChat::GetMsgContentFromJson(std::string json_str,
+                                              std::vector<ToolCall> *tool_calls,
+                                              ResponseStats *stats) {
   boost::json::value resp = boost::json::parse(json_str);
-  boost::json::object resp_obj = resp.as_object();
-  if (resp_obj.find("message") != resp_obj.end()) {
-    auto msg_obj = resp_obj["message"].as_object();
-    if (msg_obj.find("content") != msg_obj.end()) {
-      // converting the boost::json::string to std::string automatically
-      // converts the escape sequences (such as \n) appropriately.
-      return msg_obj["content"].as_string().c_str();
+  boost::json::object &resp_obj = resp.as_object();
+
+  // the last message has the counts and timings of the response
+  if (auto *done = resp_obj.if_contains("done");
+      stats != nullptr && done != nullptr && done->is_bool() &&
+      done->as_bool()) {
+    auto count = [&resp_obj](const char *name) -> std::int64_t {
+      auto *v = resp_obj.if_contains(name);
+      return v != nullptr && v->is_number() ? v->to_number<std::int64_t>() : 0;
+    };
+    stats->done = true;
+    stats->prompt_eval_count = count("prompt_eval_count");
+    stats->eval_count = count("eval_count");
+    stats->total_duration = count("total_duration");
+    stats->load_duration = count("load_duration");
+    stats->prompt_eval_duration = count("prompt_eval_duration");
+    stats->eval_duration = count("eval_duration");
+  }
+
+  auto *msg = resp_obj.if_contains("message");
+  if (msg == nullptr) {
+    return std::string();
+  }
+  auto &msg_obj = msg->as_object();
+
+  // the model requests tool calls as {"function": {"name", "arguments"}}
+  auto *calls = msg_obj.if_contains("tool_calls");
+  if (tool_calls != nullptr && calls != nullptr && calls->is_array()) {
+    for (auto &c : calls->as_array()) {
+      auto *fn = c.is_object() ? c.as_object().if_contains("function") : nullptr;
+      if (fn == nullptr || !fn->is_object()) {
+        continue;
+      }
+      ToolCall call;
+      if (auto *name = fn->as_object().if_contains("name");
+          name != nullptr && name->is_string()) {
+        call.name = name->as_string().c_str();
+      }
+      if (auto *args = fn->as_object().if_contains("arguments")) {
+        if (args->is_object()) {
+          call.arguments = args->as_object();
+        } else if (args->is_string()) { // some models send a JSON string
+          boost::system::error_code ec;
+          auto parsed = boost::json::parse(args->as_string(), ec);
+          if (!ec && parsed.is_object()) {
+            call.arguments = parsed.as_object();
+          }
+        }
+      }
+      tool_calls->push_back(std::move(call));
     }
   }
+
+  if (auto *content = msg_obj.if_contains("content");
+      content != nullptr && content->is_string()) {
+    // converting the boost::json::string to std::string automatically
+    // converts the escape sequences (such as \n) appropriately.
+    return content->as_string().c_str();
+  }
   return std::string();
 }
 
-// Send a request to an Ollama server and display its response.
-void OllamaChat::SendRequestToAi(const string &req) {
-  boost::json::string prompt(req.c_str(), req.size());
-  std::stringstream output;
-  std::string endpoint = opt_.endpoint;
-
-  // create a connection to the Ollama host
-  boost::asio::io_context io_context;
-  tcp::resolver resolver(io_context);
-  auto endpoints = resolver.resolve(opt_.server, std::to_string(opt_.port));
-  tcp::socket socket(io_context);
-  boost::asio::connect(socket, endpoints);
-
-  // format and send the post request to the ollama server
-  std::string post_req = FormatPostRequest(req, history_);
-  if (opt_.debug) {
-    os_ << COL::WRN << "POST Request: " << COL::DEF << post_req << endl;
-    os_ << post_req << endl;
+void OllamaChat::RegisterTool(Tool tool) {
+  boost::system::error_code ec;
+  boost::json::value params = boost::json::parse(tool.parameters, ec);
+  if (ec || !params.is_object()) {
+    throw std::invalid_argument("Tool parameters must be a JSON schema object");
   }
-  boost::asio::write(socket, boost::asio::buffer(post_req));
+  tools_[tool.name] = std::move(tool);
 
-  // read the response header from the server
-  std::string myresp;
-  boost::asio::streambuf resp_buff;
-  resp_buff.prepare(1 << 14); // Prepare buffer to hold up to 16KB of data
-  boost::system::error_code error;
-  boost::asio::read_until(socket, resp_buff, "\r\n\r\n");
-  std::istream resp_strm(&resp_buff);
+  // rebuild the tool definitions that are sent with each request
+  boost::json::array defs;
+  for (auto &[name, t] : tools_) {
+    boost::json::object fn;
+    fn["name"] = name;
+    fn["description"] = t.description;
+    fn["parameters"] = boost::json::parse(t.parameters);
+    boost::json::object def;
+    def["type"] = "function";
+    def["function"] = std::move(fn);
+    defs.push_back(std::move(def));
+  }
+  tools_json_ = boost::json::serialize(defs);
+}
 
-  // parse the response header
-  auto res_map = ParseHttpRespHeader(resp_strm);
-  if (opt_.debug) {
-    os_ << COL::WRN << "Parsed response headers: " << COL::DEF << endl;
-    for (auto [k, v] : res_map) {
-      os_ << k << " : " << v << endl;
+// The worker threads of the tool calls.  At most max workers are alive,
+// including those stuck in calls that timed out.  The workers are detached
+// and share this with the client, so that a worker stuck in a hung tool can
+// outlive the client; the others exit when the client stops them.
+struct ToolWorkers {
+  explicit ToolWorkers(int n) : max(std::max(n, 1)) {}
+
+  // queues a task, and starts a worker if none is idle
+  void Submit(std::shared_ptr<ToolWorkers> self, std::function<void()> task) {
+    std::lock_guard<std::mutex> lock(mutex);
+    tasks.push_back(std::move(task));
+    if (idle == 0 && threads < max) {
+      ++threads;
+      std::thread([self = std::move(self)] { self->Work(); }).detach();
     }
+    cv.notify_one();
   }
 
-  // check for chunked transfer or non-chunked w/ content-length specified.
-  bool chunked = false;
-  int content_length = -1;
-  if (res_map.find("Transfer-Encoding") != res_map.end() &&
-      res_map["Transfer-Encoding"] == "chunked\r") {
-    chunked = true;
-    if (opt_.debug) {
-      os_ << COL::WRN << "Chunked encoding detected" << COL::DEF << endl;
+  void Work() {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+      ++idle;
+      cv.wait(lock, [this] { return stop || !tasks.empty(); });
+      --idle;
+      if (tasks.empty()) {
+        --threads;
+        return; // stopped and drained
+      }
+      std::function<void()> task = std::move(tasks.front());
+      tasks.pop_front();
+      lock.unlock();
+      task();
+      lock.lock();
     }
-  } else {
-    if (res_map.find("Content-Length") != res_map.end()) {
-      content_length = std::stoi(res_map["Content-Length"]);
-      if (opt_.debug) {
-        os_ << COL::WRN << "Content-Length header found: " << content_length
-            << COL::DEF << endl;
+  }
+
+  // lets the idle workers exit, those in a call exit once it returns
+  void Stop() {
+    std::lock_guard<std::mutex> lock(mutex);
+    stop = true;
+    cv.notify_all();
+  }
+
+  std::mutex mutex; // guards the members below
+  std::condition_variable cv;
+  std::deque<std::function<void()>> tasks;
+  const int max;
+  int threads = 0; // alive
+  int idle = 0;    // waiting for a task
+  int hung = 0;    // running calls that timed out
+  bool stop = false;
+};
+
+namespace {
+
+struct ToolCallState {
+  std::promise<std::string> result;
+  bool running = false;   // started on a worker
+  bool abandoned = false; // timed out, the result is dropped
+};
+
+} // namespace
+
+OllamaChat::~OllamaChat() {
+  CancelPrefill();
+  if (tool_workers_) {
+    tool_workers_->Stop();
+  }
+}
+
+// Run the tool calls concurrently on the tool workers.  The calls in a
+// response are independent of each other so the round trip takes as long as
+// the slowest tool rather than the sum of all of them.  A call that times out
+// is abandoned: if it has not started it never runs, if it runs it keeps its
+// worker until it returns.  The calls are refused once every worker is stuck
+// in an abandoned call, rather than starting more threads.
+std::vector<std::string>
+OllamaChat::RunToolCalls(const std::vector<ToolCall> &calls) {
+  if (!tool_workers_) {
+    tool_workers_ = std::make_shared<ToolWorkers>(opt_.tool_threads);
+  }
+  auto workers = tool_workers_;
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::shared_ptr<ToolCallState>> states;
+  std::vector<std::future<std::string>> results;
+  std::vector<std::chrono::milliseconds> timeouts;
+  for (auto &call : calls) {
+    auto state = std::make_shared<ToolCallState>();
+    results.push_back(state->result.get_future());
+    states.push_back(state);
+    timeouts.push_back(std::chrono::milliseconds(0));
+    auto it = tools_.find(call.name);
+    if (it == tools_.end()) {
+      state->result.set_value("error: unknown tool '" + call.name + "'");
+      continue;
+    }
+    int hung;
+    {
+      std::lock_guard<std::mutex> lock(workers->mutex);
+      hung = workers->hung;
+    }
+    if (hung >= workers->max) {
+      state->result.set_value("error: tool '" + call.name + "' not run, " +
+                              std::to_string(hung) + " tool calls are hung");
+      continue;
+    }
+    os_ << COL::WRN << "Calling tool: " << call.name << "("
+        << boost::json::serialize(call.arguments) << ")" << COL::DEF << endl;
+    // the task owns copies of the function and arguments
+    workers->Submit(workers, [workers, state, fn = it->second.fn,
+                              args = call.arguments] {
+      {
+        std::lock_guard<std::mutex> lock(workers->mutex);
+        if (state->abandoned) {
+          return;
+        }
+        state->running = true;
+      }
+      try {
+        state->result.set_value(fn(args));
+      } catch (...) {
+        state->result.set_exception(std::current_exception());
       }
-    } else {
-      throw std::runtime_error("No Content-Length header found in response");
+      std::lock_guard<std::mutex> lock(workers->mutex);
+      if (state->abandoned) {
+        --workers->hung;
+      }
+    });
+    timeouts.back() = it->second.timeout;
+  }
+
+  std::vector<std::string> out;
+  out.reserve(results.size());
+  for (size_t i = 0; i < results.size(); ++i) {
+    if (results[i].wait_until(start + timeouts[i]) !=
+        std::future_status::ready) {
+      std::lock_guard<std::mutex> lock(workers->mutex);
+      if (results[i].wait_for(std::chrono::seconds(0)) !=
+          std::future_status::ready) {
+        states[i]->abandoned = true;
+        if (states[i]->running) {
+          ++workers->hung;
+        }
+        out.push_back("error: tool '" + calls[i].name + "' timed out");
+        continue;
+      }
+    }
+    try {
+      out.push_back(results[i].get());
+    } catch (const std::exception &e) {
+      out.push_back("error: " + std::string(e.what()));
     }
   }
+  return out;
+}
 
-  std::string resp_body;
-  if (chunked) {
-    os_ << COL::AI << "AI: ";
-    ;
-    // Handle a chunked response:
-    // payload of a chunked response starts with the length of the chunk in
-    // hexadecimal followed by a \r\n then the actual data of the chunk. then
-    // a \r\n indicating end of that chunk.  The final chunk specifies a chunk
-    // length of 0;
-    while (true) {
-      // Read the chunk length followed by "\r\n"
-      ReadUntilDelimeter(socket, resp_buff, "\r\n");
-      std::string csize_str;
-      std::getline(resp_strm, csize_str);
+// Connect to the Ollama server, send the request and read the response
+// header.  Requests are retried while the server reports that it is busy.
+HttpRespHeader OllamaChat::PostRequest(Transport &conn,
+                                       boost::asio::streambuf &resp_buff,
+                                       const std::string &post_req) {
+  for (int attempt = 0;; ++attempt) {
+    // create a connection to the Ollama host and send the request
+    conn.Connect(opt_.server, opt_.port);
+    conn.Write(post_req);
+
+    // read and parse the response header from the server
+    resp_buff.consume(resp_buff.size());
+    resp_buff.prepare(1 << 14); // Prepare buffer to hold up to 16KB of data
+    HttpRespHeader hdr = ReadRespHeader(conn, resp_buff);
+    if (hdr.status == 200) {
       if (opt_.debug) {
-        os_ << COL::WRN << "Chunk size: " << csize_str << COL::DEF << endl;
+        if (hdr.chunked) {
+          os_ << COL::WRN << "Chunked encoding detected" << COL::DEF << endl;
+        } else if (hdr.content_length >= 0) {
+          os_ << COL::WRN << "Content-Length header found: "
+              << hdr.content_length << COL::DEF << endl;
+        }
+      }
+      return hdr;
+    }
+
+    // the body of an error response holds the reason for the error
+    std::string err_body = ReadRespBody(conn, resp_buff, hdr);
+    std::string err_msg = err_body;
+    boost::system::error_code ec;
+    boost::json::value err_json = boost::json::parse(err_body, ec);
+    if (!ec && err_json.is_object()) {
+      if (auto *e = err_json.as_object().if_contains("error");
+          e != nullptr && e->is_string()) {
+        err_msg = e->as_string().c_str();
       }
-      size_t cs = std::stoul(csize_str, nullptr, 16);
+    }
+    HttpError err(hdr.status,
+                  "Server returned HTTP " + std::to_string(hdr.status) +
+                      (err_msg.empty() ? "" : ": " + err_msg),
+                  hdr.retry_after);
+    if (!err.busy() || attempt >= opt_.max_retries) {
+      throw err;
+    }
 
-      if (cs == 0) {
+    // the server is busy, wait as requested (or back off) and retry
+    int wait = hdr.retry_after >= 0 ? hdr.retry_after : (1 << attempt);
+    wait = std::min(wait, OLLAMA_MAX_RETRY_WAIT);
+    if (opt_.debug) {
+      os_ << COL::WRN << err.what() << ", retrying in " << wait << "s"
+          << COL::DEF << endl;
+    }
+    conn.Close();
+    std::this_thread::sleep_for(std::chrono::seconds(wait));
+  }
+}
+
+// Send the request and display the response as it arrives.  When a validator
+// is given the response is checked against it as it streams in, and the
+// request is abandoned (closing the connection stops the generation) at the
+// first violation.
+//
+// If the connection is lost while the response is streaming, the request is
+// sent again (after a backoff) with the partial answer as the last message,
+// so the model continues the answer where it stopped instead of generating it
+// again.  The caller sees a single uninterrupted response.
+ChatResponse OllamaChat::StreamResponse(
+    const std::string &post_req, JsonStreamValidator *validator,
+    const std::function<std::string(const std::string &)> &resume) {
+  ChatResponse resp;
+  std::string &output = resp.content;
+  if (validator != nullptr) {
+    validator->Reset();
+  }
+  std::unique_ptr<Transport> conn = NewTransport();
+  boost::asio::streambuf resp_buff;
+
+  auto validate = [&](const std::string &msg) {
+    if (validator == nullptr) {
+      return;
+    }
+    if (!validator->Feed(msg)) {
+      os_ << COL::DEF << endl;
+      conn->Close();
+      throw SchemaViolation("Response violates the requested format, " +
+                            validator->error());
+    }
+    if (structured_handler_) {
+      structured_handler_(validator->Partial());
+    }
+  };
+
+  std::string req = post_req;
+  bool started = false;        // the "AI: " prefix has been displayed
+  size_t progress = 0;         // output size at the last disconnect
+  for (int attempt = 0;; ++attempt) {
+    try {
+      HttpRespHeader hdr = PostRequest(*conn, resp_buff, req);
+      if (hdr.chunked) {
+        if (!started) {
+          os_ << COL::AI << "AI: ";
+          started = true;
+        }
+        std::string chunk;
+        while (ReadChunk(*conn, resp_buff, chunk)) {
+          std::string msg =
+              GetMsgContentFromJson(chunk, &resp.tool_calls, &resp.stats);
+          output += msg;
+          os_ << COL::AI << msg;
+          os_.flush();
+          if (token_handler_ && !msg.empty()) {
+            token_handler_(msg);
+          }
+          validate(msg);
+        }
         os_ << endl;
-        break; // End of chunked responses (this is the last chunk)
+      } else {
+        std::string resp_body = ReadRespBody(*conn, resp_buff, hdr);
+        os_ << COL::AI << "AI: " << resp_body << COL::DEF << endl;
+        // Parse the returned JSON data for the message content.
+        if (!resp_body.empty()) {
+          output += GetMsgContentFromJson(resp_body, &resp.tool_calls,
+                                          &resp.stats);
+          if (token_handler_ && !output.empty()) {
+            token_handler_(output);
+          }
+          validate(output);
+        }
       }
+      break;
+    } catch (const boost::system::system_error &e) {
+      if (!IsDisconnect(e.code()) || !resume) {
+        throw;
+      }
+      if (output.size() > progress) {
+        attempt = 0; // the stream made progress since the last disconnect
+        progress = output.size();
+      }
+      if (attempt >= opt_.reconnect_attempts) {
+        throw;
+      }
+      // reconnect with exponential backoff and continue the answer
+      int delay = std::min(opt_.reconnect_backoff_ms << attempt,
+                           OLLAMA_MAX_RECONNECT_BACKOFF_MS);
+      if (opt_.debug) {
+        os_ << COL::WRN << "\nConnection lost (" << e.code().message()
+            << "), reconnecting in " << delay << "ms" << COL::DEF << endl;
+      }
+      conn->Close();
+      std::this_thread::sleep_for(std::chrono::milliseconds(delay));
+      req = resume(output);
+    }
+  }
+
+  // a response with tool calls is not the final answer
+  if (validator != nullptr && resp.tool_calls.empty() &&
+      !validator->Finish()) {
+    throw SchemaViolation("Response violates the requested format, " +
+                          validator->error());
+  }
+  return resp;
+}
+
+// Send a request to an Ollama server and display its response.
+void OllamaChat::SendRequestToAi(const string &req) {
+  // the prompt was submitted before the prefill finished
+  CancelPrefill();
+  boost::json::string prompt(req.c_str(), req.size());
+
+  // structured output is validated on the client as it streams in
+  std::unique_ptr<JsonStreamValidator> validator;
+  if (!opt_.format.empty()) {
+    validator = std::make_unique<JsonStreamValidator>(
+        opt_.format == "json" ? boost::json::value()
+                              : boost::json::parse(opt_.format));
+  }
+
+  // format the post request for the ollama server
+  std::string user_msgs = PromptMessages(req); // context and prompt
+  std::string msgs = user_msgs; // messages after the history
+  std::string post_req = FormatChatRequest(history_, msgs);
+  std::string tool_msgs; // tool calls and results of this prompt
+  ChatResponse resp;
+
+  // after a disconnect the partial answer is sent as an assistant message,
+  // which the model continues
+  auto resume = [this, &msgs, &post_req](const std::string &partial) {
+    if (partial.empty()) {
+      return post_req;
+    }
+    return FormatChatRequest(history_,
+                             msgs + ",\n" + ChatMsg("assistant", partial));
+  };
 
-      // Read the chunk data accounting for any previous residual already in
-      // the resp_buff.
-      size_t residual = resp_buff.size();
-      if (residual < cs) {
-        size_t cs_remaining = cs - residual;
-        boost::asio::read(socket, resp_buff,
-                          boost::asio::transfer_exactly(cs_remaining));
+  for (int round = 0;; ++round) {
+    if (opt_.debug) {
+      os_ << COL::WRN << "POST Request: " << COL::DEF << post_req << endl;
+      os_ << post_req << endl;
+    }
+    for (int attempt = 0;; ++attempt) {
+      try {
+        // the permit is held while the response streams in, not while the
+        // tools run
+        auto permit = AdmitRequest(opt_.model);
+        resp = StreamResponse(post_req, validator.get(), resume);
+        last_stats_ = resp.stats;
+        break;
+      } catch (const SchemaViolation &e) {
+        if (attempt >= opt_.format_retries) {
+          throw;
+        }
+        os_ << COL::WRN << e.what() << ", retrying" << COL::DEF << endl;
       }
+    }
+    if (resp.tool_calls.empty() || tools_.empty() ||
+        round >= opt_.max_tool_rounds) {
+      break;
+    }
 
-      std::string chunk(
-          boost::asio::buffer_cast<const char *>(resp_buff.data()), cs);
-      resp_buff.consume(chunk.size());
-      resp_body += chunk;
-      std::string msg = GetMsgContentFromJson(chunk);
-      output << msg;
-      os_ << COL::AI << msg;
-      os_.flush();
-
-      // the trailing "\r\n" marks end of each chunk
-      ReadUntilDelimeter(socket, resp_buff, "\r\n");
-      std::string chunk_delim_buff(
-          boost::asio::buffer_cast<const char *>(resp_buff.data()),
-          resp_buff.size());
-      size_t chunk_delim_pos = chunk_delim_buff.find("\r\n");
-      resp_buff.consume(chunk_delim_pos + 2);
+    // run the requested tools and send the results back to the model
+    std::vector<std::string> results = RunToolCalls(resp.tool_calls);
+    boost::json::object call_msg;
+    call_msg["role"] = "assistant";
+    call_msg["content"] = resp.content;
+    boost::json::array calls;
+    for (auto &call : resp.tool_calls) {
+      boost::json::object fn;
+      fn["name"] = call.name;
+      fn["arguments"] = call.arguments;
+      boost::json::object c;
+      c["function"] = std::move(fn);
+      calls.push_back(std::move(c));
     }
-  } else if (content_length > 0) {
-    // Handle a response with a Content-Length header
-    size_t residual = resp_buff.size();
-    if (residual > 0) {
-      resp_body = std::string(boost::asio::buffers_begin(resp_buff.data()),
-                              boost::asio::buffers_end(resp_buff.data()));
-      resp_buff.consume(resp_body.length());
+    call_msg["tool_calls"] = std::move(calls);
+    tool_msgs += " " + boost::json::serialize(call_msg) + ",\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+      boost::json::object result_msg;
+      result_msg["role"] = "tool";
+      result_msg["content"] = results[i];
+      result_msg["tool_name"] = resp.tool_calls[i].name;
+      tool_msgs += " " + boost::json::serialize(result_msg) + ",\n";
+    }
+    msgs = user_msgs + ",\n" +
+           tool_msgs.substr(0, tool_msgs.size() - 2); // drop the last ",\n"
+    post_req = FormatChatRequest(history_, msgs);
+  }
+
+  // save history (to maintain the chat context), the encoded images are
+  // kept so that later requests resend them without encoding them again
+  boost::json::string lastResponse(resp.content.c_str(), resp.content.size());
+  std::stringstream newHist;
+  newHist << " { \"role\": \"user\", " << "  \"content\": " << prompt;
+  std::stringstream rest;
+  rest << " }," << endl;
+  rest << tool_msgs;
+  rest << " { \"role\": \"assistant\", "
+       << "  \"content\": " << lastResponse << " }," << endl;
+  std::string entry = newHist.str();
+  std::string entry_end = rest.str();
+  if (!images_.empty()) {
+    entry.reserve(entry.size() + ImagesSize(images_) + entry_end.size());
+    AppendImages(entry, images_);
+    images_.clear();
+  }
+  entry += entry_end;
+  history_.push_back(std::move(entry));
+  if (opt_.prefill) {
+    StartPrefill();
+  }
+}
+
+void OllamaChat::ResetContext() {
+  CancelPrefill();
+  history_.clear();
+  images_.clear();
+  branches_.clear();
+}
+
+// The request is formatted here, the thread only sends it.  The prompt is
+// evaluated once the response starts (a non streamed response is sent when
+// the token is generated), so the connection is closed after the header.
+void OllamaChat::StartPrefill() {
+  CancelPrefill();
+  if (history_.empty()) {
+    return;
+  }
+  std::string req = FormatChatRequest(history_, "", true);
+  std::shared_ptr<Transport> conn = NewTransport();
+  prefill_cancelled_ = false;
+  prefill_scheduler_ = scheduler_;
+  RequestClass rc = SchedulerClass(opt_.model);
+  rc.priority = Priority::kBatch;
+  rc.cancelled = &prefill_cancelled_;
+  prefill_thread_ = std::thread([this, conn, req = std::move(req), rc,
+                                 server = opt_.server, port = opt_.port] {
+    try {
+      RequestScheduler::Permit permit;
+      if (prefill_scheduler_) {
+        permit = prefill_scheduler_->Acquire(rc);
+      }
+      {
+        // connecting under the lock keeps a cancel from racing the connect
+        std::lock_guard<std::mutex> lock(prefill_mutex_);
+        if (prefill_cancelled_) {
+          return;
+        }
+        conn->Connect(server, port);
+        prefill_conn_ = conn.get();
+      }
+      conn->Write(req);
+      boost::asio::streambuf buf;
+      conn->ReadUntil(buf, "\r\n\r\n");
+    } catch (const std::exception &) {
+      // the prefill is only an optimization, a failure (or the cancel) leaves
+      // the next request to evaluate the history
     }
-    if ((content_length -= residual) > 0) {
+    std::lock_guard<std::mutex> lock(prefill_mutex_);
+    prefill_conn_ = nullptr;
+    conn->Close();
+  });
+}
 
-      boost::asio::read(socket, resp_buff,
-                        boost::asio::transfer_exactly(content_length));
+// Interrupt() ends the wait for the scheduler, Cancel() the blocking write or
+// read of the prefill thread.  The thread closes the transport under the
+// lock, so it is open while Cancel() runs.
+void OllamaChat::CancelPrefill() {
+  if (!prefill_thread_.joinable()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(prefill_mutex_);
+    prefill_cancelled_ = true;
+    if (prefill_conn_ != nullptr) {
+      prefill_conn_->Cancel();
     }
+  }
+  if (prefill_scheduler_) {
+    prefill_scheduler_->Interrupt();
+  }
+  prefill_thread_.join();
+  prefill_scheduler_.reset();
+}
 
-    resp_body += std::string(boost::asio::buffers_begin(resp_buff.data()),
-                             boost::asio::buffers_end(resp_buff.data()));
+void OllamaChat::WaitForPrefill() {
+  if (prefill_thread_.joinable()) {
+    prefill_thread_.join();
+  }
+}
+
+// Encoded images come from the cache when the file did not change.
+std::size_t OllamaChat::AttachImage(const std::string &path) {
+  images_.push_back(image_cache_.Encode(path));
+  return images_.back()->size();
+}
 
-    os_ << COL::AI << "AI: " << resp_body << COL::DEF << endl;
-    // Parse the returned JSON data for the message content.
-    output << GetMsgContentFromJson(resp_body);
+// Requests are scheduled by server and model, on behalf of the tenant of this
+// client.
+RequestScheduler::Permit OllamaChat::AdmitRequest(const std::string &model) {
+  if (!scheduler_) {
+    return {};
   }
+  return scheduler_->Acquire(SchedulerClass(model));
+}
 
-  // save history (to maintain the chat context)
-  std::string ret = output.str();
-  boost::json::string lastResponse(ret.c_str(), ret.size());
-  std::stringstream newHist;
-  newHist << " { \"role\": \"user\", " << "  \"content\": " << prompt << " },"
-          << endl;
-  newHist << " { \"role\": \"assistant\", "
-          << "  \"content\": " << lastResponse << " }," << endl;
-  history_.push_back(newHist.str());
+RequestClass OllamaChat::SchedulerClass(const std::string &model) const {
+  RequestClass rc;
+  rc.backend = opt_.server + ":" + std::to_string(opt_.port);
+  rc.model = model;
+  rc.tenant = sched_tenant_;
+  rc.priority = sched_priority_;
+  return rc;
 }
 
-void OllamaChat::ResetContext() { history_.clear(); }
+std::unique_ptr<Transport> OllamaChat::NewTransport() {
+  if (transport_factory_) {
+    return transport_factory_();
+  }
+  return MakeTransport(opt_.server, opt_.transport);
+}
+
+// Embed all the inputs with a single request to the embed endpoint.  Each
+// call uses its own connection, so concurrent calls are independent requests
+// that the server can process in parallel.
+std::vector<std::vector<float>>
+OllamaChat::Embed(const std::vector<std::string> &inputs) {
+  if (inputs.empty()) {
+    return {};
+  }
+  auto permit = AdmitRequest(opt_.embed_model);
+  std::unique_ptr<Transport> conn = NewTransport();
+  boost::asio::streambuf resp_buff;
+  HttpRespHeader hdr =
+      PostRequest(*conn, resp_buff, FormatEmbedRequest(inputs));
+  auto vecs = GetEmbeddingsFromJson(ReadRespBody(*conn, resp_buff, hdr));
+  if (vecs.size() != inputs.size()) {
+    throw std::runtime_error("Expected " + std::to_string(inputs.size()) +
+                             " embeddings, received " +
+                             std::to_string(vecs.size()));
+  }
+  return vecs;
+}
+
+// Parse the embedding vectors from the JSON response of the embed endpoint.
+std::vector<std::vector<float>>
+OllamaChat::GetEmbeddingsFromJson(const std::string &json_str) {
+  boost::system::error_code ec;
+  boost::json::value json = boost::json::parse(json_str, ec);
+  const boost::json::value *embeddings = nullptr;
+  if (!ec && json.is_object()) {
+    embeddings = json.as_object().if_contains("embeddings");
+  }
+  if (embeddings == nullptr || !embeddings->is_array()) {
+    throw std::runtime_error("Invalid embed response: " + json_str.substr(0, 80));
+  }
+  std::vector<std::vector<float>> vecs;
+  vecs.reserve(embeddings->as_array().size());
+  for (auto &e : embeddings->as_array()) {
+    std::vector<float> &v = vecs.emplace_back();
+    v.reserve(e.as_array().size());
+    for (auto &x : e.as_array()) {
+      v.push_back(x.to_number<float>());
+    }
+  }
+  return vecs;
+}
 
 } // namespace ochat
\ No newline at end of file
@@ -2,10 +2,23 @@
 #define __OCHAT_H__
 
 #include "app_config.h"
+#include "http_resp.h"
+#include "image.h"
+#include "json_stream_validator.h"
+#include "profiles.h"
+#include "scheduler.h"
+#include "transport.h"
+#include <atomic>
 #include <boost/asio.hpp>
+#include <chrono>
+#include <functional>
 #include <iostream>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <vector>
 
 // forward declare test fixture class (needed for friend declaration)
@@ -16,18 +29,104 @@ class OllamaChatTest_F;
 namespace ochat {
 
 struct Options {
-  std::string server;
+  std::string server; // host name or address, or unix://<socket path>
   int port;
   std::string endpoint;
   std::string model;
   bool stream_resp;
   bool debug;
+  int max_retries; // retries when the server is busy (HTTP 429 / 503)
+  std::string format; // structured output: "json" or a JSON schema
+  int format_retries; // retries when the response violates the format
+  int tool_threads;    // max threads that run tool calls, see RegisterTool()
+  int max_tool_rounds; // max follow up requests with tool results per prompt
+  int reconnect_attempts;   // reconnects when a response is interrupted
+  int reconnect_backoff_ms; // delay before the first reconnect (doubles)
+  std::string embed_model;  // model used by Embed()
+  std::string vector_store; // path of the vector store for retrieval
+  int rag_top_k;            // retrieved chunks added to each prompt
+  bool prefill;             // send the history while idle, see StartPrefill()
+  std::string keep_alive;   // how long the server keeps the model loaded
+  ModelProfiles profiles;             // the "options" of each model
+  boost::json::object model_options; // replace those of the profile
+  TransportOptions transport;         // socket options of the connections
 
   // default constructor
   Options()
       : server(OLLAMA_SERVER_ADDR), port(OLLAMA_SERVER_PORT),
         endpoint(OLLAMA_ENDPOINT), model(OLLAMA_MODEL),
-        stream_resp(OLLAMA_STREAM_RESP), debug(ENABLE_DEBUG_LOG) {}
+        stream_resp(OLLAMA_STREAM_RESP), debug(ENABLE_DEBUG_LOG),
+        max_retries(OLLAMA_MAX_RETRIES), format_retries(0),
+        tool_threads(OLLAMA_TOOL_THREADS),
+        max_tool_rounds(OLLAMA_MAX_TOOL_ROUNDS),
+        reconnect_attempts(OLLAMA_RECONNECT_ATTEMPTS),
+        reconnect_backoff_ms(OLLAMA_RECONNECT_BACKOFF_MS),
+        embed_model(OLLAMA_EMBED_MODEL), vector_store(OLLAMA_VECTOR_STORE),
+        rag_top_k(OLLAMA_RAG_TOP_K), prefill(OLLAMA_PREFILL),
+        keep_alive(OLLAMA_KEEP_ALIVE) {}
+};
+
+// The threads that run the tool calls, see RunToolCalls().
+struct ToolWorkers;
+
+// A tool (function) that the model can call.
+struct Tool {
+  std::string name;
+  std::string description;
+  std::string parameters; // JSON schema of the arguments object
+  // the implementation, returns the result that is sent back to the model
+  std::function<std::string(const boost::json::object &args)> fn;
+  // max time to wait for the result, measured from when the calls of a
+  // response are dispatched.  A call that times out is abandoned, not
+  // stopped: it finishes in the background, holding its thread, and its
+  // result is dropped.
+  std::chrono::milliseconds timeout{OLLAMA_TOOL_TIMEOUT_MS};
+};
+
+// A call to a tool requested by the model.
+struct ToolCall {
+  std::string name;
+  boost::json::object arguments;
+};
+
+// Counts and timings reported by the server with the last message of a
+// response (durations are in nanoseconds).
+struct ResponseStats {
+  bool done = false; // the last message was received
+  std::int64_t prompt_eval_count = 0;
+  std::int64_t eval_count = 0;
+  std::int64_t total_duration = 0;
+  std::int64_t load_duration = 0;
+  std::int64_t prompt_eval_duration = 0;
+  std::int64_t eval_duration = 0;
+};
+
+// The message returned by the model for a request.
+struct ChatResponse {
+  std::string content;
+  std::vector<ToolCall> tool_calls;
+  ResponseStats stats;
+};
+
+// A model to compare, on Options::server unless a server is given.
+struct CompareTarget {
+  std::string model;
+  std::string server; // empty for Options::server
+  int port = 0;       // 0 for Options::port
+
+  // the label of the answer of the target in a comparison
+  std::string label() const;
+};
+
+// The answer of one model to a compared prompt, or to a forked prompt.
+struct CompareResult {
+  std::string label; // the name of the answer stream and of the branch
+  CompareTarget target;
+  std::string content;
+  ResponseStats stats; // the server timings
+  double ttft_ms = 0;  // measured on the client, from the request
+  double wall_ms = 0;  // measured on the client, the whole request
+  std::string error;   // why the request failed, empty on success
 };
 
 // Get reference to the options object for the library.
@@ -35,11 +134,13 @@ class OllamaChat {
 public:
   OllamaChat(const Options opt = Options(), std::ostream &os = std::cout)
       : os_(os), opt_(opt) {}
-  ~OllamaChat() {}
+  ~OllamaChat();
 
   /**
    * Sends an HTTP POST request to the Ollama AI model with the given
-   * parameters and updates the conversation history.
+   * parameters and updates the conversation history.  A prefill in progress
+   * is cancelled first, and with Options::prefill a new one is started once
+   * the response is complete.
    *
    * @param req The formatted HTTP POST request as a string.
    * @param history A vector containing the conversation history, which will
@@ -48,10 +149,191 @@ public:
   void SendRequestToAi(const std::string &req);
 
   /**
-   * Resets the conversation context.
+   * Resets the conversation context, and drops the attached images and the
+   * history branches.
    */
   void ResetContext();
 
+  /**
+   * Sends the history and the prompt to several models at once, each on its
+   * own connection (and possibly its own server).  The answers are streamed
+   * as they arrive, each line labelled with CompareTarget::label().  Each
+   * answer is kept in a history branch named by the label, see
+   * SwitchBranch(), the current history is not changed.  The attached images
+   * are sent to all the models.
+   *
+   * @param targets The models to compare.
+   * @param prompt The user's input.
+   * @return The result of each target, in the order of the targets.  The
+   * requests that failed have an error, they do not throw.
+   */
+  std::vector<CompareResult> Compare(const std::vector<CompareTarget> &targets,
+                                     const std::string &prompt);
+
+  /**
+   * Sends independent prompts at once to the model, each on a fork of the
+   * conversation (the history and the attached images), so that they do not
+   * wait for each other.  The answers are streamed like those of Compare(),
+   * labelled "#<n>" by the position of the prompt, and are kept in history
+   * branches of the same name.  The current history is not changed.
+   *
+   * @param prompts The prompts.
+   * @return The result of each prompt, in the order of the prompts.
+   */
+  std::vector<CompareResult> Fork(const std::vector<std::string> &prompts);
+
+  /**
+   * Continues the conversation of a history branch: the history, model and
+   * server are those of the branch.
+   *
+   * @param label The label of the branch.
+   * @throw std::out_of_range if there is no such branch.
+   */
+  void SwitchBranch(const std::string &label);
+
+  /**
+   * Returns the labels of the history branches.
+   */
+  std::vector<std::string> branches() const;
+
+  /**
+   * Sends the history in the background so that the server evaluates it into
+   * its prompt (KV) cache while the user types the next prompt, which then
+   * only needs the new message evaluated.  The request generates a single
+   * token, which is discarded, and asks the server to keep the model loaded
+   * (Options::keep_alive, or OLLAMA_PREFILL_KEEP_ALIVE).  With a scheduler
+   * the request is admitted as a batch request, and leaves the queue when it
+   * is cancelled.  A prefill in progress is cancelled first, errors are
+   * ignored.
+   */
+  void StartPrefill();
+
+  /**
+   * Cancels a prefill in progress by closing its connection, which stops the
+   * server evaluating it, and waits for it.
+   */
+  void CancelPrefill();
+
+  /**
+   * Waits for a prefill in progress to finish.
+   */
+  void WaitForPrefill();
+
+  /**
+   * Attaches an image to the next prompt, for vision models.  The file is
+   * memory mapped and base64 encoded now.  The encoded images are cached, so
+   * attaching an unchanged file again does not encode it again, and the
+   * history keeps the encoded images of earlier prompts.
+   *
+   * @param path The image file (png, jpeg, gif, webp or bmp).
+   * @return The size of the encoded image.
+   * @throw std::runtime_error if the file cannot be read or is not an image.
+   */
+  std::size_t AttachImage(const std::string &path);
+
+  // the number of images attached to the next prompt
+  std::size_t attached_images() const { return images_.size(); }
+
+  /**
+   * Sets a handler that is called with the partially parsed response each
+   * time more of a structured (Options::format) response arrives.
+   *
+   * @param handler The handler, receives the document parsed so far.
+   */
+  void SetStructuredOutputHandler(
+      std::function<void(const boost::json::value &)> handler) {
+    structured_handler_ = std::move(handler);
+  }
+
+  /**
+   * Sets a handler that is called with each piece of the response content as
+   * it arrives (one token at a time when streaming).
+   *
+   * @param handler The handler, or an empty function to remove it.
+   */
+  void SetTokenHandler(std::function<void(std::string_view)> handler) {
+    token_handler_ = std::move(handler);
+  }
+
+  /**
+   * Returns the server statistics of the last response.
+   */
+  const ResponseStats &last_stats() const { return last_stats_; }
+
+  /**
+   * Returns the options, changes apply to the following requests.
+   */
+  Options &options() { return opt_; }
+
+  /**
+   * Sets a provider of context for each prompt (e.g. passages retrieved from
+   * local files).  The context is sent as a system message before the prompt,
+   * it is not kept in the chat history.
+   *
+   * @param provider Returns the context for a prompt (empty for none), or
+   * an empty function to stop adding context.
+   */
+  void SetContextProvider(
+      std::function<std::string(const std::string &prompt)> provider) {
+    context_provider_ = std::move(provider);
+  }
+
+  /**
+   * Sends the requests through a scheduler, which delays them while the
+   * server or model is at its concurrency limit and may shed them.  The
+   * scheduler is meant to be shared by the clients of several users or
+   * sessions.
+   *
+   * @param scheduler The scheduler, or nullptr to send requests directly.
+   * @param tenant The user or session the requests are made for.
+   * @param priority The priority class of the requests.
+   * @note Requests that are shed throw RequestRejected.
+   */
+  void SetScheduler(std::shared_ptr<RequestScheduler> scheduler,
+                    std::string tenant = "",
+                    Priority priority = Priority::kInteractive) {
+    scheduler_ = std::move(scheduler);
+    sched_tenant_ = std::move(tenant);
+    sched_priority_ = priority;
+  }
+
+  /**
+   * Sets how the connections to the server are made, e.g. to record the
+   * traffic or to replay a recording instead of connecting to a server.
+   *
+   * @param factory Creates the transport of each connection, or an empty
+   * function for connections to Options::server (see MakeTransport()).
+   */
+  void SetTransportFactory(TransportFactory factory) {
+    transport_factory_ = std::move(factory);
+  }
+
+  /**
+   * Registers a tool that the model can call.  When the model responds with
+   * tool calls, the tools are run concurrently on up to Options::tool_threads
+   * threads, and their results are sent back to the model in a follow up
+   * request.  A call that exceeds Tool::timeout is abandoned: the client does
+   * not wait for it, but a hung tool is never stopped and keeps its thread
+   * until it returns.  While all the threads are held by abandoned calls,
+   * new calls are refused with an error result.
+   *
+   * @param tool The tool, replaces a registered tool with the same name.
+   * @throw std::invalid_argument if the parameters are not a JSON object.
+   */
+  void RegisterTool(Tool tool);
+
+  /**
+   * Computes the embeddings of the inputs with Options::embed_model, all
+   * inputs are sent in a single request.  This does not use or change the
+   * chat state, so it can be called concurrently from several threads to
+   * keep more than one request in flight.
+   *
+   * @param inputs The texts to embed.
+   * @return One embedding vector per input, in the order of the inputs.
+   * @throw HttpError if the server responds with an error.
+   */
+  std::vector<std::vector<float>> Embed(const std::vector<std::string> &inputs);
+
 protected:
   /**
    * Formats a POST request with the given prompt, stream response flag, and
@@ -65,32 +347,194 @@ protected:
                                 std::vector<std::string> &history);
 
   /**
-   * Parses the HTTP response header from the given input stream.
+   * Formats the messages for a prompt, the context from the context provider
+   * (if any) followed by the user message with the attached images.
+   *
+   * @param prompt The user's input.
+   * @return The messages (comma separated).
+   */
+  std::string PromptMessages(const std::string &prompt);
+
+  /**
+   * Formats a POST request for the chat endpoint.
+   *
+   * @param history A vector containing the conversation history.
+   * @param messages The messages that follow the history (comma separated),
+   * empty for a prefill.
+   * @param prefill Formats a prefill request (see StartPrefill()), which is
+   * not streamed and generates a single token.
+   * @return The formatted POST request as a string.
+   */
+  std::string FormatChatRequest(const std::vector<std::string> &history,
+                                const std::string &messages,
+                                bool prefill = false);
+
+  /**
+   * Formats a POST request for the embed endpoint.
+   *
+   * @param inputs The texts to embed.
+   * @return The formatted POST request as a string.
+   */
+  std::string FormatEmbedRequest(const std::vector<std::string> &inputs);
+
+  /**
+   * Wraps a JSON body in a POST request for the given endpoint.
+   *
+   * @param endpoint The endpoint path on the server.
+   * @param json_data The request body.
+   * @return The formatted POST request as a string.
+   */
+  std::string FormatHttpPost(const std::string &endpoint,
+                             const std::string &json_data);
+
+  /**
+   * Formats the header of a POST request with a JSON body.
+   *
+   * @param endpoint The endpoint path on the server.
+   * @param content_length The size of the body.
+   * @return The header, including the blank line that ends it.
+   */
+  std::string FormatHttpHeader(const std::string &endpoint,
+                               std::size_t content_length);
+
+  /**
+   * Extracts the embedding vectors from an embed response.
+   *
+   * @param json_str The JSON response body.
+   * @return The embedding vectors.
+   */
+  std::vector<std::vector<float>> GetEmbeddingsFromJson(
+      const std::string &json_str);
+
+  /**
+   * Runs the tool calls concurrently and waits for their results.
+   *
+   * @param calls The tool calls requested by the model.
+   * @return The result of each call, or an error message for calls that
+   * failed, timed out or named an unknown tool.
+   */
+  std::vector<std::string> RunToolCalls(const std::vector<ToolCall> &calls);
+
+  /**
+   * Connects to the server, sends the request and reads the response header,
+   * retrying while the server is busy.
+   *
+   * @param conn The connection to the server.
+   * @param resp_buff A streambuf to store the read data.
+   * @param post_req The formatted HTTP POST request.
+   * @return The parsed header of a successful (200) response.
+   * @throw HttpError if the server responds with an error.
+   */
+  HttpRespHeader PostRequest(Transport &conn,
+                             boost::asio::streambuf &resp_buff,
+                             const std::string &post_req);
+
+  /**
+   * Sends the request and displays the response as it arrives.
+   *
+   * @param post_req The formatted HTTP POST request.
+   * @param validator If not null, the response is validated as it arrives.
+   * @param resume If set, called with the partial answer after the connection
+   * is lost, returns the request that continues the answer.
+   * @return The response message.
+   * @throw SchemaViolation at the first violation of the validator's schema.
+   */
+  ChatResponse StreamResponse(
+      const std::string &post_req, JsonStreamValidator *validator,
+      const std::function<std::string(const std::string &)> &resume = {});
+
+  /**
+   * Reads and parses the HTTP response header from the connection.  The header
+   * bytes are consumed from resp_buff, any body bytes read along with the
+   * header are left in resp_buff.
+   *
+   * @param conn The connection to read from.
+   * @param resp_buff A streambuf to store the read data.
+   * @return The parsed header.  Only the scalar members are valid once this
+   * returns (the field views refer to consumed buffer space).
+   */
+  HttpRespHeader ReadRespHeader(Transport &conn,
+                                boost::asio::streambuf &resp_buff);
+
+  /**
+   * Reads the next chunk of a chunked response body.
+   *
+   * @param conn The connection to read from.
+   * @param resp_buff A streambuf holding any data already read.
+   * @param chunk Receives the chunk data.
+   * @return false if this was the terminating (zero length) chunk.
+   */
+  bool ReadChunk(Transport &conn, boost::asio::streambuf &resp_buff,
+                 std::string &chunk);
+
+  /**
+   * Reads a complete (non streamed) response body as described by the
+   * response header.
    *
-   * @param responseStream The input stream containing the HTTP response.
-   * @return A map of key-value pairs representing the content of the response
-   * header.
+   * @param conn The connection to read from.
+   * @param resp_buff A streambuf holding any data already read.
+   * @param hdr The parsed response header.
+   * @return The response body.
    */
-  std::map<std::string, std::string>
-  ParseHttpRespHeader(std::istream &responseStream);
+  std::string ReadRespBody(Transport &conn, boost::asio::streambuf &resp_buff,
+                           const HttpRespHeader &hdr);
 
   /**
-   * Reads data from the socket until a specified delimiter is encountered.
+   * Reads data from the connection until a specified delimiter is
+   * encountered.
    *
-   * @param socket The TCP socket to read from.
+   * @param conn The connection to read from.
    * @param resp_buff A streambuf to store the read data.
    * @param delim The delimiter string to look for.
    */
-  void ReadUntilDelimeter(boost::asio::ip::tcp::socket &socket,
-                          boost::asio::streambuf &resp_buff, const char *delim);
+  void ReadUntilDelimeter(Transport &conn, boost::asio::streambuf &resp_buff,
+                          const char *delim);
 
   /**
    * Extracts the Ollama response message content from a JSON string.
    *
    * @param json_str The JSON string containing the message content.
+   * @param tool_calls If not null, any tool calls in the message are appended.
+   * @param stats If not null, receives the statistics of the last message.
    * @return A string representing the message content.
    */
-  std::string GetMsgContentFromJson(std::string json_str);
+  std::string GetMsgContentFromJson(std::string json_str,
+                                    std::vector<ToolCall> *tool_calls = nullptr,
+                                    ResponseStats *stats = nullptr);
+
+  /**
+   * Waits for the scheduler (if any) to admit a request to the model.
+   *
+   * @param model The model the request is sent to.
+   * @return The permit to keep while the request is in flight, empty without
+   * a scheduler.
+   * @throw RequestRejected if the request is shed.
+   */
+  RequestScheduler::Permit AdmitRequest(const std::string &model);
+
+  // the scheduler class of the requests of this client to the model
+  RequestClass SchedulerClass(const std::string &model) const;
+
+  // a request of Compare() or Fork()
+  struct ForkRequest {
+    CompareTarget target;
+    std::string prompt;
+    std::string label;
+  };
+
+  /**
+   * Sends the requests concurrently, each with its own client on a copy of
+   * the conversation, and keeps each answer in a history branch.
+   *
+   * @param requests The requests.
+   * @return The result of each request, in the order of the requests.
+   */
+  std::vector<CompareResult> RunForks(const std::vector<ForkRequest> &requests);
+
+  /**
+   * Creates the transport for a new connection to the server.
+   */
+  std::unique_ptr<Transport> NewTransport();
 
   OllamaChat(const OllamaChat &) = delete;
   OllamaChat(OllamaChat &&) = delete;
@@ -99,11 +543,59 @@ protected:
   std::ostream &os_;
   Options opt_;
   std::vector<std::string> history_; // chat history to preserve context
+  // a history branch created by Compare()
+  struct Branch {
+    CompareTarget target;
+    std::vector<std::string> history;
+  };
+  std::map<std::string, Branch> branches_; // by label
+  // base64 encoded images attached to the next prompt
+  std::vector<std::shared_ptr<const std::string>> images_;
+  ImageCache image_cache_;
+  std::function<void(const boost::json::value &)> structured_handler_;
+  std::function<std::string(const std::string &)> context_provider_;
+  std::function<void(std::string_view)> token_handler_;
+  ResponseStats last_stats_;
+  std::map<std::string, Tool> tools_;
+  std::string tools_json_; // tool definitions sent with each request
+  std::shared_ptr<ToolWorkers> tool_workers_; // created on the first call
+  std::shared_ptr<RequestScheduler> scheduler_;
+  std::string sched_tenant_;
+  Priority sched_priority_ = Priority::kInteractive;
+  TransportFactory transport_factory_; // TCP when empty
+  std::thread prefill_thread_; // the prefill in progress, see StartPrefill()
+  std::mutex prefill_mutex_;   // guards the members below
+  std::atomic<bool> prefill_cancelled_{false}; // also read by the scheduler
+  Transport *prefill_conn_ = nullptr; // the connected prefill transport
+  // the scheduler of the prefill in progress, if any, only changed while
+  // there is none
+  std::shared_ptr<RequestScheduler> prefill_scheduler_;
 
   // test fixture for unit testing
   friend class ::testing::OllamaChatTest_F;
 };
 
+/**
+ * Parses a comma separated list of models to compare, each optionally on
+ * its own server: "model[@server[:port]]", e.g.
+ * "llama3.2:1b,qwen3:4b@gpu2:11434,phi4@unix:///run/ollama.sock".
+ *
+ * @param spec The list.
+ * @return The targets.
+ * @throw std::invalid_argument if a model or port is missing or invalid.
+ */
+std::vector<CompareTarget> ParseCompareTargets(const std::string &spec);
+
+/**
+ * Prints a table of the comparison: time to first token, generation speed
+ * and total time from the server timings, and the client wall time.
+ *
+ * @param os The stream to print to.
+ * @param results The results of Compare().
+ */
+void PrintComparison(std::ostream &os,
+                     const std::vector<CompareResult> &results);
+
 } // namespace ochat
 
 #endif //__OCHAT_H__
\ No newline at end of file
@@ -0,0 +1,78 @@
+#include "profiles.h"
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+namespace ochat {
+
+ModelProfiles LoadProfiles(const std::string &path) {
+  std::ifstream in(path);
+  if (!in) {
+    return {};
+  }
+  std::stringstream text;
+  text << in.rdbuf();
+  boost::json::value doc;
+  try {
+    doc = boost::json::parse(text.str());
+  } catch (const std::exception &e) {
+    throw std::runtime_error("Invalid profiles " + path + ": " + e.what());
+  }
+  if (!doc.is_object()) {
+    throw std::runtime_error("Invalid profiles " + path +
+                             ": expected an object of models");
+  }
+  ModelProfiles profiles;
+  for (auto &kv : doc.as_object()) {
+    if (!kv.value().is_object()) {
+      throw std::runtime_error("Invalid profiles " + path +
+                               ": the options of " + std::string(kv.key()) +
+                               " are not an object");
+    }
+    profiles[std::string(kv.key())] = kv.value().as_object();
+  }
+  return profiles;
+}
+
+// one model per line, so that the file is easy to edit by hand
+void SaveProfiles(const std::string &path, const ModelProfiles &profiles) {
+  std::ofstream out(path + ".tmp", std::ios::trunc);
+  out << "{";
+  const char *sep = "\n";
+  for (auto &[model, options] : profiles) {
+    out << sep << "  " << boost::json::serialize(boost::json::string(model))
+        << ": " << boost::json::serialize(options);
+    sep = ",\n";
+  }
+  out << "\n}\n";
+  out.close();
+  if (!out || std::rename((path + ".tmp").c_str(), path.c_str())) {
+    std::remove((path + ".tmp").c_str());
+    throw std::runtime_error("Cannot write profiles: " + path);
+  }
+}
+
+boost::json::object ProfileOptions(const ModelProfiles &profiles,
+                                   const std::string &model,
+                                   const boost::json::object &overrides) {
+  boost::json::object options;
+  auto merge = [&options](const boost::json::object &from) {
+    for (auto &kv : from) {
+      options[kv.key()] = kv.value();
+    }
+  };
+  std::string base = model.substr(0, model.find(':'));
+  for (const std::string &name : {std::string("*"), base, model}) {
+    if (auto it = profiles.find(name); it != profiles.end()) {
+      merge(it->second);
+    }
+    if (name == model) {
+      break; // a model without a tag is its own base
+    }
+  }
+  merge(overrides);
+  return options;
+}
+
+} // namespace ochat
@@ -0,0 +1,56 @@
+/**
+ * @file profiles.h
+ * @brief Per model generation options (num_ctx, num_batch, num_thread, ...)
+ * loaded from a config file and sent as the "options" of the requests.
+ */
+
+#ifndef __PROFILES_H__
+#define __PROFILES_H__
+
+#include <boost/json.hpp>
+#include <map>
+#include <string>
+
+namespace ochat {
+
+// The "options" of each model, by model name.  A name without a tag (e.g.
+// "llama3.2") applies to all the tags of the model, and "*" to all models.
+using ModelProfiles = std::map<std::string, boost::json::object>;
+
+/**
+ * Loads profiles from a JSON file that maps model names to options, e.g.
+ * {"llama3.2:1b": {"num_ctx": 8192, "num_thread": 8}}.
+ *
+ * @param path The config file.
+ * @return The profiles, empty if the file does not exist.
+ * @throw std::runtime_error if the file cannot be parsed.
+ */
+ModelProfiles LoadProfiles(const std::string &path);
+
+/**
+ * Writes profiles to a file in the format read by LoadProfiles().  The file
+ * is replaced once it is completely written.
+ *
+ * @param path The config file.
+ * @param profiles The profiles.
+ * @throw std::runtime_error if the file cannot be written.
+ */
+void SaveProfiles(const std::string &path, const ModelProfiles &profiles);
+
+/**
+ * Returns the options of a model: those of "*", then of the model name
+ * without its tag, then of the model, then the overrides, the later ones
+ * replacing the earlier ones.
+ *
+ * @param profiles The profiles.
+ * @param model The model name, e.g. "llama3.2:1b".
+ * @param overrides Options that replace those of the profiles.
+ * @return The options.
+ */
+boost::json::object ProfileOptions(const ModelProfiles &profiles,
+                                   const std::string &model,
+                                   const boost::json::object &overrides = {});
+
+} // namespace ochat
+
+#endif // __PROFILES_H__
@@ -0,0 +1,65 @@
+#include "prompt_queue.h"
+#include <thread>
+
+namespace ochat {
+
+void PromptQueue::Push(std::string line) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    lines_.push_back(std::move(line));
+  }
+  cv_.notify_one();
+}
+
+void PromptQueue::Close() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+  }
+  cv_.notify_all();
+}
+
+bool PromptQueue::Pop(std::string &line, bool *waited) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (waited != nullptr) {
+    *waited = lines_.empty();
+  }
+  cv_.wait(lock, [this] { return !lines_.empty() || closed_; });
+  if (lines_.empty()) {
+    return false;
+  }
+  line = std::move(lines_.front());
+  lines_.pop_front();
+  return true;
+}
+
+bool PromptQueue::PopIf(std::string &line,
+                        const std::function<bool(const std::string &)> &pred) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (lines_.empty() || !pred(lines_.front())) {
+    return false;
+  }
+  line = std::move(lines_.front());
+  lines_.pop_front();
+  return true;
+}
+
+std::size_t PromptQueue::size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return lines_.size();
+}
+
+// The thread is detached as it can block on the input until the process
+// exits (e.g. a terminal after /bye).
+void ReadLinesAsync(std::istream &in, std::shared_ptr<PromptQueue> queue) {
+  in.tie(nullptr);
+  std::thread([&in, queue = std::move(queue)] {
+    std::string line;
+    while (std::getline(in, line)) {
+      queue->Push(std::move(line));
+    }
+    queue->Close();
+  }).detach();
+}
+
+} // namespace ochat
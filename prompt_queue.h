@@ -0,0 +1,81 @@
+/**
+ * @file prompt_queue.h
+ * @brief Type-ahead input: the lines entered while a response streams are
+ * queued and handled as soon as the response is complete.
+ */
+
+#ifndef __PROMPT_QUEUE_H__
+#define __PROMPT_QUEUE_H__
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <istream>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace ochat {
+
+// The lines read from the input and not handled yet.  Thread safe.
+class PromptQueue {
+public:
+  /**
+   * Appends a line.
+   *
+   * @param line The line.
+   */
+  void Push(std::string line);
+
+  /**
+   * Ends the input, Pop() returns false once the queued lines are handled.
+   */
+  void Close();
+
+  /**
+   * Takes the next line, waiting for one if the queue is empty.
+   *
+   * @param line Receives the line.
+   * @param waited If not null, set to true if the queue was empty, i.e. the
+   * line was entered after the wait started rather than typed ahead.
+   * @return false if the input ended.
+   */
+  bool Pop(std::string &line, bool *waited = nullptr);
+
+  /**
+   * Takes the next line if one is queued and it satisfies the predicate,
+   * without waiting.
+   *
+   * @param line Receives the line.
+   * @param pred The predicate.
+   * @return true if a line was taken.
+   */
+  bool PopIf(std::string &line,
+             const std::function<bool(const std::string &)> &pred);
+
+  // the number of queued lines
+  std::size_t size() const;
+
+private:
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<std::string> lines_;
+  bool closed_ = false;
+};
+
+/**
+ * Reads the lines of the input into the queue on a detached thread, so that
+ * lines are read while the caller is busy; the queue is closed at the end of
+ * the input.  The input is untied from its output stream (e.g. std::cin from
+ * std::cout), so that reading does not flush an output written by another
+ * thread.
+ *
+ * @param in The input, must outlive the reading (e.g. std::cin).
+ * @param queue The queue the lines are appended to.
+ */
+void ReadLinesAsync(std::istream &in, std::shared_ptr<PromptQueue> queue);
+
+} // namespace ochat
+
+#endif // __PROMPT_QUEUE_H__
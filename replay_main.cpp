@@ -0,0 +1,152 @@
+#include "capture.h"
+#include "hdr_histogram.h"
+#include "ochat.h"
+#include <chrono>
+#include <getopt.h>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+using namespace std;
+
+void show_usage_help() {
+  cout << "Usage: ochat_replay [options] <capture file>" << endl;
+  cout << "Replays the chat responses of a capture (recorded with ochat "
+          "--record) through the response decoding and display, and reports "
+          "the time taken."
+       << endl;
+  cout << "Options:" << endl;
+  cout << "  --speed=<x>      - replay x times faster than recorded, 0 for no "
+          "delays (default: 0)"
+       << endl;
+  cout << "  --iterations=<n> - replays of the capture (default: 10)" << endl;
+  cout << "  --show           - display the responses" << endl;
+  cout << "  --help           - display help text" << endl;
+}
+
+int main(int argc, char **argv) {
+  double speed = 0;
+  int iterations = 10;
+  bool show = false;
+
+  static struct option long_options[] = {
+      {"speed", required_argument, nullptr, 's'},
+      {"iterations", required_argument, nullptr, 'n'},
+      {"show", no_argument, nullptr, 'v'},
+      {"help", no_argument, nullptr, 'h'},
+      {0, 0, 0, 0}};
+
+  int c;
+  try {
+    while ((c = getopt_long(argc, argv, "n:", long_options, nullptr)) != -1) {
+      switch (c) {
+      case 's':
+        speed = std::stod(optarg);
+        break;
+      case 'n':
+        iterations = std::stoi(optarg);
+        break;
+      case 'v':
+        show = true;
+        break;
+      case 'h':
+      default:
+        show_usage_help();
+        return 1;
+      }
+    }
+  } catch (const std::exception &e) {
+    cerr << "Invalid option value: " << e.what() << endl;
+    return 1;
+  }
+  if (optind + 1 != argc || iterations < 1) {
+    show_usage_help();
+    return 1;
+  }
+
+  std::unique_ptr<ochat::Replayer> replayer;
+  try {
+    replayer = std::make_unique<ochat::Replayer>(
+        ochat::Capture::Load(argv[optind]), speed);
+  } catch (const std::exception &e) {
+    cerr << e.what() << endl;
+    return 1;
+  }
+
+  // times in microseconds
+  ochat::HdrHistogram run_us;
+  ochat::HdrHistogram ttft_us;
+  long long tokens = 0;
+  int responses = 0;
+  std::ostringstream sink;
+  for (int i = 0; i < iterations; ++i) {
+    replayer->Rewind();
+    sink.str("");
+    ochat::Options opt;
+    opt.reconnect_backoff_ms = 0;
+    ochat::OllamaChat chat(opt, show && i == 0 ? cout : sink);
+    chat.SetTransportFactory(replayer->Factory());
+    std::chrono::steady_clock::time_point sent;
+    bool first = true;
+    chat.SetTokenHandler([&](std::string_view) {
+      if (first) {
+        ttft_us.Record(std::chrono::duration_cast<std::chrono::microseconds>(
+                           std::chrono::steady_clock::now() - sent)
+                           .count());
+        first = false;
+      }
+      ++tokens;
+    });
+
+    auto start = std::chrono::steady_clock::now();
+    // the chat responses are replayed, other requests are skipped
+    while (const ochat::CaptureConnection *conn = replayer->Peek()) {
+      if (conn->target() != opt.endpoint) {
+        replayer->Next();
+        continue;
+      }
+      sent = std::chrono::steady_clock::now();
+      first = true;
+      try {
+        chat.SendRequestToAi("replay");
+      } catch (const std::exception &e) {
+        cerr << "Replay failed: " << e.what() << endl;
+        return 1;
+      }
+      ++responses;
+    }
+    run_us.Record(std::chrono::duration_cast<std::chrono::microseconds>(
+                      std::chrono::steady_clock::now() - start)
+                      .count());
+  }
+
+  double best_s = run_us.min() / 1e6;
+  double bytes = static_cast<double>(replayer->capture().received_bytes());
+  cout << "replayed " << responses / iterations << " responses in "
+       << iterations << " iterations, " << tokens / iterations << " tokens, "
+       << fixed << setprecision(0) << bytes << " bytes each" << endl;
+  cout << left << setw(10) << "us" << right;
+  for (const char *col : {"min", "p50", "p99", "max"}) {
+    cout << " " << setw(10) << col;
+  }
+  cout << endl;
+  auto row = [](const char *name, const ochat::HdrHistogram &h) {
+    cout << left << setw(10) << name << right;
+    for (auto v : {h.min(), h.ValueAtPercentile(50), h.ValueAtPercentile(99),
+                   h.max()}) {
+      cout << " " << setw(10) << v;
+    }
+    cout << endl;
+  };
+  row("replay", run_us);
+  if (ttft_us.count() > 0) {
+    row("ttft", ttft_us);
+  }
+  if (best_s > 0) {
+    cout << "best: " << setprecision(0) << tokens / iterations / best_s
+         << " tokens/s, " << setprecision(1) << bytes / best_s / 1e6
+         << " MB/s" << endl;
+  }
+  return 0;
+}
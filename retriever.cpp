@@ -0,0 +1,69 @@
+#include "retriever.h"
+#include <sstream>
+#include <stdexcept>
+
+namespace ochat {
+
+Retriever::Retriever(EmbedFn embed, const RetrieverOptions &opt)
+    : embed_(std::move(embed)), opt_(opt) {}
+
+bool Retriever::Open(const std::string &store_path, std::ostream *log) {
+  index_.reset();
+  if (!store_.Open(store_path))
+    return false;
+  if (store_.size() < opt_.hnsw_min_size) {
+    index_ = std::make_unique<FlatIndex>(store_, opt_.threads);
+    return true;
+  }
+
+  // building the graph takes a while for a large store, so it is saved and
+  // reused until the store changes
+  HnswOptions hnsw;
+  hnsw.threads = opt_.threads;
+  auto index = std::make_unique<HnswIndex>(store_, hnsw);
+  std::string index_path = store_path + ".hnsw";
+  if (!index->Load(index_path)) {
+    if (log) {
+      *log << COL::APP << "Indexing " << store_.size() << " chunks..."
+           << COL::DEF << std::endl;
+    }
+    index->Build();
+    index->Save(index_path);
+  }
+  index_ = std::move(index);
+  return true;
+}
+
+std::vector<SearchHit> Retriever::Search(const std::string &query,
+                                         std::size_t k) {
+  if (!index_ || store_.size() == 0)
+    return {};
+  auto vecs = embed_({query});
+  if (vecs.size() != 1 || vecs[0].size() != store_.dim()) {
+    throw std::runtime_error("Query embedding does not match the store, was "
+                             "it ingested with another model?");
+  }
+  // normalize like the stored vectors, so the scores are cosine similarities
+  Normalize(vecs[0]);
+  return index_->Search(vecs[0].data(), k);
+}
+
+std::string Retriever::Context(const std::string &prompt) {
+  std::vector<SearchHit> hits = Search(prompt, opt_.top_k);
+  if (hits.empty())
+    return "";
+  std::stringstream ss;
+  ss << "Use the following excerpts from local files to answer the next "
+        "question if they are relevant.\n";
+  for (auto &hit : hits) {
+    const ChunkMeta &m = store_.meta()[hit.id];
+    ss << "\n--- " << m.file << " (bytes " << m.begin << "-" << m.end
+       << ")\n"
+       << m.text;
+    if (!m.text.empty() && m.text.back() != '\n')
+      ss << "\n";
+  }
+  return ss.str();
+}
+
+} // namespace ochat
@@ -0,0 +1,78 @@
+/**
+ * @file retriever.h
+ * @brief Retrieves the chunks of a vector store that are most relevant to a
+ * prompt, to add them to the chat context.
+ */
+
+#ifndef __RETRIEVER_H__
+#define __RETRIEVER_H__
+
+#include "app_config.h"
+#include "ingest.h"
+#include "vector_index.h"
+#include "vector_store.h"
+#include <algorithm>
+#include <cstddef>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace ochat {
+
+struct RetrieverOptions {
+  std::size_t top_k = OLLAMA_RAG_TOP_K; // chunks added to the context
+  // stores with fewer chunks are searched exactly, larger stores use an HNSW
+  // index (saved next to the store as <store>.hnsw)
+  std::size_t hnsw_min_size = OLLAMA_HNSW_MIN_SIZE;
+  std::size_t threads = std::max(1u, std::thread::hardware_concurrency());
+};
+
+class Retriever {
+public:
+  /**
+   * @param embed Computes the embedding of the query.
+   * @param opt The retrieval options.
+   */
+  explicit Retriever(EmbedFn embed, const RetrieverOptions &opt = {});
+
+  /**
+   * Opens the vector store and loads (or builds and saves) its index.
+   *
+   * @param store_path The path of the vector store.
+   * @param log If not null, progress is reported here.
+   * @return false if the store does not exist.
+   */
+  bool Open(const std::string &store_path, std::ostream *log = nullptr);
+
+  /**
+   * Finds the chunks most similar to the query.
+   *
+   * @param query The query text.
+   * @param k The number of chunks.
+   * @return The hits, best first.
+   */
+  std::vector<SearchHit> Search(const std::string &query, std::size_t k);
+
+  /**
+   * Formats the top_k chunks most relevant to the prompt as context for the
+   * model.
+   *
+   * @param prompt The user's input.
+   * @return The context, or an empty string if the store is empty.
+   */
+  std::string Context(const std::string &prompt);
+
+  const VectorStore &store() const { return store_; }
+
+private:
+  EmbedFn embed_;
+  RetrieverOptions opt_;
+  VectorStore store_;
+  std::unique_ptr<VectorIndex> index_;
+};
+
+} // namespace ochat
+
+#endif // __RETRIEVER_H__
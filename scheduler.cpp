@@ -0,0 +1,212 @@
+#include "scheduler.h"
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+
+namespace ochat {
+
+namespace {
+
+constexpr const char *kPriorityNames[kPriorityClasses] = {"interactive",
+                                                          "batch"};
+
+// tenants whose virtual finish time has passed are dropped once there are
+// more than this many
+constexpr std::size_t kMaxIdleTenants = 1024;
+
+} // namespace
+
+void RequestScheduler::Permit::Release() {
+  if (sched_ != nullptr) {
+    std::exchange(sched_, nullptr)->Release(backend_, model_);
+  }
+}
+
+RequestScheduler::RequestScheduler(const SchedulerOptions &opt) : opt_(opt) {}
+
+void RequestScheduler::SetWeight(const std::string &tenant, double weight) {
+  if (!(weight > 0)) {
+    throw std::invalid_argument("tenant weight must be positive");
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  weights_[tenant] = weight;
+}
+
+int RequestScheduler::ModelLimit(const std::string &model) const {
+  auto it = opt_.model_limits.find(model);
+  return it != opt_.model_limits.end() ? it->second
+                                       : opt_.max_in_flight_per_model;
+}
+
+bool RequestScheduler::HasCapacity(const RequestClass &rc) const {
+  if (opt_.max_in_flight > 0) {
+    auto it = in_flight_.find(rc.backend);
+    if (it != in_flight_.end() && it->second >= opt_.max_in_flight)
+      return false;
+  }
+  int model_limit = ModelLimit(rc.model);
+  if (model_limit > 0) {
+    auto it = model_in_flight_.find({rc.backend, rc.model});
+    if (it != model_in_flight_.end() && it->second >= model_limit)
+      return false;
+  }
+  return true;
+}
+
+void RequestScheduler::Admit(Waiter *w) {
+  w->state = State::kAdmitted;
+  ++in_flight_[w->rc->backend];
+  ++model_in_flight_[{w->rc->backend, w->rc->model}];
+  virtual_time_ = std::max(virtual_time_, w->start);
+  int p = static_cast<int>(w->rc->priority);
+  ++metrics_.admitted;
+  metrics_.queue_wait_us[p].Record(
+      std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() -
+                                                            w->enqueued)
+          .count());
+}
+
+// Admits the queued requests in order while their backend and model have
+// free slots.  A request that does not fit does not block the requests after
+// it that are sent to other backends or models.
+void RequestScheduler::Dispatch() {
+  bool admitted = false;
+  for (auto it = queue_.begin(); it != queue_.end();) {
+    Waiter *w = *it;
+    if (!HasCapacity(*w->rc)) {
+      ++it;
+      continue;
+    }
+    Admit(w);
+    --metrics_.queued[static_cast<int>(w->rc->priority)];
+    it = queue_.erase(it);
+    admitted = true;
+  }
+  if (admitted) {
+    cv_.notify_all();
+  }
+  if (last_finish_.size() > kMaxIdleTenants) {
+    for (auto it = last_finish_.begin(); it != last_finish_.end();) {
+      it = it->second <= virtual_time_ ? last_finish_.erase(it) : std::next(it);
+    }
+  }
+}
+
+void RequestScheduler::Release(const std::string &backend,
+                               const std::string &model) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (--in_flight_[backend] == 0)
+    in_flight_.erase(backend);
+  auto key = std::make_pair(backend, model);
+  if (--model_in_flight_[key] == 0)
+    model_in_flight_.erase(key);
+  Dispatch();
+}
+
+RequestScheduler::Permit RequestScheduler::Acquire(const RequestClass &rc) {
+  int p = static_cast<int>(rc.priority);
+  auto deadline_ms = rc.deadline.count() >= 0 ? rc.deadline : opt_.deadline[p];
+
+  Waiter w{&rc, 0, 0, Clock::now()};
+  auto cancelled = [&rc] { return rc.cancelled != nullptr && *rc.cancelled; };
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (cancelled()) {
+    throw RequestCancelled();
+  }
+
+  // the virtual start time of the request: a tenant that has requests
+  // waiting starts after them, an idle tenant starts now
+  auto weight_it = weights_.find(rc.tenant);
+  double weight = weight_it != weights_.end() ? weight_it->second : 1.0;
+  double &finish = last_finish_[rc.tenant];
+  w.start = std::max(virtual_time_, finish);
+  finish = w.start + rc.cost / weight;
+  w.seq = seq_++;
+
+  // the queued requests are all waiting for slots, so a request with a free
+  // slot does not pass any of them
+  if (HasCapacity(rc)) {
+    Admit(&w);
+  } else {
+    if (queue_.size() >= opt_.max_queue) {
+      // make room by evicting the request that would be admitted last (a
+      // batch request when an interactive one arrives), unless it is this one
+      Waiter *last = queue_.empty() ? nullptr : *queue_.rbegin();
+      if (last == nullptr || !WaiterOrder()(&w, last)) {
+        ++metrics_.shed_overflow;
+        throw RequestRejected("Request queue is full", false);
+      }
+      queue_.erase(std::prev(queue_.end()));
+      --metrics_.queued[static_cast<int>(last->rc->priority)];
+      last->state = State::kEvicted;
+      ++metrics_.shed_overflow;
+      cv_.notify_all();
+    }
+    queue_.insert(&w);
+    ++metrics_.queued[p];
+    metrics_.max_queued = std::max(metrics_.max_queued, queue_.size());
+
+    auto ready = [&] { return w.state != State::kWaiting || cancelled(); };
+    if (deadline_ms.count() > 0) {
+      cv_.wait_until(lock, w.enqueued + deadline_ms, ready);
+    } else {
+      cv_.wait(lock, ready);
+    }
+    if (w.state == State::kWaiting) {
+      queue_.erase(&w);
+      --metrics_.queued[p];
+      if (cancelled()) {
+        throw RequestCancelled();
+      }
+      ++metrics_.shed_deadline;
+      throw RequestRejected("Request not admitted within " +
+                                std::to_string(deadline_ms.count()) + " ms",
+                            true);
+    }
+    if (w.state == State::kEvicted) {
+      throw RequestRejected("Request evicted from the full queue", false);
+    }
+  }
+  Permit permit;
+  permit.sched_ = this;
+  permit.backend_ = rc.backend;
+  permit.model_ = rc.model;
+  return permit;
+}
+
+// Notifying under the lock, a waiter that checked the flag before it was set
+// is already waiting and is woken up.
+void RequestScheduler::Interrupt() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  cv_.notify_all();
+}
+
+SchedulerMetrics RequestScheduler::Metrics() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  SchedulerMetrics m = metrics_;
+  m.in_flight = in_flight_;
+  for (auto &[key, n] : model_in_flight_) {
+    m.model_in_flight[key.first + " " + key.second] = n;
+  }
+  return m;
+}
+
+std::string SchedulerMetrics::ToText() const {
+  std::ostringstream os;
+  os << "admitted " << admitted << ", shed " << shed_deadline
+     << " (deadline) " << shed_overflow << " (queue full), queued "
+     << queued[0] + queued[1] << " (max " << max_queued << ")\n";
+  os << std::fixed << std::setprecision(2);
+  for (int p = 0; p < kPriorityClasses; ++p) {
+    const HdrHistogram &h = queue_wait_us[p];
+    if (h.count() == 0)
+      continue;
+    os << "queue wait ms " << std::left << std::setw(12) << kPriorityNames[p]
+       << std::right << "p50 " << h.ValueAtPercentile(50) / 1000.0 << "  p99 "
+       << h.ValueAtPercentile(99) / 1000.0 << "  max " << h.max() / 1000.0
+       << "\n";
+  }
+  return os.str();
+}
+
+} // namespace ochat
@@ -0,0 +1,207 @@
+/**
+ * @file scheduler.h
+ * @brief Client side admission control for the requests sent to Ollama
+ * servers: concurrency limits, priorities and fair sharing between tenants.
+ */
+
+#ifndef __SCHEDULER_H__
+#define __SCHEDULER_H__
+
+#include "app_config.h"
+#include "hdr_histogram.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+namespace ochat {
+
+// Priority classes, a queued interactive request is always admitted before a
+// queued batch request.
+enum class Priority { kInteractive = 0, kBatch = 1 };
+constexpr int kPriorityClasses = 2;
+
+struct SchedulerOptions {
+  int max_in_flight = 0;           // requests per backend, 0 for no limit
+  int max_in_flight_per_model = 0; // requests per model of a backend, 0 for
+                                   // no limit (e.g. OLLAMA_NUM_PARALLEL)
+  std::map<std::string, int> model_limits; // per model overrides
+  std::size_t max_queue = OLLAMA_SCHED_MAX_QUEUE; // queued requests
+  // max time a request waits for admission, 0 to wait without limit
+  std::chrono::milliseconds deadline[kPriorityClasses] = {
+      std::chrono::milliseconds(OLLAMA_SCHED_INTERACTIVE_DEADLINE_MS),
+      std::chrono::milliseconds(0)};
+};
+
+// What a request is sent to and on whose behalf.
+struct RequestClass {
+  std::string backend; // e.g. "host:port"
+  std::string model;
+  std::string tenant;  // user or session the request is made for
+  Priority priority = Priority::kInteractive;
+  double cost = 1;     // relative size of the request
+  // overrides the deadline of the priority class when not negative
+  std::chrono::milliseconds deadline{-1};
+  // if not null, the request gives up once this is set, see Interrupt()
+  const std::atomic<bool> *cancelled = nullptr;
+};
+
+// Thrown when a request is shed instead of being admitted.
+class RequestRejected : public std::runtime_error {
+public:
+  RequestRejected(const std::string &msg, bool deadline)
+      : std::runtime_error(msg), deadline_(deadline) {}
+
+  // true if the request waited longer than its deadline, false if the queue
+  // was full
+  bool deadline() const { return deadline_; }
+
+private:
+  bool deadline_;
+};
+
+// Thrown when a request is cancelled before it is admitted.
+class RequestCancelled : public std::runtime_error {
+public:
+  RequestCancelled() : std::runtime_error("Request cancelled") {}
+};
+
+// A snapshot of the state and counters of a scheduler.
+struct SchedulerMetrics {
+  std::size_t queued[kPriorityClasses] = {0, 0};
+  std::size_t max_queued = 0; // largest queue depth seen
+  std::map<std::string, int> in_flight;       // by backend
+  std::map<std::string, int> model_in_flight; // by "backend model"
+  std::int64_t admitted = 0;
+  std::int64_t shed_deadline = 0; // waited longer than the deadline
+  std::int64_t shed_overflow = 0; // rejected or evicted from a full queue
+  HdrHistogram queue_wait_us[kPriorityClasses];
+
+  // a human readable summary
+  std::string ToText() const;
+};
+
+// Admits requests to the backends they are sent to.  A request waits in the
+// queue while its backend or model is at its concurrency limit.  When a slot
+// is released the waiting requests are considered by priority class, and
+// within a class by start-time fair queueing: each tenant is given a share of
+// the admissions proportional to its weight, so one tenant queueing many
+// requests cannot starve the others.  Requests that wait longer than their
+// deadline, or that arrive when the queue is full, are shed; a full queue
+// evicts a batch request to make room for an interactive one.
+//
+// All members are thread safe.
+class RequestScheduler {
+public:
+  // A slot for one request, the slot is released when the permit is
+  // destroyed.
+  class Permit {
+  public:
+    Permit() = default;
+    Permit(Permit &&other) noexcept { *this = std::move(other); }
+    Permit &operator=(Permit &&other) noexcept {
+      if (this != &other) {
+        Release();
+        sched_ = std::exchange(other.sched_, nullptr);
+        backend_ = std::move(other.backend_);
+        model_ = std::move(other.model_);
+      }
+      return *this;
+    }
+    ~Permit() { Release(); }
+
+    // releases the slot early
+    void Release();
+
+    explicit operator bool() const { return sched_ != nullptr; }
+
+  private:
+    friend class RequestScheduler;
+    RequestScheduler *sched_ = nullptr;
+    std::string backend_;
+    std::string model_;
+  };
+
+  explicit RequestScheduler(const SchedulerOptions &opt = {});
+
+  /**
+   * Sets the weight of a tenant (default 1), a tenant with weight 2 is
+   * admitted twice as often as a tenant with weight 1 when both have
+   * requests waiting.
+   */
+  void SetWeight(const std::string &tenant, double weight);
+
+  /**
+   * Waits until the request is admitted.
+   *
+   * @param rc The request.
+   * @return The permit, which must be kept while the request is in flight.
+   * @throw RequestRejected if the request is shed.
+   * @throw RequestCancelled if rc.cancelled is set before the request is
+   * admitted.
+   */
+  Permit Acquire(const RequestClass &rc);
+
+  /**
+   * Wakes up the queued requests, so that those whose RequestClass::cancelled
+   * was set give up waiting.  Call it after setting the flag.
+   */
+  void Interrupt();
+
+  /**
+   * Returns the current state and counters.
+   */
+  SchedulerMetrics Metrics() const;
+
+  RequestScheduler(const RequestScheduler &) = delete;
+  RequestScheduler &operator=(const RequestScheduler &) = delete;
+
+private:
+  using Clock = std::chrono::steady_clock;
+  enum class State { kWaiting, kAdmitted, kEvicted };
+  struct Waiter {
+    const RequestClass *rc;
+    double start; // virtual start time
+    std::uint64_t seq;
+    Clock::time_point enqueued;
+    State state = State::kWaiting;
+  };
+  // admission order: priority, then virtual start time, then arrival
+  struct WaiterOrder {
+    bool operator()(const Waiter *a, const Waiter *b) const {
+      if (a->rc->priority != b->rc->priority)
+        return a->rc->priority < b->rc->priority;
+      if (a->start != b->start)
+        return a->start < b->start;
+      return a->seq < b->seq;
+    }
+  };
+
+  int ModelLimit(const std::string &model) const;
+  bool HasCapacity(const RequestClass &rc) const;
+  void Admit(Waiter *w);
+  void Dispatch();
+  void Release(const std::string &backend, const std::string &model);
+
+  SchedulerOptions opt_;
+  mutable std::mutex mutex_; // guards the members below
+  std::condition_variable cv_;
+  std::set<Waiter *, WaiterOrder> queue_;
+  std::map<std::string, double> weights_;
+  std::map<std::string, double> last_finish_; // virtual finish by tenant
+  double virtual_time_ = 0;
+  std::uint64_t seq_ = 0;
+  std::map<std::string, int> in_flight_;
+  std::map<std::pair<std::string, std::string>, int> model_in_flight_;
+  SchedulerMetrics metrics_;
+};
+
+} // namespace ochat
+
+#endif // __SCHEDULER_H__
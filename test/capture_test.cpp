@@ -0,0 +1,262 @@
+#include "capture.h"
+#include "fake_ollama.h"
+#include "ochat.h"
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <gtest/gtest.h>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace ochat {
+
+namespace {
+
+// a capture file path that is removed by the destructor
+class TempCapture {
+public:
+  TempCapture()
+      : path_((fs::temp_directory_path() /
+               ("ochat_capture_test_" + std::to_string(::getpid()) + "_" +
+                std::to_string(counter_++) + ".ocap"))
+                  .string()) {}
+  ~TempCapture() { fs::remove(path_); }
+  const std::string &path() const { return path_; }
+
+private:
+  std::string path_;
+  static inline int counter_ = 0;
+};
+
+struct ChatResult {
+  std::vector<std::string> tokens;
+  std::string output; // what was displayed
+  ResponseStats stats;
+  double ttft_ms = 0;
+};
+
+// sends a prompt over the transports of the factory
+ChatResult Chat(const Options &opt, TransportFactory factory,
+                const std::string &prompt = "hello") {
+  std::ostringstream out;
+  OllamaChat chat(opt, out);
+  chat.SetTransportFactory(std::move(factory));
+  ChatResult r;
+  auto start = std::chrono::steady_clock::now();
+  chat.SetTokenHandler([&](std::string_view t) {
+    if (r.tokens.empty()) {
+      r.ttft_ms = std::chrono::duration<double, std::milli>(
+                      std::chrono::steady_clock::now() - start)
+                      .count();
+    }
+    r.tokens.emplace_back(t);
+  });
+  chat.SendRequestToAi(prompt);
+  r.output = out.str();
+  r.stats = chat.last_stats();
+  return r;
+}
+
+Options ClientFor(const FakeOllama &server, int tokens) {
+  Options opt;
+  opt.server = "127.0.0.1";
+  opt.port = server.port();
+  opt.model_options["num_predict"] = tokens;
+  return opt;
+}
+
+// records a chat with the fake server into the capture file
+ChatResult Record(const std::string &path, const FakeOllamaOptions &fo,
+                  int tokens) {
+  FakeOllama server(fo);
+  auto writer = std::make_shared<CaptureWriter>(path);
+  return Chat(ClientFor(server, tokens),
+              RecordingTransports(
+                  [] { return std::make_unique<TcpTransport>(); }, writer));
+}
+
+} // namespace
+
+TEST(CaptureTest, RecordAndReplay) {
+  FakeOllamaOptions fo;
+  fo.ttft_ms = 5;
+  fo.token_ms = 1;
+  TempCapture file;
+  ChatResult recorded = Record(file.path(), fo, 8);
+  ASSERT_EQ(recorded.tokens.size(), 8u);
+
+  Capture capture = Capture::Load(file.path());
+  ASSERT_EQ(capture.connections().size(), 1u);
+  const CaptureConnection &conn = capture.connections()[0];
+  EXPECT_EQ(conn.target(), "/api/chat");
+  EXPECT_EQ(conn.records.front().kind, CaptureRecord::kSent);
+  EXPECT_EQ(conn.records.back().kind, CaptureRecord::kClose);
+  EXPECT_GT(capture.received_bytes(), 8u * 20);
+
+  // the replay goes through the same decoding and display
+  Replayer replayer(std::move(capture), 0);
+  Options opt;
+  opt.reconnect_attempts = 0;
+  ChatResult replayed = Chat(opt, replayer.Factory());
+  EXPECT_EQ(replayed.tokens, recorded.tokens);
+  EXPECT_EQ(replayed.output, recorded.output);
+  EXPECT_EQ(replayed.stats.eval_count, 8);
+  EXPECT_EQ(replayed.stats.eval_duration, recorded.stats.eval_duration);
+
+  // every connection of the capture was replayed
+  EXPECT_EQ(replayer.Peek(), nullptr);
+  EXPECT_THROW(Chat(opt, replayer.Factory()), boost::system::system_error);
+  replayer.Rewind();
+  EXPECT_EQ(Chat(opt, replayer.Factory()).tokens, recorded.tokens);
+}
+
+TEST(CaptureTest, ReplaySpeed) {
+  FakeOllamaOptions fo;
+  fo.ttft_ms = 100;
+  fo.token_ms = 10;
+  TempCapture file;
+  ChatResult recorded = Record(file.path(), fo, 5);
+  ASSERT_GE(recorded.ttft_ms, 100);
+  Capture capture = Capture::Load(file.path());
+
+  Options opt;
+  Replayer realtime(capture, 1);
+  ChatResult r = Chat(opt, realtime.Factory());
+  EXPECT_GE(r.ttft_ms, 95);
+  EXPECT_EQ(r.tokens, recorded.tokens);
+
+  Replayer fast(capture, 10);
+  r = Chat(opt, fast.Factory());
+  EXPECT_GE(r.ttft_ms, 9);
+  EXPECT_LT(r.ttft_ms, 60);
+
+  Replayer unlimited(capture, 0);
+  r = Chat(opt, unlimited.Factory());
+  EXPECT_LT(r.ttft_ms, 50);
+  EXPECT_EQ(r.tokens, recorded.tokens);
+}
+
+TEST(CaptureTest, ReplaysNonStreamedAndEmbed) {
+  FakeOllamaOptions fo;
+  fo.ttft_ms = 1;
+  fo.embed_dim = 4;
+  FakeOllama server(fo);
+  TempCapture file;
+  std::vector<std::vector<float>> vecs;
+  {
+    auto writer = std::make_shared<CaptureWriter>(file.path());
+    Options opt = ClientFor(server, 3);
+    opt.stream_resp = false;
+    std::ostringstream out;
+    OllamaChat chat(opt, out);
+    chat.SetTransportFactory(RecordingTransports(
+        [] { return std::make_unique<TcpTransport>(); }, writer));
+    chat.SendRequestToAi("hi");
+    vecs = chat.Embed({"a", "b"});
+  }
+
+  Replayer replayer(Capture::Load(file.path()), 0);
+  ASSERT_EQ(replayer.capture().connections().size(), 2u);
+  EXPECT_EQ(replayer.capture().connections()[1].target(), "/api/embed");
+  Options opt;
+  opt.stream_resp = false;
+  std::ostringstream out;
+  OllamaChat chat(opt, out);
+  chat.SetTransportFactory(replayer.Factory());
+  chat.SendRequestToAi("hi");
+  EXPECT_EQ(chat.last_stats().eval_count, 3);
+  EXPECT_EQ(chat.Embed({"a", "b"}), vecs);
+}
+
+TEST(CaptureTest, ReplaysDisconnect) {
+  // a stream that is cut off after the first token, the client reconnects
+  // and the second connection continues the answer
+  std::string hdr = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n";
+  auto chunk = [](const std::string &json) {
+    std::ostringstream ss;
+    ss << std::hex << json.size() << "\r\n" << json << "\r\n";
+    return ss.str();
+  };
+  std::string part1 = chunk(R"({"message":{"content":"Hel"},"done":false})");
+  std::string part2 = chunk(R"({"message":{"content":"lo"},"done":false})") +
+                      chunk(R"({"message":{"content":""},"done":true,)"
+                            R"("eval_count":2})") +
+                      "0\r\n\r\n";
+  TempCapture file;
+  {
+    CaptureWriter writer(file.path());
+    auto c = writer.Connect("localhost:11434");
+    writer.Append(c, CaptureRecord::kSent, "POST /api/chat HTTP/1.1\r\n");
+    writer.Append(c, CaptureRecord::kReceived, hdr + part1);
+    writer.Append(c, CaptureRecord::kError,
+                  std::string(boost::asio::error::get_misc_category().name()) +
+                      ":" + std::to_string(boost::asio::error::eof));
+    c = writer.Connect("localhost:11434");
+    writer.Append(c, CaptureRecord::kSent, "POST /api/chat HTTP/1.1\r\n");
+    writer.Append(c, CaptureRecord::kReceived, hdr + part2);
+    writer.Append(c, CaptureRecord::kClose, "");
+  }
+
+  Replayer replayer(Capture::Load(file.path()), 0);
+  Options opt;
+  opt.reconnect_backoff_ms = 1;
+  ChatResult r = Chat(opt, replayer.Factory());
+  EXPECT_EQ(r.tokens, (std::vector<std::string>{"Hel", "lo"}));
+  EXPECT_EQ(r.stats.eval_count, 2);
+  EXPECT_EQ(replayer.Peek(), nullptr);
+}
+
+// connections opened at the same time by several threads are read back,
+// each with its own records
+TEST(CaptureTest, ConcurrentConnections) {
+  constexpr int kThreads = 8, kConnections = 200;
+  TempCapture file;
+  {
+    auto writer = std::make_shared<CaptureWriter>(file.path());
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreads; ++t) {
+      threads.emplace_back([writer, t] {
+        for (int i = 0; i < kConnections; ++i) {
+          std::string name = std::to_string(t) + ":" + std::to_string(i);
+          std::uint64_t conn = writer->Connect(name);
+          writer->Append(conn, CaptureRecord::kSent, name);
+          writer->Append(conn, CaptureRecord::kClose, "");
+        }
+      });
+    }
+    for (auto &t : threads) {
+      t.join();
+    }
+    writer->Flush();
+  }
+  Capture capture = Capture::Load(file.path());
+  ASSERT_EQ(capture.connections().size(),
+            static_cast<std::size_t>(kThreads * kConnections));
+  for (const CaptureConnection &conn : capture.connections()) {
+    ASSERT_EQ(conn.records.size(), 2u) << conn.endpoint;
+    EXPECT_EQ(conn.records[0].kind, CaptureRecord::kSent);
+    EXPECT_EQ(conn.records[0].data, conn.endpoint);
+    EXPECT_EQ(conn.records[1].kind, CaptureRecord::kClose);
+  }
+}
+
+TEST(CaptureTest, InvalidFiles) {
+  EXPECT_THROW(Capture::Load("/nonexistent/capture.ocap"), std::runtime_error);
+  EXPECT_THROW(Capture::Parse("GIF89a"), std::runtime_error);
+  EXPECT_THROW(Capture::Parse(std::string("OCAP\x07", 5)), std::runtime_error);
+  EXPECT_TRUE(Capture::Parse(std::string("OCAP\x01", 5)).connections().empty());
+  // a record of a connection that was never opened
+  EXPECT_THROW(Capture::Parse(std::string("OCAP\x01S\x00\x00\x00", 9)),
+               std::runtime_error);
+  // data past the end of the file
+  EXPECT_THROW(Capture::Parse(std::string("OCAP\x01" "C\x00\x00\x05" "ab", 11)),
+               std::runtime_error);
+}
+
+} // namespace ochat
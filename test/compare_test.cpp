@@ -0,0 +1,158 @@
+#include "fake_ollama.h"
+#include "loopback_server.h"
+#include "ochat.h"
+#include "transport.h"
+#include <boost/asio.hpp>
+#include <boost/json.hpp>
+#include <chrono>
+#include <gtest/gtest.h>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using boost::asio::local::stream_protocol;
+
+namespace ochat {
+
+namespace {
+
+// Answers a chat request with "answer from <model>" and records its body.
+void ServeModelAnswer(stream_protocol::socket &socket, std::mutex &mutex,
+                      std::vector<std::string> &bodies) {
+  std::string body = ReadLoopbackRequest(socket).body;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    bodies.push_back(body);
+  }
+  boost::json::object req = boost::json::parse(body).as_object();
+  std::string model = req["model"].as_string().c_str();
+  std::string msg = R"({"message":{"role":"assistant","content":)"
+                    R"("answer from )" +
+                    model + R"("},"done":true,"eval_count":3})" + "\n";
+  WriteChunkedResponse(socket, {msg});
+}
+
+} // namespace
+
+TEST(CompareTest, ParseTargets) {
+  auto targets = ParseCompareTargets(
+      "llama3.2:1b,qwen3:4b@gpu2:11500,phi4@unix:///run/ollama.sock,m@host");
+  ASSERT_EQ(targets.size(), 4u);
+  EXPECT_EQ(targets[0].model, "llama3.2:1b");
+  EXPECT_EQ(targets[0].server, "");
+  EXPECT_EQ(targets[0].port, 0);
+  EXPECT_EQ(targets[0].label(), "llama3.2:1b");
+  EXPECT_EQ(targets[1].model, "qwen3:4b");
+  EXPECT_EQ(targets[1].server, "gpu2");
+  EXPECT_EQ(targets[1].port, 11500);
+  EXPECT_EQ(targets[1].label(), "qwen3:4b@gpu2:11500");
+  EXPECT_EQ(targets[2].server, "unix:///run/ollama.sock");
+  EXPECT_EQ(targets[2].port, 0);
+  EXPECT_EQ(targets[3].server, "host");
+  EXPECT_EQ(targets[3].label(), "m@host");
+
+  for (const char *spec : {"", "a,,b", "a,", "@host", "m@", "m@host:x",
+                           "m@host:", "m@:11434"}) {
+    EXPECT_THROW(ParseCompareTargets(spec), std::invalid_argument) << spec;
+  }
+}
+
+// the models on two servers answer at the same time, a failing target does
+// not affect the others
+TEST(CompareTest, ComparesConcurrently) {
+  FakeOllamaOptions fo;
+  fo.ttft_ms = 150;
+  fo.token_ms = 1;
+  FakeOllama server1(fo);
+  FakeOllama server2(fo);
+  Options opt;
+  opt.server = "127.0.0.1";
+  opt.port = server1.port();
+  opt.model_options["num_predict"] = 3;
+  opt.reconnect_attempts = 0;
+  std::ostringstream out;
+  OllamaChat chat(opt, out);
+
+  auto targets = ParseCompareTargets(
+      "m1,m2@127.0.0.1:" + std::to_string(server2.port()) + ",m3@127.0.0.1:1");
+  auto start = std::chrono::steady_clock::now();
+  auto results = chat.Compare(targets, "hello");
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  EXPECT_LT(elapsed, std::chrono::milliseconds(290));
+  EXPECT_EQ(server1.requests(), 1u);
+  EXPECT_EQ(server2.requests(), 1u);
+
+  ASSERT_EQ(results.size(), 3u);
+  for (int i = 0; i < 2; ++i) {
+    EXPECT_EQ(results[i].error, "");
+    EXPECT_FALSE(results[i].content.empty());
+    EXPECT_EQ(results[i].stats.eval_count, 3);
+    EXPECT_GE(results[i].stats.total_duration, 150000000);
+    EXPECT_GE(results[i].ttft_ms, 150);
+    EXPECT_GE(results[i].wall_ms, results[i].ttft_ms);
+  }
+  EXPECT_NE(results[2].error, "");
+  EXPECT_EQ(out.str().find("[m3"), std::string::npos);
+  std::string line = "[m1] " + std::string(COL::AI) + results[0].content;
+  EXPECT_NE(out.str().find(line), std::string::npos);
+  EXPECT_NE(out.str().find("[" + targets[1].label() + "] "),
+            std::string::npos);
+
+  std::ostringstream table;
+  PrintComparison(table, results);
+  std::string t = table.str();
+  EXPECT_NE(t.find("tok/s"), std::string::npos);
+  EXPECT_NE(t.find("\nm1 "), std::string::npos);
+  size_t row = t.find(targets[2].label());
+  ASSERT_NE(row, std::string::npos);
+  EXPECT_EQ(t.find("error: "), t.find_first_not_of(' ', t.find(' ', row)));
+  EXPECT_EQ(chat.branches(),
+            (std::vector<std::string>{"m1", targets[1].label()}));
+}
+
+// each answer continues in its own branch, the history is not changed
+TEST(CompareTest, BranchesKeepEachAnswer) {
+  std::mutex mutex;
+  std::vector<std::string> bodies;
+  Options opt;
+  opt.model = "base";
+  std::ostringstream out;
+  OllamaChat chat(opt, out);
+  chat.SetTransportFactory([&] {
+    return std::make_unique<LoopbackTransport>(
+        [&](stream_protocol::socket &s) {
+          ServeModelAnswer(s, mutex, bodies);
+        });
+  });
+  chat.SendRequestToAi("first");
+  auto results = chat.Compare(ParseCompareTargets("a,b"), "which?");
+  ASSERT_EQ(results.size(), 2u);
+  EXPECT_EQ(results[0].content, "answer from a");
+  EXPECT_EQ(results[1].content, "answer from b");
+  EXPECT_EQ(chat.branches(), (std::vector<std::string>{"a", "b"}));
+
+  // the history does not have the compared prompt
+  chat.SendRequestToAi("plain");
+  EXPECT_EQ(bodies.back().find("which?"), std::string::npos);
+  EXPECT_NE(bodies.back().find("\"model\": \"base\""), std::string::npos);
+
+  chat.SwitchBranch("b");
+  EXPECT_EQ(chat.options().model, "b");
+  chat.SendRequestToAi("go on");
+  const std::string &req = bodies.back();
+  EXPECT_NE(req.find("\"model\": \"b\""), std::string::npos);
+  EXPECT_NE(req.find("first"), std::string::npos);
+  EXPECT_NE(req.find("which?"), std::string::npos);
+  EXPECT_NE(req.find("answer from b"), std::string::npos);
+  EXPECT_EQ(req.find("answer from a"), std::string::npos);
+  EXPECT_EQ(req.find("plain"), std::string::npos);
+
+  EXPECT_THROW(chat.SwitchBranch("c"), std::out_of_range);
+  chat.ResetContext();
+  EXPECT_TRUE(chat.branches().empty());
+}
+
+} // namespace ochat
@@ -0,0 +1,204 @@
+#include "fake_ollama.h"
+#include "gateway.h"
+#include "ochat.h"
+#include <boost/asio.hpp>
+#include <gtest/gtest.h>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using boost::asio::ip::tcp;
+
+namespace ochat {
+
+namespace {
+
+GatewayOptions GatewayFor(const FakeOllama &server) {
+  GatewayOptions opt;
+  opt.port = 0;
+  opt.backend_server = "127.0.0.1";
+  opt.backend_port = server.port();
+  return opt;
+}
+
+Options ClientFor(const Gateway &gateway, int tokens) {
+  Options opt;
+  opt.server = "127.0.0.1";
+  opt.port = gateway.port();
+  opt.model_options["num_predict"] = tokens;
+  return opt;
+}
+
+// sends a prompt through the gateway, returns the streamed tokens
+std::vector<std::string> Chat(const Options &opt, const std::string &prompt) {
+  std::ostringstream out;
+  OllamaChat chat(opt, out);
+  std::vector<std::string> tokens;
+  chat.SetTokenHandler(
+      [&tokens](std::string_view t) { tokens.emplace_back(t); });
+  chat.SendRequestToAi(prompt);
+  EXPECT_TRUE(chat.last_stats().done);
+  return tokens;
+}
+
+// sends a raw request and reads the response until the server closes
+std::string RawRequest(int port, const std::string &request) {
+  boost::asio::io_context io;
+  tcp::socket socket(io);
+  socket.connect(tcp::endpoint(boost::asio::ip::make_address("127.0.0.1"),
+                               static_cast<unsigned short>(port)));
+  boost::asio::write(socket, boost::asio::buffer(request));
+  std::string response;
+  boost::system::error_code ec;
+  char buf[4096];
+  while (!ec) {
+    std::size_t n = socket.read_some(boost::asio::buffer(buf), ec);
+    response.append(buf, n);
+  }
+  return response;
+}
+
+} // namespace
+
+TEST(GatewayTest, StreamsThroughPooledConnection) {
+  FakeOllamaOptions fo;
+  fo.ttft_ms = 5;
+  fo.token_ms = 1;
+  FakeOllama server(fo);
+  Gateway gateway(GatewayFor(server));
+  gateway.Start();
+
+  Options opt = ClientFor(gateway, 6);
+  EXPECT_EQ(Chat(opt, "one").size(), 6u);
+  EXPECT_EQ(Chat(opt, "two").size(), 6u);
+  opt.stream_resp = false;
+  EXPECT_EQ(Chat(opt, "three").size(), 1u); // the whole response at once
+
+  auto stats = gateway.stats();
+  EXPECT_EQ(stats.requests, 3u);
+  EXPECT_EQ(stats.backend_requests, 3u);
+  EXPECT_EQ(stats.backend_connections, 1u); // kept alive and reused
+  EXPECT_EQ(server.requests(), 3u);
+}
+
+TEST(GatewayTest, CoalescesIdenticalRequests) {
+  FakeOllamaOptions fo;
+  fo.ttft_ms = 200;
+  fo.token_ms = 5;
+  fo.parallel = 4;
+  FakeOllama server(fo);
+  Gateway gateway(GatewayFor(server));
+  gateway.Start();
+
+  Options opt = ClientFor(gateway, 8);
+  std::vector<std::vector<std::string>> results(4);
+  std::vector<std::thread> clients;
+  for (std::size_t i = 0; i < results.size(); ++i) {
+    clients.emplace_back(
+        [&, i] { results[i] = Chat(opt, "the same question"); });
+  }
+  for (auto &c : clients) {
+    c.join();
+  }
+  for (auto &r : results) {
+    EXPECT_EQ(r, results[0]);
+  }
+  EXPECT_EQ(results[0].size(), 8u);
+  EXPECT_EQ(server.requests(), 1u);
+  EXPECT_EQ(gateway.stats().coalesced, 3u);
+
+  // once the response completed the same request is generated again
+  Chat(opt, "the same question");
+  EXPECT_EQ(server.requests(), 2u);
+}
+
+TEST(GatewayTest, LateClientReceivesWholeStream) {
+  FakeOllamaOptions fo;
+  fo.ttft_ms = 5;
+  fo.token_ms = 20;
+  FakeOllama server(fo);
+  Gateway gateway(GatewayFor(server));
+  gateway.Start();
+
+  Options opt = ClientFor(gateway, 10);
+  std::vector<std::string> first;
+  std::thread early([&] { first = Chat(opt, "prompt"); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(80));
+  std::vector<std::string> late = Chat(opt, "prompt");
+  early.join();
+  EXPECT_EQ(late, first);
+  EXPECT_EQ(late.size(), 10u);
+  EXPECT_EQ(server.requests(), 1u);
+}
+
+TEST(GatewayTest, PoolLimitQueuesRequests) {
+  FakeOllamaOptions fo;
+  fo.ttft_ms = 20;
+  fo.token_ms = 1;
+  fo.parallel = 4;
+  FakeOllama server(fo);
+  GatewayOptions go = GatewayFor(server);
+  go.max_connections = 1;
+  Gateway gateway(go);
+  gateway.Start();
+
+  Options opt = ClientFor(gateway, 4);
+  std::vector<std::thread> clients;
+  for (int i = 0; i < 3; ++i) {
+    clients.emplace_back([&, i] {
+      EXPECT_EQ(Chat(opt, "prompt " + std::to_string(i)).size(), 4u);
+    });
+  }
+  for (auto &c : clients) {
+    c.join();
+  }
+  EXPECT_EQ(server.requests(), 3u);
+  EXPECT_EQ(gateway.stats().backend_connections, 1u);
+  EXPECT_EQ(gateway.stats().coalesced, 0u);
+}
+
+TEST(GatewayTest, ForwardsOtherRequests) {
+  FakeOllamaOptions fo;
+  fo.embed_dim = 8;
+  FakeOllama server(fo);
+  Gateway gateway(GatewayFor(server));
+  gateway.Start();
+
+  Options opt = ClientFor(gateway, 1);
+  std::ostringstream out;
+  OllamaChat chat(opt, out);
+  auto vecs = chat.Embed({"a", "b"});
+  ASSERT_EQ(vecs.size(), 2u);
+  EXPECT_EQ(vecs[0].size(), 8u);
+
+  std::string resp = RawRequest(
+      gateway.port(), "GET /api/unknown HTTP/1.1\r\nConnection: close\r\n\r\n");
+  EXPECT_EQ(resp.substr(0, 12), "HTTP/1.1 404");
+  EXPECT_NE(resp.find("not found"), std::string::npos);
+}
+
+TEST(GatewayTest, BackendDown) {
+  int port;
+  {
+    FakeOllama server;
+    port = server.port();
+  }
+  GatewayOptions go;
+  go.port = 0;
+  go.backend_server = "127.0.0.1";
+  go.backend_port = port;
+  Gateway gateway(go);
+  gateway.Start();
+
+  std::string body = R"({"model":"m","messages":[]})";
+  std::string resp = RawRequest(
+      gateway.port(), "POST /api/chat HTTP/1.1\r\nConnection: close\r\n"
+                      "Content-Length: " +
+                          std::to_string(body.size()) + "\r\n\r\n" + body);
+  EXPECT_EQ(resp.substr(0, 12), "HTTP/1.1 502");
+  gateway.Stop();
+  EXPECT_EQ(gateway.stats().clients, 0u);
+}
+
+} // namespace ochat
@@ -0,0 +1,199 @@
+#include "capture.h"
+#include "fake_ollama.h"
+#include "image.h"
+#include "ochat.h"
+#include <filesystem>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <random>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace ochat {
+
+namespace {
+
+const std::string kPng = "\x89PNG\r\n\x1a\n";
+
+// a temporary directory that is removed by the destructor
+class TempDir {
+public:
+  TempDir()
+      : path_(fs::temp_directory_path() /
+              ("ochat_image_test_" + std::to_string(::getpid()) + "_" +
+               std::to_string(counter_++))) {
+    fs::create_directories(path_);
+  }
+  ~TempDir() { fs::remove_all(path_); }
+  std::string Write(const std::string &name, const std::string &data) {
+    fs::path p = path_ / name;
+    std::ofstream(p, std::ios::binary) << data;
+    return p.string();
+  }
+
+private:
+  fs::path path_;
+  static inline int counter_ = 0;
+};
+
+std::string Encode(const std::string &data, SimdLevel level) {
+  std::string out(Base64Size(data.size()), '\0');
+  Base64Encode(data.data(), data.size(), out.data(), level);
+  return out;
+}
+
+} // namespace
+
+TEST(Base64Test, KnownVectors) {
+  // RFC 4648 test vectors
+  std::vector<std::pair<std::string, std::string>> vectors = {
+      {"", ""},         {"f", "Zg=="},         {"fo", "Zm8="},
+      {"foo", "Zm9v"},  {"foob", "Zm9vYg=="},  {"fooba", "Zm9vYmE="},
+      {"foobar", "Zm9vYmFy"}};
+  for (auto &[in, out] : vectors) {
+    EXPECT_EQ(Encode(in, SimdLevel::kScalar), out);
+    EXPECT_EQ(Encode(in, DetectSimd()), out);
+  }
+  std::string all;
+  for (int c = 0; c < 256; ++c) {
+    all.push_back(static_cast<char>(c));
+  }
+  EXPECT_EQ(Encode(all, DetectSimd()).substr(0, 32),
+            "AAECAwQFBgcICQoLDA0ODxAREhMUFRYX");
+}
+
+TEST(Base64Test, SimdMatchesScalar) {
+  if (DetectSimd() == SimdLevel::kScalar) {
+    GTEST_SKIP() << "no SIMD support";
+  }
+  std::mt19937 rng(7);
+  std::string data(1 << 20, '\0');
+  for (auto &c : data) {
+    c = static_cast<char>(rng());
+  }
+  for (std::size_t n = 0; n < 200; ++n) {
+    std::string in = data.substr(n, n);
+    ASSERT_EQ(Encode(in, DetectSimd()), Encode(in, SimdLevel::kScalar))
+        << "size " << n;
+  }
+  EXPECT_EQ(Encode(data, DetectSimd()), Encode(data, SimdLevel::kScalar));
+}
+
+TEST(ImageTest, Formats) {
+  auto format = [](const std::string &data) {
+    const char *f = ImageFormat(
+        reinterpret_cast<const unsigned char *>(data.data()), data.size());
+    return std::string(f ? f : "");
+  };
+  EXPECT_EQ(format(kPng + "data"), "png");
+  EXPECT_EQ(format("\xff\xd8\xff\xe0"), "jpeg");
+  EXPECT_EQ(format("GIF89a"), "gif");
+  EXPECT_EQ(format(std::string("RIFF\x10\0\0\0WEBPVP8 ", 16)), "webp");
+  EXPECT_EQ(format(std::string("RIFF\x10\0\0\0WAVE", 12)), "");
+  EXPECT_EQ(format("hello"), "");
+  EXPECT_EQ(format(""), "");
+}
+
+TEST(ImageTest, MappedFile) {
+  TempDir dir;
+  MappedFile file(dir.Write("a.png", kPng + "abc"));
+  EXPECT_EQ(file.size(), 11u);
+  EXPECT_EQ(std::string(reinterpret_cast<const char *>(file.data()), 11),
+            kPng + "abc");
+  MappedFile empty(dir.Write("empty", ""));
+  EXPECT_EQ(empty.size(), 0u);
+  EXPECT_THROW(MappedFile(dir.Write("x", "") + ".missing"), std::runtime_error);
+  EXPECT_THROW(MappedFile(fs::temp_directory_path().string()),
+               std::runtime_error);
+}
+
+TEST(ImageCacheTest, ReusesUnchangedFiles) {
+  TempDir dir;
+  std::string a = dir.Write("a.png", kPng + "first");
+  ImageCache cache;
+  auto e1 = cache.Encode(a);
+  auto e2 = cache.Encode(a);
+  EXPECT_EQ(e1, e2);
+  EXPECT_EQ(cache.encoded(), 1u);
+  EXPECT_EQ(*e1, Encode(kPng + "first", SimdLevel::kScalar));
+  EXPECT_EQ(cache.bytes(), e1->size());
+
+  // a file that changed is encoded again
+  dir.Write("a.png", kPng + "second!");
+  auto e3 = cache.Encode(a);
+  EXPECT_EQ(*e3, Encode(kPng + "second!", SimdLevel::kScalar));
+  EXPECT_EQ(cache.encoded(), 2u);
+  EXPECT_EQ(cache.bytes(), e3->size());
+  EXPECT_EQ(*e1, Encode(kPng + "first", SimdLevel::kScalar)); // still valid
+
+  EXPECT_THROW(cache.Encode(dir.Write("b.txt", "text")), std::runtime_error);
+  EXPECT_THROW(cache.Encode(a + ".missing"), std::runtime_error);
+}
+
+TEST(ImageCacheTest, EvictsLeastRecentlyUsed) {
+  TempDir dir;
+  std::string a = dir.Write("a.png", kPng + "1234");  // 16 encoded bytes
+  std::string b = dir.Write("b.png", kPng + "5678");
+  std::string c = dir.Write("c.png", kPng + "9012");
+  ImageCache cache(40);
+  cache.Encode(a);
+  cache.Encode(b);
+  cache.Encode(a); // b is now the least recently used
+  cache.Encode(c);
+  EXPECT_EQ(cache.bytes(), 32u);
+  EXPECT_EQ(cache.encoded(), 3u);
+  cache.Encode(a);
+  EXPECT_EQ(cache.encoded(), 3u);
+  cache.Encode(b);
+  EXPECT_EQ(cache.encoded(), 4u);
+}
+
+// the image is sent with the prompt and resent from the history with the
+// following prompts without encoding it again
+TEST(ImageTest, HistoryResendsEncodedImage) {
+  TempDir dir;
+  std::string image = kPng + std::string(100000, 'x');
+  std::string path = dir.Write("shot.png", image);
+  std::string encoded = Encode(image, SimdLevel::kScalar);
+
+  FakeOllamaOptions fo;
+  fo.ttft_ms = 1;
+  fo.token_ms = 0;
+  FakeOllama server(fo);
+  std::string capture_path = dir.Write("chat.ocap", "");
+  {
+    Options opt;
+    opt.server = "127.0.0.1";
+    opt.port = server.port();
+    opt.model_options["num_predict"] = 2;
+    std::ostringstream out;
+    OllamaChat chat(opt, out);
+    chat.SetTransportFactory(RecordingTransports(
+        [] { return std::make_unique<TcpTransport>(); },
+        std::make_shared<CaptureWriter>(capture_path)));
+    EXPECT_EQ(chat.AttachImage(path), encoded.size());
+    chat.SendRequestToAi("What is in this picture?");
+    EXPECT_EQ(chat.attached_images(), 0u);
+    chat.SendRequestToAi("And now?");
+  }
+
+  Capture capture = Capture::Load(capture_path);
+  ASSERT_EQ(capture.connections().size(), 2u);
+  for (auto &conn : capture.connections()) {
+    std::string sent;
+    for (auto &r : conn.records) {
+      if (r.kind == CaptureRecord::kSent) {
+        sent += r.data;
+      }
+    }
+    size_t pos = sent.find("\"images\": [\"" + encoded + "\"]");
+    ASSERT_NE(pos, std::string::npos);
+    EXPECT_EQ(sent.find(encoded, pos + encoded.size()), std::string::npos);
+  }
+}
+
+} // namespace ochat
@@ -0,0 +1,359 @@
+// This file contains unit tests for the vector store and the document
+// ingestion pipeline.
+//
+#include "ingest.h"
+#include "retriever.h"
+#include "vector_store.h"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace fs = std::filesystem;
+using namespace ochat;
+
+namespace {
+
+// a temporary directory that is removed by the destructor
+class TempDir {
+public:
+  TempDir() {
+    path_ = fs::temp_directory_path() /
+            ("ochat_ingest_test_" + std::to_string(::getpid()) + "_" +
+             std::to_string(counter_++));
+    fs::create_directories(path_);
+  }
+  ~TempDir() { fs::remove_all(path_); }
+  std::string Write(const std::string &name, const std::string &text) {
+    fs::path p = path_ / name;
+    fs::create_directories(p.parent_path());
+    std::ofstream(p, std::ios::binary) << text;
+    return p.string();
+  }
+  std::string Path(const std::string &name) const {
+    return (path_ / name).string();
+  }
+
+private:
+  fs::path path_;
+  static inline int counter_ = 0;
+};
+
+// fake embedding: the first bytes of the text, records the inputs and the
+// number of requests running at the same time
+struct FakeEmbedder {
+  std::mutex mutex;
+  std::vector<std::string> inputs;
+  std::atomic<int> running{0};
+  std::atomic<int> max_running{0};
+  int delay_ms = 0;
+
+  EmbedFn Fn() {
+    return [this](const std::vector<std::string> &in) {
+      int now = ++running;
+      int prev = max_running.load();
+      while (now > prev && !max_running.compare_exchange_weak(prev, now)) {
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms));
+      std::vector<std::vector<float>> out;
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto &t : in) {
+          inputs.push_back(t);
+          out.push_back({float(t[0]), float(t.size()), 1.0f, 0.0f});
+        }
+      }
+      --running;
+      return out;
+    };
+  }
+};
+
+} // namespace
+
+TEST(VectorStoreTest, HalfConversion) {
+  for (float f : {0.0f, 1.0f, -2.5f, 0.333251953125f, 65504.0f, 6.1035156e-5f,
+                  5.9604645e-8f}) {
+    EXPECT_EQ(HalfToFloat(FloatToHalf(f)), f) << f;
+  }
+  EXPECT_NEAR(HalfToFloat(FloatToHalf(0.1f)), 0.1f, 1e-4);
+  EXPECT_EQ(FloatToHalf(1e6f), 0x7C00);   // overflows to infinity
+  EXPECT_EQ(FloatToHalf(-1e-9f), 0x8000); // underflows to -0
+}
+
+TEST(VectorStoreTest, RoundTrip) {
+  TempDir dir;
+  std::string path = dir.Path("test.vec");
+  for (VecType type : {VecType::kF32, VecType::kF16}) {
+    {
+      VectorStoreWriter w(path, 3, type);
+      float v0[] = {1.0f, 0.5f, -0.25f};
+      float v1[] = {0.0f, 2.0f, 3.0f};
+      w.Add(v0, {"a.txt", 0x1234, 0, 5, "hello"});
+      w.Add(v1, {"b.txt", 0xffffffffffffffffull, 7, 9, "\"x\"\n"});
+      w.Close();
+    }
+    VectorStore s;
+    ASSERT_TRUE(s.Open(path));
+    ASSERT_EQ(s.size(), 2);
+    EXPECT_EQ(s.dim(), 3);
+    EXPECT_EQ(s.type(), type);
+    EXPECT_EQ(reinterpret_cast<std::uintptr_t>(s.data()) % 64, 0);
+    float out[3];
+    s.Get(1, out);
+    EXPECT_EQ(out[1], 2.0f);
+    EXPECT_EQ(out[2], 3.0f);
+    EXPECT_EQ(s.meta()[0].text, "hello");
+    EXPECT_EQ(s.meta()[1].hash, 0xffffffffffffffffull);
+    EXPECT_EQ(s.meta()[1].text, "\"x\"\n");
+    EXPECT_EQ(s.meta()[1].begin, 7);
+  }
+  VectorStore missing;
+  EXPECT_FALSE(missing.Open(dir.Path("missing.vec")));
+}
+
+// the store is replaced with a single rename: a reader that opened the old
+// store keeps it, the new store is one file
+TEST(VectorStoreTest, ReplacedAtomically) {
+  TempDir dir;
+  std::string path = dir.Path("r.vec");
+  float v[] = {1, 2};
+  {
+    VectorStoreWriter w(path, 2, VecType::kF32);
+    w.Add(v, {"old.txt", 1, 0, 3, "old"});
+    w.Close();
+  }
+  VectorStore reader;
+  ASSERT_TRUE(reader.Open(path));
+  {
+    VectorStoreWriter w(path, 2, VecType::kF32);
+    w.Add(v, {"new.txt", 2, 0, 3, "new"});
+    w.Add(v, {"new.txt", 2, 3, 6, "two"});
+    w.Close();
+  }
+  EXPECT_EQ(reader.size(), 1);
+  EXPECT_EQ(reader.meta()[0].text, "old");
+  VectorStore s;
+  ASSERT_TRUE(s.Open(path));
+  ASSERT_EQ(s.size(), 2);
+  EXPECT_EQ(s.meta()[1].text, "two");
+  EXPECT_EQ(std::distance(fs::directory_iterator(dir.Path("")),
+                          fs::directory_iterator()),
+            1);
+
+  // an empty store
+  VectorStoreWriter(path, 2, VecType::kF32).Close();
+  ASSERT_TRUE(s.Open(path));
+  EXPECT_EQ(s.size(), 0);
+}
+
+TEST(VectorStoreTest, AbandonedWriterLeavesNoStore) {
+  TempDir dir;
+  {
+    VectorStoreWriter w(dir.Path("x.vec"), 2, VecType::kF32);
+    float v[] = {1, 2};
+    w.Add(v, {});
+  }
+  EXPECT_FALSE(fs::exists(dir.Path("x.vec")));
+  EXPECT_FALSE(fs::exists(dir.Path("x.vec.tmp")));
+}
+
+TEST(ChunkTextTest, SplitsAtLinesWithOverlap) {
+  std::string text;
+  for (int i = 0; i < 20; ++i) {
+    text += "line " + std::to_string(i) + " of the file\n";
+  }
+  auto chunks = ChunkText(text, 100, 30);
+  ASSERT_GT(chunks.size(), 1);
+  EXPECT_EQ(chunks.front().begin, 0);
+  EXPECT_EQ(chunks.back().end, text.size());
+  for (size_t i = 0; i < chunks.size(); ++i) {
+    auto &c = chunks[i];
+    EXPECT_LE(c.end - c.begin, 100);
+    EXPECT_EQ(c.text, text.substr(c.begin, c.end - c.begin));
+    EXPECT_EQ(c.text.back(), '\n');
+    if (i > 0) {
+      EXPECT_LT(c.begin, chunks[i - 1].end); // overlaps the previous chunk
+      EXPECT_EQ(text[c.begin - 1], '\n');    // and starts at a line
+    }
+  }
+}
+
+TEST(ChunkTextTest, NoLineBreaksOrBlank) {
+  std::string text(250, 'x');
+  text.replace(99, 2, "\xc3\xa9"); // a 2 byte character across the boundary
+  auto chunks = ChunkText(text, 100, 10);
+  ASSERT_EQ(chunks.size(), 3);
+  EXPECT_EQ(chunks[0].end, 99); // does not split the character
+  EXPECT_TRUE(ChunkText(" \n\n  \n", 100, 10).empty());
+  EXPECT_TRUE(ChunkText("", 100, 10).empty());
+}
+
+TEST(IngestTest, IncrementalByContentHash) {
+  TempDir src;
+  TempDir out;
+  src.Write("a.cpp", "int a;\n");
+  src.Write("sub/b.cpp", "int b;\n");
+  src.Write("c.txt", "skipped by extension\n");
+  src.Write(".git/d.cpp", "hidden\n");
+  src.Write("e.cpp", std::string("bin\0ary", 7));
+  std::string store = out.Path("s.vec");
+
+  IngestOptions opt;
+  opt.extensions = {".cpp"};
+  FakeEmbedder fake;
+  IngestStats stats = Ingest(src.Path(""), store, fake.Fn(), opt);
+  EXPECT_EQ(stats.files, 2);
+  EXPECT_EQ(stats.chunks, 2);
+  EXPECT_EQ(stats.chunks_embedded, 2);
+  EXPECT_EQ(fake.inputs.size(), 2);
+
+  // change one file, remove one and add one
+  src.Write("a.cpp", "int a = 1;\n");
+  fs::remove(src.Path("sub/b.cpp"));
+  src.Write("f.cpp", "int f;\n");
+  fake.inputs.clear();
+  stats = Ingest(src.Path(""), store, fake.Fn(), opt);
+  EXPECT_EQ(stats.files, 2);
+  EXPECT_EQ(stats.files_reused, 0);
+  EXPECT_EQ(fake.inputs,
+            (std::vector<std::string>{"int a = 1;\n", "int f;\n"}));
+
+  // nothing changed, nothing is embedded
+  fake.inputs.clear();
+  stats = Ingest(src.Path(""), store, fake.Fn(), opt);
+  EXPECT_EQ(stats.files_reused, 2);
+  EXPECT_EQ(stats.requests, 0);
+  EXPECT_TRUE(fake.inputs.empty());
+
+  VectorStore s;
+  ASSERT_TRUE(s.Open(store));
+  ASSERT_EQ(s.size(), 2);
+  EXPECT_EQ(s.meta()[0].text, "int a = 1;\n");
+  EXPECT_EQ(s.meta()[1].text, "int f;\n");
+  EXPECT_EQ(fs::path(s.meta()[1].file).filename(), "f.cpp");
+  // the vectors are normalized
+  float v[4];
+  s.Get(0, v);
+  float norm = v[0] * v[0] + v[1] * v[1] + v[2] * v[2] + v[3] * v[3];
+  EXPECT_NEAR(norm, 1.0f, 1e-3);
+}
+
+// a store of an older format is reported by Open() and rebuilt by Ingest()
+TEST(IngestTest, RebuildsOlderFormat) {
+  TempDir src;
+  TempDir out;
+  src.Write("a.cpp", "int a;\n");
+  std::string store = out.Path("s.vec");
+  FakeEmbedder fake;
+  Ingest(src.Path(""), store, fake.Fn());
+  {
+    std::fstream f(store, std::ios::binary | std::ios::in | std::ios::out);
+    std::uint32_t version = 1;
+    f.seekp(4);
+    f.write(reinterpret_cast<const char *>(&version), sizeof(version));
+  }
+  VectorStore old;
+  EXPECT_THROW(old.Open(store), std::runtime_error);
+
+  fake.inputs.clear();
+  std::ostringstream log;
+  IngestStats stats = Ingest(src.Path(""), store, fake.Fn(), {}, &log);
+  EXPECT_EQ(stats.files_reused, 0);
+  EXPECT_EQ(fake.inputs, (std::vector<std::string>{"int a;\n"}));
+  EXPECT_NE(log.str().find("rebuilding"), std::string::npos);
+  VectorStore s;
+  ASSERT_TRUE(s.Open(store));
+  EXPECT_EQ(s.size(), 1);
+}
+
+TEST(IngestTest, RequestsInFlightConcurrently) {
+  TempDir src;
+  TempDir out;
+  for (int i = 0; i < 32; ++i) {
+    src.Write("f" + std::to_string(i) + ".txt", "file " + std::to_string(i));
+  }
+  IngestOptions opt;
+  opt.batch_size = 2;
+  opt.in_flight = 4;
+  FakeEmbedder fake;
+  fake.delay_ms = 20;
+  IngestStats stats = Ingest(src.Path(""), out.Path("s.vec"), fake.Fn(), opt);
+  EXPECT_EQ(stats.requests, 16);
+  EXPECT_EQ(stats.chunks, 32);
+  EXPECT_EQ(fake.max_running.load(), 4);
+
+  // the store is in file order, regardless of the completion order
+  VectorStore s;
+  ASSERT_TRUE(s.Open(out.Path("s.vec")));
+  for (size_t i = 1; i < s.size(); ++i) {
+    EXPECT_LT(s.meta()[i - 1].file, s.meta()[i].file);
+  }
+}
+
+TEST(IngestTest, EmbeddingFailureKeepsOldStore) {
+  TempDir src;
+  TempDir out;
+  src.Write("a.txt", "alpha");
+  FakeEmbedder fake;
+  Ingest(src.Path(""), out.Path("s.vec"), fake.Fn());
+  src.Write("a.txt", "beta");
+  EmbedFn failing = [](const std::vector<std::string> &)
+      -> std::vector<std::vector<float>> {
+    throw std::runtime_error("server down");
+  };
+  EXPECT_THROW(Ingest(src.Path(""), out.Path("s.vec"), failing),
+               std::runtime_error);
+  VectorStore s;
+  ASSERT_TRUE(s.Open(out.Path("s.vec")));
+  ASSERT_EQ(s.size(), 1);
+  EXPECT_EQ(s.meta()[0].text, "alpha");
+}
+
+TEST(RetrieverTest, ContextFromNearestChunks) {
+  TempDir src;
+  TempDir out;
+  src.Write("apple.txt", "apples are red");
+  src.Write("banana.txt", "bananas are yellow");
+  src.Write("cherry.txt", "cherries are dark red");
+  // embeds by the first letter, so a query finds the file it starts like
+  EmbedFn embed = [](const std::vector<std::string> &in) {
+    std::vector<std::vector<float>> out;
+    for (auto &t : in) {
+      out.push_back({t[0] == 'a' ? 1.0f : 0.0f, t[0] == 'b' ? 1.0f : 0.0f,
+                     t[0] == 'c' ? 1.0f : 0.1f});
+    }
+    return out;
+  };
+  Ingest(src.Path(""), out.Path("s.vec"), embed);
+
+  RetrieverOptions opt;
+  opt.top_k = 1;
+  Retriever r(embed, opt);
+  EXPECT_FALSE(r.Open(out.Path("missing.vec")));
+  ASSERT_TRUE(r.Open(out.Path("s.vec")));
+  auto hits = r.Search("bread", 3);
+  ASSERT_EQ(hits.size(), 3);
+  EXPECT_EQ(r.store().meta()[hits[0].id].text, "bananas are yellow");
+  std::string context = r.Context("crimson");
+  EXPECT_NE(context.find("cherry.txt (bytes 0-21)\ncherries are dark red\n"),
+            std::string::npos);
+  EXPECT_EQ(context.find("apples"), std::string::npos);
+
+  // large stores are searched with a saved HNSW index
+  opt.hnsw_min_size = 1;
+  Retriever big(embed, opt);
+  ASSERT_TRUE(big.Open(out.Path("s.vec")));
+  EXPECT_TRUE(fs::exists(out.Path("s.vec.hnsw")));
+  EXPECT_EQ(big.store().meta()[big.Search("apple", 1)[0].id].text,
+            "apples are red");
+}
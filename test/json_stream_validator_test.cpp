@@ -0,0 +1,147 @@
+// This file contains unit tests for the incremental JSON schema validator used
+// for structured output.
+//
+#include "json_stream_validator.h"
+#include <gtest/gtest.h>
+#include <string>
+#include <string_view>
+
+using ochat::JsonStreamValidator;
+
+namespace {
+
+const char *kPersonSchema = R"({
+  "type": "object",
+  "properties": {
+    "name": {"type": "string", "maxLength": 10},
+    "age": {"type": "integer", "minimum": 0},
+    "mood": {"enum": ["happy", "sad"]},
+    "tags": {"type": "array", "items": {"type": "string"}, "maxItems": 2}
+  },
+  "required": ["name", "age"],
+  "additionalProperties": false
+})";
+
+// feed the text one character at a time (like a stream of tokens), returns
+// the number of characters accepted before a violation was detected.
+size_t FeedByChar(JsonStreamValidator &v, std::string_view text) {
+  for (size_t i = 0; i < text.size(); ++i) {
+    if (!v.Feed(text.substr(i, 1)))
+      return i;
+  }
+  return text.size();
+}
+
+} // namespace
+
+TEST(JsonStreamValidatorTest, AnyJson) {
+  JsonStreamValidator v;
+  std::string doc = R"( {"a": [1, 2.5, "x\né"], "b": {"c": null}} )";
+  EXPECT_EQ(FeedByChar(v, doc), doc.size());
+  EXPECT_TRUE(v.Finish());
+  EXPECT_EQ(v.Partial().as_object().at("a").as_array()[2].as_string(),
+            "x\n\xc3\xa9");
+}
+
+TEST(JsonStreamValidatorTest, TopLevelNumber) {
+  JsonStreamValidator v(boost::json::parse(R"({"type": "integer"})"));
+  EXPECT_TRUE(v.Feed("42"));
+  EXPECT_FALSE(v.complete());
+  EXPECT_TRUE(v.Finish());
+  EXPECT_EQ(v.Partial().as_int64(), 42);
+}
+
+TEST(JsonStreamValidatorTest, ValidDocument) {
+  JsonStreamValidator v(boost::json::parse(kPersonSchema));
+  std::string doc =
+      R"({"name": "Ann", "age": 31, "mood": "happy", "tags": ["a", "b"]})";
+  EXPECT_EQ(FeedByChar(v, doc), doc.size());
+  EXPECT_TRUE(v.complete());
+  EXPECT_TRUE(v.Finish());
+}
+
+TEST(JsonStreamValidatorTest, WrongTypeDetectedAtFirstChar) {
+  JsonStreamValidator v(boost::json::parse(kPersonSchema));
+  std::string doc = R"({"name": "Ann", "age": "31"})";
+  EXPECT_EQ(FeedByChar(v, doc), doc.find("\"31\""));
+  EXPECT_TRUE(v.failed());
+  EXPECT_EQ(v.error(), "string not allowed at /age");
+  EXPECT_FALSE(v.Feed("}"));
+}
+
+TEST(JsonStreamValidatorTest, EnumPrefixMismatch) {
+  JsonStreamValidator v(boost::json::parse(kPersonSchema));
+  std::string doc = R"({"mood": "hungry"})";
+  // "h" could still become "happy", "hu" cannot
+  EXPECT_EQ(FeedByChar(v, doc), doc.find("hungry") + 1);
+  EXPECT_EQ(v.error(), "value is not one of the allowed values at /mood");
+}
+
+TEST(JsonStreamValidatorTest, UnknownPropertyPrefix) {
+  JsonStreamValidator v(boost::json::parse(kPersonSchema));
+  std::string doc = R"({"nickname": "Al"})";
+  // "n" could still become "name", "ni" cannot
+  EXPECT_EQ(FeedByChar(v, doc), doc.find("nickname") + 1);
+  EXPECT_TRUE(v.failed());
+}
+
+TEST(JsonStreamValidatorTest, PropertyNameThatIsOnlyAPrefix) {
+  JsonStreamValidator v(boost::json::parse(kPersonSchema));
+  EXPECT_FALSE(v.Feed(R"({"nam": )"));
+  EXPECT_EQ(v.error(), "property 'nam' not allowed at /");
+}
+
+TEST(JsonStreamValidatorTest, MissingRequired) {
+  JsonStreamValidator v(boost::json::parse(kPersonSchema));
+  EXPECT_TRUE(v.Feed(R"({"name": "Ann")"));
+  EXPECT_FALSE(v.Feed("}"));
+  EXPECT_EQ(v.error(), "missing required property 'age' at /");
+}
+
+TEST(JsonStreamValidatorTest, StringTooLong) {
+  JsonStreamValidator v(boost::json::parse(kPersonSchema));
+  std::string doc = R"({"name": "Bartholomew the third"})";
+  EXPECT_EQ(FeedByChar(v, doc), doc.find("Bartholomew") + 10);
+}
+
+TEST(JsonStreamValidatorTest, NumberLimits) {
+  JsonStreamValidator v(boost::json::parse(kPersonSchema));
+  EXPECT_FALSE(v.Feed(R"({"name": "Ann", "age": -1,)"));
+  EXPECT_EQ(v.error(), "number is less than the minimum at /age");
+
+  v.Reset();
+  EXPECT_FALSE(v.Feed(R"({"name": "Ann", "age": 1.5})"));
+  EXPECT_EQ(v.error(), "integer expected at /age");
+}
+
+TEST(JsonStreamValidatorTest, TooManyItems) {
+  JsonStreamValidator v(boost::json::parse(kPersonSchema));
+  EXPECT_FALSE(v.Feed(R"({"tags": ["a", "b", "c"]})"));
+  EXPECT_EQ(v.error(), "too many items in array at /tags/2");
+}
+
+TEST(JsonStreamValidatorTest, SyntaxErrors) {
+  JsonStreamValidator v;
+  EXPECT_FALSE(v.Feed(R"({"a" 1})"));
+  v.Reset();
+  EXPECT_FALSE(v.Feed(R"([1, 2})"));
+  v.Reset();
+  EXPECT_FALSE(v.Feed("{} {}"));
+  v.Reset();
+  EXPECT_FALSE(v.Feed("tru "));
+  v.Reset();
+  EXPECT_TRUE(v.Feed(R"({"a": [1)"));
+  EXPECT_FALSE(v.Finish());
+  EXPECT_EQ(v.error(), "incomplete JSON document at /a/0");
+}
+
+TEST(JsonStreamValidatorTest, PartialView) {
+  JsonStreamValidator v(boost::json::parse(kPersonSchema));
+  EXPECT_TRUE(v.Feed(R"({"name": "An)"));
+  EXPECT_EQ(v.Partial().as_object().at("name").as_string(), "An");
+  EXPECT_TRUE(v.Feed(R"(n", "tags": ["x")"));
+  auto &obj = v.Partial().as_object();
+  EXPECT_EQ(obj.at("name").as_string(), "Ann");
+  EXPECT_EQ(obj.at("tags").as_array().size(), 1);
+  EXPECT_FALSE(v.complete());
+}
@@ -0,0 +1,205 @@
+#include "fake_ollama.h"
+#include "hdr_histogram.h"
+#include "loadgen.h"
+#include "ochat.h"
+#include <gtest/gtest.h>
+#include <random>
+#include <sstream>
+#include <vector>
+
+namespace ochat {
+
+TEST(HdrHistogramTest, Percentiles) {
+  HdrHistogram h;
+  for (int v = 1; v <= 10000; ++v) {
+    h.Record(v);
+  }
+  EXPECT_EQ(h.count(), 10000);
+  EXPECT_EQ(h.min(), 1);
+  EXPECT_EQ(h.max(), 10000);
+  EXPECT_NEAR(h.mean(), 5000.5, 0.01);
+  // 3 significant digits
+  EXPECT_NEAR(h.ValueAtPercentile(50), 5000, 5);
+  EXPECT_NEAR(h.ValueAtPercentile(99), 9900, 10);
+  EXPECT_EQ(h.ValueAtPercentile(100), 10000);
+  EXPECT_EQ(h.ValueAtPercentile(0), 1);
+}
+
+TEST(HdrHistogramTest, LargeValuesAndMerge) {
+  HdrHistogram a;
+  HdrHistogram b;
+  a.Record(100, 99);
+  b.Record(60LL * 1000 * 1000); // one minute in microseconds
+  a.Merge(b);
+  EXPECT_EQ(a.count(), 100);
+  EXPECT_EQ(a.ValueAtPercentile(99), 100);
+  std::int64_t p100 = a.ValueAtPercentile(100);
+  EXPECT_LE(p100, 60LL * 1000 * 1000);
+  EXPECT_GE(p100, 60LL * 1000 * 1000 - a.EquivalentRange(p100));
+  HdrHistogram other(1, 1000, 2);
+  EXPECT_THROW(a.Merge(other), std::invalid_argument);
+}
+
+TEST(DistTest, Parse) {
+  std::mt19937_64 rng(1);
+  EXPECT_EQ(Dist::Parse("12").Sample(rng), 12);
+  Dist u = Dist::Parse("10:20");
+  EXPECT_EQ(u.Mean(), 15);
+  for (int i = 0; i < 100; ++i) {
+    double v = u.Sample(rng);
+    EXPECT_GE(v, 10);
+    EXPECT_LE(v, 20);
+  }
+  EXPECT_EQ(Dist::Parse("exp:5").Mean(), 5);
+  EXPECT_GE(Dist::Parse("normal:5,10").Sample(rng), 0);
+  EXPECT_THROW(Dist::Parse("abc"), std::invalid_argument);
+  EXPECT_THROW(Dist::Parse("20:10"), std::invalid_argument);
+  EXPECT_THROW(Dist::Parse("normal:5"), std::invalid_argument);
+}
+
+TEST(FakeOllamaTest, StreamsTokensWithStats) {
+  FakeOllamaOptions fo;
+  fo.ttft_ms = 5;
+  fo.token_ms = 1;
+  FakeOllama server(fo);
+
+  Options opt;
+  opt.server = "127.0.0.1";
+  opt.port = server.port();
+  opt.model_options["num_predict"] = 8;
+  std::ostringstream out;
+  OllamaChat chat(opt, out);
+  std::vector<std::string> tokens;
+  chat.SetTokenHandler(
+      [&tokens](std::string_view t) { tokens.emplace_back(t); });
+  chat.SendRequestToAi("hello");
+
+  EXPECT_EQ(tokens.size(), 8u);
+  EXPECT_TRUE(chat.last_stats().done);
+  EXPECT_EQ(chat.last_stats().eval_count, 8);
+  EXPECT_GT(chat.last_stats().prompt_eval_count, 0);
+  EXPECT_GE(chat.last_stats().prompt_eval_duration, 5 * 1000 * 1000);
+  EXPECT_EQ(server.requests(), 1u);
+}
+
+TEST(FakeOllamaTest, Embed) {
+  FakeOllamaOptions fo;
+  fo.embed_dim = 16;
+  FakeOllama server(fo);
+  Options opt;
+  opt.server = "127.0.0.1";
+  opt.port = server.port();
+  std::ostringstream out;
+  OllamaChat chat(opt, out);
+  auto vecs = chat.Embed({"a", "b", "a"});
+  ASSERT_EQ(vecs.size(), 3u);
+  EXPECT_EQ(vecs[0].size(), 16u);
+  EXPECT_EQ(vecs[0], vecs[2]);
+  EXPECT_NE(vecs[0], vecs[1]);
+}
+
+TEST(LoadgenTest, ClosedLoop) {
+  FakeOllamaOptions fo;
+  fo.parallel = 2;
+  fo.ttft_ms = 5;
+  fo.token_ms = 1;
+  FakeOllama server(fo);
+
+  Options opt;
+  opt.server = "127.0.0.1";
+  opt.port = server.port();
+  LoadgenOptions lo;
+  lo.sessions = 3;
+  lo.turns = 2;
+  lo.response_tokens = Dist(4);
+  LoadgenReport r = RunLoad(opt, lo);
+
+  EXPECT_EQ(r.sessions, 3);
+  EXPECT_EQ(r.requests, 6);
+  EXPECT_EQ(r.errors, 0);
+  EXPECT_EQ(r.tokens, 24);
+  EXPECT_EQ(r.ttft.count(), 6);
+  EXPECT_EQ(r.itl.count(), 18);
+  EXPECT_EQ(r.e2e.count(), 6);
+  EXPECT_GE(r.ttft.min(), 5000);
+  EXPECT_EQ(server.requests(), 6u);
+
+  auto json = r.ToJson();
+  EXPECT_EQ(json["requests"].as_int64(), 6);
+  EXPECT_TRUE(json["latency"].as_object().contains("ttft"));
+  EXPECT_NE(r.ToText().find("ttft"), std::string::npos);
+}
+
+TEST(LoadgenTest, OpenLoopCountsQueueing) {
+  FakeOllamaOptions fo;
+  fo.ttft_ms = 20;
+  fo.token_ms = 1;
+  FakeOllama server(fo);
+
+  Options opt;
+  opt.server = "127.0.0.1";
+  opt.port = server.port();
+  LoadgenOptions lo;
+  lo.sessions = 1; // one session at a time, arrivals wait for it
+  lo.turns = 1;
+  lo.rate = 1000;
+  lo.response_tokens = Dist(2);
+  LoadgenReport r = RunLoad(opt, lo);
+
+  EXPECT_EQ(r.requests, 1);
+  lo.duration_s = 0.05; // about 50 arrivals, served one at a time
+  r = RunLoad(opt, lo);
+  EXPECT_GT(r.requests, 10);
+  EXPECT_EQ(r.errors, 0);
+  // the later arrivals waited for the earlier sessions
+  EXPECT_GT(r.schedule.max(), 100 * 1000);
+  EXPECT_GT(r.e2e.max(), r.schedule.max());
+}
+
+TEST(LoadgenTest, SharedScheduler) {
+  FakeOllamaOptions fo;
+  fo.parallel = 4;
+  fo.ttft_ms = 10;
+  fo.token_ms = 1;
+  FakeOllama server(fo);
+
+  Options opt;
+  opt.server = "127.0.0.1";
+  opt.port = server.port();
+  SchedulerOptions so;
+  so.max_in_flight = 1;
+  LoadgenOptions lo;
+  lo.sessions = 3;
+  lo.turns = 2;
+  lo.response_tokens = Dist(2);
+  lo.batch_fraction = 0.5;
+  lo.scheduler = std::make_shared<RequestScheduler>(so);
+  LoadgenReport r = RunLoad(opt, lo);
+
+  EXPECT_EQ(r.errors, 0);
+  auto m = lo.scheduler->Metrics();
+  EXPECT_EQ(m.admitted, 6);
+  EXPECT_GE(m.max_queued, 1u);
+  EXPECT_TRUE(m.in_flight.empty());
+  EXPECT_EQ(m.queue_wait_us[1].count(), 4); // two of the sessions are batch
+}
+
+TEST(LoadgenTest, ConnectionErrors) {
+  int port;
+  {
+    FakeOllama server;
+    port = server.port();
+  }
+  Options opt;
+  opt.server = "127.0.0.1";
+  opt.port = port;
+  opt.max_retries = 0;
+  LoadgenOptions lo;
+  lo.sessions = 2;
+  lo.turns = 3;
+  LoadgenReport r = RunLoad(opt, lo);
+  EXPECT_EQ(r.requests, 2); // each session stops at its first error
+  EXPECT_EQ(r.errors, 2);
+}
+
+} // namespace ochat
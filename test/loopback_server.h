@@ -0,0 +1,88 @@
+// This file contains the helpers of the servers that the tests run at the
+// other end of a LoopbackTransport, or of a local TCP or Unix socket.
+//
+#ifndef __LOOPBACK_SERVER_H__
+#define __LOOPBACK_SERVER_H__
+
+#include "http_resp.h"
+#include <boost/asio.hpp>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace ochat {
+
+// A request received by a test server.
+struct LoopbackRequest {
+  std::string method; // e.g. "POST"
+  std::string target; // e.g. "/api/chat"
+  std::string header; // the raw header, including the request line
+  std::string body;
+};
+
+/**
+ * Reads a request from the connection.
+ *
+ * @param socket The server end of the connection.
+ * @return The request.
+ * @throw boost::system::system_error if the connection is closed.
+ */
+template <class Socket> LoopbackRequest ReadLoopbackRequest(Socket &socket) {
+  boost::asio::streambuf buf;
+  boost::asio::read_until(socket, buf, "\r\n\r\n");
+  HttpReqHeader hdr;
+  std::size_t hdr_len = ParseHttpReqHeader(buf, hdr);
+  LoopbackRequest req;
+  req.method = hdr.method;
+  req.target = hdr.target;
+  req.header.assign(boost::asio::buffer_cast<const char *>(buf.data()),
+                    hdr_len);
+  std::size_t length =
+      hdr.content_length > 0 ? static_cast<std::size_t>(hdr.content_length) : 0;
+  buf.consume(hdr_len);
+  if (buf.size() < length) {
+    boost::asio::read(socket, buf,
+                      boost::asio::transfer_exactly(length - buf.size()));
+  }
+  req.body.assign(boost::asio::buffer_cast<const char *>(buf.data()), length);
+  return req;
+}
+
+/**
+ * Writes a response with a Content-Length.
+ *
+ * @param socket The server end of the connection.
+ * @param body The body of the response.
+ * @param status The status code, e.g. 500 for an error.
+ */
+template <class Socket>
+void WriteLoopbackResponse(Socket &socket, const std::string &body,
+                           int status = 200) {
+  std::ostringstream resp;
+  resp << "HTTP/1.1 " << status << (status == 200 ? " OK" : " Error")
+       << "\r\nContent-Length: " << body.size() << "\r\n\r\n"
+       << body;
+  boost::asio::write(socket, boost::asio::buffer(resp.str()));
+}
+
+/**
+ * Writes a chunked (streamed) response, one chunk per message.
+ *
+ * @param socket The server end of the connection.
+ * @param messages The messages of the response, each ending with a newline.
+ */
+template <class Socket>
+void WriteChunkedResponse(Socket &socket,
+                          const std::vector<std::string> &messages) {
+  std::ostringstream resp;
+  resp << "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n" << std::hex;
+  for (auto &msg : messages) {
+    resp << msg.size() << "\r\n" << msg << "\r\n";
+  }
+  resp << "0\r\n\r\n";
+  boost::asio::write(socket, boost::asio::buffer(resp.str()));
+}
+
+} // namespace ochat
+
+#endif // __LOOPBACK_SERVER_H__
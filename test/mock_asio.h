@@ -78,16 +78,13 @@ std::size_t read_until(BSocket &s, BStreamBuf &b, string_view delim,
   return MockAsio::inst().read_until(s, b, delim, ec);
 }
 
+// TcpTransport opens the socket for real, and connects it here.
 template <>
-typename boost::asio::ip::tcp::endpoint connect(
-    basic_socket<boost::asio::ip::tcp, boost::asio::any_io_executor> &s,
-    const boost::asio::ip::basic_resolver_results<boost::asio::ip::tcp>
-        &endpoints,
-    typename constraint<is_endpoint_sequence<
-        boost::asio::ip::basic_resolver_results<boost::asio::ip::tcp>>::value>::
-        type) {
-  boost::asio::ip::tcp::endpoint ep;
-  return ep;
+BOOST_ASIO_SYNC_OP_VOID
+basic_socket<boost::asio::ip::tcp, boost::asio::any_io_executor>::connect(
+    const endpoint_type &peer_endpoint, boost::system::error_code &ec) {
+  ec = boost::system::error_code();
+  BOOST_ASIO_SYNC_OP_VOID_RETURN(ec);
 }
 
 template <>
@@ -98,6 +95,17 @@ std::size_t write(
   return MockAsio::inst().write(s, b);
 }
 
+// writes of const buffers (e.g. from a const std::string) are forwarded to the
+// same mock method as mutable buffers.
+template <>
+std::size_t write(
+    BSyncWrStream &s, const boost::asio::const_buffers_1 &b,
+    typename boost::asio::constraint<boost::asio::is_const_buffer_sequence<
+        boost::asio::const_buffers_1>::value>::type) {
+  BConstBufSeqType mb(const_cast<void *>(b.data()), b.size());
+  return MockAsio::inst().write(s, mb);
+}
+
 } // namespace asio
 } // namespace boost
 
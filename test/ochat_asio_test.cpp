@@ -81,7 +81,7 @@ TEST(SendRequestToAiTest, ContentLength) {
     MockAsio mock_asio;
 
     std::string resp{"HTTP/1.1 200 OK\r\nContent-Length: "
-                     "13\r\n\r\n{\"message\":{\"content\":\"Hello, World!\"}}"};
+                     "39\r\n\r\n{\"message\":{\"content\":\"Hello, World!\"}}"};
     std::string expected_post =
         "POST /api/chat HTTP/1.1\r\nHost: localhost\r\nContent-Type: "
         "application/json\r\nContent-Length: 97\r\n\r\n{  \"model\": "
@@ -207,4 +207,297 @@ TEST(SendRequestToAiTest, CheckHeaderMissingLengthNotChunked) {
             return resp.size(); // Return the number of bytes written
           });
   EXPECT_THROW(oc.SendRequestToAi(req), std::runtime_error);
-}
\ No newline at end of file
+}
+// error case, server responds with a non 200 status and an error message in
+// the body (throws ochat::HttpError with the message from the server)
+TEST(SendRequestToAiTest, ErrorStatusWithBody) {
+  ochat::Options opt;
+  opt.stream_resp = false;
+  opt.server = "localhost";
+  opt.port = 8000;
+  std::stringstream ss;
+  OllamaChatTest_F oc(opt, ss);
+  MockAsio mock_asio;
+
+  std::string resp{"HTTP/1.1 404 Not Found\r\n"
+                   "Content-Type: application/json\r\n"
+                   "Content-Length: 37\r\n\r\n"
+                   "{\"error\":\"model 'davinci' not found\"}"};
+
+  EXPECT_CALL(mock_asio, write(_, _));
+  EXPECT_CALL(mock_asio, read_until(_, BufIsEmpty(), _))
+      .WillOnce([resp](BSocket & /*s*/, BStreamBuf &b, string_view /*delim*/) {
+        std::ostream os(&b);
+        os << resp;
+        return resp.size();
+      });
+  try {
+    oc.SendRequestToAi("Hi!");
+    FAIL() << "Expected ochat::HttpError" << endl;
+  } catch (const ochat::HttpError &e) {
+    EXPECT_EQ(e.status(), 404);
+    EXPECT_FALSE(e.busy());
+    EXPECT_EQ(std::string(e.what()),
+              "Server returned HTTP 404: model 'davinci' not found");
+  }
+  EXPECT_TRUE(oc.GetHistoryObj().empty());
+}
+
+// error case, server is busy and no retries are allowed (throws
+// ochat::HttpError with the Retry-After value)
+TEST(SendRequestToAiTest, BusyNoRetry) {
+  ochat::Options opt;
+  opt.server = "localhost";
+  opt.port = 8000;
+  opt.max_retries = 0;
+  std::stringstream ss;
+  OllamaChatTest_F oc(opt, ss);
+  MockAsio mock_asio;
+
+  vector<string> resp{"HTTP/1.1 429 Too Many Requests\r\n"
+                      "Retry-After: 5\r\n"
+                      "Transfer-Encoding: chunked\r\n\r\n",
+                      "4\r\nbusy\r\n", "0\r\n\r\n"};
+  auto itResp = resp.begin();
+  EXPECT_CALL(mock_asio, write(_, _));
+  EXPECT_CALL(mock_asio, read_until(_, _, _))
+      .Times(resp.size())
+      .WillRepeatedly(
+          [&itResp](BSocket & /*s*/, BStreamBuf &b, string_view /*delim*/) {
+            std::ostream os(&b);
+            size_t resp_size = itResp->size();
+            os << *itResp++;
+            return resp_size;
+          });
+  try {
+    oc.SendRequestToAi("Hi!");
+    FAIL() << "Expected ochat::HttpError" << endl;
+  } catch (const ochat::HttpError &e) {
+    EXPECT_EQ(e.status(), 429);
+    EXPECT_TRUE(e.busy());
+    EXPECT_EQ(e.retry_after(), 5);
+    EXPECT_EQ(std::string(e.what()), "Server returned HTTP 429: busy");
+  }
+}
+
+// structured output, the stream is abandoned at the first chunk that violates
+// the requested schema (throws ochat::SchemaViolation)
+TEST(SendRequestToAiTest, SchemaViolationAbortsStream) {
+  ochat::Options opt;
+  opt.server = "localhost";
+  opt.port = 8000;
+  opt.format = R"({"type":"object","properties":{"n":{"type":"integer"}}})";
+  std::stringstream ss;
+  OllamaChatTest_F oc(opt, ss);
+  MockAsio mock_asio;
+
+  int partial_updates = 0;
+  oc.obj_.SetStructuredOutputHandler(
+      [&partial_updates](const boost::json::value &v) {
+        EXPECT_TRUE(v.is_object());
+        ++partial_updates;
+      });
+
+  // the remaining chunks are never read once the violation is seen
+  vector<string> resp{
+      "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n",
+      "21\r\n{\"message\":{\"content\":\"{\\\"n\\\":\"}}\r\n",
+      "20\r\n{\"message\":{\"content\":\" \\\"x\\\"\"}}\r\n",
+      "0\r\n\r\n"};
+  auto itResp = resp.begin();
+  EXPECT_CALL(mock_asio, write(_, _));
+  EXPECT_CALL(mock_asio, read_until(_, _, _))
+      .Times(3)
+      .WillRepeatedly(
+          [&itResp](BSocket & /*s*/, BStreamBuf &b, string_view /*delim*/) {
+            std::ostream os(&b);
+            size_t resp_size = itResp->size();
+            os << *itResp++;
+            return resp_size;
+          });
+  try {
+    oc.SendRequestToAi("Hi!");
+    FAIL() << "Expected ochat::SchemaViolation" << endl;
+  } catch (const ochat::SchemaViolation &e) {
+    EXPECT_EQ(std::string(e.what()),
+              "Response violates the requested format, string not allowed "
+              "at /n");
+  }
+  EXPECT_EQ(partial_updates, 1);
+  EXPECT_TRUE(oc.GetHistoryObj().empty());
+}
+
+// the model requests a tool call, the result is sent back in a follow up
+// request and the final answer is saved to the history.
+TEST(SendRequestToAiTest, ToolCallRoundTrip) {
+  ochat::Options opt;
+  opt.server = "localhost";
+  opt.port = 8000;
+  std::stringstream ss;
+  OllamaChatTest_F oc(opt, ss);
+  MockAsio mock_asio;
+
+  ochat::Tool add;
+  add.name = "add";
+  add.parameters = R"({"type":"object"})";
+  add.fn = [](const boost::json::object &args) {
+    return std::to_string(args.at("a").as_int64() + args.at("b").as_int64());
+  };
+  oc.obj_.RegisterTool(add);
+
+  std::string call = "{\"message\":{\"content\":\"\",\"tool_calls\":[{"
+                     "\"function\":{\"name\":\"add\",\"arguments\":{\"a\":1,"
+                     "\"b\":2}}}]}}";
+  std::string answer = "{\"message\":{\"content\":\"It is 3\"}}";
+  auto hex = [](size_t n) {
+    std::stringstream h;
+    h << std::hex << n;
+    return h.str();
+  };
+  vector<string> resp{
+      "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n",
+      hex(call.size()) + "\r\n" + call + "\r\n", "0\r\n\r\n",
+      "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n",
+      hex(answer.size()) + "\r\n" + answer + "\r\n", "0\r\n\r\n"};
+  auto itResp = resp.begin();
+  vector<string> posts;
+  EXPECT_CALL(mock_asio, write(_, _))
+      .Times(2)
+      .WillRepeatedly([&posts](BSyncWrStream &s, const BConstBufSeqType &b) {
+        posts.emplace_back(static_cast<const char *>(b.data()), b.size());
+        return b.size();
+      });
+  EXPECT_CALL(mock_asio, read_until(_, _, _))
+      .Times(resp.size())
+      .WillRepeatedly(
+          [&itResp](BSocket & /*s*/, BStreamBuf &b, string_view /*delim*/) {
+            std::ostream os(&b);
+            size_t resp_size = itResp->size();
+            os << *itResp++;
+            return resp_size;
+          });
+
+  oc.SendRequestToAi("What is 1 + 2?");
+
+  ASSERT_EQ(posts.size(), 2);
+  EXPECT_NE(posts[1].find(R"({"role":"tool","content":"3","tool_name":"add"})"),
+            std::string::npos);
+  EXPECT_NE(posts[1].find(R"("tool_calls":[{"function":{"name":"add",)"),
+            std::string::npos);
+  auto &history = oc.GetHistoryObj();
+  ASSERT_EQ(history.size(), 1);
+  EXPECT_NE(history[0].find(R"({"role":"tool","content":"3")"),
+            std::string::npos);
+  EXPECT_NE(history[0].find("\"It is 3\""), std::string::npos);
+}
+
+// the connection drops in the middle of a streamed answer, the client
+// reconnects and asks the model to continue the partial answer.
+TEST(SendRequestToAiTest, ResumeAfterDisconnect) {
+  ochat::Options opt;
+  opt.server = "localhost";
+  opt.port = 8000;
+  opt.reconnect_backoff_ms = 1;
+  std::stringstream ss;
+  OllamaChatTest_F oc(opt, ss);
+  MockAsio mock_asio;
+
+  vector<string> resp{
+      "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n",
+      "20\r\n{\"message\":{\"content\":\"Hello,\"}}\r\n",
+      "", // connection reset
+      "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n",
+      "21\r\n{\"message\":{\"content\":\" World!\"}}\r\n", "0\r\n\r\n"};
+  auto itResp = resp.begin();
+  vector<string> posts;
+  EXPECT_CALL(mock_asio, write(_, _))
+      .Times(2)
+      .WillRepeatedly([&posts](BSyncWrStream &s, const BConstBufSeqType &b) {
+        posts.emplace_back(static_cast<const char *>(b.data()), b.size());
+        return b.size();
+      });
+  EXPECT_CALL(mock_asio, read_until(_, _, _))
+      .Times(resp.size())
+      .WillRepeatedly(
+          [&itResp](BSocket & /*s*/, BStreamBuf &b, string_view /*delim*/) {
+            if (itResp->empty()) {
+              ++itResp;
+              throw boost::system::system_error(
+                  boost::asio::error::connection_reset);
+            }
+            std::ostream os(&b);
+            size_t resp_size = itResp->size();
+            os << *itResp++;
+            return resp_size;
+          });
+
+  oc.SendRequestToAi("Hi!");
+
+  ASSERT_EQ(posts.size(), 2);
+  EXPECT_NE(posts[1].find("{ \"role\": \"user\", \"content\": \"Hi!\" },\n"
+                          "   { \"role\": \"assistant\", \"content\": "
+                          "\"Hello,\" }  ]"),
+            std::string::npos);
+  // the answer is displayed as one response
+  std::string out = ss.str();
+  EXPECT_EQ(out.find("AI: "), out.rfind("AI: "));
+  EXPECT_LT(out.find("Hello,"), out.find(" World!"));
+  auto &history = oc.GetHistoryObj();
+  ASSERT_EQ(history.size(), 1);
+  EXPECT_NE(history[0].find("\"Hello, World!\""), std::string::npos);
+}
+
+// the connection keeps failing, the error is reported after the configured
+// number of reconnects.
+TEST(SendRequestToAiTest, ReconnectAttemptsExhausted) {
+  ochat::Options opt;
+  opt.server = "localhost";
+  opt.port = 8000;
+  opt.reconnect_attempts = 2;
+  opt.reconnect_backoff_ms = 1;
+  std::stringstream ss;
+  OllamaChatTest_F oc(opt, ss);
+  MockAsio mock_asio;
+
+  EXPECT_CALL(mock_asio, write(_, _)).Times(3);
+  EXPECT_CALL(mock_asio, read_until(_, _, _))
+      .Times(3)
+      .WillRepeatedly([](BSocket & /*s*/, BStreamBuf & /*b*/,
+                         string_view /*delim*/) -> std::size_t {
+        throw boost::system::system_error(boost::asio::error::eof);
+      });
+  EXPECT_THROW(oc.SendRequestToAi("Hi!"), boost::system::system_error);
+}
+
+// embeddings for a batch of inputs are returned in a single response
+TEST(EmbedTest, BatchResponse) {
+  ochat::Options opt;
+  opt.server = "localhost";
+  opt.port = 8000;
+  std::stringstream ss;
+  OllamaChatTest_F oc(opt, ss);
+  MockAsio mock_asio;
+
+  std::string body{R"({"model":"m","embeddings":[[1,0],[0,1],[0.5,0.5]]})"};
+  std::string resp{"HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n"
+                   "Content-Length: " +
+                   std::to_string(body.size()) + "\r\n\r\n" + body};
+
+  EXPECT_CALL(mock_asio, write(_, _))
+      .WillOnce([](BSyncWrStream & /*s*/, const BConstBufSeqType &b) {
+        std::string req(static_cast<const char *>(b.data()), b.size());
+        EXPECT_NE(req.find("POST /api/embed "), std::string::npos);
+        EXPECT_NE(req.find(R"("input": ["a", "b", "c"])"), std::string::npos);
+        return b.size();
+      });
+  EXPECT_CALL(mock_asio, read_until(_, BufIsEmpty(), _))
+      .WillOnce([resp](BSocket & /*s*/, BStreamBuf &b, string_view /*delim*/) {
+        std::ostream os(&b);
+        os << resp;
+        return resp.size();
+      });
+  auto vecs = oc.obj_.Embed({"a", "b", "c"});
+  ASSERT_EQ(vecs.size(), 3);
+  EXPECT_EQ(vecs[2], (std::vector<float>{0.5f, 0.5f}));
+  EXPECT_TRUE(oc.obj_.Embed({}).empty());
+}
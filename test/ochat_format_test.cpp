@@ -4,19 +4,20 @@
 #include "app_config.h"
 #include "ochat.h"
 #include "ochat_test_f.h"
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <future>
 #include <gtest/gtest.h>
 #include <iostream>
+#include <stdexcept>
+#include <thread>
 #include <string>
+#include <unistd.h>
 #include <vector>
 
 using OllamaChatTest_F = testing::OllamaChatTest_F;
 
-// Mock an input stream for testing purposes
-class FakeInputStream : public std::stringstream {
-public:
-  FakeInputStream(std::string str) : std::stringstream(str) {}
-};
-
 TEST(OchatTest, TestStringify) {
   EXPECT_EQ(std::string(STRINGIFY(314)), std::string("314"));
 }
@@ -55,30 +56,168 @@ TEST(FormatRequestTest, Basic) {
   EXPECT_EQ(oc.FormatPostRequest(prompt, history), expected);
 }
 
+TEST(FormatRequestTest, StructuredOutput) {
+  std::vector<std::string> history;
+  ochat::Options opt;
+  opt.model = "davinci";
+  opt.stream_resp = true;
+  opt.format = "json";
+  OllamaChatTest_F oc(opt);
+  EXPECT_NE(oc.FormatPostRequest("Hi", history)
+                .find("  \"stream\": true,  \"format\": \"json\", \"messages\""),
+            std::string::npos);
+
+  // a schema is sent as is
+  opt.format = R"({"type":"object"})";
+  OllamaChatTest_F oc_schema(opt);
+  EXPECT_NE(oc_schema.FormatPostRequest("Hi", history)
+                .find(R"("format": {"type":"object"},)"),
+            std::string::npos);
+}
+
+TEST(FormatRequestTest, Tools) {
+  std::vector<std::string> history;
+  ochat::Options opt;
+  OllamaChatTest_F oc(opt);
+  ochat::Tool tool;
+  tool.name = "get_time";
+  tool.description = "Current time";
+  tool.parameters = R"({"type":"object","properties":{}})";
+  oc.obj_.RegisterTool(tool);
+
+  EXPECT_NE(oc.FormatPostRequest("What \"time\" is it?", history)
+                .find(R"(  "tools": [{"type":"function","function":{"name":)"
+                      R"("get_time","description":"Current time","parameters":)"
+                      R"({"type":"object","properties":{}}}}], "messages": [)"
+                      R"(   { "role": "user", "content": "What \"time\" is )"
+                      R"(it?" })"),
+            std::string::npos);
+
+  tool.parameters = "not json";
+  EXPECT_THROW(oc.obj_.RegisterTool(tool), std::invalid_argument);
+}
+
+TEST(FormatRequestTest, ModelOptions) {
+  std::vector<std::string> history;
+  ochat::Options opt;
+  opt.model_options["num_predict"] = 16;
+  OllamaChatTest_F oc(opt);
+  EXPECT_NE(oc.FormatPostRequest("Hi", history)
+                .find(R"(  "options": {"num_predict":16}, "messages": [)"),
+            std::string::npos);
+}
+
+// the profile of the model is sent, the model options replace its values
+TEST(FormatRequestTest, ModelProfiles) {
+  std::vector<std::string> history;
+  ochat::Options opt;
+  opt.model = "llama3.2:1b";
+  opt.embed_model = "embed";
+  opt.profiles["llama3.2:1b"]["num_ctx"] = 8192;
+  opt.profiles["llama3.2:1b"]["num_thread"] = 8;
+  opt.profiles["embed"]["num_thread"] = 4;
+  opt.model_options["num_thread"] = 2;
+  OllamaChatTest_F oc(opt);
+  EXPECT_NE(oc.FormatPostRequest("Hi", history)
+                .find(R"("options": {"num_ctx":8192,"num_thread":2}, )"),
+            std::string::npos);
+  EXPECT_NE(oc.FormatEmbedRequest({"a"}).find(
+                R"("options": {"num_thread":4},  "input": ["a"])"),
+            std::string::npos);
+
+  // the other models do not get the options
+  oc.obj_.options().model = "qwen3:4b";
+  EXPECT_NE(oc.FormatPostRequest("Hi", history)
+                .find(R"("options": {"num_thread":2}, )"),
+            std::string::npos);
+}
+
+TEST(FormatRequestTest, ContextProvider) {
+  std::vector<std::string> history;
+  OllamaChatTest_F oc;
+  oc.obj_.SetContextProvider([](const std::string &prompt) {
+    return prompt == "skip" ? "" : "context for " + prompt;
+  });
+  EXPECT_NE(oc.FormatPostRequest("Hi", history)
+                .find(R"(   { "role": "system", "content": "context for Hi" },)"
+                      "\n"
+                      R"(   { "role": "user", "content": "Hi" })"),
+            std::string::npos);
+  EXPECT_EQ(oc.FormatPostRequest("skip", history).find("system"),
+            std::string::npos);
+  oc.obj_.SetContextProvider(nullptr);
+  EXPECT_EQ(oc.FormatPostRequest("Hi", history).find("system"),
+            std::string::npos);
+}
+
+TEST(FormatRequestTest, Images) {
+  std::string path = (std::filesystem::temp_directory_path() /
+                      ("ochat_format_test_" + std::to_string(::getpid()) +
+                       ".png"))
+                         .string();
+  std::ofstream(path, std::ios::binary) << "\x89PNG\r\n\x1a\nfoobar";
+  std::vector<std::string> history;
+  OllamaChatTest_F oc;
+  EXPECT_EQ(oc.obj_.AttachImage(path), 20u);
+  EXPECT_EQ(oc.obj_.AttachImage(path), 20u);
+  EXPECT_EQ(oc.obj_.attached_images(), 2u);
+  std::filesystem::remove(path);
+
+  std::string req = oc.FormatPostRequest("Look", history);
+  EXPECT_NE(req.find(R"(   { "role": "user", "content": "Look", "images": )"
+                     R"(["iVBORw0KGgpmb29iYXI=", "iVBORw0KGgpmb29iYXI="] }  ]})"),
+            std::string::npos);
+  // the body is assembled in place, its size must match the header
+  size_t body = req.find("\r\n\r\n") + 4;
+  EXPECT_NE(req.find("Content-Length: " + std::to_string(req.size() - body)),
+            std::string::npos);
+
+  oc.ResetContext();
+  EXPECT_EQ(oc.obj_.attached_images(), 0u);
+  EXPECT_EQ(oc.FormatPostRequest("Look", history).find("images"),
+            std::string::npos);
+}
+
+TEST(FormatRequestTest, Embed) {
+  ochat::Options opt;
+  opt.server = "localhost";
+  opt.embed_model = "all-minilm";
+  OllamaChatTest_F oc(opt);
+  std::string json = R"({  "model": "all-minilm",  "input": ["a \"b\"", "c"]})";
+  EXPECT_EQ(oc.FormatEmbedRequest({"a \"b\"", "c"}),
+            "POST /api/embed HTTP/1.1\r\nHost: localhost\r\n"
+            "Content-Type: application/json\r\nContent-Length: " +
+                std::to_string(json.size()) + "\r\n\r\n" + json);
+}
+
 TEST(ParseHttpRespHeaderTest, CompleteHttpResponse) {
   std::string response = "HTTP/1.1 200 OK\r\n"
                          "Content-Type: application/json\r\n"
                          "Date: Mon, 27 Jul 2009 12:28:53 GMT\r\n"
                          "\r\n";
-  FakeInputStream input(response);
 
-  OllamaChatTest_F oc;
-  std::map<std::string, std::string> headers = oc.ParseHttpRespHeader(input);
+  ochat::HttpRespHeader hdr;
+  EXPECT_EQ(ochat::ParseHttpRespHeader(response, hdr), response.size());
 
-  EXPECT_EQ(headers["Status"], "HTTP/1.1 200 OK\r");
-  EXPECT_EQ(headers["Content-Type"], "application/json\r");
-  EXPECT_EQ(headers["Date"], "Mon, 27 Jul 2009 12:28:53 GMT\r");
+  EXPECT_EQ(hdr.status, 200);
+  EXPECT_EQ(hdr.reason, "OK");
+  EXPECT_EQ(hdr.num_fields, 2);
+  EXPECT_EQ(hdr.Get("Content-Type"), "application/json");
+  EXPECT_EQ(hdr.Get("Date"), "Mon, 27 Jul 2009 12:28:53 GMT");
+  EXPECT_FALSE(hdr.chunked);
+  EXPECT_EQ(hdr.content_length, -1);
+  EXPECT_FALSE(hdr.conn_close);
 }
 
 TEST(ParseHttpRespHeaderTest, StatusLineWithSpaces) {
-  std::string response = "HTTP/1.1 200 OK\r\n"
+  std::string response = "HTTP/1.1 404 Not Found\r\n"
                          "\r\n";
-  FakeInputStream input(response);
 
-  OllamaChatTest_F oc;
-  std::map<std::string, std::string> headers = oc.ParseHttpRespHeader(input);
+  ochat::HttpRespHeader hdr;
+  EXPECT_EQ(ochat::ParseHttpRespHeader(response, hdr), response.size());
 
-  EXPECT_EQ(headers["Status"], "HTTP/1.1 200 OK\r");
+  EXPECT_EQ(hdr.status, 404);
+  EXPECT_EQ(hdr.reason, "Not Found");
 }
 
 TEST(ParseHttpRespHeaderTest, InvalidHeader) {
@@ -87,34 +226,129 @@ TEST(ParseHttpRespHeaderTest, InvalidHeader) {
                          "Date: Mon, 27 Jul 2009 12:28:53 GMT\r\n"
                          "Invalid-Header\r\n"
                          "\r\n";
-  FakeInputStream input(response);
 
-  OllamaChatTest_F oc;
-  std::map<std::string, std::string> headers = oc.ParseHttpRespHeader(input);
+  ochat::HttpRespHeader hdr;
+  EXPECT_EQ(ochat::ParseHttpRespHeader(response, hdr), response.size());
 
-  EXPECT_EQ(headers["Status"], "HTTP/1.1 200 OK\r");
-  EXPECT_EQ(headers["Content-Type"], "application/json\r");
-  EXPECT_EQ(headers["Date"], "Mon, 27 Jul 2009 12:28:53 GMT\r");
+  EXPECT_EQ(hdr.status, 200);
+  EXPECT_EQ(hdr.num_fields, 2);
+  EXPECT_EQ(hdr.Get("Content-Type"), "application/json");
+  EXPECT_EQ(hdr.Get("Date"), "Mon, 27 Jul 2009 12:28:53 GMT");
+  EXPECT_FALSE(hdr.Has("Invalid-Header"));
 }
 
 TEST(ParseHttpRespHeaderTest, EmptyResponse) {
   std::string response = "";
-  FakeInputStream input(response);
 
-  OllamaChatTest_F oc;
-  std::map<std::string, std::string> headers = oc.ParseHttpRespHeader(input);
+  ochat::HttpRespHeader hdr;
+  EXPECT_EQ(ochat::ParseHttpRespHeader(response, hdr), 0);
+  EXPECT_EQ(hdr.num_fields, 0);
+}
 
-  EXPECT_TRUE(headers.empty());
+TEST(ParseHttpRespHeaderTest, IncompleteHeader) {
+  std::string response = "HTTP/1.1 200 OK\r\n"
+                         "Content-Type: application/json\r\n";
+
+  ochat::HttpRespHeader hdr;
+  EXPECT_EQ(ochat::ParseHttpRespHeader(response, hdr), 0);
 }
 
 TEST(ParseHttpRespHeaderTest, NoHeaders) {
-  std::string response = "HTTP/1.1 200 OK\r\n\r\n";
-  FakeInputStream input(response);
+  std::string response = "HTTP/1.1 200 OK\r\n\r\n{\"body\":1}";
 
-  OllamaChatTest_F oc;
-  std::map<std::string, std::string> headers = oc.ParseHttpRespHeader(input);
+  ochat::HttpRespHeader hdr;
+  EXPECT_EQ(ochat::ParseHttpRespHeader(response, hdr), 19);
+
+  EXPECT_EQ(hdr.status, 200);
+  EXPECT_EQ(hdr.num_fields, 0);
+}
+
+TEST(ParseHttpRespHeaderTest, CaseInsensitiveFields) {
+  std::string response = "HTTP/1.1 200 OK\r\n"
+                         "transfer-encoding:  Chunked \r\n"
+                         "CONNECTION: Close\r\n"
+                         "\r\n";
+
+  ochat::HttpRespHeader hdr;
+  EXPECT_EQ(ochat::ParseHttpRespHeader(response, hdr), response.size());
+
+  EXPECT_TRUE(hdr.chunked);
+  EXPECT_TRUE(hdr.conn_close);
+  EXPECT_EQ(hdr.Get("Transfer-Encoding"), "Chunked");
+  EXPECT_EQ(hdr.Get("connection"), "Close");
+}
+
+TEST(ParseHttpRespHeaderTest, ContentLengthAndRetryAfter) {
+  std::string response = "HTTP/1.1 503 Service Unavailable\r\n"
+                         "Content-Length: 42\r\n"
+                         "Retry-After: 7\r\n"
+                         "\r\n";
+
+  ochat::HttpRespHeader hdr;
+  EXPECT_EQ(ochat::ParseHttpRespHeader(response, hdr), response.size());
+
+  EXPECT_EQ(hdr.status, 503);
+  EXPECT_EQ(hdr.content_length, 42);
+  EXPECT_EQ(hdr.retry_after, 7);
+}
+
+TEST(ParseHttpRespHeaderTest, Http10ClosesByDefault) {
+  ochat::HttpRespHeader hdr;
+  ochat::ParseHttpRespHeader(std::string_view("HTTP/1.0 200 OK\r\n\r\n"), hdr);
+  EXPECT_TRUE(hdr.conn_close);
+
+  ochat::ParseHttpRespHeader(
+      std::string_view("HTTP/1.0 200 OK\r\nConnection: keep-alive\r\n\r\n"),
+      hdr);
+  EXPECT_FALSE(hdr.conn_close);
+}
+
+TEST(ParseHttpRespHeaderTest, MalformedStatusLine) {
+  ochat::HttpRespHeader hdr;
+  EXPECT_THROW(
+      ochat::ParseHttpRespHeader(std::string_view("garbage\r\n\r\n"), hdr),
+      std::runtime_error);
+  EXPECT_THROW(ochat::ParseHttpRespHeader(
+                   std::string_view("HTTP/1.1 2x0 OK\r\n\r\n"), hdr),
+               std::runtime_error);
+}
+
+TEST(ParseHttpReqHeaderTest, RequestLineAndFields) {
+  std::string request = "POST /api/chat HTTP/1.1\r\n"
+                        "Host: localhost\r\n"
+                        "Content-Length: 12\r\n"
+                        "Connection: close\r\n"
+                        "\r\n{\"a\":1}";
+  ochat::HttpReqHeader hdr;
+  EXPECT_EQ(ochat::ParseHttpReqHeader(request, hdr), request.size() - 7);
+  EXPECT_EQ(hdr.method, "POST");
+  EXPECT_EQ(hdr.target, "/api/chat");
+  EXPECT_EQ(hdr.content_length, 12);
+  EXPECT_TRUE(hdr.conn_close);
+  EXPECT_EQ(hdr.Get("host"), "localhost");
+
+  ochat::ParseHttpReqHeader(std::string_view("GET / HTTP/1.0\r\n\r\n"), hdr);
+  EXPECT_EQ(hdr.method, "GET");
+  EXPECT_TRUE(hdr.conn_close);
+  EXPECT_EQ(ochat::ParseHttpReqHeader(std::string_view("GET / HTTP/1.1\r\n"),
+                                      hdr),
+            0);
+  EXPECT_THROW(ochat::ParseHttpReqHeader(
+                   std::string_view("GET /only-two\r\n\r\n"), hdr),
+               std::runtime_error);
 
-  EXPECT_EQ(headers["Status"], "HTTP/1.1 200 OK\r");
+  // a length that does not fit in a long is rejected, not wrapped
+  EXPECT_THROW(ochat::ParseHttpReqHeader(
+                   std::string_view("POST / HTTP/1.1\r\n"
+                                    "Content-Length: 18446744073709551617\r\n"
+                                    "\r\n"),
+                   hdr),
+               std::runtime_error);
+  EXPECT_THROW(ochat::ParseHttpReqHeader(
+                   std::string_view("POST / HTTP/1.1\r\n"
+                                    "Content-Length: +12\r\n\r\n"),
+                   hdr),
+               std::runtime_error);
 }
 
 // Test case: JSON with missing content
@@ -149,6 +383,23 @@ TEST(GetMsgContentFromJsonTest, EmptyJson) {
   EXPECT_TRUE(oc.GetMsgContentFromJson(json_str).empty());
 }
 
+// Test case: JSON with tool calls
+TEST(GetMsgContentFromJsonTest, ToolCalls) {
+  std::string json_str = R"({"message": {"role": "assistant", "content": "",
+      "tool_calls": [
+        {"function": {"name": "add", "arguments": {"a": 1, "b": 2}}},
+        {"function": {"name": "neg", "arguments": "{\"a\": 5}"}}]}})";
+
+  OllamaChatTest_F oc;
+  std::vector<ochat::ToolCall> calls;
+  EXPECT_TRUE(oc.GetMsgContentFromJson(json_str, &calls).empty());
+  ASSERT_EQ(calls.size(), 2);
+  EXPECT_EQ(calls[0].name, "add");
+  EXPECT_EQ(calls[0].arguments.at("b").as_int64(), 2);
+  EXPECT_EQ(calls[1].name, "neg");
+  EXPECT_EQ(calls[1].arguments.at("a").as_int64(), 5);
+}
+
 // Test case: JSON with invalid format
 TEST(GetMsgContentFromJsonTest, InvalidJson) {
   std::string json_str = "invalid_json_string";
@@ -156,4 +407,162 @@ TEST(GetMsgContentFromJsonTest, InvalidJson) {
   OllamaChatTest_F oc;
   EXPECT_THROW(oc.GetMsgContentFromJson(json_str),
                boost::wrapexcept<boost::system::system_error>);
-}
\ No newline at end of file
+}
+// independent tool calls run concurrently, failures and timeouts are reported
+// back to the model as results.
+TEST(GetMsgContentFromJsonTest, Stats) {
+  OllamaChatTest_F oc;
+  ochat::ResponseStats stats;
+  EXPECT_EQ(oc.GetMsgContentFromJson(
+                R"({"message":{"content":"Hi"},"done":false})", nullptr,
+                &stats),
+            "Hi");
+  EXPECT_FALSE(stats.done);
+  oc.GetMsgContentFromJson(
+      R"({"message":{"content":""},"done":true,"total_duration":5000,)"
+      R"("prompt_eval_count":12,"prompt_eval_duration":1000,)"
+      R"("eval_count":34,"eval_duration":3000})",
+      nullptr, &stats);
+  EXPECT_TRUE(stats.done);
+  EXPECT_EQ(stats.prompt_eval_count, 12);
+  EXPECT_EQ(stats.eval_count, 34);
+  EXPECT_EQ(stats.total_duration, 5000);
+  EXPECT_EQ(stats.load_duration, 0);
+  EXPECT_EQ(stats.eval_duration, 3000);
+}
+
+TEST(GetEmbeddingsFromJsonTest, Embeddings) {
+  OllamaChatTest_F oc;
+  auto vecs = oc.GetEmbeddingsFromJson(
+      R"({"model":"all-minilm","embeddings":[[0.5,-1,2],[0,0.25,1e-3]]})");
+  ASSERT_EQ(vecs.size(), 2);
+  EXPECT_EQ(vecs[0], (std::vector<float>{0.5f, -1.0f, 2.0f}));
+  EXPECT_EQ(vecs[1], (std::vector<float>{0.0f, 0.25f, 1e-3f}));
+
+  EXPECT_THROW(oc.GetEmbeddingsFromJson(R"({"error":"no model"})"),
+               std::runtime_error);
+  EXPECT_THROW(oc.GetEmbeddingsFromJson("not json"), std::runtime_error);
+}
+
+TEST(RunToolCallsTest, ConcurrentWithTimeout) {
+  ochat::Options opt;
+  opt.tool_threads = 4;
+  std::stringstream ss;
+  OllamaChatTest_F oc(opt, ss);
+
+  // a and b each wait for the other to start, so they only both complete if
+  // they run at the same time
+  std::promise<void> a_started, b_started;
+  std::shared_future<void> a_ready = a_started.get_future().share();
+  std::shared_future<void> b_ready = b_started.get_future().share();
+  auto pair_tool = [](const std::string &name, std::promise<void> &started,
+                      std::shared_future<void> other) {
+    ochat::Tool t;
+    t.name = name;
+    t.parameters = "{}";
+    t.timeout = std::chrono::milliseconds(10000);
+    t.fn = [name, &started, other](const boost::json::object &) {
+      started.set_value();
+      bool both = other.wait_for(std::chrono::seconds(5)) ==
+                  std::future_status::ready;
+      return name + (both ? " done" : " alone");
+    };
+    return t;
+  };
+  oc.obj_.RegisterTool(pair_tool("a", a_started, b_ready));
+  oc.obj_.RegisterTool(pair_tool("b", b_started, a_ready));
+  ochat::Tool slow;
+  slow.name = "slow";
+  slow.parameters = "{}";
+  slow.timeout = std::chrono::milliseconds(50);
+  slow.fn = [](const boost::json::object &) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+    return std::string("slow done");
+  };
+  oc.obj_.RegisterTool(slow);
+  ochat::Tool fail;
+  fail.name = "fail";
+  fail.parameters = "{}";
+  fail.fn = [](const boost::json::object &) -> std::string {
+    throw std::runtime_error("boom");
+  };
+  oc.obj_.RegisterTool(fail);
+
+  std::vector<ochat::ToolCall> calls(5);
+  calls[0].name = "a";
+  calls[1].name = "b";
+  calls[2].name = "slow";
+  calls[3].name = "fail";
+  calls[4].name = "missing";
+
+  auto results = oc.RunToolCalls(calls);
+  ASSERT_EQ(results.size(), 5);
+  EXPECT_EQ(results[0], "a done");
+  EXPECT_EQ(results[1], "b done");
+  EXPECT_EQ(results[2], "error: tool 'slow' timed out");
+  EXPECT_EQ(results[3], "error: boom");
+  EXPECT_EQ(results[4], "error: unknown tool 'missing'");
+}
+
+// a hung tool is abandoned: it does not hold up the following calls, nor the
+// destruction of the client
+TEST(RunToolCallsTest, HungToolIsAbandoned) {
+  std::promise<void> release;
+  std::shared_future<void> released = release.get_future().share();
+  std::promise<void> release_last;
+  std::shared_future<void> last_released = release_last.get_future().share();
+  {
+    ochat::Options opt;
+    opt.tool_threads = 2;
+    std::stringstream ss;
+    OllamaChatTest_F oc(opt, ss);
+    auto hang_tool = [](const std::string &name,
+                        std::shared_future<void> until) {
+      ochat::Tool hang;
+      hang.name = name;
+      hang.parameters = "{}";
+      hang.timeout = std::chrono::milliseconds(50);
+      hang.fn = [until](const boost::json::object &) {
+        until.wait();
+        return std::string("hang done");
+      };
+      return hang;
+    };
+    oc.obj_.RegisterTool(hang_tool("hang", released));
+    oc.obj_.RegisterTool(hang_tool("hang_last", last_released));
+    ochat::Tool quick;
+    quick.name = "quick";
+    quick.parameters = "{}";
+    quick.timeout = std::chrono::milliseconds(10000);
+    quick.fn = [](const boost::json::object &) {
+      return std::string("quick done");
+    };
+    oc.obj_.RegisterTool(quick);
+    auto run = [&oc](const std::string &name) {
+      std::vector<ochat::ToolCall> calls(1);
+      calls[0].name = name;
+      return oc.RunToolCalls(calls).at(0);
+    };
+
+    EXPECT_EQ(run("hang"), "error: tool 'hang' timed out");
+    // the other thread runs the calls
+    EXPECT_EQ(run("quick"), "quick done");
+    EXPECT_EQ(run("hang"), "error: tool 'hang' timed out");
+    // both threads are hung, no more are started
+    EXPECT_EQ(run("quick"), "error: tool 'quick' not run, 2 tool calls are "
+                            "hung");
+
+    // the threads are usable again once the hung calls return
+    release.set_value();
+    std::string result;
+    for (int i = 0; i < 500 && result != "quick done"; ++i) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      result = run("quick");
+    }
+    EXPECT_EQ(result, "quick done");
+
+    // the client is destroyed while a call is hung
+    EXPECT_EQ(run("hang_last"), "error: tool 'hang_last' timed out");
+  }
+  release_last.set_value();
+}
@@ -27,19 +27,37 @@ public:
     return obj_.FormatPostRequest(prompt, history);
   }
 
-  std::map<std::string, std::string>
-  ParseHttpRespHeader(std::istream &responseStream) {
-    return obj_.ParseHttpRespHeader(responseStream);
+  ochat::HttpRespHeader ReadRespHeader(boost::asio::ip::tcp::socket &socket,
+                                       boost::asio::streambuf &resp_buff) {
+    ochat::TcpTransport conn(std::move(socket));
+    return obj_.ReadRespHeader(conn, resp_buff);
   }
 
   void ReadUntilDelimeter(boost::asio::ip::tcp::socket &socket,
                           boost::asio::streambuf &resp_buff,
                           const char *delim) {
-    obj_.ReadUntilDelimeter(socket, resp_buff, delim);
+    ochat::TcpTransport conn(std::move(socket));
+    obj_.ReadUntilDelimeter(conn, resp_buff, delim);
   }
 
-  std::string GetMsgContentFromJson(std::string json_str) {
-    return obj_.GetMsgContentFromJson(json_str);
+  std::string GetMsgContentFromJson(
+      std::string json_str, std::vector<ochat::ToolCall> *tool_calls = nullptr,
+      ochat::ResponseStats *stats = nullptr) {
+    return obj_.GetMsgContentFromJson(json_str, tool_calls, stats);
+  }
+
+  std::vector<std::string>
+  RunToolCalls(const std::vector<ochat::ToolCall> &calls) {
+    return obj_.RunToolCalls(calls);
+  }
+
+  std::string FormatEmbedRequest(const std::vector<std::string> &inputs) {
+    return obj_.FormatEmbedRequest(inputs);
+  }
+
+  std::vector<std::vector<float>>
+  GetEmbeddingsFromJson(const std::string &json_str) {
+    return obj_.GetEmbeddingsFromJson(json_str);
   }
 
   std::vector<std::string> &GetHistoryObj() { return obj_.history_; }
@@ -0,0 +1,210 @@
+#include "fake_ollama.h"
+#include "loopback_server.h"
+#include "ochat.h"
+#include "transport.h"
+#include <boost/asio.hpp>
+#include <boost/json.hpp>
+#include <chrono>
+#include <condition_variable>
+#include <gtest/gtest.h>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using boost::asio::local::stream_protocol;
+
+namespace ochat {
+
+namespace {
+
+// the requests received over loopback connections
+struct Requests {
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::vector<std::string> bodies;
+
+  void Add(std::string body) {
+    std::lock_guard<std::mutex> lock(mutex);
+    bodies.push_back(std::move(body));
+    cv.notify_all();
+  }
+  void WaitFor(std::size_t n) {
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [&] { return bodies.size() >= n; });
+  }
+};
+
+// responds to a chat request with the answer "Hi"
+void WriteAnswer(stream_protocol::socket &socket, const std::string &body) {
+  std::string msg = R"({"message":{"role":"assistant","content":"Hi"},)"
+                    R"("done":true})";
+  if (body.find("\"stream\": true") != std::string::npos) {
+    WriteChunkedResponse(socket, {msg + "\n"});
+  } else {
+    WriteLoopbackResponse(socket, msg);
+  }
+}
+
+bool IsPrefill(const std::string &body) {
+  return body.find("\"stream\": false") != std::string::npos;
+}
+
+} // namespace
+
+TEST(PrefillTest, SendsHistoryAfterResponse) {
+  Requests requests;
+  Options opt;
+  opt.prefill = true;
+  std::ostringstream out;
+  OllamaChat chat(opt, out);
+  chat.SetTransportFactory([&requests] {
+    return std::make_unique<LoopbackTransport>(
+        [&requests](stream_protocol::socket &s) {
+          std::string body = ReadLoopbackRequest(s).body;
+          requests.Add(body);
+          WriteAnswer(s, body);
+        });
+  });
+  chat.SendRequestToAi("hello");
+  chat.WaitForPrefill();
+
+  ASSERT_EQ(requests.bodies.size(), 2u);
+  EXPECT_FALSE(IsPrefill(requests.bodies[0]));
+  EXPECT_EQ(requests.bodies[0].find("keep_alive"), std::string::npos);
+  const std::string &prefill = requests.bodies[1];
+  ASSERT_TRUE(IsPrefill(prefill));
+  boost::json::object req = boost::json::parse(prefill).as_object();
+  EXPECT_EQ(req["keep_alive"].as_string(), OLLAMA_PREFILL_KEEP_ALIVE);
+  EXPECT_EQ(req["options"].as_object()["num_predict"].to_number<int>(), 1);
+  // the history ends with the answer
+  boost::json::array &msgs = req["messages"].as_array();
+  ASSERT_EQ(msgs.size(), 2u);
+  EXPECT_EQ(msgs[0].as_object()["content"].as_string(), "hello");
+  EXPECT_EQ(msgs[1].as_object()["role"].as_string(), "assistant");
+  EXPECT_EQ(msgs[1].as_object()["content"].as_string(), "Hi");
+
+  // the chat requests keep the model loaded as long as the prefill
+  chat.options().keep_alive = "1h";
+  chat.SendRequestToAi("again");
+  chat.WaitForPrefill();
+  ASSERT_EQ(requests.bodies.size(), 4u);
+  EXPECT_NE(requests.bodies[2].find("\"keep_alive\": \"1h\""),
+            std::string::npos);
+  EXPECT_NE(requests.bodies[3].find("\"keep_alive\": \"1h\""),
+            std::string::npos);
+
+  // there is nothing to prefill after a reset
+  chat.ResetContext();
+  chat.StartPrefill();
+  chat.WaitForPrefill();
+  EXPECT_EQ(requests.bodies.size(), 4u);
+}
+
+// a prompt submitted while the server evaluates the prefill cancels it
+TEST(PrefillTest, CancelledWhenPromptSubmitted) {
+  Requests requests;
+  bool prefill_closed = false;
+  Options opt;
+  opt.prefill = true;
+  std::ostringstream out;
+  OllamaChat chat(opt, out);
+  chat.SetTransportFactory([&] {
+    return std::make_unique<LoopbackTransport>(
+        [&](stream_protocol::socket &s) {
+          std::string body = ReadLoopbackRequest(s).body;
+          requests.Add(body);
+          if (!IsPrefill(body)) {
+            WriteAnswer(s, body);
+            return;
+          }
+          // never responds, the client closes the connection
+          boost::asio::streambuf buf;
+          boost::system::error_code ec;
+          boost::asio::read(s, buf, boost::asio::transfer_at_least(1), ec);
+          prefill_closed = ec == boost::asio::error::eof;
+        });
+  });
+  chat.SendRequestToAi("hello");
+  requests.WaitFor(2);
+  chat.SendRequestToAi("next");
+  EXPECT_TRUE(prefill_closed);
+  requests.WaitFor(4);
+  chat.CancelPrefill();
+  ASSERT_EQ(requests.bodies.size(), 4u);
+  EXPECT_NE(requests.bodies[2].find("next"), std::string::npos);
+  EXPECT_TRUE(IsPrefill(requests.bodies[3]));
+}
+
+// the prefill waits for the scheduler as a batch request, and leaves the
+// queue when it is cancelled
+TEST(PrefillTest, AdmittedByScheduler) {
+  Requests requests;
+  Options opt;
+  std::ostringstream out;
+  OllamaChat chat(opt, out);
+  chat.SetTransportFactory([&requests] {
+    return std::make_unique<LoopbackTransport>(
+        [&requests](stream_protocol::socket &s) {
+          std::string body = ReadLoopbackRequest(s).body;
+          requests.Add(body);
+          WriteAnswer(s, body);
+        });
+  });
+  SchedulerOptions so;
+  so.max_in_flight = 1;
+  auto scheduler = std::make_shared<RequestScheduler>(so);
+  chat.SetScheduler(scheduler, "user");
+  chat.SendRequestToAi("hello");
+
+  RequestClass rc;
+  rc.backend = opt.server + ":" + std::to_string(opt.port);
+  rc.model = opt.model;
+  auto hold = scheduler->Acquire(rc);
+  chat.StartPrefill();
+  while (scheduler->Metrics().queued[1] != 1) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  chat.CancelPrefill();
+  EXPECT_EQ(scheduler->Metrics().queued[1], 0u);
+  EXPECT_EQ(requests.bodies.size(), 1u);
+
+  hold.Release();
+  chat.StartPrefill();
+  chat.WaitForPrefill();
+  ASSERT_EQ(requests.bodies.size(), 2u);
+  EXPECT_TRUE(IsPrefill(requests.bodies[1]));
+  EXPECT_EQ(scheduler->Metrics().admitted, 3);
+}
+
+// the server has evaluated the history, including the answer, when the next
+// prompt arrives
+TEST(PrefillTest, WarmsPromptCache) {
+  auto second_prompt_tokens = [](bool prefill) {
+    FakeOllamaOptions fo;
+    fo.ttft_ms = 0;
+    fo.token_ms = 0;
+    fo.prompt_cache = true;
+    FakeOllama server(fo);
+    Options opt;
+    opt.server = "127.0.0.1";
+    opt.port = server.port();
+    opt.model_options["num_predict"] = 40;
+    opt.prefill = prefill;
+    std::ostringstream out;
+    OllamaChat chat(opt, out);
+    chat.SendRequestToAi("What is the capital of France?");
+    chat.WaitForPrefill(); // the user is typing
+    chat.SendRequestToAi("And Spain?");
+    return chat.last_stats().prompt_eval_count;
+  };
+  std::int64_t cold = second_prompt_tokens(false);
+  std::int64_t warm = second_prompt_tokens(true);
+  // only "And Spain?" is evaluated, 10 characters at about 4 per token
+  EXPECT_EQ(warm, 10 / 4 + 1);
+  EXPECT_GT(cold, warm + 20);
+}
+
+} // namespace ochat
@@ -0,0 +1,77 @@
+#include "profiles.h"
+#include <boost/json.hpp>
+#include <filesystem>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+namespace ochat {
+
+namespace {
+
+std::string TempPath(const std::string &name) {
+  return (fs::temp_directory_path() /
+          ("ochat_profiles_test_" + std::to_string(::getpid()) + "_" + name))
+      .string();
+}
+
+} // namespace
+
+TEST(ProfilesTest, SaveAndLoad) {
+  std::string path = TempPath("profiles.json");
+  EXPECT_TRUE(LoadProfiles(path).empty());
+
+  ModelProfiles profiles;
+  profiles["llama3.2:1b"]["num_ctx"] = 8192;
+  profiles["llama3.2:1b"]["num_thread"] = 8;
+  profiles["qwen3"]["seed"] = 42;
+  profiles["qwen3"]["stop"] = boost::json::array{"\n\n"};
+  SaveProfiles(path, profiles);
+  EXPECT_FALSE(fs::exists(path + ".tmp"));
+
+  ModelProfiles loaded = LoadProfiles(path);
+  ASSERT_EQ(loaded.size(), 2u);
+  EXPECT_EQ(boost::json::serialize(loaded["llama3.2:1b"]),
+            R"({"num_ctx":8192,"num_thread":8})");
+  EXPECT_EQ(boost::json::serialize(loaded["qwen3"]),
+            R"({"seed":42,"stop":["\n\n"]})");
+  fs::remove(path);
+}
+
+TEST(ProfilesTest, InvalidFile) {
+  std::string path = TempPath("invalid.json");
+  for (const char *text : {"{", "[]", R"({"m": 1})"}) {
+    std::ofstream(path) << text;
+    EXPECT_THROW(LoadProfiles(path), std::runtime_error) << text;
+  }
+  fs::remove(path);
+}
+
+// the options of all models, then of all tags of a model, then of the model
+TEST(ProfilesTest, Layers) {
+  ModelProfiles profiles;
+  profiles["*"]["num_thread"] = 4;
+  profiles["*"]["num_batch"] = 256;
+  profiles["llama3.2"]["num_batch"] = 512;
+  profiles["llama3.2"]["num_ctx"] = 4096;
+  profiles["llama3.2:1b"]["num_ctx"] = 8192;
+  boost::json::object overrides;
+  overrides["num_thread"] = 2;
+
+  EXPECT_EQ(boost::json::serialize(ProfileOptions(profiles, "llama3.2:1b")),
+            R"({"num_thread":4,"num_batch":512,"num_ctx":8192})");
+  EXPECT_EQ(boost::json::serialize(ProfileOptions(profiles, "llama3.2:3b")),
+            R"({"num_thread":4,"num_batch":512,"num_ctx":4096})");
+  EXPECT_EQ(boost::json::serialize(ProfileOptions(profiles, "llama3.2")),
+            R"({"num_thread":4,"num_batch":512,"num_ctx":4096})");
+  EXPECT_EQ(
+      boost::json::serialize(ProfileOptions(profiles, "phi4", overrides)),
+      R"({"num_thread":2,"num_batch":256})");
+  EXPECT_TRUE(ProfileOptions({}, "phi4").empty());
+}
+
+} // namespace ochat
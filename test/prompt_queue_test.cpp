@@ -0,0 +1,104 @@
+#include "fake_ollama.h"
+#include "ochat.h"
+#include "prompt_queue.h"
+#include <chrono>
+#include <gtest/gtest.h>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace ochat {
+
+TEST(PromptQueueTest, PopsInOrder) {
+  PromptQueue queue;
+  queue.Push("one");
+  queue.Push("two");
+  EXPECT_EQ(queue.size(), 2u);
+  std::string line;
+  bool waited = true;
+  ASSERT_TRUE(queue.Pop(line, &waited));
+  EXPECT_EQ(line, "one");
+  EXPECT_FALSE(waited);
+  ASSERT_TRUE(queue.Pop(line));
+  EXPECT_EQ(line, "two");
+
+  // a line pushed while waiting
+  std::thread t([&] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    queue.Push("three");
+  });
+  ASSERT_TRUE(queue.Pop(line, &waited));
+  t.join();
+  EXPECT_EQ(line, "three");
+  EXPECT_TRUE(waited);
+}
+
+TEST(PromptQueueTest, PopIfDoesNotWait) {
+  PromptQueue queue;
+  auto is_par = [](const std::string &s) { return s.rfind("/par ", 0) == 0; };
+  std::string line;
+  EXPECT_FALSE(queue.PopIf(line, is_par));
+  queue.Push("/par a");
+  queue.Push("b");
+  EXPECT_TRUE(queue.PopIf(line, is_par));
+  EXPECT_EQ(line, "/par a");
+  EXPECT_FALSE(queue.PopIf(line, is_par));
+  EXPECT_EQ(queue.size(), 1u);
+}
+
+TEST(PromptQueueTest, CloseEndsAfterQueuedLines) {
+  PromptQueue queue;
+  queue.Push("last");
+  queue.Close();
+  std::string line;
+  ASSERT_TRUE(queue.Pop(line));
+  EXPECT_EQ(line, "last");
+  EXPECT_FALSE(queue.Pop(line));
+}
+
+TEST(PromptQueueTest, ReadsLinesAsync) {
+  std::istringstream in("hello\n/par a\n/par b\n/bye\n");
+  auto queue = std::make_shared<PromptQueue>();
+  ReadLinesAsync(in, queue);
+  std::vector<std::string> lines;
+  std::string line;
+  while (queue->Pop(line)) {
+    lines.push_back(line);
+  }
+  EXPECT_EQ(lines,
+            (std::vector<std::string>{"hello", "/par a", "/par b", "/bye"}));
+}
+
+// the prompts are answered at the same time on forks of the conversation
+TEST(PromptQueueTest, ForksRunConcurrently) {
+  FakeOllamaOptions fo;
+  fo.parallel = 2;
+  fo.ttft_ms = 150;
+  fo.token_ms = 1;
+  FakeOllama server(fo);
+  Options opt;
+  opt.server = "127.0.0.1";
+  opt.port = server.port();
+  opt.model_options["num_predict"] = 3;
+  std::ostringstream out;
+  OllamaChat chat(opt, out);
+
+  auto start = std::chrono::steady_clock::now();
+  auto results = chat.Fork({"first", "second"});
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  EXPECT_LT(elapsed, std::chrono::milliseconds(290));
+  EXPECT_EQ(server.requests(), 2u);
+  ASSERT_EQ(results.size(), 2u);
+  EXPECT_EQ(results[0].label, "#1");
+  EXPECT_EQ(results[1].label, "#2");
+  for (auto &r : results) {
+    EXPECT_EQ(r.error, "");
+    EXPECT_FALSE(r.content.empty());
+  }
+  EXPECT_EQ(chat.branches(), (std::vector<std::string>{"#1", "#2"}));
+  EXPECT_NE(out.str().find("[#2] "), std::string::npos);
+}
+
+} // namespace ochat
@@ -0,0 +1,41 @@
+#include "capture.h"
+#include "ochat.h"
+#include <cstdint>
+#include <gtest/gtest.h>
+#include <sstream>
+#include <string>
+#include <string_view>
+
+namespace ochat {
+
+// testdata/chat_stream.ocap was recorded with
+//   ochat --record=chat_stream.ocap
+// against ochat_loadgen --serve-fake, a chat of two prompts.
+TEST(ReplayTest, ReplaysCheckedInCapture) {
+  Capture capture = Capture::Load("testdata/chat_stream.ocap");
+  Options opt;
+  ASSERT_EQ(capture.connections().size(), 2u);
+  for (const CaptureConnection &conn : capture.connections()) {
+    EXPECT_EQ(conn.target(), opt.endpoint);
+  }
+
+  Replayer replayer(std::move(capture), 0);
+  for (int iteration = 0; iteration < 2; ++iteration) {
+    std::ostringstream out;
+    OllamaChat chat(opt, out);
+    chat.SetTransportFactory(replayer.Factory());
+    std::int64_t tokens = 0, eval_count = 0;
+    chat.SetTokenHandler([&tokens](std::string_view) { ++tokens; });
+    while (replayer.Peek() != nullptr) {
+      chat.SendRequestToAi("replay");
+      EXPECT_GT(chat.last_stats().eval_count, 0);
+      eval_count += chat.last_stats().eval_count;
+    }
+    EXPECT_EQ(tokens, 128);
+    EXPECT_EQ(eval_count, tokens);
+    EXPECT_FALSE(out.str().empty());
+    replayer.Rewind();
+  }
+}
+
+} // namespace ochat
@@ -0,0 +1,234 @@
+#include "scheduler.h"
+#include <atomic>
+#include <gtest/gtest.h>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace ochat {
+
+namespace {
+
+RequestClass Req(const std::string &tenant,
+                 Priority priority = Priority::kInteractive,
+                 const std::string &model = "m") {
+  RequestClass rc;
+  rc.backend = "host:1";
+  rc.model = model;
+  rc.tenant = tenant;
+  rc.priority = priority;
+  return rc;
+}
+
+std::size_t Queued(const RequestScheduler &s) {
+  auto m = s.Metrics();
+  return m.queued[0] + m.queued[1];
+}
+
+// waits until n requests are queued
+void WaitQueued(const RequestScheduler &s, std::size_t n) {
+  while (Queued(s) != n) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
+
+// Queues the requests one at a time behind a held slot, then releases the
+// slot and returns the order the requests were admitted in.
+std::vector<std::string> AdmissionOrder(RequestScheduler &s,
+                                        const std::vector<RequestClass> &reqs) {
+  auto hold = s.Acquire(Req("holder"));
+  std::mutex mutex;
+  std::vector<std::string> order;
+  std::vector<std::thread> threads;
+  for (std::size_t i = 0; i < reqs.size(); ++i) {
+    threads.emplace_back([&, i] {
+      auto permit = s.Acquire(reqs[i]);
+      std::lock_guard<std::mutex> lock(mutex);
+      order.push_back(reqs[i].tenant);
+    });
+    WaitQueued(s, i + 1);
+  }
+  hold.Release();
+  for (auto &t : threads) {
+    t.join();
+  }
+  return order;
+}
+
+} // namespace
+
+TEST(SchedulerTest, BackendLimit) {
+  SchedulerOptions opt;
+  opt.max_in_flight = 2;
+  RequestScheduler s(opt);
+  auto a = s.Acquire(Req("a"));
+  auto b = s.Acquire(Req("b"));
+  EXPECT_EQ(s.Metrics().in_flight.at("host:1"), 2);
+
+  // another backend is not limited by this one
+  RequestClass other = Req("c");
+  other.backend = "host:2";
+  auto c = s.Acquire(other);
+
+  bool admitted = false;
+  std::thread t([&] {
+    auto d = s.Acquire(Req("d"));
+    admitted = true;
+  });
+  WaitQueued(s, 1);
+  EXPECT_FALSE(admitted);
+  a.Release();
+  t.join();
+  EXPECT_TRUE(admitted);
+  auto m = s.Metrics();
+  EXPECT_EQ(m.admitted, 4);
+  EXPECT_EQ(m.in_flight.at("host:1"), 1);
+  EXPECT_EQ(m.max_queued, 1u);
+}
+
+TEST(SchedulerTest, ModelLimit) {
+  SchedulerOptions opt;
+  opt.max_in_flight_per_model = 1;
+  opt.model_limits["big"] = 2;
+  RequestScheduler s(opt);
+  auto a = s.Acquire(Req("a", Priority::kInteractive, "small"));
+  auto b = s.Acquire(Req("b", Priority::kInteractive, "big"));
+  auto c = s.Acquire(Req("c", Priority::kInteractive, "big"));
+  EXPECT_EQ(s.Metrics().model_in_flight.at("host:1 big"), 2);
+
+  // a waiting request for one model does not block another model
+  std::thread t([&] { s.Acquire(Req("d", Priority::kInteractive, "small")); });
+  WaitQueued(s, 1);
+  b.Release();
+  auto e = s.Acquire(Req("e", Priority::kInteractive, "big"));
+  EXPECT_EQ(Queued(s), 1u);
+  a.Release();
+  t.join();
+  EXPECT_EQ(Queued(s), 0u);
+}
+
+TEST(SchedulerTest, InteractiveBeforeBatch) {
+  SchedulerOptions opt;
+  opt.max_in_flight = 1;
+  RequestScheduler s(opt);
+  auto order = AdmissionOrder(s, {Req("b1", Priority::kBatch),
+                                  Req("b2", Priority::kBatch),
+                                  Req("i1", Priority::kInteractive)});
+  EXPECT_EQ(order, (std::vector<std::string>{"i1", "b1", "b2"}));
+  EXPECT_EQ(s.Metrics().queue_wait_us[1].count(), 2);
+}
+
+TEST(SchedulerTest, FairShareBetweenTenants) {
+  SchedulerOptions opt;
+  opt.max_in_flight = 1;
+  RequestScheduler s(opt);
+  // the heavy tenant queued first, the light tenant is not starved
+  auto order = AdmissionOrder(s, {Req("heavy"), Req("heavy"), Req("heavy"),
+                                  Req("heavy"), Req("light"), Req("light")});
+  EXPECT_EQ(order, (std::vector<std::string>{"heavy", "light", "heavy",
+                                             "light", "heavy", "heavy"}));
+}
+
+TEST(SchedulerTest, Weights) {
+  SchedulerOptions opt;
+  opt.max_in_flight = 1;
+  RequestScheduler s(opt);
+  s.SetWeight("gold", 2);
+  EXPECT_THROW(s.SetWeight("x", 0), std::invalid_argument);
+  auto order = AdmissionOrder(s, {Req("std"), Req("std"), Req("std"),
+                                  Req("gold"), Req("gold"), Req("gold"),
+                                  Req("gold")});
+  EXPECT_EQ(order, (std::vector<std::string>{"std", "gold", "gold", "std",
+                                             "gold", "gold", "std"}));
+}
+
+TEST(SchedulerTest, DeadlineSheds) {
+  SchedulerOptions opt;
+  opt.max_in_flight = 1;
+  opt.deadline[0] = std::chrono::milliseconds(20);
+  RequestScheduler s(opt);
+  auto hold = s.Acquire(Req("a"));
+  auto start = std::chrono::steady_clock::now();
+  try {
+    s.Acquire(Req("b"));
+    FAIL() << "expected RequestRejected";
+  } catch (const RequestRejected &e) {
+    EXPECT_TRUE(e.deadline());
+  }
+  EXPECT_GE(std::chrono::steady_clock::now() - start,
+            std::chrono::milliseconds(20));
+  auto m = s.Metrics();
+  EXPECT_EQ(m.shed_deadline, 1);
+  EXPECT_EQ(m.queued[0], 0u);
+
+  // a per request deadline overrides the class deadline
+  RequestClass rc = Req("c", Priority::kBatch);
+  rc.deadline = std::chrono::milliseconds(1);
+  EXPECT_THROW(s.Acquire(rc), RequestRejected);
+}
+
+// a queued request gives up when it is cancelled, a cancelled request is not
+// admitted even with a free slot
+TEST(SchedulerTest, CancelledWhileQueued) {
+  SchedulerOptions opt;
+  opt.max_in_flight = 1;
+  RequestScheduler s(opt);
+  auto hold = s.Acquire(Req("a"));
+  std::atomic<bool> cancelled{false};
+  RequestClass rc = Req("b", Priority::kBatch);
+  rc.cancelled = &cancelled;
+  bool gave_up = false;
+  std::thread waiter([&] {
+    try {
+      s.Acquire(rc);
+    } catch (const RequestCancelled &) {
+      gave_up = true;
+    }
+  });
+  WaitQueued(s, 1);
+  cancelled = true;
+  s.Interrupt();
+  waiter.join();
+  EXPECT_TRUE(gave_up);
+  auto m = s.Metrics();
+  EXPECT_EQ(m.queued[1], 0u);
+  EXPECT_EQ(m.shed_deadline, 0);
+
+  hold.Release();
+  EXPECT_THROW(s.Acquire(rc), RequestCancelled);
+  EXPECT_EQ(s.Metrics().in_flight["host:1"], 0);
+}
+
+TEST(SchedulerTest, FullQueueEvictsBatch) {
+  SchedulerOptions opt;
+  opt.max_in_flight = 1;
+  opt.max_queue = 1;
+  RequestScheduler s(opt);
+  auto hold = s.Acquire(Req("a"));
+
+  bool evicted = false;
+  std::thread batch([&] {
+    try {
+      s.Acquire(Req("b", Priority::kBatch));
+    } catch (const RequestRejected &e) {
+      evicted = !e.deadline();
+    }
+  });
+  WaitQueued(s, 1);
+  // another batch request does not fit
+  EXPECT_THROW(s.Acquire(Req("c", Priority::kBatch)), RequestRejected);
+
+  // an interactive request takes the place of the batch request
+  std::thread interactive([&] { s.Acquire(Req("d")); });
+  batch.join();
+  EXPECT_TRUE(evicted);
+  WaitQueued(s, 1);
+  EXPECT_EQ(s.Metrics().queued[0], 1u);
+  hold.Release();
+  interactive.join();
+  EXPECT_EQ(s.Metrics().shed_overflow, 2);
+  EXPECT_NE(s.Metrics().ToText().find("admitted 2"), std::string::npos);
+}
+
+} // namespace ochat
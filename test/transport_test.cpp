@@ -0,0 +1,180 @@
+#include "fake_ollama.h"
+#include "loopback_server.h"
+#include "ochat.h"
+#include "transport.h"
+#include <boost/asio.hpp>
+#include <filesystem>
+#include <gtest/gtest.h>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace fs = std::filesystem;
+using boost::asio::local::stream_protocol;
+
+namespace ochat {
+
+namespace {
+
+// the requests received by ServeChat()
+struct Requests {
+  std::mutex mutex;
+  std::vector<std::string> received;
+};
+
+// Serves one chat request on any stream socket with a streamed response of
+// two tokens, the request is recorded.
+template <class Socket> void ServeChat(Socket &socket, Requests &requests) {
+  LoopbackRequest req = ReadLoopbackRequest(socket);
+  {
+    std::lock_guard<std::mutex> lock(requests.mutex);
+    requests.received.push_back(req.header + req.body);
+  }
+  WriteChunkedResponse(
+      socket,
+      {R"({"message":{"role":"assistant","content":"Hel"},"done":false})" "\n",
+       R"({"message":{"role":"assistant","content":"lo"},"done":false})" "\n",
+       R"({"message":{"role":"assistant","content":""},"done":true,)"
+       R"("eval_count":2})" "\n"});
+}
+
+// sends the prompts and returns the tokens of the responses
+std::vector<std::string> Chat(OllamaChat &chat,
+                              const std::vector<std::string> &prompts) {
+  std::vector<std::string> tokens;
+  chat.SetTokenHandler(
+      [&tokens](std::string_view t) { tokens.emplace_back(t); });
+  for (auto &p : prompts) {
+    chat.SendRequestToAi(p);
+  }
+  return tokens;
+}
+
+std::string TempSocketPath() {
+  static int counter = 0;
+  return (fs::temp_directory_path() /
+          ("ochat_transport_test_" + std::to_string(::getpid()) + "_" +
+           std::to_string(counter++) + ".sock"))
+      .string();
+}
+
+} // namespace
+
+TEST(TransportTest, UnixSocketChat) {
+  std::string path = TempSocketPath();
+  boost::asio::io_context io;
+  stream_protocol::acceptor acceptor(io, stream_protocol::endpoint(path));
+  Requests requests;
+  std::thread server([&] {
+    for (int i = 0; i < 2; ++i) {
+      stream_protocol::socket socket(io);
+      acceptor.accept(socket);
+      ServeChat(socket, requests);
+    }
+  });
+
+  Options opt;
+  opt.server = "unix://" + path;
+  opt.port = 1; // ignored
+  std::ostringstream out;
+  OllamaChat chat(opt, out);
+  EXPECT_EQ(Chat(chat, {"hello", "again"}),
+            (std::vector<std::string>{"Hel", "lo", "Hel", "lo"}));
+  server.join();
+  fs::remove(path);
+
+  ASSERT_EQ(requests.received.size(), 2u);
+  EXPECT_NE(requests.received[0].find("Host: localhost\r\n"),
+            std::string::npos);
+  EXPECT_NE(requests.received[1].find("again"), std::string::npos);
+  EXPECT_EQ(chat.last_stats().eval_count, 2);
+}
+
+TEST(TransportTest, LoopbackChat) {
+  Requests requests;
+  Options opt;
+  std::ostringstream out;
+  OllamaChat chat(opt, out);
+  chat.SetTransportFactory([&requests] {
+    return std::make_unique<LoopbackTransport>(
+        [&requests](stream_protocol::socket &s) { ServeChat(s, requests); });
+  });
+  EXPECT_EQ(Chat(chat, {"hello", "again"}),
+            (std::vector<std::string>{"Hel", "lo", "Hel", "lo"}));
+  ASSERT_EQ(requests.received.size(), 2u);
+  EXPECT_NE(requests.received[0].find("Host: " + opt.server + "\r\n"),
+            std::string::npos);
+}
+
+// a loopback transport whose handler exits early reports the disconnect
+TEST(TransportTest, LoopbackDisconnect) {
+  LoopbackTransport conn([](stream_protocol::socket &) {});
+  conn.Connect("ignored", 0);
+  boost::asio::streambuf buf;
+  EXPECT_THROW(conn.ReadUntil(buf, "\r\n"), boost::system::system_error);
+  conn.Close();
+  // the transport can be connected again
+  conn.Connect("ignored", 0);
+  EXPECT_EQ(conn.ReadToEnd(buf), 0u);
+}
+
+TEST(TransportTest, MakeTransportSelectsByServer) {
+  EXPECT_TRUE(IsUnixSocket("unix:///run/ollama.sock"));
+  EXPECT_FALSE(IsUnixSocket("localhost"));
+  EXPECT_FALSE(IsUnixSocket("unix"));
+  auto unix_conn = MakeTransport("unix:///run/ollama.sock");
+  EXPECT_NE(dynamic_cast<UnixTransport *>(unix_conn.get()), nullptr);
+  auto tcp_conn = MakeTransport("localhost");
+  EXPECT_NE(dynamic_cast<TcpTransport *>(tcp_conn.get()), nullptr);
+
+  UnixTransport missing;
+  EXPECT_THROW(missing.Connect("unix://" + TempSocketPath(), 0),
+               boost::system::system_error);
+}
+
+TEST(TransportTest, TcpSocketOptions) {
+  FakeOllama server;
+  TransportOptions topt;
+  topt.receive_buffer = 1 << 16;
+  topt.send_buffer = 1 << 16;
+  TcpTransport conn(topt);
+  conn.Connect("127.0.0.1", server.port());
+  boost::asio::ip::tcp::no_delay no_delay;
+  conn.socket().get_option(no_delay);
+  EXPECT_TRUE(no_delay.value());
+  boost::asio::socket_base::receive_buffer_size rcvbuf;
+  conn.socket().get_option(rcvbuf);
+  EXPECT_GE(rcvbuf.value(), topt.receive_buffer);
+  boost::asio::socket_base::send_buffer_size sndbuf;
+  conn.socket().get_option(sndbuf);
+  EXPECT_GE(sndbuf.value(), topt.send_buffer);
+  conn.Close();
+
+  // a refused connection throws, and the transport can connect again
+  int closed_port;
+  {
+    boost::asio::io_context io;
+    boost::asio::ip::tcp::acceptor acceptor(
+        io, {boost::asio::ip::make_address("127.0.0.1"), 0});
+    closed_port = acceptor.local_endpoint().port();
+  }
+  EXPECT_THROW(conn.Connect("127.0.0.1", closed_port),
+               boost::system::system_error);
+  EXPECT_FALSE(conn.socket().is_open());
+  conn.Connect("127.0.0.1", server.port());
+  conn.socket().get_option(rcvbuf);
+  EXPECT_GE(rcvbuf.value(), topt.receive_buffer);
+  conn.Close();
+
+  topt.no_delay = false;
+  TcpTransport nagle(topt);
+  nagle.Connect("127.0.0.1", server.port());
+  nagle.socket().get_option(no_delay);
+  EXPECT_FALSE(no_delay.value());
+}
+
+} // namespace ochat
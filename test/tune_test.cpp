@@ -0,0 +1,150 @@
+#include "loopback_server.h"
+#include "ochat.h"
+#include "transport.h"
+#include "tune.h"
+#include <boost/asio.hpp>
+#include <boost/json.hpp>
+#include <cmath>
+#include <cstdint>
+#include <gtest/gtest.h>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using boost::asio::local::stream_protocol;
+
+namespace ochat {
+
+namespace {
+
+std::int64_t Option(const boost::json::object &options, const char *name,
+                    std::int64_t dflt) {
+  auto *v = options.if_contains(name);
+  return v != nullptr ? v->to_number<std::int64_t>() : dflt;
+}
+
+// A server that generates fastest with 4 threads and evaluates prompts
+// fastest with batches of 256, and rejects batches of 1024.  The timings
+// are reported, not waited for.
+void ServeTimings(stream_protocol::socket &socket, std::mutex &mutex,
+                  std::vector<boost::json::object> &requests) {
+  boost::json::object req =
+      boost::json::parse(ReadLoopbackRequest(socket).body).as_object();
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    requests.push_back(req);
+  }
+  const boost::json::object &options = req["options"].as_object();
+  std::int64_t threads = Option(options, "num_thread", 8);
+  std::int64_t batch = Option(options, "num_batch", 512);
+  if (batch == 1024) {
+    WriteLoopbackResponse(socket, R"({"error":"out of memory"})", 500);
+    return;
+  }
+  std::int64_t tokens = Option(options, "num_predict", 128);
+  double eval_ms = 10 * (1 + 0.25 * std::abs(threads - 4));
+  double prompt_ms = 1 * (1 + 0.2 * std::abs(std::log2(batch / 256.0)));
+  std::ostringstream msg;
+  msg << R"({"message":{"role":"assistant","content":"ok"},"done":true,)"
+      << R"("prompt_eval_count":100,"prompt_eval_duration":)"
+      << static_cast<std::int64_t>(100 * prompt_ms * 1e6)
+      << R"(,"eval_count":)" << tokens << R"(,"eval_duration":)"
+      << static_cast<std::int64_t>(tokens * eval_ms * 1e6) << "}\n";
+  WriteChunkedResponse(socket, {msg.str()});
+}
+
+} // namespace
+
+TEST(TuneTest, FindsFastestOptions) {
+  std::mutex mutex;
+  std::vector<boost::json::object> requests;
+  Options opt;
+  opt.model = "m:1b";
+  opt.max_retries = 0;
+  opt.profiles["m"]["num_thread"] = 8;
+  opt.profiles["m"]["num_ctx"] = 4096;
+  std::ostringstream out;
+  OllamaChat chat(opt, out);
+  chat.SetTransportFactory([&] {
+    return std::make_unique<LoopbackTransport>(
+        [&](stream_protocol::socket &s) { ServeTimings(s, mutex, requests); });
+  });
+
+  TuneOptions tune;
+  tune.prompts = {"p1", "p2"};
+  tune.num_predict = 16;
+  tune.parameters = {{"num_thread", {1, 2, 4, 8}},
+                     {"num_batch", {128, 256, 1024}}};
+  std::ostringstream log;
+  TuneResult result = Tune(chat, tune, &log);
+
+  EXPECT_EQ(boost::json::serialize(result.best),
+            R"({"num_thread":4,"num_ctx":4096,"num_batch":256})");
+  // the starting options, 3 thread counts and 3 batch sizes
+  ASSERT_EQ(result.trials.size(), 7u);
+  EXPECT_EQ(result.best_trial, 5u);
+  EXPECT_EQ(boost::json::serialize(result.trials[0].options),
+            R"({"num_thread":8,"num_ctx":4096})");
+  EXPECT_NEAR(result.trials[0].eval_tps, 1000 / 20.0, 0.01);
+  EXPECT_NEAR(result.trials[0].prompt_tps, 1000 / 1.2, 0.01);
+  EXPECT_NEAR(result.trials[5].eval_tps, 1000 / 10.0, 0.01);
+  EXPECT_NEAR(result.trials[5].prompt_tps, 1000 / 1.0, 0.01);
+  EXPECT_NE(result.trials[6].error, "");
+  EXPECT_NE(log.str().find("error: "), std::string::npos);
+  EXPECT_NE(log.str().find("generation 100.0 tok/s"), std::string::npos);
+
+  // a warmup and the prompts for each trial, each prompt is new; the failed
+  // trial stopped at its warmup
+  ASSERT_EQ(requests.size(), 19u);
+  for (std::size_t i = 0; i < requests.size(); ++i) {
+    const boost::json::object &options = requests[i]["options"].as_object();
+    EXPECT_EQ(Option(options, "num_predict", 0), i % 3 == 0 ? 1 : 16);
+    std::string content =
+        requests[i]["messages"].as_array().at(0).as_object().at("content")
+            .as_string().c_str();
+    EXPECT_EQ(content.rfind("(" + std::to_string(i + 1) + ") p", 0), 0u)
+        << content;
+  }
+  EXPECT_TRUE(chat.options().model_options.empty());
+}
+
+TEST(TuneTest, CurrentOptionsFail) {
+  std::mutex mutex;
+  std::vector<boost::json::object> requests;
+  Options opt;
+  opt.max_retries = 0;
+  opt.model_options["num_batch"] = 1024;
+  std::ostringstream out;
+  OllamaChat chat(opt, out);
+  chat.SetTransportFactory([&] {
+    return std::make_unique<LoopbackTransport>(
+        [&](stream_protocol::socket &s) { ServeTimings(s, mutex, requests); });
+  });
+  TuneOptions tune;
+  tune.prompts = {"p"};
+  tune.parameters = {{"num_thread", {4}}};
+  EXPECT_THROW(Tune(chat, tune), std::runtime_error);
+  EXPECT_EQ(requests.size(), 1u);
+  EXPECT_EQ(boost::json::serialize(chat.options().model_options),
+            R"({"num_batch":1024})");
+}
+
+TEST(TuneTest, ParseParameter) {
+  TuneParameter p = ParseTuneParameter("num_ctx=2048,4096,8192");
+  EXPECT_EQ(p.name, "num_ctx");
+  EXPECT_EQ(p.values, (std::vector<std::int64_t>{2048, 4096, 8192}));
+  EXPECT_EQ(ParseTuneParameter("num_gpu=0").values,
+            (std::vector<std::int64_t>{0}));
+  for (const char *spec :
+       {"", "num_ctx", "num_ctx=", "=1", "num_ctx=1,", "num_ctx=1,,2",
+        "num_ctx=x", "num_ctx=1 2"}) {
+    EXPECT_THROW(ParseTuneParameter(spec), std::invalid_argument) << spec;
+  }
+  EXPECT_FALSE(DefaultTuneParameters().empty());
+  EXPECT_FALSE(DefaultTunePrompts().empty());
+}
+
+} // namespace ochat
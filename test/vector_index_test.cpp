@@ -0,0 +1,240 @@
+// This file contains unit tests for the SIMD dot product kernels and the
+// exact and approximate vector indexes.
+//
+#include "vector_index.h"
+#include "vector_store.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <gtest/gtest.h>
+#include <random>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace ochat;
+
+namespace {
+
+std::vector<float> RandomUnitVector(std::mt19937 &rng, std::size_t dim) {
+  std::normal_distribution<float> normal;
+  std::vector<float> v(dim);
+  double sum = 0;
+  for (auto &x : v) {
+    x = normal(rng);
+    sum += x * x;
+  }
+  for (auto &x : v) {
+    x = static_cast<float>(x / std::sqrt(sum));
+  }
+  return v;
+}
+
+// a store of random unit vectors, removed by the destructor
+class RandomStore {
+public:
+  RandomStore(std::size_t n, std::size_t dim, VecType type,
+              std::uint32_t seed = 1) {
+    path_ = (std::filesystem::temp_directory_path() /
+             ("ochat_index_test_" + std::to_string(::getpid()) + "_" +
+              std::to_string(counter_++) + ".vec"))
+                .string();
+    std::mt19937 rng(seed);
+    VectorStoreWriter w(path_, dim, type);
+    for (std::size_t i = 0; i < n; ++i) {
+      auto v = RandomUnitVector(rng, dim);
+      w.Add(v.data(), {"f", i, i, i + 1, "chunk " + std::to_string(i)});
+    }
+    w.Close();
+    EXPECT_TRUE(store.Open(path_));
+  }
+  ~RandomStore() {
+    std::remove(path_.c_str());
+    std::remove((path_ + ".hnsw").c_str());
+  }
+  const std::string &path() const { return path_; }
+
+  VectorStore store;
+
+private:
+  std::string path_;
+  static inline int counter_ = 0;
+};
+
+// the ids of the k best rows, by a scalar scan
+std::vector<std::size_t> ExactTopK(const VectorStore &store, const float *q,
+                                   std::size_t k) {
+  DotFn dot = GetDotKernel(store.type(), SimdLevel::kScalar);
+  std::vector<std::pair<float, std::size_t>> all;
+  for (std::size_t i = 0; i < store.size(); ++i) {
+    all.push_back({dot(q, store.row(i), store.dim()), i});
+  }
+  std::partial_sort(all.begin(), all.begin() + k, all.end(),
+                    [](auto &a, auto &b) { return a.first > b.first; });
+  std::vector<std::size_t> ids;
+  for (std::size_t i = 0; i < k; ++i) {
+    ids.push_back(all[i].second);
+  }
+  return ids;
+}
+
+std::vector<SimdLevel> SupportedLevels() {
+  std::vector<SimdLevel> levels{SimdLevel::kScalar};
+  if (DetectSimd() >= SimdLevel::kAvx2)
+    levels.push_back(SimdLevel::kAvx2);
+  if (DetectSimd() >= SimdLevel::kAvx512)
+    levels.push_back(SimdLevel::kAvx512);
+  return levels;
+}
+
+} // namespace
+
+TEST(DotKernelTest, MatchesScalarForAllTypesAndSizes) {
+  std::mt19937 rng(7);
+  for (VecType type : {VecType::kF32, VecType::kF16, VecType::kI8}) {
+    // sizes that exercise the unrolled loops and the scalar tails
+    for (std::size_t dim : {1, 7, 8, 15, 16, 31, 33, 384, 770}) {
+      RandomStore rs(2, dim, type);
+      auto q = RandomUnitVector(rng, dim);
+      std::vector<float> row(dim);
+      rs.store.Get(0, row.data());
+      float expected = 0;
+      for (std::size_t i = 0; i < dim; ++i) {
+        expected += q[i] * row[i];
+      }
+      for (SimdLevel level : SupportedLevels()) {
+        float got = GetDotKernel(type, level)(q.data(), rs.store.row(0), dim);
+        EXPECT_NEAR(got, expected, 1e-4)
+            << "type " << int(type) << " dim " << dim << " level "
+            << int(level);
+      }
+    }
+  }
+}
+
+TEST(VectorStoreTest, Int8Quantization) {
+  RandomStore rs(4, 64, VecType::kI8);
+  RandomStore exact(4, 64, VecType::kF32);
+  std::vector<float> a(64), b(64);
+  for (std::size_t i = 0; i < 4; ++i) {
+    rs.store.Get(i, a.data());
+    exact.store.Get(i, b.data());
+    for (std::size_t j = 0; j < 64; ++j) {
+      EXPECT_NEAR(a[j], b[j], 0.01);
+    }
+  }
+}
+
+TEST(FlatIndexTest, ExactTopK) {
+  RandomStore rs(40000, 32, VecType::kF16);
+  std::mt19937 rng(3);
+  FlatIndex single(rs.store, 1);
+  FlatIndex parallel(rs.store, 4); // scans the store in 2 ranges
+  for (int t = 0; t < 5; ++t) {
+    auto q = RandomUnitVector(rng, 32);
+    auto expected = ExactTopK(rs.store, q.data(), 10);
+    for (const FlatIndex *index : {&single, &parallel}) {
+      auto hits = index->Search(q.data(), 10);
+      ASSERT_EQ(hits.size(), 10);
+      for (std::size_t i = 0; i < hits.size(); ++i) {
+        EXPECT_EQ(hits[i].id, expected[i]);
+        if (i > 0) {
+          EXPECT_GE(hits[i - 1].score, hits[i].score);
+        }
+      }
+    }
+  }
+  EXPECT_EQ(single.Search(RandomUnitVector(rng, 32).data(), 0).size(), 0);
+}
+
+TEST(FlatIndexTest, FewerRowsThanK) {
+  RandomStore rs(3, 8, VecType::kF32);
+  std::mt19937 rng(5);
+  FlatIndex index(rs.store);
+  EXPECT_EQ(index.Search(RandomUnitVector(rng, 8).data(), 10).size(), 3);
+}
+
+TEST(HnswIndexTest, RecallAndSaveLoad) {
+  RandomStore rs(5000, 24, VecType::kF16);
+  HnswOptions opt;
+  opt.threads = 4;
+  opt.ef_construction = 100;
+  HnswIndex index(rs.store, opt);
+  index.Build();
+
+  std::mt19937 rng(11);
+  std::vector<std::vector<float>> queries;
+  for (int t = 0; t < 50; ++t) {
+    queries.push_back(RandomUnitVector(rng, 24));
+  }
+  auto recall = [&](const HnswIndex &idx) {
+    std::size_t found = 0;
+    for (auto &q : queries) {
+      auto expected = ExactTopK(rs.store, q.data(), 10);
+      for (auto &hit : idx.Search(q.data(), 10)) {
+        found += std::count(expected.begin(), expected.end(), hit.id);
+      }
+    }
+    return static_cast<double>(found) / (10 * queries.size());
+  };
+  double built = recall(index);
+  EXPECT_GT(built, 0.9);
+
+  index.Save(rs.path() + ".hnsw");
+  HnswIndex loaded(rs.store);
+  ASSERT_TRUE(loaded.Load(rs.path() + ".hnsw"));
+  EXPECT_EQ(recall(loaded), built);
+
+  // a graph saved for another store is not loaded
+  RandomStore other(5000, 24, VecType::kF16, 2);
+  HnswIndex stale(other.store);
+  EXPECT_FALSE(stale.Load(rs.path() + ".hnsw"));
+}
+
+TEST(HnswIndexTest, ConcurrentQueries) {
+  RandomStore rs(2000, 16, VecType::kF32);
+  HnswIndex index(rs.store);
+  index.Build();
+  std::mt19937 rng(13);
+  std::vector<std::vector<float>> queries;
+  std::vector<std::vector<SearchHit>> expected;
+  for (int t = 0; t < 32; ++t) {
+    queries.push_back(RandomUnitVector(rng, 16));
+    expected.push_back(index.Search(queries.back().data(), 5));
+  }
+  std::vector<std::thread> threads;
+  std::vector<int> mismatches(4, 0);
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([&, t] {
+      for (std::size_t i = 0; i < queries.size(); ++i) {
+        auto hits = index.Search(queries[i].data(), 5);
+        for (std::size_t j = 0; j < hits.size(); ++j) {
+          mismatches[t] += hits[j].id != expected[i][j].id;
+        }
+      }
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  for (int m : mismatches) {
+    EXPECT_EQ(m, 0);
+  }
+}
+
+TEST(HnswIndexTest, EmptyAndSingle) {
+  RandomStore empty(0, 8, VecType::kF32);
+  HnswIndex e(empty.store);
+  e.Build();
+  std::vector<float> q(8, 0.5f);
+  EXPECT_TRUE(e.Search(q.data(), 3).empty());
+
+  RandomStore one(1, 8, VecType::kF32);
+  HnswIndex o(one.store);
+  o.Build();
+  auto hits = o.Search(q.data(), 3);
+  ASSERT_EQ(hits.size(), 1);
+  EXPECT_EQ(hits[0].id, 0);
+}
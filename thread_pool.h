@@ -0,0 +1,96 @@
+/**
+ * @file thread_pool.h
+ * @brief A small fixed size thread pool.
+ */
+
+#ifndef __THREAD_POOL_H__
+#define __THREAD_POOL_H__
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace ochat {
+
+// Runs submitted tasks on a fixed number of worker threads.  Tasks that are
+// submitted while all workers are busy wait in a FIFO queue.  The destructor
+// waits for all queued and running tasks to finish.
+class ThreadPool {
+public:
+  explicit ThreadPool(std::size_t threads) {
+    if (threads == 0)
+      threads = 1;
+    workers_.reserve(threads);
+    for (std::size_t i = 0; i < threads; ++i) {
+      workers_.emplace_back([this] { WorkerLoop(); });
+    }
+  }
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    for (auto &w : workers_) {
+      w.join();
+    }
+  }
+
+  /**
+   * Queues a task to run on the pool.
+   *
+   * @param f The task to run.
+   * @return A future for the result of the task (holds any exception thrown
+   * by the task).
+   */
+  template <class F> auto Submit(F &&f) -> std::future<std::invoke_result_t<F>> {
+    using R = std::invoke_result_t<F>;
+    auto task = std::make_shared<std::packaged_task<R()>>(std::forward<F>(f));
+    std::future<R> result = task->get_future();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      tasks_.emplace_back([task] { (*task)(); });
+    }
+    cv_.notify_one();
+    return result;
+  }
+
+  std::size_t size() const { return workers_.size(); }
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+private:
+  void WorkerLoop() {
+    while (true) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this] { return stop_ || !tasks_.empty(); });
+        if (tasks_.empty())
+          return; // stopped and drained
+        task = std::move(tasks_.front());
+        tasks_.pop_front();
+      }
+      task();
+    }
+  }
+
+  std::vector<std::thread> workers_;
+  std::deque<std::function<void()>> tasks_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool stop_ = false;
+};
+
+} // namespace ochat
+
+#endif // __THREAD_POOL_H__
@@ -0,0 +1,145 @@
+#include "transport.h"
+#include <boost/asio.hpp>
+#include <string>
+#include <sys/socket.h>
+
+using boost::asio::ip::tcp;
+using boost::asio::local::stream_protocol;
+
+namespace ochat {
+
+template <class Protocol>
+void SocketTransport<Protocol>::Write(const std::string &data) {
+  boost::asio::write(socket_, boost::asio::buffer(data));
+}
+
+template <class Protocol>
+std::size_t SocketTransport<Protocol>::ReadUntil(boost::asio::streambuf &buf,
+                                                 std::string_view delim) {
+  return boost::asio::read_until(socket_, buf, delim);
+}
+
+template <class Protocol>
+std::size_t SocketTransport<Protocol>::ReadExactly(boost::asio::streambuf &buf,
+                                                   std::size_t n) {
+  return boost::asio::read(socket_, buf, boost::asio::transfer_exactly(n));
+}
+
+// Read until the server closes the connection, which is not an error here.
+template <class Protocol>
+std::size_t SocketTransport<Protocol>::ReadToEnd(boost::asio::streambuf &buf) {
+  boost::system::error_code ec;
+  std::size_t n =
+      boost::asio::read(socket_, buf, boost::asio::transfer_all(), ec);
+  if (ec && ec != boost::asio::error::eof) {
+    throw boost::system::system_error(ec);
+  }
+  return n;
+}
+
+template <class Protocol> void SocketTransport<Protocol>::Close() {
+  boost::system::error_code ignored;
+  socket_.close(ignored);
+}
+
+// Shutting the socket down wakes up a blocked read (with eof) or write, which
+// closing it from another thread would not do.  An asio socket must not be
+// used by two threads at once, so the shutdown is made on the descriptor,
+// which the kernel allows concurrently with the read or write.  The caller
+// keeps the socket from being closed meanwhile (see Transport::Cancel()).
+template <class Protocol> void SocketTransport<Protocol>::Cancel() {
+  if (socket_.is_open()) {
+    ::shutdown(socket_.native_handle(), SHUT_RDWR);
+  }
+}
+
+template <class Protocol> void SocketTransport<Protocol>::SetBufferSizes() {
+  boost::system::error_code ignored;
+  if (opt_.receive_buffer > 0) {
+    socket_.set_option(
+        boost::asio::socket_base::receive_buffer_size(opt_.receive_buffer),
+        ignored);
+  }
+  if (opt_.send_buffer > 0) {
+    socket_.set_option(
+        boost::asio::socket_base::send_buffer_size(opt_.send_buffer), ignored);
+  }
+}
+
+template class SocketTransport<tcp>;
+template class SocketTransport<stream_protocol>;
+
+// Resolve the server and connect to the first endpoint that accepts.  The
+// buffer sizes are set before connecting, as the TCP window scale is agreed
+// on in the handshake.  The requests are small writes followed by a read of
+// the response, so Nagle's algorithm would only delay them.
+void TcpTransport::Connect(const std::string &server, int port) {
+  tcp::resolver resolver(socket_.get_executor());
+  auto endpoints = resolver.resolve(server, std::to_string(port));
+  boost::system::error_code ec = boost::asio::error::host_not_found;
+  boost::system::error_code ignored;
+  for (const auto &entry : endpoints) {
+    socket_.close(ignored);
+    socket_.open(entry.endpoint().protocol(), ec);
+    if (ec) {
+      continue;
+    }
+    SetBufferSizes();
+    socket_.connect(entry.endpoint(), ec);
+    if (!ec) {
+      break;
+    }
+  }
+  if (ec) {
+    socket_.close(ignored);
+    throw boost::system::system_error(ec);
+  }
+  socket_.set_option(tcp::no_delay(opt_.no_delay), ignored);
+}
+
+void UnixTransport::Connect(const std::string &server, int port) {
+  std::string path =
+      IsUnixSocket(server) ? server.substr(kUnixScheme.size()) : server;
+  boost::system::error_code ignored;
+  socket_.close(ignored);
+  socket_.open();
+  SetBufferSizes();
+  socket_.connect(stream_protocol::endpoint(path));
+}
+
+LoopbackTransport::~LoopbackTransport() { Close(); }
+
+// The handler serves the other end of a socket pair, the server and port are
+// ignored.
+void LoopbackTransport::Connect(const std::string &server, int port) {
+  Close();
+  auto peer = std::make_shared<stream_protocol::socket>(io_context_);
+  boost::asio::local::connect_pair(socket_, *peer);
+  server_ = std::thread([handler = handler_, peer] {
+    try {
+      handler(*peer);
+    } catch (const std::exception &) {
+      // the client closed the connection
+    }
+    boost::system::error_code ignored;
+    peer->close(ignored);
+  });
+}
+
+// Closing the client end lets a handler that still reads or writes finish.
+void LoopbackTransport::Close() {
+  SocketTransport::Close();
+  if (server_.joinable()) {
+    server_.join();
+  }
+}
+
+std::unique_ptr<Transport> MakeTransport(const std::string &server,
+                                         const TransportOptions &opt) {
+  if (IsUnixSocket(server)) {
+    return std::make_unique<UnixTransport>(opt);
+  }
+  return std::make_unique<TcpTransport>(opt);
+}
+
+} // namespace ochat
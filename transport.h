@@ -0,0 +1,199 @@
+/**
+ * @file transport.h
+ * @brief Byte stream connections to the Ollama server used by OllamaChat.
+ */
+
+#ifndef __TRANSPORT_H__
+#define __TRANSPORT_H__
+
+#include <boost/asio.hpp>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+
+namespace ochat {
+
+// A connection to the server that carries HTTP requests and responses.  The
+// read operations append to a streambuf and follow the semantics of the asio
+// free functions of the same name (read_until may read past the delimiter).
+// Errors are thrown as boost::system::system_error, a lost connection with
+// the asio error codes (e.g. eof, connection_reset) so that the caller can
+// reconnect.  A transport can be connected again after Close().
+class Transport {
+public:
+  virtual ~Transport() = default;
+
+  /**
+   * Connects to the server.
+   *
+   * @param server The server address.
+   * @param port The server port.
+   */
+  virtual void Connect(const std::string &server, int port) = 0;
+
+  /**
+   * Writes all the data.
+   *
+   * @param data The bytes to send.
+   */
+  virtual void Write(const std::string &data) = 0;
+
+  /**
+   * Reads until the buffer contains the delimiter.
+   *
+   * @param buf The buffer the data is appended to.
+   * @param delim The delimiter.
+   * @return The size of the buffered data up to and including the delimiter.
+   */
+  virtual std::size_t ReadUntil(boost::asio::streambuf &buf,
+                                std::string_view delim) = 0;
+
+  /**
+   * Reads exactly n bytes.
+   *
+   * @param buf The buffer the data is appended to.
+   * @param n The number of bytes to read.
+   * @return n
+   */
+  virtual std::size_t ReadExactly(boost::asio::streambuf &buf,
+                                  std::size_t n) = 0;
+
+  /**
+   * Reads until the server closes the connection.
+   *
+   * @param buf The buffer the data is appended to.
+   * @return The number of bytes read.
+   */
+  virtual std::size_t ReadToEnd(boost::asio::streambuf &buf) = 0;
+
+  /**
+   * Closes the connection, errors are ignored.
+   */
+  virtual void Close() = 0;
+
+  /**
+   * Makes a write or read that blocks on another thread fail, without
+   * closing the connection (the thread closes it).  Safe to call
+   * concurrently with Write() and the reads, but not with Connect() or
+   * Close().  Transports that cannot be interrupted ignore it.
+   */
+  virtual void Cancel() {}
+};
+
+// Creates the transport of each connection a client makes.
+using TransportFactory = std::function<std::unique_ptr<Transport>()>;
+
+// Socket options of the connections, 0 leaves a buffer size to the system.
+struct TransportOptions {
+  bool no_delay = true;    // TCP_NODELAY, send small requests immediately
+  int receive_buffer = 0;  // SO_RCVBUF in bytes
+  int send_buffer = 0;     // SO_SNDBUF in bytes
+};
+
+// The prefix of Options::server for a Unix domain socket, e.g.
+// "unix:///run/ollama.sock".
+constexpr std::string_view kUnixScheme = "unix://";
+
+/**
+ * Returns true if the server is a Unix domain socket path.
+ */
+inline bool IsUnixSocket(std::string_view server) {
+  return server.substr(0, kUnixScheme.size()) == kUnixScheme;
+}
+
+// Blocking I/O on a connected asio stream socket, with its own io_context.
+template <class Protocol> class SocketTransport : public Transport {
+public:
+  using socket_type = typename Protocol::socket;
+
+  explicit SocketTransport(const TransportOptions &opt = {})
+      : opt_(opt), socket_(io_context_) {}
+
+  /**
+   * Uses an existing socket (e.g. one created on another io_context).
+   *
+   * @param socket The socket.
+   */
+  explicit SocketTransport(socket_type socket)
+      : socket_(std::move(socket)) {}
+
+  void Write(const std::string &data) override;
+  std::size_t ReadUntil(boost::asio::streambuf &buf,
+                        std::string_view delim) override;
+  std::size_t ReadExactly(boost::asio::streambuf &buf, std::size_t n) override;
+  std::size_t ReadToEnd(boost::asio::streambuf &buf) override;
+  void Close() override;
+  void Cancel() override;
+
+  socket_type &socket() { return socket_; }
+
+protected:
+  // sets the buffer sizes, errors are ignored (the options are hints)
+  void SetBufferSizes();
+
+  TransportOptions opt_;
+  boost::asio::io_context io_context_;
+  socket_type socket_;
+};
+
+// the members are defined in transport.cpp for these protocols
+extern template class SocketTransport<boost::asio::ip::tcp>;
+extern template class SocketTransport<boost::asio::local::stream_protocol>;
+
+// A TCP connection, TCP_NODELAY and the buffer sizes are set on connect.
+class TcpTransport : public SocketTransport<boost::asio::ip::tcp> {
+public:
+  using SocketTransport::SocketTransport;
+
+  void Connect(const std::string &server, int port) override;
+};
+
+// A Unix domain socket connection to a server on the same host, the server
+// is given as "unix://<path>" and the port is ignored.
+class UnixTransport
+    : public SocketTransport<boost::asio::local::stream_protocol> {
+public:
+  using SocketTransport::SocketTransport;
+
+  void Connect(const std::string &server, int port) override;
+};
+
+// An in-process connection for tests: each Connect() creates a connected
+// pair of sockets and runs the handler with the server end on a thread, the
+// handler serves the connection like a server would.
+class LoopbackTransport
+    : public SocketTransport<boost::asio::local::stream_protocol> {
+public:
+  using Handler =
+      std::function<void(boost::asio::local::stream_protocol::socket &)>;
+
+  explicit LoopbackTransport(Handler handler)
+      : handler_(std::move(handler)) {}
+
+  // closes the connection and waits for the handler
+  ~LoopbackTransport() override;
+
+  void Connect(const std::string &server, int port) override;
+  void Close() override;
+
+private:
+  Handler handler_;
+  std::thread server_;
+};
+
+/**
+ * Creates the transport for a server: a Unix domain socket for
+ * "unix://<path>", TCP otherwise.
+ *
+ * @param server The server (Options::server).
+ * @param opt The socket options.
+ */
+std::unique_ptr<Transport> MakeTransport(const std::string &server,
+                                         const TransportOptions &opt = {});
+
+} // namespace ochat
+
+#endif // __TRANSPORT_H__
@@ -0,0 +1,176 @@
+#include "tune.h"
+#include <algorithm>
+#include <charconv>
+#include <iomanip>
+#include <set>
+#include <stdexcept>
+#include <thread>
+
+namespace ochat {
+
+namespace {
+
+// Sends the prompts with the options and adds up the server timings.
+TuneTrial Measure(OllamaChat &chat, const boost::json::object &options,
+                  const std::vector<std::string> &prompts,
+                  const TuneOptions &opt, int &request) {
+  TuneTrial trial;
+  trial.options = options;
+  boost::json::object &req = chat.options().model_options;
+  req = options;
+  auto send = [&](const std::string &prompt) {
+    chat.ResetContext();
+    chat.SendRequestToAi("(" + std::to_string(++request) + ") " + prompt);
+  };
+  std::int64_t prompt_count = 0, prompt_ns = 0, eval_count = 0, eval_ns = 0;
+  try {
+    if (opt.warmup) {
+      // loads the model with the options, and pages its weights in
+      req["num_predict"] = 1;
+      send(prompts.front());
+    }
+    req["num_predict"] = opt.num_predict;
+    for (int r = 0; r < std::max(opt.repeats, 1); ++r) {
+      for (auto &prompt : prompts) {
+        send(prompt);
+        const ResponseStats &s = chat.last_stats();
+        prompt_count += s.prompt_eval_count;
+        prompt_ns += s.prompt_eval_duration;
+        eval_count += s.eval_count;
+        eval_ns += s.eval_duration;
+      }
+    }
+  } catch (const std::exception &e) {
+    trial.error = e.what();
+    return trial;
+  }
+  trial.seconds = (prompt_ns + eval_ns) / 1e9;
+  trial.prompt_tps = prompt_ns > 0 ? prompt_count * 1e9 / prompt_ns : 0;
+  trial.eval_tps = eval_ns > 0 ? eval_count * 1e9 / eval_ns : 0;
+  return trial;
+}
+
+void LogTrial(std::ostream &os, const TuneTrial &trial) {
+  os << boost::json::serialize(trial.options) << " ";
+  if (!trial.error.empty()) {
+    os << "error: " << trial.error << std::endl;
+    return;
+  }
+  std::ios_base::fmtflags flags = os.flags();
+  std::streamsize precision = os.precision();
+  os << std::fixed << std::setprecision(1) << "prompt " << trial.prompt_tps
+     << " tok/s, generation " << trial.eval_tps << " tok/s, "
+     << std::setprecision(2) << trial.seconds << " s" << std::endl;
+  os.flags(flags);
+  os.precision(precision);
+}
+
+} // namespace
+
+std::vector<std::string> DefaultTunePrompts() {
+  return {
+      "What is the capital of France?",
+      "Write a C++ function that returns the n-th Fibonacci number, and "
+      "explain its time complexity.",
+      "Summarize the following text in three sentences. The development of "
+      "the steam engine in the eighteenth century changed how goods were "
+      "made and moved. Factories no longer had to be built next to rivers "
+      "for water power, so they grew in the cities where workers lived. "
+      "Railways carried raw materials to the factories and finished goods "
+      "to ports, which cut the cost of transport and opened distant markets. "
+      "The demand for coal and iron grew, which in turn drove improvements "
+      "in mining and metallurgy. At the same time, working conditions in the "
+      "new factories were often harsh, with long hours, low wages and child "
+      "labour, which led to the first labour laws and to the rise of trade "
+      "unions. Historians still debate whether living standards rose or fell "
+      "in the first decades of the industrial revolution.",
+  };
+}
+
+// Ollama uses the number of physical cores by default, which is often half
+// the hardware threads.
+std::vector<TuneParameter> DefaultTuneParameters() {
+  std::int64_t threads = std::max(1u, std::thread::hardware_concurrency());
+  std::set<std::int64_t> counts = {threads,
+                                   std::max<std::int64_t>(threads / 2, 1)};
+  for (std::int64_t n = 2; n < threads; n *= 2) {
+    counts.insert(n);
+  }
+  return {
+      {"num_thread", {counts.begin(), counts.end()}},
+      {"num_batch", {128, 256, 512, 1024}},
+  };
+}
+
+TuneResult Tune(OllamaChat &chat, const TuneOptions &opt, std::ostream *log) {
+  std::vector<std::string> prompts =
+      opt.prompts.empty() ? DefaultTunePrompts() : opt.prompts;
+  std::vector<TuneParameter> parameters =
+      opt.parameters.empty() ? DefaultTuneParameters() : opt.parameters;
+  Options &chat_opt = chat.options();
+  boost::json::object saved = chat_opt.model_options;
+  TuneResult result;
+  result.best =
+      ProfileOptions(chat_opt.profiles, chat_opt.model, chat_opt.model_options);
+  int request = 0;
+  auto run = [&](const boost::json::object &options) -> const TuneTrial & {
+    result.trials.push_back(Measure(chat, options, prompts, opt, request));
+    if (log != nullptr) {
+      LogTrial(*log, result.trials.back());
+    }
+    return result.trials.back();
+  };
+
+  if (const TuneTrial &start = run(result.best); !start.error.empty()) {
+    chat_opt.model_options = saved;
+    throw std::runtime_error("The current options failed: " + start.error);
+  }
+  for (auto &param : parameters) {
+    for (std::int64_t value : param.values) {
+      boost::json::object options = result.best;
+      options[param.name] = value;
+      std::string key = boost::json::serialize(options);
+      if (std::any_of(result.trials.begin(), result.trials.end(),
+                      [&key](const TuneTrial &t) {
+                        return boost::json::serialize(t.options) == key;
+                      })) {
+        continue; // already measured, e.g. the best setting
+      }
+      const TuneTrial &trial = run(options);
+      double best = result.trials[result.best_trial].seconds;
+      if (trial.error.empty() && trial.seconds < best * (1 - opt.min_gain)) {
+        result.best = trial.options;
+        result.best_trial = result.trials.size() - 1;
+      }
+    }
+  }
+  chat_opt.model_options = saved;
+  chat.ResetContext();
+  return result;
+}
+
+TuneParameter ParseTuneParameter(const std::string &spec) {
+  TuneParameter param;
+  size_t eq = spec.find('=');
+  if (eq == 0 || eq == std::string::npos || eq + 1 == spec.size()) {
+    throw std::invalid_argument("Expected name=value[,value...]: " + spec);
+  }
+  param.name = spec.substr(0, eq);
+  std::string_view values = std::string_view(spec).substr(eq + 1);
+  for (;;) {
+    std::int64_t v = 0;
+    const char *end = values.data() + values.size();
+    auto [p, ec] = std::from_chars(values.data(), end, v);
+    if (ec != std::errc() || (p != end && (*p != ',' || p + 1 == end))) {
+      throw std::invalid_argument("Invalid value in \"" + spec + "\"");
+    }
+    param.values.push_back(v);
+    if (p == end) {
+      break;
+    }
+    values.remove_prefix(p + 1 - values.data());
+  }
+  return param;
+}
+
+} // namespace ochat
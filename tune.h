@@ -0,0 +1,95 @@
+/**
+ * @file tune.h
+ * @brief Finds the generation options (num_thread, num_batch, ...) of a model
+ * that run a set of representative prompts fastest on the server.
+ */
+
+#ifndef __TUNE_H__
+#define __TUNE_H__
+
+#include "app_config.h"
+#include "ochat.h"
+#include <boost/json.hpp>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace ochat {
+
+// An option and the values tried for it.
+struct TuneParameter {
+  std::string name; // e.g. "num_thread"
+  std::vector<std::int64_t> values;
+};
+
+struct TuneOptions {
+  std::vector<std::string> prompts;      // DefaultTunePrompts() if empty
+  std::vector<TuneParameter> parameters; // DefaultTuneParameters() if empty
+  int num_predict = OLLAMA_TUNE_PREDICT; // tokens generated per prompt
+  int repeats = 1;     // times the prompts are sent for each setting
+  bool warmup = true;  // send a request before measuring a setting
+  // fraction by which a setting must be faster to replace the best one, so
+  // that noise does not change the profile
+  double min_gain = 0.02;
+};
+
+// The measurement of one setting.
+struct TuneTrial {
+  boost::json::object options;
+  double prompt_tps = 0; // prompt evaluation tokens per second
+  double eval_tps = 0;   // generated tokens per second
+  double seconds = 0;    // server time of the prompts, excluding model loads
+  std::string error;     // why the setting failed, empty on success
+};
+
+struct TuneResult {
+  boost::json::object best;      // the options of the fastest setting
+  std::vector<TuneTrial> trials; // in the order they were run
+  std::size_t best_trial = 0;    // the index of the fastest trial
+};
+
+/**
+ * Returns a few prompts of different lengths, like those of a chat.
+ */
+std::vector<std::string> DefaultTunePrompts();
+
+/**
+ * Returns the settings swept by default: num_thread up to the number of
+ * hardware threads and num_batch.  num_ctx is not included as a smaller
+ * context is always faster but truncates the conversations, nor num_gpu as
+ * it does not apply to CPU only servers; both can be added.
+ */
+std::vector<TuneParameter> DefaultTuneParameters();
+
+/**
+ * Sweeps the parameters one at a time (coordinate descent), starting from
+ * the current options of the model (see ProfileOptions()).  Each value of a
+ * parameter is tried with the best values found for the other parameters,
+ * and kept if it runs the prompts faster.  A setting is measured by the
+ * prompt evaluation and generation durations reported by the server, so
+ * model loads are not counted.  Each prompt is sent on a new conversation
+ * and starts with the number of the request, so that the server does not
+ * reuse the prompt cache of an earlier request.
+ *
+ * The conversation of the chat is reset, its model_options are restored.
+ *
+ * @param chat The client, connected to the server and with the model set.
+ * @param opt The sweep options.
+ * @param log If not null, each trial is reported here.
+ * @return The best options and the trials.
+ * @throw std::runtime_error if the starting options fail.
+ */
+TuneResult Tune(OllamaChat &chat, const TuneOptions &opt = {},
+                std::ostream *log = nullptr);
+
+/**
+ * Parses a parameter sweep, e.g. "num_ctx=2048,4096,8192".
+ *
+ * @throw std::invalid_argument if the spec is not name=value[,value...].
+ */
+TuneParameter ParseTuneParameter(const std::string &spec);
+
+} // namespace ochat
+
+#endif // __TUNE_H__
@@ -0,0 +1,237 @@
+// Dot product kernels for the stored vector types.  The AVX2 and AVX-512
+// kernels are compiled with function level target attributes and selected at
+// run time, so the library runs on any x86-64 CPU without special compiler
+// flags.
+#include "vector_index.h"
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define OCHAT_X86 1
+#include <immintrin.h>
+#endif
+
+namespace ochat {
+
+namespace {
+
+float I8Scale(const void *row) {
+  float scale;
+  std::memcpy(&scale, row, sizeof(scale));
+  return scale;
+}
+
+const std::int8_t *I8Data(const void *row) {
+  return static_cast<const std::int8_t *>(row) + sizeof(float);
+}
+
+float DotF32Scalar(const float *q, const void *row, std::size_t dim) {
+  auto *r = static_cast<const float *>(row);
+  float sum = 0;
+  for (std::size_t i = 0; i < dim; ++i) {
+    sum += q[i] * r[i];
+  }
+  return sum;
+}
+
+float DotF16Scalar(const float *q, const void *row, std::size_t dim) {
+  auto *r = static_cast<const std::uint16_t *>(row);
+  float sum = 0;
+  for (std::size_t i = 0; i < dim; ++i) {
+    sum += q[i] * HalfToFloat(r[i]);
+  }
+  return sum;
+}
+
+float DotI8Scalar(const float *q, const void *row, std::size_t dim) {
+  const std::int8_t *r = I8Data(row);
+  float sum = 0;
+  for (std::size_t i = 0; i < dim; ++i) {
+    sum += q[i] * r[i];
+  }
+  return sum * I8Scale(row);
+}
+
+#ifdef OCHAT_X86
+
+__attribute__((target("avx2,fma"))) float HorizontalSum(__m256 v) {
+  __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+  s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+  s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+  return _mm_cvtss_f32(s);
+}
+
+// two accumulators hide the latency of the fused multiply adds
+__attribute__((target("avx2,fma"))) float DotF32Avx2(const float *q,
+                                                     const void *row,
+                                                     std::size_t dim) {
+  auto *r = static_cast<const float *>(row);
+  __m256 acc0 = _mm256_setzero_ps();
+  __m256 acc1 = _mm256_setzero_ps();
+  std::size_t i = 0;
+  for (; i + 16 <= dim; i += 16) {
+    acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(q + i), _mm256_loadu_ps(r + i), acc0);
+    acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(q + i + 8),
+                           _mm256_loadu_ps(r + i + 8), acc1);
+  }
+  for (; i + 8 <= dim; i += 8) {
+    acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(q + i), _mm256_loadu_ps(r + i), acc0);
+  }
+  return HorizontalSum(_mm256_add_ps(acc0, acc1)) +
+         DotF32Scalar(q + i, r + i, dim - i);
+}
+
+__attribute__((target("avx2,fma,f16c"))) float DotF16Avx2(const float *q,
+                                                          const void *row,
+                                                          std::size_t dim) {
+  auto *r = static_cast<const std::uint16_t *>(row);
+  __m256 acc0 = _mm256_setzero_ps();
+  __m256 acc1 = _mm256_setzero_ps();
+  std::size_t i = 0;
+  for (; i + 16 <= dim; i += 16) {
+    __m256 r0 = _mm256_cvtph_ps(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(r + i)));
+    __m256 r1 = _mm256_cvtph_ps(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(r + i + 8)));
+    acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(q + i), r0, acc0);
+    acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(q + i + 8), r1, acc1);
+  }
+  for (; i + 8 <= dim; i += 8) {
+    __m256 r0 = _mm256_cvtph_ps(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(r + i)));
+    acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(q + i), r0, acc0);
+  }
+  return HorizontalSum(_mm256_add_ps(acc0, acc1)) +
+         DotF16Scalar(q + i, r + i, dim - i);
+}
+
+__attribute__((target("avx2,fma"))) float DotI8Avx2(const float *q,
+                                                    const void *row,
+                                                    std::size_t dim) {
+  const std::int8_t *r = I8Data(row);
+  __m256 acc0 = _mm256_setzero_ps();
+  __m256 acc1 = _mm256_setzero_ps();
+  std::size_t i = 0;
+  for (; i + 16 <= dim; i += 16) {
+    __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(r + i));
+    __m256 r0 = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(b));
+    __m256 r1 = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_srli_si128(b, 8)));
+    acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(q + i), r0, acc0);
+    acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(q + i + 8), r1, acc1);
+  }
+  float sum = HorizontalSum(_mm256_add_ps(acc0, acc1));
+  for (; i < dim; ++i) {
+    sum += q[i] * r[i];
+  }
+  return sum * I8Scale(row);
+}
+
+__attribute__((target("avx512f"))) float DotF32Avx512(const float *q,
+                                                      const void *row,
+                                                      std::size_t dim) {
+  auto *r = static_cast<const float *>(row);
+  __m512 acc0 = _mm512_setzero_ps();
+  __m512 acc1 = _mm512_setzero_ps();
+  std::size_t i = 0;
+  for (; i + 32 <= dim; i += 32) {
+    acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(q + i), _mm512_loadu_ps(r + i), acc0);
+    acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(q + i + 16),
+                           _mm512_loadu_ps(r + i + 16), acc1);
+  }
+  for (; i + 16 <= dim; i += 16) {
+    acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(q + i), _mm512_loadu_ps(r + i), acc0);
+  }
+  return _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1)) +
+         DotF32Scalar(q + i, r + i, dim - i);
+}
+
+__attribute__((target("avx512f"))) float DotF16Avx512(const float *q,
+                                                      const void *row,
+                                                      std::size_t dim) {
+  auto *r = static_cast<const std::uint16_t *>(row);
+  __m512 acc0 = _mm512_setzero_ps();
+  __m512 acc1 = _mm512_setzero_ps();
+  std::size_t i = 0;
+  for (; i + 32 <= dim; i += 32) {
+    __m512 r0 = _mm512_cvtph_ps(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(r + i)));
+    __m512 r1 = _mm512_cvtph_ps(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(r + i + 16)));
+    acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(q + i), r0, acc0);
+    acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(q + i + 16), r1, acc1);
+  }
+  for (; i + 16 <= dim; i += 16) {
+    __m512 r0 = _mm512_cvtph_ps(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(r + i)));
+    acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(q + i), r0, acc0);
+  }
+  return _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1)) +
+         DotF16Scalar(q + i, r + i, dim - i);
+}
+
+__attribute__((target("avx512f"))) float DotI8Avx512(const float *q,
+                                                     const void *row,
+                                                     std::size_t dim) {
+  const std::int8_t *r = I8Data(row);
+  __m512 acc0 = _mm512_setzero_ps();
+  __m512 acc1 = _mm512_setzero_ps();
+  std::size_t i = 0;
+  for (; i + 32 <= dim; i += 32) {
+    __m512 r0 = _mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(r + i))));
+    __m512 r1 = _mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(r + i + 16))));
+    acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(q + i), r0, acc0);
+    acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(q + i + 16), r1, acc1);
+  }
+  for (; i + 16 <= dim; i += 16) {
+    __m512 r0 = _mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(r + i))));
+    acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(q + i), r0, acc0);
+  }
+  float sum = _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+  for (; i < dim; ++i) {
+    sum += q[i] * r[i];
+  }
+  return sum * I8Scale(row);
+}
+
+#endif // OCHAT_X86
+
+} // namespace
+
+SimdLevel DetectSimd() {
+#ifdef OCHAT_X86
+  static const SimdLevel level = [] {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+      return SimdLevel::kAvx512;
+    // every CPU with AVX2 and FMA also has F16C
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+      return SimdLevel::kAvx2;
+    return SimdLevel::kScalar;
+  }();
+  return level;
+#else
+  return SimdLevel::kScalar;
+#endif
+}
+
+DotFn GetDotKernel(VecType type, SimdLevel level) {
+#ifdef OCHAT_X86
+  if (level == SimdLevel::kAvx512) {
+    return type == VecType::kF16  ? DotF16Avx512
+           : type == VecType::kI8 ? DotI8Avx512
+                                  : DotF32Avx512;
+  }
+  if (level == SimdLevel::kAvx2) {
+    return type == VecType::kF16  ? DotF16Avx2
+           : type == VecType::kI8 ? DotI8Avx2
+                                  : DotF32Avx2;
+  }
+#endif
+  return type == VecType::kF16  ? DotF16Scalar
+         : type == VecType::kI8 ? DotI8Scalar
+                                : DotF32Scalar;
+}
+
+} // namespace ochat
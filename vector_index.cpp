@@ -0,0 +1,502 @@
+#include "vector_index.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <future>
+#include <queue>
+#include <random>
+#include <stdexcept>
+
+namespace ochat {
+
+namespace {
+
+// rows per thread below which a flat scan is not split
+constexpr std::size_t kMinRowsPerThread = 16384;
+
+constexpr char kHnswMagic[4] = {'O', 'C', 'H', 'N'};
+constexpr std::uint32_t kHnswVersion = 1;
+
+struct HnswHeader {
+  char magic[4];
+  std::uint32_t version;
+  std::uint32_t m;
+  std::int32_t max_level;
+  std::uint64_t n;
+  std::uint64_t fingerprint;
+  std::uint32_t entry;
+  std::uint32_t reserved;
+};
+
+// keeps the k hits with the highest score
+class TopK {
+public:
+  explicit TopK(std::size_t k) : k_(k) {}
+
+  void Push(std::size_t id, float score) {
+    if (heap_.size() < k_) {
+      heap_.push_back({id, score});
+      std::push_heap(heap_.begin(), heap_.end(), Worse);
+    } else if (k_ > 0 && score > heap_.front().score) {
+      std::pop_heap(heap_.begin(), heap_.end(), Worse);
+      heap_.back() = {id, score};
+      std::push_heap(heap_.begin(), heap_.end(), Worse);
+    }
+  }
+
+  // the hits, best first
+  std::vector<SearchHit> Take() {
+    std::sort_heap(heap_.begin(), heap_.end(), Worse);
+    return std::move(heap_);
+  }
+
+private:
+  // heap order that keeps the worst hit at the front
+  static bool Worse(const SearchHit &a, const SearchHit &b) {
+    return a.score > b.score;
+  }
+
+  std::size_t k_;
+  std::vector<SearchHit> heap_;
+};
+
+// Per thread visited marks for graph searches.  Bumping the epoch clears all
+// the marks, so a search does not need to clear a mark per node.
+class Visited {
+public:
+  void Reset(std::size_t n) {
+    if (marks_.size() < n) {
+      marks_.assign(n, 0);
+      epoch_ = 0;
+    }
+    if (++epoch_ == 0) { // wrapped around
+      std::fill(marks_.begin(), marks_.end(), 0);
+      epoch_ = 1;
+    }
+  }
+  // marks the node, returns false if it was already marked
+  bool Mark(std::uint32_t id) {
+    if (marks_[id] == epoch_)
+      return false;
+    marks_[id] = epoch_;
+    return true;
+  }
+
+private:
+  std::vector<std::uint32_t> marks_;
+  std::uint32_t epoch_ = 0;
+};
+
+thread_local Visited t_visited;
+
+} // namespace
+
+std::uint64_t StoreFingerprint(const VectorStore &store) {
+  std::uint64_t h = 14695981039346656037ull;
+  auto mix = [&h](std::uint64_t v) {
+    for (int i = 0; i < 8; ++i) {
+      h ^= (v >> (8 * i)) & 0xFF;
+      h *= 1099511628211ull;
+    }
+  };
+  mix(store.size());
+  mix(store.dim());
+  mix(static_cast<std::uint64_t>(store.type()));
+  for (auto &m : store.meta()) {
+    mix(m.hash);
+    mix(m.begin);
+  }
+  // and a sample of the vectors, which change when the embedding model does
+  std::size_t step = std::max<std::size_t>(1, store.size() / 64);
+  for (std::size_t i = 0; i < store.size(); i += step) {
+    auto *row = static_cast<const unsigned char *>(store.row(i));
+    for (std::size_t j = 0; j < store.row_bytes(); ++j) {
+      h ^= row[j];
+      h *= 1099511628211ull;
+    }
+  }
+  return h;
+}
+
+FlatIndex::FlatIndex(const VectorStore &store, std::size_t threads)
+    : store_(store), dot_(GetDotKernel(store.type())) {
+  if (threads > 1) {
+    pool_ = std::make_unique<ThreadPool>(threads - 1);
+  }
+  store_.Prefetch();
+}
+
+std::vector<SearchHit> FlatIndex::Search(const float *query,
+                                         std::size_t k) const {
+  std::size_t n = store_.size();
+  std::size_t dim = store_.dim();
+  auto scan = [this, query, k, dim](std::size_t begin, std::size_t end) {
+    TopK top(k);
+    for (std::size_t i = begin; i < end; ++i) {
+      top.Push(i, dot_(query, store_.row(i), dim));
+    }
+    return top.Take();
+  };
+
+  std::size_t parts = pool_ ? pool_->size() + 1 : 1;
+  parts = std::max<std::size_t>(1, std::min(parts, n / kMinRowsPerThread));
+  if (parts == 1) {
+    return scan(0, n);
+  }
+
+  // scan ranges on the helper threads and the first range on this thread,
+  // then merge the per range results
+  std::size_t step = (n + parts - 1) / parts;
+  std::vector<std::future<std::vector<SearchHit>>> futures;
+  for (std::size_t p = 1; p < parts; ++p) {
+    std::size_t begin = p * step;
+    std::size_t end = std::min(n, begin + step);
+    futures.push_back(pool_->Submit([&scan, begin, end] {
+      return scan(begin, end);
+    }));
+  }
+  TopK top(k);
+  for (auto &hit : scan(0, step)) {
+    top.Push(hit.id, hit.score);
+  }
+  for (auto &f : futures) {
+    for (auto &hit : f.get()) {
+      top.Push(hit.id, hit.score);
+    }
+  }
+  return top.Take();
+}
+
+HnswIndex::HnswIndex(const VectorStore &store, const HnswOptions &opt)
+    : store_(store), opt_(opt), dot_(GetDotKernel(store.type())) {
+  opt_.m = std::max<std::size_t>(opt_.m, 2);
+}
+
+std::size_t HnswIndex::MaxLinks(int level) const {
+  return level == 0 ? 2 * opt_.m : opt_.m;
+}
+
+std::uint32_t *HnswIndex::Links(std::uint32_t id, int level) {
+  if (level == 0) {
+    return &level0_[id * (MaxLinks(0) + 1)];
+  }
+  return &upper_[id][(level - 1) * (opt_.m + 1)];
+}
+
+const std::uint32_t *HnswIndex::Links(std::uint32_t id, int level) const {
+  return const_cast<HnswIndex *>(this)->Links(id, level);
+}
+
+float HnswIndex::Score(const float *query, std::uint32_t id) const {
+  return dot_(query, store_.row(id), store_.dim());
+}
+
+// move towards the query on one level, until no link is closer
+std::uint32_t HnswIndex::Greedy(const float *query, std::uint32_t entry,
+                                int level, bool lock) const {
+  std::uint32_t cur = entry;
+  float best = Score(query, cur);
+  for (bool changed = true; changed;) {
+    changed = false;
+    std::unique_lock<std::mutex> guard;
+    if (lock)
+      guard = std::unique_lock<std::mutex>(node_locks_[cur]);
+    const std::uint32_t *links = Links(cur, level);
+    for (std::uint32_t i = 1; i <= links[0]; ++i) {
+      float s = Score(query, links[i]);
+      if (s > best) {
+        best = s;
+        cur = links[i];
+        changed = true;
+      }
+    }
+  }
+  return cur;
+}
+
+// best first search of one level, returns up to ef nodes best first
+std::vector<HnswIndex::Cand> HnswIndex::SearchLevel(const float *query,
+                                                    std::uint32_t entry,
+                                                    std::size_t ef, int level,
+                                                    bool lock) const {
+  auto better = [](const Cand &a, const Cand &b) { return a.score < b.score; };
+  auto worse = [](const Cand &a, const Cand &b) { return a.score > b.score; };
+  // candidates to expand, best on top, and results, worst on top
+  std::priority_queue<Cand, std::vector<Cand>, decltype(better)> cands(better);
+  std::priority_queue<Cand, std::vector<Cand>, decltype(worse)> results(worse);
+
+  Visited &visited = t_visited;
+  visited.Reset(n_);
+  visited.Mark(entry);
+  Cand start{Score(query, entry), entry};
+  cands.push(start);
+  results.push(start);
+
+  std::vector<std::uint32_t> links;
+  while (!cands.empty()) {
+    Cand c = cands.top();
+    if (results.size() >= ef && c.score < results.top().score)
+      break;
+    cands.pop();
+    {
+      std::unique_lock<std::mutex> guard;
+      if (lock)
+        guard = std::unique_lock<std::mutex>(node_locks_[c.id]);
+      const std::uint32_t *l = Links(c.id, level);
+      links.assign(l + 1, l + 1 + l[0]);
+    }
+    for (std::uint32_t nb : links) {
+      if (!visited.Mark(nb))
+        continue;
+      float s = Score(query, nb);
+      if (results.size() < ef || s > results.top().score) {
+        cands.push({s, nb});
+        results.push({s, nb});
+        if (results.size() > ef)
+          results.pop();
+      }
+    }
+  }
+
+  std::vector<Cand> out(results.size());
+  for (std::size_t i = out.size(); i-- > 0;) {
+    out[i] = results.top();
+    results.pop();
+  }
+  return out;
+}
+
+// Keeps candidates (best first) that are closer to the query than to any
+// already kept neighbour, so the links point in diverse directions.  The
+// remaining slots are filled with the best of the pruned candidates.
+std::vector<std::uint32_t>
+HnswIndex::SelectNeighbors(std::vector<Cand> cands, std::size_t max) const {
+  std::vector<std::uint32_t> kept;
+  std::vector<std::uint32_t> pruned;
+  std::vector<float> vec(store_.dim());
+  for (auto &c : cands) {
+    if (kept.size() >= max)
+      break;
+    store_.Get(c.id, vec.data());
+    bool diverse = true;
+    for (std::uint32_t k : kept) {
+      if (Score(vec.data(), k) > c.score) {
+        diverse = false;
+        break;
+      }
+    }
+    (diverse ? kept : pruned).push_back(c.id);
+  }
+  for (std::size_t i = 0; i < pruned.size() && kept.size() < max; ++i) {
+    kept.push_back(pruned[i]);
+  }
+  return kept;
+}
+
+// adds a link from -> to, pruning the links of from when it has too many
+void HnswIndex::Link(std::uint32_t from, std::uint32_t to, int level) {
+  std::lock_guard<std::mutex> guard(node_locks_[from]);
+  std::uint32_t *links = Links(from, level);
+  std::size_t max = MaxLinks(level);
+  if (links[0] < max) {
+    links[++links[0]] = to;
+    return;
+  }
+  std::vector<float> vec(store_.dim());
+  store_.Get(from, vec.data());
+  std::vector<Cand> cands;
+  cands.reserve(max + 1);
+  cands.push_back({Score(vec.data(), to), to});
+  for (std::uint32_t i = 1; i <= links[0]; ++i) {
+    cands.push_back({Score(vec.data(), links[i]), links[i]});
+  }
+  std::sort(cands.begin(), cands.end(),
+            [](const Cand &a, const Cand &b) { return a.score > b.score; });
+  std::vector<std::uint32_t> kept = SelectNeighbors(std::move(cands), max);
+  links[0] = static_cast<std::uint32_t>(kept.size());
+  std::copy(kept.begin(), kept.end(), links + 1);
+}
+
+void HnswIndex::Insert(std::uint32_t id) {
+  int level = levels_[id];
+  std::vector<float> query(store_.dim());
+  store_.Get(id, query.data());
+
+  // a node that becomes the new top of the graph holds the entry lock for
+  // its whole insertion, like in the reference implementation
+  std::unique_lock<std::mutex> top_guard(entry_lock_);
+  std::uint32_t cur = entry_;
+  int top = max_level_;
+  if (top < 0) { // the first node
+    entry_ = id;
+    max_level_ = level;
+    return;
+  }
+  if (level <= top)
+    top_guard.unlock();
+
+  for (int l = top; l > level; --l) {
+    cur = Greedy(query.data(), cur, l, true);
+  }
+  for (int l = std::min(level, top); l >= 0; --l) {
+    std::vector<Cand> cands =
+        SearchLevel(query.data(), cur, opt_.ef_construction, l, true);
+    cur = cands.front().id;
+    std::vector<std::uint32_t> neighbors =
+        SelectNeighbors(std::move(cands), opt_.m);
+    {
+      std::lock_guard<std::mutex> guard(node_locks_[id]);
+      std::uint32_t *links = Links(id, l);
+      links[0] = static_cast<std::uint32_t>(neighbors.size());
+      std::copy(neighbors.begin(), neighbors.end(), links + 1);
+    }
+    for (std::uint32_t nb : neighbors) {
+      Link(nb, id, l);
+    }
+  }
+  if (level > top) {
+    entry_ = id;
+    max_level_ = level;
+  }
+}
+
+void HnswIndex::Build() {
+  n_ = store_.size();
+  max_level_ = -1;
+  entry_ = 0;
+  levels_.assign(n_, 0);
+  level0_.assign(n_ * (MaxLinks(0) + 1), 0);
+  upper_.assign(n_, {});
+  node_locks_ = std::make_unique<std::mutex[]>(n_);
+
+  // the levels are drawn up front so the graph does not depend on the order
+  // the threads insert the nodes in
+  std::mt19937_64 rng(opt_.seed);
+  std::uniform_real_distribution<double> uniform(0.0, 1.0);
+  double ml = 1.0 / std::log(static_cast<double>(opt_.m));
+  for (std::size_t i = 0; i < n_; ++i) {
+    int level = static_cast<int>(-std::log(1.0 - uniform(rng)) * ml);
+    levels_[i] = static_cast<std::uint8_t>(std::min(level, 32));
+    upper_[i].assign(levels_[i] * (opt_.m + 1), 0);
+  }
+
+  if (n_ > 0) {
+    Insert(0);
+  }
+  std::atomic<std::size_t> next{1};
+  auto worker = [this, &next] {
+    for (std::size_t i; (i = next++) < n_;) {
+      Insert(static_cast<std::uint32_t>(i));
+    }
+  };
+  std::size_t threads = std::max<std::size_t>(1, opt_.threads);
+  if (threads > 1) {
+    ThreadPool pool(threads - 1);
+    std::vector<std::future<void>> helpers;
+    for (std::size_t t = 1; t < threads; ++t) {
+      helpers.push_back(pool.Submit(worker));
+    }
+    worker();
+    for (auto &h : helpers) {
+      h.get();
+    }
+  } else {
+    worker();
+  }
+  node_locks_.reset();
+}
+
+std::vector<SearchHit> HnswIndex::Search(const float *query,
+                                         std::size_t k) const {
+  std::vector<SearchHit> hits;
+  if (max_level_ < 0 || k == 0)
+    return hits;
+  std::uint32_t cur = entry_;
+  for (int l = max_level_; l > 0; --l) {
+    cur = Greedy(query, cur, l, false);
+  }
+  std::vector<Cand> cands =
+      SearchLevel(query, cur, std::max(opt_.ef_search, k), 0, false);
+  for (std::size_t i = 0; i < cands.size() && i < k; ++i) {
+    hits.push_back({cands[i].id, cands[i].score});
+  }
+  return hits;
+}
+
+void HnswIndex::Save(const std::string &path) const {
+  std::ofstream out(path + ".tmp", std::ios::binary | std::ios::trunc);
+  HnswHeader hdr = {};
+  std::memcpy(hdr.magic, kHnswMagic, sizeof(kHnswMagic));
+  hdr.version = kHnswVersion;
+  hdr.m = static_cast<std::uint32_t>(opt_.m);
+  hdr.max_level = max_level_;
+  hdr.n = n_;
+  hdr.fingerprint = StoreFingerprint(store_);
+  hdr.entry = entry_;
+  out.write(reinterpret_cast<const char *>(&hdr), sizeof(hdr));
+  out.write(reinterpret_cast<const char *>(levels_.data()),
+            static_cast<std::streamsize>(levels_.size()));
+  out.write(reinterpret_cast<const char *>(level0_.data()),
+            static_cast<std::streamsize>(level0_.size() * 4));
+  for (auto &u : upper_) {
+    out.write(reinterpret_cast<const char *>(u.data()),
+              static_cast<std::streamsize>(u.size() * 4));
+  }
+  out.close();
+  if (!out || std::rename((path + ".tmp").c_str(), path.c_str())) {
+    std::remove((path + ".tmp").c_str());
+    throw std::runtime_error("Cannot write index: " + path);
+  }
+}
+
+bool HnswIndex::Load(const std::string &path) {
+  std::ifstream in(path, std::ios::binary);
+  HnswHeader hdr;
+  if (!in.read(reinterpret_cast<char *>(&hdr), sizeof(hdr)) ||
+      std::memcmp(hdr.magic, kHnswMagic, sizeof(kHnswMagic)) != 0 ||
+      hdr.version != kHnswVersion || hdr.n != store_.size() ||
+      hdr.fingerprint != StoreFingerprint(store_) || hdr.m < 2) {
+    return false;
+  }
+  opt_.m = hdr.m;
+  n_ = hdr.n;
+  max_level_ = hdr.max_level;
+  entry_ = hdr.entry;
+  levels_.resize(n_);
+  level0_.resize(n_ * (MaxLinks(0) + 1));
+  in.read(reinterpret_cast<char *>(levels_.data()),
+          static_cast<std::streamsize>(levels_.size()));
+  in.read(reinterpret_cast<char *>(level0_.data()),
+          static_cast<std::streamsize>(level0_.size() * 4));
+  upper_.assign(n_, {});
+  for (std::size_t i = 0; i < n_ && in; ++i) {
+    upper_[i].resize(levels_[i] * (opt_.m + 1));
+    in.read(reinterpret_cast<char *>(upper_[i].data()),
+            static_cast<std::streamsize>(upper_[i].size() * 4));
+  }
+  // a damaged file must not send a search outside the store
+  bool valid = static_cast<bool>(in) && entry_ < std::max<std::size_t>(n_, 1) &&
+               max_level_ < 33;
+  auto check = [&](const std::uint32_t *links, std::size_t max) {
+    valid = valid && links[0] <= max &&
+            std::all_of(links + 1, links + 1 + links[0],
+                        [this](std::uint32_t id) { return id < n_; });
+  };
+  for (std::size_t i = 0; i < n_ && valid; ++i) {
+    check(Links(static_cast<std::uint32_t>(i), 0), MaxLinks(0));
+    for (int l = 1; l <= levels_[i] && valid; ++l) {
+      check(Links(static_cast<std::uint32_t>(i), l), opt_.m);
+    }
+  }
+  if (!valid) {
+    n_ = 0;
+    max_level_ = -1;
+    return false;
+  }
+  return true;
+}
+
+} // namespace ochat
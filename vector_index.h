@@ -0,0 +1,171 @@
+/**
+ * @file vector_index.h
+ * @brief Nearest neighbour search over the vectors of a vector store, exact
+ * (SIMD brute force scan) or approximate (HNSW graph).
+ */
+
+#ifndef __VECTOR_INDEX_H__
+#define __VECTOR_INDEX_H__
+
+#include "thread_pool.h"
+#include "vector_store.h"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace ochat {
+
+// instruction set used by the dot product kernels
+enum class SimdLevel { kScalar, kAvx2, kAvx512 };
+
+// dot product of a float query with a stored row of dim elements
+using DotFn = float (*)(const float *query, const void *row, std::size_t dim);
+
+/**
+ * Returns the best instruction set supported by the CPU.
+ */
+SimdLevel DetectSimd();
+
+/**
+ * Returns the dot product kernel for rows of the given type.
+ *
+ * @param type The element type of the rows.
+ * @param level The instruction set, must be supported by the CPU.
+ */
+DotFn GetDotKernel(VecType type, SimdLevel level = DetectSimd());
+
+// A search result, the row of the store and its dot product with the query
+// (the cosine similarity for normalized vectors).
+struct SearchHit {
+  std::size_t id;
+  float score;
+};
+
+// Finds the rows of a vector store with the largest dot product with a query.
+// Search() may be called concurrently from several threads.
+class VectorIndex {
+public:
+  virtual ~VectorIndex() = default;
+
+  /**
+   * @param query The query vector (store.dim() floats).
+   * @param k The number of results.
+   * @return Up to k results, best first.
+   */
+  virtual std::vector<SearchHit> Search(const float *query,
+                                        std::size_t k) const = 0;
+};
+
+// Exact search that scans every row.  Large stores are split into ranges that
+// are scanned in parallel.
+class FlatIndex : public VectorIndex {
+public:
+  /**
+   * @param store The store to search, must outlive the index.
+   * @param threads The number of threads that scan a store.
+   */
+  explicit FlatIndex(const VectorStore &store, std::size_t threads = 1);
+
+  std::vector<SearchHit> Search(const float *query,
+                                std::size_t k) const override;
+
+private:
+  const VectorStore &store_;
+  DotFn dot_;
+  std::unique_ptr<ThreadPool> pool_; // helpers for parallel scans
+};
+
+struct HnswOptions {
+  std::size_t m = 16;                // links per node (2 * m on level 0)
+  std::size_t ef_construction = 200; // candidate list size when building
+  std::size_t ef_search = 64;        // candidate list size when searching
+  std::size_t threads = 1;           // threads that build the graph
+  std::uint64_t seed = 42;           // seed for the node levels
+};
+
+// Approximate search on a hierarchical navigable small world graph, which
+// visits a few thousand rows per query regardless of the size of the store.
+class HnswIndex : public VectorIndex {
+public:
+  /**
+   * @param store The store to index, must outlive the index.
+   * @param opt The graph parameters.
+   */
+  explicit HnswIndex(const VectorStore &store, const HnswOptions &opt = {});
+
+  /**
+   * Builds the graph for all the rows of the store, inserting rows
+   * concurrently on opt.threads threads.
+   */
+  void Build();
+
+  /**
+   * Loads a graph saved by Save().
+   *
+   * @param path The path of the graph file.
+   * @return false if the file does not exist or was built for a different
+   * store (the graph then needs to be built).
+   */
+  bool Load(const std::string &path);
+
+  /**
+   * Saves the graph.
+   *
+   * @param path The path of the graph file.
+   * @throw std::runtime_error if the file cannot be written.
+   */
+  void Save(const std::string &path) const;
+
+  std::vector<SearchHit> Search(const float *query,
+                                std::size_t k) const override;
+
+  void set_ef_search(std::size_t ef) { opt_.ef_search = ef; }
+
+private:
+  struct Cand {
+    float score;
+    std::uint32_t id;
+  };
+
+  // the link list of a node on a level, a count followed by the ids
+  std::uint32_t *Links(std::uint32_t id, int level);
+  const std::uint32_t *Links(std::uint32_t id, int level) const;
+  std::size_t MaxLinks(int level) const;
+
+  float Score(const float *query, std::uint32_t id) const;
+  std::uint32_t Greedy(const float *query, std::uint32_t entry, int level,
+                       bool lock) const;
+  std::vector<Cand> SearchLevel(const float *query, std::uint32_t entry,
+                                std::size_t ef, int level, bool lock) const;
+  std::vector<std::uint32_t> SelectNeighbors(std::vector<Cand> cands,
+                                             std::size_t max) const;
+  void Insert(std::uint32_t id);
+  void Link(std::uint32_t from, std::uint32_t to, int level);
+
+  const VectorStore &store_;
+  HnswOptions opt_;
+  DotFn dot_;
+  std::size_t n_ = 0;
+  int max_level_ = -1;
+  std::uint32_t entry_ = 0;
+  std::vector<std::uint8_t> levels_;           // top level of each node
+  std::vector<std::uint32_t> level0_;          // level 0 links of all nodes
+  std::vector<std::vector<std::uint32_t>> upper_; // links on levels >= 1
+
+  // locks used while building
+  std::unique_ptr<std::mutex[]> node_locks_;
+  mutable std::mutex entry_lock_;
+};
+
+/**
+ * Computes a fingerprint of the contents of a store, used to check a saved
+ * index belongs to it.
+ */
+std::uint64_t StoreFingerprint(const VectorStore &store);
+
+} // namespace ochat
+
+#endif // __VECTOR_INDEX_H__
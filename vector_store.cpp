@@ -0,0 +1,247 @@
+#include "vector_store.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace ochat {
+
+namespace {
+
+// The store file starts with a fixed size header, the vectors follow it so
+// that the first vector is 64 byte aligned in the mapping, and the metadata
+// follows the vectors.  Version 2 kept the metadata in a <path>.meta file,
+// which could not be replaced together with the vectors.
+constexpr char kMagic[4] = {'O', 'C', 'V', 'S'};
+constexpr std::uint32_t kVersion = 3;
+constexpr std::size_t kHeaderSize = 64;
+
+struct FileHeader {
+  char magic[4];
+  std::uint32_t version;
+  std::uint32_t dim;
+  std::uint32_t type;
+  std::uint64_t count;
+  std::uint64_t meta_offset; // where the metadata starts
+};
+static_assert(sizeof(FileHeader) <= kHeaderSize);
+
+// The metadata holds one record per vector: the file name, the hash,
+// the begin and end offsets and the text, strings are prefixed by their
+// length.
+template <class T> void WritePod(std::ostream &os, T v) {
+  os.write(reinterpret_cast<const char *>(&v), sizeof(v));
+}
+
+template <class T> bool ReadPod(std::istream &is, T &v) {
+  return static_cast<bool>(is.read(reinterpret_cast<char *>(&v), sizeof(v)));
+}
+
+void WriteString(std::ostream &os, const std::string &s) {
+  WritePod(os, static_cast<std::uint32_t>(s.size()));
+  os.write(s.data(), static_cast<std::streamsize>(s.size()));
+}
+
+bool ReadString(std::istream &is, std::string &s) {
+  std::uint32_t len;
+  if (!ReadPod(is, len) || len > (1u << 30))
+    return false;
+  s.resize(len);
+  return static_cast<bool>(is.read(s.data(), len));
+}
+
+} // namespace
+
+VectorStoreWriter::VectorStoreWriter(const std::string &path, std::size_t dim,
+                                     VecType type)
+    : path_(path), dim_(dim), type_(type), row_(RowBytes(type, dim)) {
+  vec_.open(path_ + ".tmp", std::ios::binary | std::ios::trunc);
+  meta_.open(path_ + ".meta.tmp", std::ios::binary | std::ios::trunc);
+  if (!vec_ || !meta_) {
+    throw std::runtime_error("Cannot create vector store: " + path_);
+  }
+  // the metadata is appended to the vectors by Close(), which also rewrites
+  // the header with the final count
+  char header[kHeaderSize] = {};
+  vec_.write(header, sizeof(header));
+}
+
+VectorStoreWriter::~VectorStoreWriter() {
+  if (!closed_) { // abandoned, don't leave the temporary files behind
+    vec_.close();
+    meta_.close();
+    std::remove((path_ + ".tmp").c_str());
+    std::remove((path_ + ".meta.tmp").c_str());
+  }
+}
+
+void VectorStoreWriter::Add(const float *vec, const ChunkMeta &meta) {
+  if (type_ == VecType::kF16) {
+    auto *out = reinterpret_cast<std::uint16_t *>(row_.data());
+    for (std::size_t i = 0; i < dim_; ++i) {
+      out[i] = FloatToHalf(vec[i]);
+    }
+    AddRaw(row_.data(), meta);
+  } else if (type_ == VecType::kI8) {
+    // symmetric quantization, the largest magnitude maps to 127
+    float max_abs = 0;
+    for (std::size_t i = 0; i < dim_; ++i) {
+      max_abs = std::max(max_abs, std::fabs(vec[i]));
+    }
+    float scale = max_abs > 0 ? max_abs / 127.0f : 1.0f;
+    std::memcpy(row_.data(), &scale, sizeof(scale));
+    auto *out = reinterpret_cast<std::int8_t *>(row_.data() + sizeof(scale));
+    for (std::size_t i = 0; i < dim_; ++i) {
+      out[i] = static_cast<std::int8_t>(std::lround(vec[i] / scale));
+    }
+    AddRaw(row_.data(), meta);
+  } else {
+    AddRaw(vec, meta);
+  }
+}
+
+void VectorStoreWriter::AddRaw(const void *vec, const ChunkMeta &meta) {
+  vec_.write(static_cast<const char *>(vec),
+             static_cast<std::streamsize>(row_.size()));
+  WriteString(meta_, meta.file);
+  WritePod(meta_, meta.hash);
+  WritePod(meta_, static_cast<std::uint64_t>(meta.begin));
+  WritePod(meta_, static_cast<std::uint64_t>(meta.end));
+  WriteString(meta_, meta.text);
+  ++count_;
+}
+
+void VectorStoreWriter::Close() {
+  if (closed_)
+    return;
+  FileHeader hdr = {};
+  std::memcpy(hdr.magic, kMagic, sizeof(kMagic));
+  hdr.version = kVersion;
+  hdr.dim = static_cast<std::uint32_t>(dim_);
+  hdr.type = static_cast<std::uint32_t>(type_);
+  hdr.count = count_;
+  hdr.meta_offset = kHeaderSize + count_ * row_.size();
+  meta_.close();
+  std::ifstream meta(path_ + ".meta.tmp", std::ios::binary);
+  if (meta_ && meta.peek() != std::ifstream::traits_type::eof()) {
+    vec_ << meta.rdbuf();
+  }
+  meta.close();
+  vec_.seekp(0);
+  vec_.write(reinterpret_cast<const char *>(&hdr), sizeof(hdr));
+  vec_.close();
+  if (!vec_ || !meta_) {
+    throw std::runtime_error("Error writing vector store: " + path_);
+  }
+  std::remove((path_ + ".meta.tmp").c_str());
+  // the only step that changes the store seen by readers
+  if (std::rename((path_ + ".tmp").c_str(), path_.c_str())) {
+    throw std::runtime_error("Cannot move vector store into place: " + path_);
+  }
+  closed_ = true;
+  std::remove((path_ + ".meta").c_str()); // of a version 2 store
+}
+
+VectorStore::~VectorStore() { Unmap(); }
+
+void VectorStore::Unmap() {
+  if (map_) {
+    munmap(map_, map_size_);
+  }
+  map_ = nullptr;
+  map_size_ = 0;
+  data_ = nullptr;
+  count_ = 0;
+  dim_ = 0;
+  meta_.clear();
+}
+
+bool VectorStore::Open(const std::string &path) {
+  Unmap();
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || static_cast<std::size_t>(st.st_size) < kHeaderSize) {
+    ::close(fd);
+    throw std::runtime_error("Invalid vector store: " + path);
+  }
+  map_size_ = static_cast<std::size_t>(st.st_size);
+  void *map = mmap(nullptr, map_size_, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd); // the mapping keeps the file open
+  if (map == MAP_FAILED) {
+    map_size_ = 0;
+    throw std::runtime_error("Cannot map vector store: " + path);
+  }
+  map_ = map;
+
+  FileHeader hdr;
+  std::memcpy(&hdr, map_, sizeof(hdr));
+  if (std::memcmp(hdr.magic, kMagic, sizeof(kMagic)) == 0 &&
+      hdr.version != kVersion) {
+    Unmap();
+    throw std::runtime_error("Vector store " + path + " has an older " +
+                             "format, ingest again to rebuild it");
+  }
+  if (std::memcmp(hdr.magic, kMagic, sizeof(kMagic)) != 0 || hdr.type > 2 ||
+      kHeaderSize + hdr.count * RowBytes(VecType(hdr.type), hdr.dim) !=
+          hdr.meta_offset ||
+      hdr.meta_offset > map_size_) {
+    Unmap();
+    throw std::runtime_error("Invalid vector store: " + path);
+  }
+  dim_ = hdr.dim;
+  type_ = static_cast<VecType>(hdr.type);
+  count_ = hdr.count;
+  data_ = static_cast<const char *>(map_) + kHeaderSize;
+
+  std::ifstream meta(path, std::ios::binary);
+  meta.seekg(static_cast<std::streamoff>(hdr.meta_offset));
+  meta_.resize(count_);
+  for (auto &m : meta_) {
+    std::uint64_t begin, end;
+    if (!ReadString(meta, m.file) || !ReadPod(meta, m.hash) ||
+        !ReadPod(meta, begin) || !ReadPod(meta, end) ||
+        !ReadString(meta, m.text)) {
+      meta_.clear();
+      break;
+    }
+    m.begin = begin;
+    m.end = end;
+  }
+  if (meta_.size() != count_) {
+    Unmap();
+    throw std::runtime_error("Vector store metadata does not match: " + path);
+  }
+  return true;
+}
+
+void VectorStore::Prefetch() const {
+  if (map_) {
+    madvise(map_, map_size_, MADV_WILLNEED);
+  }
+}
+
+void VectorStore::Get(std::size_t i, float *out) const {
+  if (type_ == VecType::kF16) {
+    auto *in = static_cast<const std::uint16_t *>(row(i));
+    for (std::size_t j = 0; j < dim_; ++j) {
+      out[j] = HalfToFloat(in[j]);
+    }
+  } else if (type_ == VecType::kI8) {
+    float scale;
+    std::memcpy(&scale, row(i), sizeof(scale));
+    auto *in = static_cast<const std::int8_t *>(row(i)) + sizeof(scale);
+    for (std::size_t j = 0; j < dim_; ++j) {
+      out[j] = in[j] * scale;
+    }
+  } else {
+    std::memcpy(out, row(i), row_bytes());
+  }
+}
+
+} // namespace ochat
@@ -0,0 +1,207 @@
+/**
+ * @file vector_store.h
+ * @brief Compact memory-mapped file of embedding vectors and the metadata of
+ * the text chunk each vector was computed from.
+ */
+
+#ifndef __VECTOR_STORE_H__
+#define __VECTOR_STORE_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace ochat {
+
+// element type of the stored vectors.  kI8 rows hold a float scale followed
+// by the elements quantized to int8 (value = element * scale).
+enum class VecType : std::uint32_t { kF32 = 0, kF16 = 1, kI8 = 2 };
+
+// size in bytes of one stored vector of the given type
+inline std::size_t RowBytes(VecType t, std::size_t dim) {
+  switch (t) {
+  case VecType::kF16:
+    return 2 * dim;
+  case VecType::kI8:
+    return sizeof(float) + dim;
+  default:
+    return 4 * dim;
+  }
+}
+
+// IEEE 754 half precision conversions (round to nearest even).
+inline std::uint16_t FloatToHalf(float f) {
+  std::uint32_t x;
+  std::memcpy(&x, &f, sizeof(x));
+  std::uint32_t sign = (x >> 16) & 0x8000;
+  std::uint32_t exp = (x >> 23) & 0xFF;
+  std::uint32_t mant = x & 0x7FFFFF;
+  if (exp == 0xFF) // inf / nan
+    return static_cast<std::uint16_t>(sign | 0x7C00 | (mant ? 0x200 : 0));
+  int e = static_cast<int>(exp) - 127 + 15;
+  if (e >= 0x1F) // overflow
+    return static_cast<std::uint16_t>(sign | 0x7C00);
+  if (e <= 0) { // subnormal or zero
+    if (e < -10)
+      return static_cast<std::uint16_t>(sign);
+    mant |= 0x800000;
+    std::uint32_t shift = static_cast<std::uint32_t>(14 - e);
+    std::uint32_t half = mant >> shift;
+    std::uint32_t rem = mant & ((1u << shift) - 1);
+    std::uint32_t mid = 1u << (shift - 1);
+    if (rem > mid || (rem == mid && (half & 1)))
+      ++half;
+    return static_cast<std::uint16_t>(sign | half);
+  }
+  std::uint32_t half = sign | (static_cast<std::uint32_t>(e) << 10) |
+                       (mant >> 13);
+  std::uint32_t rem = mant & 0x1FFF;
+  if (rem > 0x1000 || (rem == 0x1000 && (half & 1)))
+    ++half; // may carry into the exponent, which is still correct
+  return static_cast<std::uint16_t>(half);
+}
+
+inline float HalfToFloat(std::uint16_t h) {
+  std::uint32_t sign = static_cast<std::uint32_t>(h & 0x8000) << 16;
+  std::uint32_t exp = (h >> 10) & 0x1F;
+  std::uint32_t mant = h & 0x3FF;
+  std::uint32_t x;
+  if (exp == 0) {
+    if (mant == 0) {
+      x = sign;
+    } else { // subnormal, normalize it
+      exp = 127 - 15 + 1;
+      while ((mant & 0x400) == 0) {
+        mant <<= 1;
+        --exp;
+      }
+      x = sign | (exp << 23) | ((mant & 0x3FF) << 13);
+    }
+  } else if (exp == 0x1F) {
+    x = sign | 0x7F800000 | (mant << 13);
+  } else {
+    x = sign | ((exp - 15 + 127) << 23) | (mant << 13);
+  }
+  float f;
+  std::memcpy(&f, &x, sizeof(f));
+  return f;
+}
+
+// Metadata of the text chunk a vector was computed from.
+struct ChunkMeta {
+  std::string file;        // path of the source file
+  std::uint64_t hash = 0;  // content hash of the whole source file
+  std::size_t begin = 0;   // byte offset of the chunk in the file
+  std::size_t end = 0;     // byte offset of the end of the chunk
+  std::string text;        // the chunk text
+};
+
+// Writes a vector store: a single file holding the vectors followed by the
+// chunk metadata.  The file is written under a temporary name and renamed
+// into place by Close(), so readers see either the old or the new store,
+// never a partially written one.
+class VectorStoreWriter {
+public:
+  /**
+   * @param path The path of the vector file.
+   * @param dim The number of elements in each vector.
+   * @param type The element type to store the vectors as.
+   * @throw std::runtime_error if the files cannot be created.
+   */
+  VectorStoreWriter(const std::string &path, std::size_t dim, VecType type);
+  ~VectorStoreWriter();
+
+  /**
+   * Adds a vector (converted to the element type of the store).
+   */
+  void Add(const float *vec, const ChunkMeta &meta);
+
+  /**
+   * Adds a vector that is already in the element type of the store.
+   */
+  void AddRaw(const void *vec, const ChunkMeta &meta);
+
+  /**
+   * Finishes the store and moves it into place.
+   */
+  void Close();
+
+  std::size_t size() const { return count_; }
+
+  VectorStoreWriter(const VectorStoreWriter &) = delete;
+  VectorStoreWriter &operator=(const VectorStoreWriter &) = delete;
+
+private:
+  std::string path_;
+  std::size_t dim_;
+  VecType type_;
+  std::size_t count_ = 0;
+  std::ofstream vec_;
+  std::ofstream meta_;
+  std::vector<char> row_; // conversion buffer
+  bool closed_ = false;
+};
+
+// Read only, memory-mapped view of a vector store.
+class VectorStore {
+public:
+  VectorStore() = default;
+  ~VectorStore();
+
+  /**
+   * Maps the vector file and loads the chunk metadata.
+   *
+   * @param path The path of the vector file.
+   * @return false if the store does not exist.
+   * @throw std::runtime_error if the store exists but is corrupt.
+   */
+  bool Open(const std::string &path);
+
+  std::size_t size() const { return count_; }
+  std::size_t dim() const { return dim_; }
+  VecType type() const { return type_; }
+
+  // size in bytes of one stored vector
+  std::size_t row_bytes() const { return RowBytes(type_, dim_); }
+
+  // the stored vectors, size() rows of row_bytes() each (64 byte aligned)
+  const void *data() const { return data_; }
+  const void *row(std::size_t i) const {
+    return static_cast<const char *>(data_) + i * row_bytes();
+  }
+
+  /**
+   * Copies vector i into out (dim() floats), converting from the element
+   * type of the store.
+   */
+  void Get(std::size_t i, float *out) const;
+
+  const std::vector<ChunkMeta> &meta() const { return meta_; }
+
+  /**
+   * Asks the kernel to read the whole vector file into the page cache, for
+   * full scans.
+   */
+  void Prefetch() const;
+
+  VectorStore(const VectorStore &) = delete;
+  VectorStore &operator=(const VectorStore &) = delete;
+
+private:
+  void Unmap();
+
+  void *map_ = nullptr;
+  std::size_t map_size_ = 0;
+  const void *data_ = nullptr;
+  std::size_t count_ = 0;
+  std::size_t dim_ = 0;
+  VecType type_ = VecType::kF32;
+  std::vector<ChunkMeta> meta_;
+};
+
+} // namespace ochat
+
+#endif // __VECTOR_STORE_H__